@@ -9,17 +9,32 @@
  */
 
 #include <unistd.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/select.h>
+#endif
 #include "pg_probackup.h"
 #include "utils/thread.h"
 #include "instr_time.h"
 
 static int push_file_internal_uncompressed(const char *wal_file_name, const char *pg_xlog_dir,
 								  const char *archive_dir, bool overwrite, bool no_sync,
-								  uint32 archive_timeout);
+								  uint32 archive_timeout, bool group_commit);
 #ifdef HAVE_LIBZ
 static int push_file_internal_gz(const char *wal_file_name, const char *pg_xlog_dir,
 									 const char *archive_dir, bool overwrite, bool no_sync,
-									 int compress_level, uint32 archive_timeout);
+									 int compress_level, uint32 archive_timeout,
+									 bool group_commit);
+#endif
+#ifdef HAVE_LIBZSTD
+static int push_file_internal_zstd(const char *wal_file_name, const char *pg_xlog_dir,
+									 const char *archive_dir, bool overwrite, bool no_sync,
+									 int compress_level, uint32 archive_timeout,
+									 bool group_commit);
+static int get_wal_file_internal_zstd(const char *from_path, const char *to_path, FILE *out);
 #endif
 static void *push_files(void *arg);
 static void *get_files(void *arg);
@@ -38,15 +53,64 @@ static const char *get_gz_error(gzFile gzf, int errnum);
 static bool next_wal_segment_exists(TimeLineID tli, XLogSegNo segno, const char *prefetch_dir, uint32 wal_seg_size);
 static uint32 run_wal_prefetch(const char *prefetch_dir, const char *archive_dir, TimeLineID tli,
 							   XLogSegNo first_segno, int num_threads, bool inclusive, int batch_size,
-							   uint32 wal_seg_size);
+							   uint32 wal_seg_size, double *fetch_latency);
+static int prefetch_wal_file(const char *wal_file_name, const char *prefetch_dir,
+							 const char *archive_dir);
 static bool wal_satisfy_from_prefetch(TimeLineID tli, XLogSegNo segno, const char *wal_file_name,
 									  const char *prefetch_dir, const char *absolute_wal_file_path,
 									  uint32 wal_seg_size, bool parse_wal);
 
-static uint32 maintain_prefetch(const char *prefetch_dir, XLogSegNo first_segno, uint32 wal_seg_size);
+static uint32 maintain_prefetch(const char *prefetch_dir, XLogSegNo first_segno, uint32 wal_seg_size,
+								bool refill_running);
+
+/*
+ * Files in prefetch directory, which are not WAL segments:
+ * state of adaptive prefetch and lock of background refill.
+ */
+#define PREFETCH_STATE_FILE		"pbk_prefetch.state"
+#define PREFETCH_LOCK_FILE		"pbk_prefetch.pid"
+/* empty lock file older than this is considered stale, in seconds */
+#define PREFETCH_LOCK_TIMEOUT	60
+/* weight of the last sample in moving averages of prefetch state */
+#define PREFETCH_SAMPLE_WEIGHT	0.25
+/* how often archive-get checks background refill, in microseconds */
+#define PREFETCH_WAIT_INTERVAL	10000
+/* how long archive-get waits for background refill, in seconds */
+#define PREFETCH_WAIT_TIMEOUT	30
+
+/*
+ * Observed speed of recovery and of archive, shared by archive-get calls.
+ * Zero values mean that there is no data yet.
+ */
+typedef struct prefetch_state
+{
+	char		last_wal_file[MAXFNAMELEN];	/* last requested segment */
+	double		last_time;			/* when it was requested */
+	double		replay_interval;	/* average time between requests */
+	double		fetch_latency;		/* average time to fetch one segment by one thread */
+} prefetch_state;
+
+static double prefetch_clock(void);
+static void read_prefetch_state(const char *prefetch_dir, prefetch_state *state);
+static void write_prefetch_state(const char *prefetch_dir, prefetch_state *state);
+static void update_prefetch_latency(const char *prefetch_dir, double fetch_latency);
+static void plan_prefetch(prefetch_state *state, int max_depth, int max_threads,
+						  int *depth, int *n_threads, int *low_watermark);
+static bool prefetch_refill_running(const char *prefetch_dir);
+static bool wait_prefetch_refill(const char *prefetch_dir, TimeLineID tli, XLogSegNo segno,
+								 uint32 wal_seg_size);
+static void start_prefetch_refill(const char *prefetch_dir, const char *archive_dir,
+								  TimeLineID tli, XLogSegNo segno, int depth, int n_threads,
+								  uint32 wal_seg_size);
 
 static bool prefetch_stop = false;
 static uint32 xlog_seg_size;
+/* number of WAL segments in pack file, 0 if packing is disabled */
+static uint32 wal_pack_size = 0;
+/* build WAL summaries for PAGE backups */
+static bool build_wal_summaries = false;
+/* number of threads compressing a single WAL file, used by zstd */
+static __thread int wal_compress_workers = 1;
 
 typedef struct
 {
@@ -55,13 +119,14 @@ typedef struct
 	const char *archive_dir;
 	const char *archive_status_dir;
 	bool        overwrite;
-	bool        compress;
 	bool        no_sync;
 	bool        no_ready_rename;
+	bool        group_commit;
 	uint32      archive_timeout;
 
 	CompressAlg compress_alg;
 	int         compress_level;
+	int         compress_workers;
 	int         thread_num;
 
 	parray     *files;
@@ -91,17 +156,81 @@ typedef struct WALSegno
 {
 	char        name[MAXFNAMELEN];
 	volatile    pg_atomic_flag lock;
+	/*
+	 * Result of push_file(): -1 if file was not pushed, 0 if it was copied,
+	 * 1 if it was already in the archive.
+	 */
+	int         push_rc;
 } WALSegno;
 
+/* Files of the batch, copied but not yet synced and renamed */
+typedef struct
+{
+	parray     *files;
+	const char *archive_dir;
+	CompressAlg compress_alg;
+} push_batch;
+
 static int push_file(WALSegno *xlogfile, const char *archive_status_dir,
 								   const char *pg_xlog_dir, const char *archive_dir,
 								   bool overwrite, bool no_sync, uint32 archive_timeout,
-								   bool no_ready_rename, bool is_compress,
-								   int compress_level);
+								   bool no_ready_rename, CompressAlg compress_alg,
+								   int compress_level, bool group_commit);
+static void push_batch_commit(push_batch *batch, const char *archive_status_dir,
+							  const char *first_filename, bool no_sync,
+							  bool no_ready_rename);
+static void push_batch_cleanup_atexit(bool fatal, void *userdata);
+static void mark_wal_file_done(const char *archive_status_dir, const char *wal_file_name);
+static bool wal_segment_in_pack(const char *wal_file_name, const char *pg_xlog_dir,
+								const char *archive_dir);
+static bool wal_segment_completes_pack(const char *wal_file_name);
+static void pack_wal_segments(const char *wal_file_name, const char *archive_dir, bool no_sync);
+static void pack_wal_segments_background(parray *batch_files, const char *archive_dir,
+										 bool no_sync);
+static void check_wal_pack_size(uint32 pack_size);
+static void summarize_prev_wal_segment(const char *wal_file_name, const char *pg_xlog_dir,
+									   const char *archive_dir, bool no_sync);
+static int get_wal_file_from_pack(const char *filename, const char *from_fullpath, FILE *out);
 
 static parray *setup_push_filelist(const char *archive_status_dir,
 								   const char *first_file, int batch_size);
 
+/* How long archive-push daemon sleeps between archive_status scans */
+#define PUSH_DAEMON_SCAN_INTERVAL	1		/* seconds */
+#define PUSH_DAEMON_POLL_INTERVAL	200000	/* microseconds, without inotify */
+#define PUSH_DAEMON_IDLE_SLEEP		10000	/* microseconds, idle worker */
+
+/* State shared between archive-push daemon and its workers */
+typedef struct
+{
+	const char *pg_xlog_dir;
+	const char *archive_dir;
+	const char *archive_status_dir;
+	bool		overwrite;
+	bool		no_sync;
+	uint32		archive_timeout;
+	CompressAlg	compress_alg;
+	int			compress_level;
+
+	/* WALSegno entries queued or being pushed right now */
+	parray	   *queue;
+	pthread_mutex_t lock;
+	volatile bool stop;
+} push_daemon_state;
+
+typedef struct
+{
+	push_daemon_state *state;
+	int			thread_num;
+	uint32		n_pushed;
+	uint32		n_skipped;
+	/* 0 means there is no error, 1 - there is an error */
+	int			ret;
+} push_daemon_arg;
+
+static void *push_daemon_worker(void *arg);
+static int push_daemon_enqueue(push_daemon_state *state);
+
 /*
  * At this point, we already done one roundtrip to archive server
  * to get instance config.
@@ -115,12 +244,12 @@ static parray *setup_push_filelist(const char *archive_status_dir,
 void
 do_archive_push(InstanceState *instanceState, InstanceConfig *instance, char *pg_xlog_dir,
 				char *wal_file_name, int batch_size, bool overwrite,
-				bool no_sync, bool no_ready_rename)
+				bool no_sync, bool no_ready_rename, bool wal_summary)
 {
 	uint64		i;
 	/* usually instance pgdata/pg_wal/archive_status, empty if no_ready_rename or batch_size == 1 */
 	char		archive_status_dir[MAXPGPATH] = "";
-	bool		is_compress = false;
+	CompressAlg	compress_alg = NONE_COMPRESS;
 
 	/* arrays with meta info for multi threaded backup */
 	pthread_t	*threads;
@@ -138,18 +267,42 @@ do_archive_push(InstanceState *instanceState, InstanceConfig *instance, char *pg
 	/* files to push in multi-thread mode */
 	parray     *batch_files = NULL;
 	int         n_threads;
+	push_batch  batch;
+	bool        group_commit;
 
 	if (!no_ready_rename || batch_size > 1)
 		join_path_components(archive_status_dir, pg_xlog_dir, "archive_status");
 
 #ifdef HAVE_LIBZ
 	if (instance->compress_alg == ZLIB_COMPRESS)
-		is_compress = true;
+		compress_alg = ZLIB_COMPRESS;
 #endif
+#ifdef HAVE_LIBZSTD
+	if (instance->compress_alg == ZSTD_COMPRESS)
+		compress_alg = ZSTD_COMPRESS;
+#endif
+
+	check_wal_pack_size(instance->wal_pack_size);
+	wal_pack_size = instance->wal_pack_size;
+	xlog_seg_size = instance->xlog_seg_size;
+	build_wal_summaries = wal_summary;
 
 	/*  Setup filelist and locks */
 	batch_files = setup_push_filelist(archive_status_dir, wal_file_name, batch_size);
 
+	/*
+	 * If there are several files to push, do not sync and rename them one
+	 * by one. Files are copied into temp files, then synced all together and
+	 * renamed by push_batch_commit(), and only then marked as done.
+	 */
+	group_commit = parray_num(batch_files) > 1;
+	batch.files = batch_files;
+	batch.archive_dir = instanceState->instance_wal_subdir_path;
+	batch.compress_alg = compress_alg;
+
+	if (group_commit)
+		pgut_atexit_push(push_batch_cleanup_atexit, &batch);
+
 	n_threads = num_threads;
 	if (num_threads > parray_num(batch_files))
 		n_threads = parray_num(batch_files);
@@ -158,8 +311,10 @@ do_archive_push(InstanceState *instanceState, InstanceConfig *instance, char *pg
 					"threads: %i/%i, batch: %lu/%i, compression: %s",
 						wal_file_name, n_threads, num_threads,
 						parray_num(batch_files), batch_size,
-						is_compress ? "zlib" : "none");
+						deparse_compress_alg(compress_alg));
 
+	/* Spare threads are used to compress each file in parallel */
+	wal_compress_workers = num_threads / n_threads;
 	num_threads = n_threads;
 
 	/* Single-thread push
@@ -186,8 +341,8 @@ do_archive_push(InstanceState *instanceState, InstanceConfig *instance, char *pg
 						   overwrite, no_sync,
 						   instance->archive_timeout,
 						   no_ready_rename || first_wal,
-						   is_compress && IsXLogFileName(xlogfile->name) ? true : false,
-						   instance->compress_level);
+						   IsXLogFileName(xlogfile->name) ? compress_alg : NONE_COMPRESS,
+						   instance->compress_level, group_commit);
 			if (rc == 0)
 				n_total_pushed++;
 			else
@@ -211,13 +366,14 @@ do_archive_push(InstanceState *instanceState, InstanceConfig *instance, char *pg
 		arg->pg_xlog_dir = pg_xlog_dir;
 		arg->archive_status_dir = (!no_ready_rename || batch_size > 1) ? archive_status_dir : NULL;
 		arg->overwrite = overwrite;
-		arg->compress = is_compress;
 		arg->no_sync = no_sync;
 		arg->no_ready_rename = no_ready_rename;
+		arg->group_commit = group_commit;
 		arg->archive_timeout = instance->archive_timeout;
 
-		arg->compress_alg = instance->compress_alg;
+		arg->compress_alg = compress_alg;
 		arg->compress_level = instance->compress_level;
+		arg->compress_workers = wal_compress_workers;
 
 		arg->files = batch_files;
 		arg->n_pushed = 0;
@@ -256,6 +412,28 @@ do_archive_push(InstanceState *instanceState, InstanceConfig *instance, char *pg
 	 */
 
 push_done:
+	/* Files pushed successfully are committed even if some thread has failed */
+	if (group_commit)
+	{
+		push_batch_commit(&batch, archive_status_dir, wal_file_name,
+						  no_sync, no_ready_rename);
+		pgut_atexit_pop(push_batch_cleanup_atexit, &batch);
+	}
+
+	/* Segments are in place, pack completed groups of them */
+	pack_wal_segments_background(batch_files, instanceState->instance_wal_subdir_path,
+								 no_sync);
+
+	/* Next segments are complete now, summarize segments preceding them */
+	for (i = 0; i < parray_num(batch_files); i++)
+	{
+		WALSegno *xlogfile = (WALSegno *) parray_get(batch_files, i);
+
+		if (xlogfile->push_rc >= 0)
+			summarize_prev_wal_segment(xlogfile->name, pg_xlog_dir,
+									   instanceState->instance_wal_subdir_path, no_sync);
+	}
+
 	fio_disconnect();
 	/* calculate elapsed time */
 	INSTR_TIME_SET_CURRENT(end_time);
@@ -275,6 +453,159 @@ push_done:
 					pretty_time_str);
 }
 
+/*
+ * Persistent archive-push: instead of being started by archive_command for
+ * every WAL segment, run forever and push each file, for which postgres has
+ * created '.ready' status file, as soon as it appears in 'archive_status'.
+ * Workers keep their remote connections open between files.
+ *
+ * When file is safely in the archive, '<wal-file-name>.pushed' marker is
+ * created in 'archive_status', so archive_command only has to wait for it.
+ * '.ready' files are never renamed by daemon, postgres does it itself when
+ * archive_command returns success. Markers, which '.ready' file is gone,
+ * are removed on the next scan.
+ *
+ * Daemon stops on SIGINT or SIGTERM. Error in any worker stops daemon as
+ * well, so it is supposed to be run under some kind of supervisor.
+ */
+void
+do_archive_push_daemon(InstanceState *instanceState, InstanceConfig *instance,
+					   char *pg_xlog_dir, bool overwrite, bool no_sync, bool wal_summary)
+{
+	int			i;
+	char		archive_status_dir[MAXPGPATH];
+	push_daemon_state state;
+#ifdef __linux__
+	int			notify_fd = -1;
+#endif
+
+	/* arrays with meta info for multi threaded push */
+	pthread_t	*threads;
+	push_daemon_arg *threads_args;
+	bool		push_isok = true;
+
+	/* reporting */
+	uint32      n_total_pushed = 0;
+	uint32      n_total_skipped = 0;
+
+	join_path_components(archive_status_dir, pg_xlog_dir, "archive_status");
+
+	state.pg_xlog_dir = pg_xlog_dir;
+	state.archive_dir = instanceState->instance_wal_subdir_path;
+	state.archive_status_dir = archive_status_dir;
+	state.overwrite = overwrite;
+	state.compress_alg = NONE_COMPRESS;
+	state.no_sync = no_sync;
+	state.archive_timeout = instance->archive_timeout;
+	state.compress_level = instance->compress_level;
+	state.queue = parray_new();
+
+	check_wal_pack_size(instance->wal_pack_size);
+	wal_pack_size = instance->wal_pack_size;
+	xlog_seg_size = instance->xlog_seg_size;
+	build_wal_summaries = wal_summary;
+	state.lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+	state.stop = false;
+
+#ifdef HAVE_LIBZ
+	if (instance->compress_alg == ZLIB_COMPRESS)
+		state.compress_alg = ZLIB_COMPRESS;
+#endif
+#ifdef HAVE_LIBZSTD
+	if (instance->compress_alg == ZSTD_COMPRESS)
+		state.compress_alg = ZSTD_COMPRESS;
+#endif
+
+#ifdef __linux__
+	/* Wake up as soon as postgres creates new '.ready' file */
+	notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (notify_fd < 0 ||
+		inotify_add_watch(notify_fd, archive_status_dir, IN_CREATE | IN_MOVED_TO) < 0)
+	{
+		elog(WARNING, "Cannot watch directory \"%s\", fall back to polling: %s",
+			 archive_status_dir, strerror(errno));
+		if (notify_fd >= 0)
+			close(notify_fd);
+		notify_fd = -1;
+	}
+#endif
+
+	elog(INFO, "pg_probackup archive-push daemon started for directory \"%s\", "
+				"threads: %i, compression: %s",
+				pg_xlog_dir, num_threads, deparse_compress_alg(state.compress_alg));
+
+	threads = (pthread_t *) palloc(sizeof(pthread_t) * num_threads);
+	threads_args = (push_daemon_arg *) palloc(sizeof(push_daemon_arg) * num_threads);
+
+	/* Run workers */
+	for (i = 0; i < num_threads; i++)
+	{
+		push_daemon_arg *arg = &(threads_args[i]);
+
+		arg->state = &state;
+		arg->thread_num = i+1;
+		arg->n_pushed = 0;
+		arg->n_skipped = 0;
+		/* By default there are some error */
+		arg->ret = 1;
+
+		pthread_create(&threads[i], NULL, push_daemon_worker, arg);
+	}
+
+	while (!interrupted && !thread_interrupted)
+	{
+		push_daemon_enqueue(&state);
+
+#ifdef __linux__
+		if (notify_fd >= 0)
+		{
+			fd_set		rfds;
+			struct timeval timeout;
+			char		buf[4096];
+
+			FD_ZERO(&rfds);
+			FD_SET(notify_fd, &rfds);
+			timeout.tv_sec = PUSH_DAEMON_SCAN_INTERVAL;
+			timeout.tv_usec = 0;
+
+			/* Rescan on any event or on timeout, consume pending events */
+			if (select(notify_fd + 1, &rfds, NULL, NULL, &timeout) > 0)
+				while (read(notify_fd, buf, sizeof(buf)) > 0)
+					;
+			continue;
+		}
+#endif
+		pg_usleep(PUSH_DAEMON_POLL_INTERVAL);
+	}
+
+	/* Wait workers */
+	state.stop = true;
+	for (i = 0; i < num_threads; i++)
+	{
+		pthread_join(threads[i], NULL);
+		if (threads_args[i].ret == 1)
+			push_isok = false;
+
+		n_total_pushed += threads_args[i].n_pushed;
+		n_total_skipped += threads_args[i].n_skipped;
+	}
+
+#ifdef __linux__
+	if (notify_fd >= 0)
+		close(notify_fd);
+#endif
+	fio_disconnect();
+
+	if (!push_isok || thread_interrupted)
+		elog(ERROR, "pg_probackup archive-push daemon failed, "
+					"pushed: %u, skipped: %u",
+					n_total_pushed, n_total_skipped);
+
+	elog(INFO, "pg_probackup archive-push daemon stopped, "
+				"pushed: %u, skipped: %u",
+				n_total_pushed, n_total_skipped);
+}
+
 /* ------------- INTERNAL FUNCTIONS ---------- */
 /*
  * Copy files from pg_wal to archive catalog with possible compression.
@@ -287,6 +618,7 @@ push_files(void *arg)
 	archive_push_arg *args = (archive_push_arg *) arg;
 
 	my_thread_num = args->thread_num;
+	wal_compress_workers = args->compress_workers;
 
 	for (i = 0; i < parray_num(args->files); i++)
 	{
@@ -308,68 +640,956 @@ push_files(void *arg)
 					   args->overwrite, args->no_sync,
 					   args->archive_timeout, no_ready_rename,
 					   /* do not compress .backup, .partial and .history files */
-					   args->compress && IsXLogFileName(xlogfile->name) ? true : false,
-					   args->compress_level);
+					   IsXLogFileName(xlogfile->name) ? args->compress_alg : NONE_COMPRESS,
+					   args->compress_level, args->group_commit);
+
+		if (rc == 0)
+			args->n_pushed++;
+		else
+			args->n_skipped++;
+	}
+
+	/* close ssh connection */
+	fio_disconnect();
+
+	args->ret = 0;
+	return NULL;
+}
+
+/*
+ * Add files, which have '.ready' status file and are neither queued nor
+ * already pushed, to the daemon queue. Remove '.pushed' markers of files
+ * already marked as done by postgres.
+ * Returns the number of newly queued files.
+ */
+static int
+push_daemon_enqueue(push_daemon_state *state)
+{
+	int		i;
+	int		n_queued = 0;
+	parray *status_files = parray_new();
+
+	dir_list_file(status_files, state->archive_status_dir, false, false, false, false, true, 0, FIO_DB_HOST);
+	parray_qsort(status_files, pgFileCompareName);
+
+	for (i = 0; i < parray_num(status_files); i++)
+	{
+		pgFile *file = (pgFile *) parray_get(status_files, i);
+		size_t	len = strlen(file->name);
+		char	name[MAXFNAMELEN];
+		char	status_name[MAXFNAMELEN + 16];
+		char	path[MAXPGPATH];
+		bool	queued = false;
+		int		j;
+
+		if (len > strlen(".pushed") && len - strlen(".pushed") < MAXFNAMELEN &&
+			strcmp(file->name + len - strlen(".pushed"), ".pushed") == 0)
+		{
+			snprintf(name, MAXFNAMELEN, "%.*s", (int) (len - strlen(".pushed")), file->name);
+			snprintf(status_name, sizeof(status_name), "%s.ready", name);
+			join_path_components(path, state->archive_status_dir, status_name);
+
+			if (!fileExists(path, FIO_DB_HOST))
+			{
+				join_path_components(path, state->archive_status_dir, file->name);
+				elog(VERBOSE, "Remove marker \"%s\"", path);
+				fio_unlink(path, FIO_DB_HOST);
+			}
+			continue;
+		}
+
+		/* not a '.ready' file */
+		if (len <= strlen(".ready") || len - strlen(".ready") >= MAXFNAMELEN ||
+			strcmp(file->name + len - strlen(".ready"), ".ready") != 0)
+			continue;
+
+		snprintf(name, MAXFNAMELEN, "%.*s", (int) (len - strlen(".ready")), file->name);
+		snprintf(status_name, sizeof(status_name), "%s.pushed", name);
+		join_path_components(path, state->archive_status_dir, status_name);
+
+		/*
+		 * Worker creates marker before removing file from the queue,
+		 * so checking both under lock cannot miss the file.
+		 */
+		pthread_lock(&state->lock);
+		for (j = 0; j < parray_num(state->queue); j++)
+		{
+			WALSegno *xlogfile = (WALSegno *) parray_get(state->queue, j);
+
+			if (strcmp(xlogfile->name, name) == 0)
+			{
+				queued = true;
+				break;
+			}
+		}
+
+		if (!queued && !fileExists(path, FIO_DB_HOST))
+		{
+			WALSegno *xlogfile = palloc(sizeof(WALSegno));
+
+			pg_atomic_init_flag(&xlogfile->lock);
+			xlogfile->push_rc = -1;
+			snprintf(xlogfile->name, MAXFNAMELEN, "%s", name);
+			parray_append(state->queue, xlogfile);
+			n_queued++;
+		}
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	/* cleanup */
+	parray_walk(status_files, pgFileFree);
+	parray_free(status_files);
+
+	return n_queued;
+}
+
+/*
+ * archive-push daemon worker. Take files from the queue until daemon is
+ * stopped, push them and create '.pushed' markers.
+ */
+static void *
+push_daemon_worker(void *arg)
+{
+	push_daemon_arg *args = (push_daemon_arg *) arg;
+	push_daemon_state *state = args->state;
+
+	my_thread_num = args->thread_num;
+
+	while (!state->stop && !interrupted && !thread_interrupted)
+	{
+		int		i;
+		int		rc;
+		int		fd;
+		WALSegno *xlogfile = NULL;
+		char	marker_name[MAXFNAMELEN + 16];
+		char	marker_path[MAXPGPATH];
+
+		pthread_lock(&state->lock);
+		for (i = 0; i < parray_num(state->queue); i++)
+		{
+			WALSegno *candidate = (WALSegno *) parray_get(state->queue, i);
+
+			if (pg_atomic_test_set_flag(&candidate->lock))
+			{
+				xlogfile = candidate;
+				break;
+			}
+		}
+
+		/*
+		 * Queue holds files being pushed and waiting for a worker, as in
+		 * archive-push the threads left over are used to compress this file.
+		 */
+		if (xlogfile != NULL)
+			wal_compress_workers = Max(num_threads / (int) parray_num(state->queue), 1);
+		pthread_mutex_unlock(&state->lock);
+
+		if (xlogfile == NULL)
+		{
+			pg_usleep(PUSH_DAEMON_IDLE_SLEEP);
+			continue;
+		}
+
+		/* '.ready' file is renamed by postgres, when archive_command succeeds */
+		rc = push_file(xlogfile, NULL,
+					   state->pg_xlog_dir, state->archive_dir,
+					   state->overwrite, state->no_sync,
+					   state->archive_timeout, true,
+					   /* do not compress .backup, .partial and .history files */
+					   IsXLogFileName(xlogfile->name) ? state->compress_alg : NONE_COMPRESS,
+					   state->compress_level, false);
+
+		if (rc == 0)
+			args->n_pushed++;
+		else
+			args->n_skipped++;
+
+		/* let archive_command know, that file is in the archive */
+		snprintf(marker_name, sizeof(marker_name), "%s.pushed", xlogfile->name);
+		join_path_components(marker_path, state->archive_status_dir, marker_name);
+
+		fd = fio_open(marker_path, O_WRONLY | O_CREAT | PG_BINARY, FIO_DB_HOST);
+		if (fd < 0)
+			elog(ERROR, "Cannot create marker file \"%s\": %s",
+				 marker_path, strerror(errno));
+		fio_close(fd);
+
+		pthread_lock(&state->lock);
+		for (i = 0; i < parray_num(state->queue); i++)
+		{
+			if (parray_get(state->queue, i) == xlogfile)
+			{
+				parray_remove(state->queue, i);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&state->lock);
+
+		/* archive_command is already released, pack completed group */
+		pack_wal_segments(xlogfile->name, state->archive_dir, state->no_sync);
+		summarize_prev_wal_segment(xlogfile->name, state->pg_xlog_dir,
+								   state->archive_dir, state->no_sync);
+
+		pfree(xlogfile);
+	}
+
+	/* close ssh connection */
+	fio_disconnect();
+
+	args->ret = 0;
+	return NULL;
+}
+
+int
+push_file(WALSegno *xlogfile, const char *archive_status_dir,
+		  const char *pg_xlog_dir, const char *archive_dir,
+		  bool overwrite, bool no_sync, uint32 archive_timeout,
+		  bool no_ready_rename, CompressAlg compress_alg,
+		  int compress_level, bool group_commit)
+{
+	int     rc;
+
+	elog(LOG, "pushing file \"%s\"", xlogfile->name);
+
+	/* Segment, which is already packed, cannot be pushed again */
+	if (wal_segment_in_pack(xlogfile->name, pg_xlog_dir, archive_dir))
+	{
+		xlogfile->push_rc = 1;
+		return 1;
+	}
+
+	switch (compress_alg)
+	{
+#ifdef HAVE_LIBZ
+		case ZLIB_COMPRESS:
+			rc = push_file_internal_gz(xlogfile->name, pg_xlog_dir, archive_dir,
+									   overwrite, no_sync, compress_level,
+									   archive_timeout, group_commit);
+			break;
+#endif
+#ifdef HAVE_LIBZSTD
+		case ZSTD_COMPRESS:
+			rc = push_file_internal_zstd(xlogfile->name, pg_xlog_dir, archive_dir,
+										 overwrite, no_sync, compress_level,
+										 archive_timeout, group_commit);
+			break;
+#endif
+		default:
+			/* If compression is not required, then just copy it as is */
+			rc = push_file_internal_uncompressed(xlogfile->name, pg_xlog_dir,
+												 archive_dir, overwrite, no_sync,
+												 archive_timeout, group_commit);
+			break;
+	}
+
+	xlogfile->push_rc = rc;
+
+	/* In group commit mode ready file is renamed by push_batch_commit() */
+	if (group_commit)
+		return rc;
+
+	/* take '--no-ready-rename' flag into account */
+	if (!no_ready_rename && archive_status_dir != NULL)
+		mark_wal_file_done(archive_status_dir, xlogfile->name);
+
+	return rc;
+}
+
+/* Rename '.ready' status file of WAL file to '.done' */
+static void
+mark_wal_file_done(const char *archive_status_dir, const char *wal_file_name)
+{
+	char	wal_file_dummy[MAXPGPATH];
+	char	wal_file_ready[MAXPGPATH];
+	char	wal_file_done[MAXPGPATH];
+
+	join_path_components(wal_file_dummy, archive_status_dir, wal_file_name);
+	snprintf(wal_file_ready, MAXPGPATH, "%s.%s", wal_file_dummy, "ready");
+	snprintf(wal_file_done, MAXPGPATH, "%s.%s", wal_file_dummy, "done");
+
+	canonicalize_path(wal_file_ready);
+	canonicalize_path(wal_file_done);
+	/* It is ok to rename status file in archive_status directory */
+	elog(VERBOSE, "Rename \"%s\" to \"%s\"", wal_file_ready, wal_file_done);
+
+	/* do not error out, if rename failed */
+	if (fio_rename(wal_file_ready, wal_file_done, FIO_DB_HOST) < 0)
+		elog(WARNING, "Cannot rename ready file \"%s\" to \"%s\": %s",
+			wal_file_ready, wal_file_done, strerror(errno));
+}
+
+/*
+ * Check if WAL segment is already stored in pack file. If it is, but
+ * its content differs from the file to push, error out: pack members
+ * cannot be overwritten.
+ */
+static bool
+wal_segment_in_pack(const char *wal_file_name, const char *pg_xlog_dir,
+					const char *archive_dir)
+{
+	char		pack_path[MAXPGPATH];
+	char		from_fullpath[MAXPGPATH];
+	char	   *buf;
+	pg_crc32	crc32_src;
+	pg_crc32	crc32_dst;
+
+	if (!IsXLogFileName(wal_file_name))
+		return false;
+
+	if (!get_wal_pack_path(pack_path, archive_dir, wal_file_name,
+						   xlog_seg_size, wal_pack_size, FIO_BACKUP_HOST))
+		return false;
+
+	buf = read_wal_pack_segment(archive_dir, wal_file_name, xlog_seg_size,
+								wal_pack_size, FIO_BACKUP_HOST);
+	if (buf == NULL)
+		elog(ERROR, "Cannot read WAL file \"%s\" from pack \"%s\"",
+			 wal_file_name, pack_path);
+
+	INIT_FILE_CRC32(true, crc32_dst);
+	COMP_FILE_CRC32(true, crc32_dst, buf, xlog_seg_size);
+	FIN_FILE_CRC32(true, crc32_dst);
+	pg_free(buf);
+
+	join_path_components(from_fullpath, pg_xlog_dir, wal_file_name);
+	crc32_src = fio_get_crc32(from_fullpath, FIO_DB_HOST, NONE_COMPRESS);
+
+	if (crc32_src != crc32_dst)
+		elog(ERROR, "WAL file already exists in pack \"%s\" with "
+			 "different checksum: \"%s\"", pack_path, wal_file_name);
+
+	elog(LOG, "WAL file already exists in pack \"%s\" with the same "
+		 "checksum, skip pushing: \"%s\"", pack_path, from_fullpath);
+	return true;
+}
+
+/* Check if WAL segment is the last one in a group of wal_pack_size segments */
+static bool
+wal_segment_completes_pack(const char *wal_file_name)
+{
+	TimeLineID	tli;
+	XLogSegNo	segno;
+
+	if (wal_pack_size == 0 || !IsXLogFileName(wal_file_name))
+		return false;
+
+	GetXLogFromFileName(wal_file_name, &tli, &segno, xlog_seg_size);
+	return (segno + 1) % wal_pack_size == 0;
+}
+
+/*
+ * If WAL segment completes a group of wal_pack_size segments, pack the group.
+ * Packing only changes archive layout, so failure to pack is not an error,
+ * segments just stay in separate files.
+ */
+static void
+pack_wal_segments(const char *wal_file_name, const char *archive_dir, bool no_sync)
+{
+	TimeLineID	tli;
+	XLogSegNo	segno;
+	char		first_wal_file_name[MAXFNAMELEN];
+
+	if (!wal_segment_completes_pack(wal_file_name))
+		return;
+
+	GetXLogFromFileName(wal_file_name, &tli, &segno, xlog_seg_size);
+	GetXLogFileName(first_wal_file_name, tli, segno + 1 - wal_pack_size, xlog_seg_size);
+
+	if (fio_wal_pack(archive_dir, first_wal_file_name, wal_pack_size,
+					 xlog_seg_size, no_sync, FIO_BACKUP_HOST) == 0)
+		elog(LOG, "WAL segments from %s to %s are packed",
+			 first_wal_file_name, wal_file_name);
+	else if (errno == ENOENT)
+		elog(LOG, "Some of WAL segments from %s to %s are missing, cannot pack them",
+			 first_wal_file_name, wal_file_name);
+	else if (errno == EBUSY)
+		elog(LOG, "WAL segments from %s to %s are being packed by another process",
+			 first_wal_file_name, wal_file_name);
+	else
+		elog(WARNING, "Cannot pack WAL segments from %s to %s: %s",
+			 first_wal_file_name, wal_file_name, strerror(errno));
+}
+
+/*
+ * Pack groups completed by the pushed segments. Copying a group of up to
+ * WAL_PACK_MAX_SIZE segments takes a while, and archive_command must not
+ * wait for it, so it is done in a detached child process.
+ */
+static void
+pack_wal_segments_background(parray *batch_files, const char *archive_dir, bool no_sync)
+{
+	bool		need_pack = false;
+	int			i;
+#ifndef WIN32
+	pid_t		pid;
+#endif
+
+	for (i = 0; i < parray_num(batch_files); i++)
+	{
+		WALSegno *xlogfile = (WALSegno *) parray_get(batch_files, i);
+
+		if (xlogfile->push_rc >= 0 && wal_segment_completes_pack(xlogfile->name))
+			need_pack = true;
+	}
+
+	if (!need_pack)
+		return;
+
+#ifndef WIN32
+	/* Child must not share remote connection, it will open its own */
+	fio_disconnect();
+	fflush(NULL);
+
+	pid = fork();
+	if (pid > 0)
+	{
+		elog(LOG, "Started background packing of WAL segments, pid %d", (int) pid);
+		return;
+	}
+	else if (pid < 0)
+		elog(LOG, "Cannot start background packing of WAL segments, "
+			 "packing them now: %s", strerror(errno));
+	else
+	{
+		/* Detach from archive_command, so archiver does not wait for us */
+		setsid();
+		ssh_mux_reset_after_fork();
+	}
+#endif
+
+	for (i = 0; i < parray_num(batch_files); i++)
+	{
+		WALSegno *xlogfile = (WALSegno *) parray_get(batch_files, i);
+
+		if (xlogfile->push_rc >= 0)
+			pack_wal_segments(xlogfile->name, archive_dir, no_sync);
+	}
+
+#ifndef WIN32
+	if (pid == 0)
+	{
+		fio_disconnect();
+		exit(0);
+	}
+#endif
+}
+
+/*
+ * Build WAL summary of the segment, preceding just pushed one. The last
+ * record of a segment usually continues into the next one, so summary
+ * is built only when the next segment is complete. Source segment is read
+ * from pg_wal, which still has it most of the time; if it is already
+ * recycled, PAGE backup just reads the segment from archive.
+ */
+static void
+summarize_prev_wal_segment(const char *wal_file_name, const char *pg_xlog_dir,
+						   const char *archive_dir, bool no_sync)
+{
+	TimeLineID	tli;
+	XLogSegNo	segno;
+
+	if (!build_wal_summaries || !IsXLogFileName(wal_file_name))
+		return;
+
+	GetXLogFromFileName(wal_file_name, &tli, &segno, xlog_seg_size);
+	if (segno <= 1)
+		return;
+
+	build_wal_summary(pg_xlog_dir, archive_dir, tli, segno - 1, xlog_seg_size, no_sync);
+}
+
+static void
+check_wal_pack_size(uint32 pack_size)
+{
+	if (pack_size != 0 &&
+		(pack_size < 2 || pack_size > WAL_PACK_MAX_SIZE ||
+		 (pack_size & (pack_size - 1)) != 0))
+		elog(ERROR, "--wal-pack-size must be 0 or a power of two between 2 and %d",
+			 WAL_PACK_MAX_SIZE);
+}
+
+/*
+ * Parse contents of WAL_PACK_SIZES_FILE.
+ * Returns mask of pack sizes, each of them being a power of two.
+ */
+uint32
+parse_wal_pack_sizes(const char *buf)
+{
+	uint32		sizes = 0;
+	char	   *end;
+	long		n;
+
+	for (;;)
+	{
+		n = strtol(buf, &end, 10);
+		if (end == buf)
+			break;
+		if (n >= 2 && n <= WAL_PACK_MAX_SIZE && (n & (n - 1)) == 0)
+			sizes |= (uint32) n;
+		buf = end;
+	}
+
+	return sizes;
+}
+
+/* Read sizes of packs, ever created in archive directory */
+static uint32
+read_wal_pack_sizes(const char *archive_dir, fio_location location)
+{
+	char		path[MAXPGPATH];
+	char		buf[256];
+	size_t		len = 0;
+	ssize_t		rc;
+	int			fd;
+
+	join_path_components(path, archive_dir, WAL_PACK_SIZES_FILE);
+
+	fd = fio_open(path, O_RDONLY | PG_BINARY, location);
+	if (fd < 0)
+		return 0;
+
+	while (len < sizeof(buf) - 1 &&
+		   (rc = fio_read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += rc;
+	buf[len] = '\0';
+	fio_close(fd);
+
+	return parse_wal_pack_sizes(buf);
+}
+
+/* Build path of the pack of pack_size segments, which would contain segment */
+static bool
+probe_wal_pack(char *pack_path, const char *archive_dir, TimeLineID tli,
+			   XLogSegNo segno, uint32 wal_seg_size, uint32 pack_size,
+			   fio_location location)
+{
+	char		pack_name[MAXFNAMELEN];
+
+	GetXLogFileName(pack_name, tli, segno - segno % pack_size, wal_seg_size);
+	join_path_components(pack_path, archive_dir, pack_name);
+	strncat(pack_path, ".pack", MAXPGPATH - strlen(pack_path) - 1);
+
+	return fileExists(pack_path, location);
+}
+
+/*
+ * Find pack file, containing WAL segment. Pack of the configured size
+ * pack_size (0 if packing is disabled) is looked up first, then packs
+ * of other sizes, listed in WAL_PACK_SIZES_FILE. So packs stay visible
+ * after --wal-pack-size is changed.
+ */
+bool
+get_wal_pack_path(char *pack_path, const char *archive_dir, const char *wal_file_name,
+				  uint32 wal_seg_size, uint32 pack_size, fio_location location)
+{
+	TimeLineID	tli;
+	XLogSegNo	segno;
+	uint32		sizes;
+	uint32		n;
+
+	GetXLogFromFileName(wal_file_name, &tli, &segno, wal_seg_size);
+
+	if (pack_size >= 2 &&
+		probe_wal_pack(pack_path, archive_dir, tli, segno,
+					   wal_seg_size, pack_size, location))
+		return true;
+
+	sizes = read_wal_pack_sizes(archive_dir, location) & ~pack_size;
+
+	for (n = 2; n <= WAL_PACK_MAX_SIZE; n <<= 1)
+	{
+		if ((sizes & n) &&
+			probe_wal_pack(pack_path, archive_dir, tli, segno,
+						   wal_seg_size, n, location))
+			return true;
+	}
+
+	return false;
+}
+
+/* Read exactly size bytes from file, opened with fio_open() */
+static bool
+fio_read_exact(int fd, void *buf, size_t size)
+{
+	size_t	done = 0;
+
+	while (done < size)
+	{
+		ssize_t	rc = fio_read(fd, (char *) buf + done, size - done);
+
+		if (rc <= 0)
+			return false;
+		done += rc;
+	}
+
+	return true;
+}
+
+/*
+ * Read index of WAL pack file.
+ * Returns array of n_entries entries, or NULL if pack cannot be read.
+ */
+WalPackEntry *
+read_wal_pack_index(const char *pack_path, int *n_entries, fio_location location)
+{
+	struct stat		st;
+	WalPackTrailer	trailer;
+	WalPackEntry   *entries;
+	size_t			index_size;
+	int				fd;
+
+	if (fio_stat(pack_path, &st, true, location) < 0)
+	{
+		elog(WARNING, "Cannot stat WAL pack file \"%s\": %s",
+			 pack_path, strerror(errno));
+		return NULL;
+	}
+
+	fd = fio_open(pack_path, O_RDONLY | PG_BINARY, location);
+	if (fd < 0)
+	{
+		elog(WARNING, "Cannot open WAL pack file \"%s\": %s",
+			 pack_path, strerror(errno));
+		return NULL;
+	}
+
+	if (st.st_size < sizeof(trailer) ||
+		fio_seek(fd, st.st_size - sizeof(trailer)) < 0 ||
+		!fio_read_exact(fd, &trailer, sizeof(trailer)) ||
+		trailer.magic != WAL_PACK_MAGIC ||
+		trailer.n_entries == 0 || trailer.n_entries > WAL_PACK_MAX_SIZE)
+	{
+		fio_close(fd);
+		elog(WARNING, "WAL pack file \"%s\" is corrupted", pack_path);
+		return NULL;
+	}
+
+	index_size = sizeof(WalPackEntry) * trailer.n_entries;
+	entries = pgut_malloc(index_size);
+
+	if (st.st_size < sizeof(trailer) + index_size ||
+		fio_seek(fd, st.st_size - sizeof(trailer) - index_size) < 0 ||
+		!fio_read_exact(fd, entries, index_size))
+	{
+		fio_close(fd);
+		pg_free(entries);
+		elog(WARNING, "WAL pack file \"%s\" is corrupted", pack_path);
+		return NULL;
+	}
+
+	fio_close(fd);
+	*n_entries = trailer.n_entries;
+	return entries;
+}
+
+/*
+ * Read WAL segment from pack file and decompress it.
+ * Returns palloc'ed buffer of wal_seg_size bytes, or NULL if segment
+ * is not packed or cannot be read.
+ */
+char *
+read_wal_pack_segment(const char *archive_dir, const char *wal_file_name,
+					  uint32 wal_seg_size, uint32 pack_size, fio_location location)
+{
+	char			pack_path[MAXPGPATH];
+	WalPackEntry   *entries;
+	WalPackEntry   *entry = NULL;
+	int				n_entries;
+	int				fd;
+	int				i;
+	char		   *data = NULL;
+	char		   *buf = NULL;
+	const char	   *suffix;
+	pg_crc32		crc;
+
+	if (!get_wal_pack_path(pack_path, archive_dir, wal_file_name,
+						   wal_seg_size, pack_size, location))
+		return NULL;
+
+	entries = read_wal_pack_index(pack_path, &n_entries, location);
+	if (entries == NULL)
+		return NULL;
+
+	for (i = 0; i < n_entries; i++)
+	{
+		if (strncmp(entries[i].name, wal_file_name, XLOG_FNAME_LEN) == 0)
+		{
+			entry = &entries[i];
+			break;
+		}
+	}
+
+	if (entry == NULL)
+	{
+		pg_free(entries);
+		return NULL;
+	}
+
+	suffix = entry->name + XLOG_FNAME_LEN;
+
+	/* read stored content */
+	fd = fio_open(pack_path, O_RDONLY | PG_BINARY, location);
+	if (fd < 0)
+	{
+		elog(WARNING, "Cannot open WAL pack file \"%s\": %s",
+			 pack_path, strerror(errno));
+		goto cleanup;
+	}
+
+	data = pgut_malloc(entry->size);
+	if (fio_seek(fd, entry->offset) < 0 ||
+		!fio_read_exact(fd, data, entry->size))
+	{
+		fio_close(fd);
+		elog(WARNING, "Cannot read WAL file \"%s\" from pack \"%s\"",
+			 entry->name, pack_path);
+		goto cleanup;
+	}
+	fio_close(fd);
+
+	INIT_FILE_CRC32(true, crc);
+	COMP_FILE_CRC32(true, crc, data, entry->size);
+	FIN_FILE_CRC32(true, crc);
+
+	if (crc != entry->crc)
+	{
+		elog(WARNING, "WAL file \"%s\" in pack \"%s\" is corrupted",
+			 entry->name, pack_path);
+		goto cleanup;
+	}
+
+	buf = pgut_malloc(wal_seg_size);
+
+	if (*suffix == '\0')
+	{
+		if (entry->size != wal_seg_size)
+			goto corrupted;
+		memcpy(buf, data, wal_seg_size);
+	}
+#ifdef HAVE_LIBZ
+	else if (strcmp(suffix, ".gz") == 0)
+	{
+		z_stream	z;
+		int			rc;
+
+		memset(&z, 0, sizeof(z));
+		z.next_in = (Bytef *) data;
+		z.avail_in = entry->size;
+		z.next_out = (Bytef *) buf;
+		z.avail_out = wal_seg_size;
+
+		/* gzip header is expected */
+		if (inflateInit2(&z, MAX_WBITS + 16) != Z_OK)
+			goto corrupted;
+		rc = inflate(&z, Z_FINISH);
+		inflateEnd(&z);
+
+		if (rc != Z_STREAM_END || z.total_out != wal_seg_size)
+			goto corrupted;
+	}
+#endif
+#ifdef HAVE_LIBZSTD
+	else if (strcmp(suffix, ".zst") == 0)
+	{
+		size_t	rc = ZSTD_decompress(buf, wal_seg_size, data, entry->size);
+
+		if (ZSTD_isError(rc) || rc != wal_seg_size)
+			goto corrupted;
+	}
+#endif
+	else
+	{
+		elog(WARNING, "Cannot decompress WAL file \"%s\" from pack \"%s\", "
+			 "this build does not support its compression", entry->name, pack_path);
+		pg_free(buf);
+		buf = NULL;
+	}
+
+cleanup:
+	pg_free(data);
+	pg_free(entries);
+	return buf;
+
+corrupted:
+	elog(WARNING, "Cannot decompress WAL file \"%s\" from pack \"%s\"",
+		 entry->name, pack_path);
+	pg_free(buf);
+	buf = NULL;
+	goto cleanup;
+}
+
+/*
+ * Copy WAL segment from pack file in archive.
+ * Returns SEND_OK, FILE_MISSING or WRITE_FAILED.
+ */
+static int
+get_wal_file_from_pack(const char *filename, const char *from_fullpath, FILE *out)
+{
+	char	archive_dir[MAXPGPATH];
+	char   *buf;
+
+	strncpy(archive_dir, from_fullpath, MAXPGPATH - 1);
+	archive_dir[MAXPGPATH - 1] = '\0';
+	get_parent_directory(archive_dir);
+
+	buf = read_wal_pack_segment(archive_dir, filename, xlog_seg_size,
+								wal_pack_size, FIO_BACKUP_HOST);
+	if (buf == NULL)
+		return FILE_MISSING;
+
+	if (fwrite(buf, 1, xlog_seg_size, out) != xlog_seg_size)
+	{
+		pg_free(buf);
+		return WRITE_FAILED;
+	}
+
+	pg_free(buf);
+	elog(VERBOSE, "WAL file %s is copied from pack", filename);
+	return SEND_OK;
+}
+
+/* Construct path of the temp file, which push_file() creates in archive */
+static void
+get_archived_wal_part_path(char *path, char *part_path, const char *archive_dir,
+						   const char *wal_file_name, CompressAlg compress_alg)
+{
+	const char *suffix = "";
+
+	if (IsXLogFileName(wal_file_name))
+	{
+		if (compress_alg == ZLIB_COMPRESS)
+			suffix = ".gz";
+		else if (compress_alg == ZSTD_COMPRESS)
+			suffix = ".zst";
+	}
+
+	join_path_components(path, archive_dir, wal_file_name);
+	snprintf(part_path, MAXPGPATH, "%s%s.part", path, suffix);
+	strncat(path, suffix, MAXPGPATH - strlen(path) - 1);
+}
+
+/*
+ * Group commit of the batch pushed with group_commit flag.
+ *
+ * Temp files are synced all together, with a single syncfs() if it is
+ * available for the archive, renamed into place and synced again to make
+ * renames durable. Only after that '.ready' files are renamed to '.done',
+ * so PostgreSQL never considers a segment archived before it is on disk.
+ */
+static void
+push_batch_commit(push_batch *batch, const char *archive_status_dir,
+				  const char *first_filename, bool no_sync, bool no_ready_rename)
+{
+	int		i;
+	int		n_pending = 0;
+	bool	fs_synced = false;
+	char	to_fullpath[MAXPGPATH];
+	char	to_fullpath_part[MAXPGPATH];
+
+	for (i = 0; i < parray_num(batch->files); i++)
+	{
+		WALSegno *xlogfile = (WALSegno *) parray_get(batch->files, i);
+
+		if (xlogfile->push_rc == 0)
+			n_pending++;
+	}
+
+	if (n_pending > 0 && !no_sync)
+	{
+		if (fio_syncfs(batch->archive_dir, FIO_BACKUP_HOST) == 0)
+			fs_synced = true;
+		else
+		{
+			elog(VERBOSE, "Cannot sync filesystem of \"%s\", sync files one by one: %s",
+				 batch->archive_dir, strerror(errno));
+
+			for (i = 0; i < parray_num(batch->files); i++)
+			{
+				WALSegno *xlogfile = (WALSegno *) parray_get(batch->files, i);
+
+				if (xlogfile->push_rc != 0)
+					continue;
+
+				get_archived_wal_part_path(to_fullpath, to_fullpath_part, batch->archive_dir,
+										   xlogfile->name, batch->compress_alg);
+
+				if (fio_sync(to_fullpath_part, FIO_BACKUP_HOST) != 0)
+					elog(ERROR, "Failed to sync file \"%s\": %s",
+						 to_fullpath_part, strerror(errno));
+			}
+		}
+	}
+
+	/* Rename temp files to destination files */
+	for (i = 0; i < parray_num(batch->files); i++)
+	{
+		WALSegno *xlogfile = (WALSegno *) parray_get(batch->files, i);
+
+		if (xlogfile->push_rc != 0)
+			continue;
 
-		if (rc == 0)
-			args->n_pushed++;
-		else
-			args->n_skipped++;
+		get_archived_wal_part_path(to_fullpath, to_fullpath_part, batch->archive_dir,
+								   xlogfile->name, batch->compress_alg);
+
+		elog(VERBOSE, "Rename \"%s\" to \"%s\"", to_fullpath_part, to_fullpath);
+
+		if (fio_rename(to_fullpath_part, to_fullpath, FIO_BACKUP_HOST) < 0)
+			elog(ERROR, "Cannot rename file \"%s\" to \"%s\": %s",
+				 to_fullpath_part, to_fullpath, strerror(errno));
+
+		/* file is in place, there is no temp file to clean up anymore */
+		xlogfile->push_rc = 1;
 	}
 
-	/* close ssh connection */
-	fio_disconnect();
+	/* make renames durable before reporting segments as archived */
+	if (fs_synced && fio_syncfs(batch->archive_dir, FIO_BACKUP_HOST) != 0)
+		elog(ERROR, "Cannot sync filesystem of \"%s\": %s",
+			 batch->archive_dir, strerror(errno));
 
-	args->ret = 0;
-	return NULL;
+	if (n_pending > 0)
+		elog(LOG, "Committed %i WAL files of the batch", n_pending);
+
+	if (no_ready_rename || archive_status_dir == NULL)
+		return;
+
+	for (i = 0; i < parray_num(batch->files); i++)
+	{
+		WALSegno *xlogfile = (WALSegno *) parray_get(batch->files, i);
+
+		/*
+		 * Ready file of the first file is renamed by postgres itself,
+		 * when archive_command succeeds.
+		 */
+		if (xlogfile->push_rc < 0 || strcmp(xlogfile->name, first_filename) == 0)
+			continue;
+
+		mark_wal_file_done(archive_status_dir, xlogfile->name);
+	}
 }
 
-int
-push_file(WALSegno *xlogfile, const char *archive_status_dir,
-		  const char *pg_xlog_dir, const char *archive_dir,
-		  bool overwrite, bool no_sync, uint32 archive_timeout,
-		  bool no_ready_rename, bool is_compress,
-		  int compress_level)
+/* Remove temp files of the batch, which were not committed */
+static void
+push_batch_cleanup_atexit(bool fatal, void *userdata)
 {
-	int     rc;
-
-	elog(LOG, "pushing file \"%s\"", xlogfile->name);
+	push_batch *batch = (push_batch *) userdata;
+	char		to_fullpath[MAXPGPATH];
+	char		to_fullpath_part[MAXPGPATH];
+	int			i;
 
-	/* If compression is not required, then just copy it as is */
-	if (!is_compress)
-		rc = push_file_internal_uncompressed(xlogfile->name, pg_xlog_dir,
-											 archive_dir, overwrite, no_sync,
-											 archive_timeout);
-#ifdef HAVE_LIBZ
-	else
-		rc = push_file_internal_gz(xlogfile->name, pg_xlog_dir, archive_dir,
-								   overwrite, no_sync, compress_level,
-								   archive_timeout);
-#endif
+	if (!fatal)
+		return;
 
-	/* take '--no-ready-rename' flag into account */
-	if (!no_ready_rename && archive_status_dir != NULL)
+	for (i = 0; i < parray_num(batch->files); i++)
 	{
-		char	wal_file_dummy[MAXPGPATH];
-		char	wal_file_ready[MAXPGPATH];
-		char	wal_file_done[MAXPGPATH];
+		WALSegno *xlogfile = (WALSegno *) parray_get(batch->files, i);
 
-		join_path_components(wal_file_dummy, archive_status_dir, xlogfile->name);
-		snprintf(wal_file_ready, MAXPGPATH, "%s.%s", wal_file_dummy, "ready");
-		snprintf(wal_file_done, MAXPGPATH, "%s.%s", wal_file_dummy, "done");
-
-		canonicalize_path(wal_file_ready);
-		canonicalize_path(wal_file_done);
-		/* It is ok to rename status file in archive_status directory */
-		elog(VERBOSE, "Rename \"%s\" to \"%s\"", wal_file_ready, wal_file_done);
+		if (xlogfile->push_rc != 0)
+			continue;
 
-		/* do not error out, if rename failed */
-		if (fio_rename(wal_file_ready, wal_file_done, FIO_DB_HOST) < 0)
-			elog(WARNING, "Cannot rename ready file \"%s\" to \"%s\": %s",
-				wal_file_ready, wal_file_done, strerror(errno));
+		get_archived_wal_part_path(to_fullpath, to_fullpath_part, batch->archive_dir,
+								   xlogfile->name, batch->compress_alg);
+		fio_unlink(to_fullpath_part, FIO_BACKUP_HOST);
 	}
-
-	return rc;
 }
 
 /*
@@ -383,7 +1603,7 @@ push_file(WALSegno *xlogfile, const char *archive_status_dir,
 int
 push_file_internal_uncompressed(const char *wal_file_name, const char *pg_xlog_dir,
 								const char *archive_dir, bool overwrite, bool no_sync,
-								uint32 archive_timeout)
+								uint32 archive_timeout, bool group_commit)
 {
 	FILE	   *in = NULL;
 	int			out = -1;
@@ -512,8 +1732,8 @@ part_opened:
 		pg_crc32 crc32_src;
 		pg_crc32 crc32_dst;
 
-		crc32_src = fio_get_crc32(from_fullpath, FIO_DB_HOST, false);
-		crc32_dst = fio_get_crc32(to_fullpath, FIO_BACKUP_HOST, false);
+		crc32_src = fio_get_crc32(from_fullpath, FIO_DB_HOST, NONE_COMPRESS);
+		crc32_dst = fio_get_crc32(to_fullpath, FIO_BACKUP_HOST, NONE_COMPRESS);
 
 		if (crc32_src == crc32_dst)
 		{
@@ -587,6 +1807,13 @@ part_opened:
 					to_fullpath_part, strerror(errno));
 	}
 
+	/* in group commit mode temp file is synced and renamed by the caller */
+	if (group_commit)
+	{
+		pg_free(buf);
+		return 0;
+	}
+
 	/* sync temp file to disk */
 	if (!no_sync)
 	{
@@ -622,7 +1849,7 @@ part_opened:
 int
 push_file_internal_gz(const char *wal_file_name, const char *pg_xlog_dir,
 					  const char *archive_dir, bool overwrite, bool no_sync,
-					  int compress_level, uint32 archive_timeout)
+					  int compress_level, uint32 archive_timeout, bool group_commit)
 {
 	FILE	   *in = NULL;
 	gzFile		out = NULL;
@@ -761,8 +1988,8 @@ part_opened:
 		pg_crc32 crc32_dst;
 
 		/* TODO: what if one of them goes missing? */
-		crc32_src = fio_get_crc32(from_fullpath, FIO_DB_HOST, false);
-		crc32_dst = fio_get_crc32(to_fullpath_gz, FIO_BACKUP_HOST, true);
+		crc32_src = fio_get_crc32(from_fullpath, FIO_DB_HOST, NONE_COMPRESS);
+		crc32_dst = fio_get_crc32(to_fullpath_gz, FIO_BACKUP_HOST, ZLIB_COMPRESS);
 
 		if (crc32_src == crc32_dst)
 		{
@@ -820,45 +2047,341 @@ part_opened:
 	/* close source file */
 	fclose(in);
 
-	/* Writing is asynchronous in case of push in remote mode, so check agent status */
-	if (fio_check_error_fd_gz(out, &errmsg))
+	/* Writing is asynchronous in case of push in remote mode, so check agent status */
+	if (fio_check_error_fd_gz(out, &errmsg))
+	{
+		fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
+		elog(ERROR, "Cannot write to the remote compressed file \"%s\": %s",
+					to_fullpath_gz_part, errmsg);
+	}
+
+	/* close temp file, TODO: make it synchronous */
+	if (fio_gzclose(out) != 0)
+	{
+		fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
+		elog(ERROR, "Cannot close compressed temp WAL file \"%s\": %s",
+				to_fullpath_gz_part, strerror(errno));
+	}
+
+	/* in group commit mode temp file is synced and renamed by the caller */
+	if (group_commit)
+	{
+		pg_free(buf);
+		return 0;
+	}
+
+	/* sync temp file to disk */
+	if (!no_sync)
+	{
+		if (fio_sync(to_fullpath_gz_part, FIO_BACKUP_HOST) != 0)
+			elog(ERROR, "Failed to sync file \"%s\": %s",
+					to_fullpath_gz_part, strerror(errno));
+	}
+
+	elog(VERBOSE, "Rename \"%s\" to \"%s\"",
+			to_fullpath_gz_part, to_fullpath_gz);
+
+	//copy_file_attributes(from_path, FIO_DB_HOST, to_path_temp, FIO_BACKUP_HOST, true);
+
+	/* Rename temp file to destination file */
+	if (fio_rename(to_fullpath_gz_part, to_fullpath_gz, FIO_BACKUP_HOST) < 0)
+	{
+		fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
+		elog(ERROR, "Cannot rename file \"%s\" to \"%s\": %s",
+				to_fullpath_gz_part, to_fullpath_gz, strerror(errno));
+	}
+
+	pg_free(buf);
+
+	return 0;
+}
+#endif
+
+#ifdef HAVE_LIBZSTD
+/*
+ * Push WAL segment into archive and apply zstd streaming compression to it.
+ * Compression is done locally, so only compressed data is sent to the
+ * backup host. If wal_compress_workers is greater than one, zstd compresses
+ * parts of the segment on several threads.
+ * Returns:
+ *  0 - file was successfully pushed
+ *  1 - push was skipped because file already exists in the archive and
+ *      has the same checksum
+ */
+int
+push_file_internal_zstd(const char *wal_file_name, const char *pg_xlog_dir,
+						const char *archive_dir, bool overwrite, bool no_sync,
+						int compress_level, uint32 archive_timeout, bool group_commit)
+{
+	FILE	   *in = NULL;
+	int			out = -1;
+	char       *buf = pgut_malloc(OUT_BUF_SIZE); /* 1MB buffer */
+	size_t		out_buf_size = ZSTD_CStreamOutSize();
+	char       *out_buf = pgut_malloc(out_buf_size);
+	ZSTD_CCtx  *cctx = NULL;
+	char		from_fullpath[MAXPGPATH];
+	char		to_fullpath[MAXPGPATH];
+	char		to_fullpath_zst[MAXPGPATH];
+
+	/* partial handling */
+	struct stat		st;
+	char		to_fullpath_zst_part[MAXPGPATH];
+	int			partial_try_count = 0;
+	int			partial_file_size = 0;
+	bool		partial_is_stale = true;
+	/* remote agent error message */
+	char       *errmsg = NULL;
+
+	/* from path */
+	join_path_components(from_fullpath, pg_xlog_dir, wal_file_name);
+	canonicalize_path(from_fullpath);
+	/* to path */
+	join_path_components(to_fullpath, archive_dir, wal_file_name);
+	canonicalize_path(to_fullpath);
+
+	/* destination file with .zst suffix */
+	snprintf(to_fullpath_zst, sizeof(to_fullpath_zst), "%s.zst", to_fullpath);
+	/* destination temp file */
+	snprintf(to_fullpath_zst_part, sizeof(to_fullpath_zst_part), "%s.part", to_fullpath_zst);
+
+	/* Open source file for read */
+	in = fopen(from_fullpath, PG_BINARY_R);
+	if (in == NULL)
+		elog(ERROR, "Cannot open source WAL file \"%s\": %s",
+				from_fullpath, strerror(errno));
+
+	/* disable stdio buffering for input file */
+	setvbuf(in, NULL, _IONBF, BUFSIZ);
+
+	/* Grab lock by creating temp file in exclusive mode */
+	out = fio_open(to_fullpath_zst_part, O_RDWR | O_CREAT | O_EXCL | PG_BINARY, FIO_BACKUP_HOST);
+	if (out < 0)
+	{
+		if (errno != EEXIST)
+			elog(ERROR, "Failed to open temp WAL file \"%s\": %s",
+					to_fullpath_zst_part, strerror(errno));
+		/* Already existing destination temp file is not an error condition */
+	}
+	else
+		goto part_opened;
+
+	/*
+	 * Partial file already exists, see push_file_internal_uncompressed()
+	 * for the details.
+	 */
+	while (partial_try_count < archive_timeout)
+	{
+		if (fio_stat(to_fullpath_zst_part, &st, false, FIO_BACKUP_HOST) < 0)
+		{
+			if (errno == ENOENT)
+			{
+				//part file is gone, lets try to grab it
+				out = fio_open(to_fullpath_zst_part, O_RDWR | O_CREAT | O_EXCL | PG_BINARY, FIO_BACKUP_HOST);
+				if (out < 0)
+				{
+					if (errno != EEXIST)
+						elog(ERROR, "Failed to open temp WAL file \"%s\": %s",
+										to_fullpath_zst_part, strerror(errno));
+				}
+				else
+					/* Successfully created partial file */
+					break;
+			}
+			else
+				elog(ERROR, "Cannot stat temp WAL file \"%s\": %s",
+							to_fullpath_zst_part, strerror(errno));
+		}
+
+		/* first round */
+		if (!partial_try_count)
+		{
+			elog(LOG, "Temp WAL file already exists, waiting on it %u seconds: \"%s\"",
+					archive_timeout, to_fullpath_zst_part);
+			partial_file_size = st.st_size;
+		}
+
+		/* file size is changing */
+		if (st.st_size > partial_file_size)
+			partial_is_stale = false;
+
+		sleep(1);
+		partial_try_count++;
+	}
+
+	/*
+	 * If temp file was not grabbed for ARCHIVE_TIMEOUT and temp file is not stale,
+	 * then exit with error.
+	 */
+	if (out < 0)
+	{
+		if (!partial_is_stale)
+			elog(ERROR, "Failed to open temp WAL file \"%s\" in %i seconds",
+					to_fullpath_zst_part, archive_timeout);
+
+		/* Partial segment is considered stale, so reuse it */
+		elog(LOG, "Reusing stale temp WAL file \"%s\"", to_fullpath_zst_part);
+		fio_unlink(to_fullpath_zst_part, FIO_BACKUP_HOST);
+
+		out = fio_open(to_fullpath_zst_part, O_RDWR | O_CREAT | O_EXCL | PG_BINARY, FIO_BACKUP_HOST);
+		if (out < 0)
+			elog(ERROR, "Cannot open temp WAL file \"%s\": %s",
+					to_fullpath_zst_part, strerror(errno));
+	}
+
+part_opened:
+	elog(VERBOSE, "Temp WAL file successfully created: \"%s\"", to_fullpath_zst_part);
+	/* Check if possible to skip copying */
+	if (fileExists(to_fullpath_zst, FIO_BACKUP_HOST))
+	{
+		pg_crc32 crc32_src;
+		pg_crc32 crc32_dst;
+
+		crc32_src = fio_get_crc32(from_fullpath, FIO_DB_HOST, NONE_COMPRESS);
+		crc32_dst = fio_get_crc32(to_fullpath_zst, FIO_BACKUP_HOST, ZSTD_COMPRESS);
+
+		if (crc32_src == crc32_dst)
+		{
+			elog(LOG, "WAL file already exists in archive with the same "
+					"checksum, skip pushing: \"%s\"", from_fullpath);
+			/* cleanup */
+			fclose(in);
+			fio_close(out);
+			fio_unlink(to_fullpath_zst_part, FIO_BACKUP_HOST);
+			pg_free(buf);
+			pg_free(out_buf);
+			return 1;
+		}
+		else
+		{
+			if (overwrite)
+				elog(LOG, "WAL file already exists in archive with "
+						"different checksum, overwriting: \"%s\"", to_fullpath_zst);
+			else
+			{
+				/* Overwriting is forbidden,
+				 * so we must unlink partial file and exit with error.
+				 */
+				fio_unlink(to_fullpath_zst_part, FIO_BACKUP_HOST);
+				elog(ERROR, "WAL file already exists in archive with "
+						"different checksum: \"%s\"", to_fullpath_zst);
+			}
+		}
+	}
+
+	/* setup compressor */
+	cctx = ZSTD_createCCtx();
+	if (cctx == NULL)
+	{
+		fio_unlink(to_fullpath_zst_part, FIO_BACKUP_HOST);
+		elog(ERROR, "Cannot create zstd compression context");
+	}
+
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, compress_level);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+
+	/* libzstd may be built without multithreading support, it is not an error */
+	if (wal_compress_workers > 1 &&
+		ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, wal_compress_workers)))
+		elog(VERBOSE, "libzstd does not support multithreading, compress \"%s\" on a single thread",
+			 from_fullpath);
+
+	/* copy content */
+	for (;;)
+	{
+		size_t			read_len = 0;
+		bool			last_chunk;
+		ZSTD_inBuffer	input;
+		size_t			remaining;
+
+		read_len = fread(buf, 1, OUT_BUF_SIZE, in);
+
+		if (ferror(in))
+		{
+			fio_unlink(to_fullpath_zst_part, FIO_BACKUP_HOST);
+			elog(ERROR, "Cannot read from source file \"%s\": %s",
+					from_fullpath, strerror(errno));
+		}
+
+		last_chunk = feof(in);
+		input.src = buf;
+		input.size = read_len;
+		input.pos = 0;
+
+		/* compress the chunk, flush everything on the last one */
+		do
+		{
+			ZSTD_outBuffer output = { out_buf, out_buf_size, 0 };
+
+			remaining = ZSTD_compressStream2(cctx, &output, &input,
+											 last_chunk ? ZSTD_e_end : ZSTD_e_continue);
+			if (ZSTD_isError(remaining))
+			{
+				fio_unlink(to_fullpath_zst_part, FIO_BACKUP_HOST);
+				elog(ERROR, "Cannot compress WAL file \"%s\": %s",
+						from_fullpath, ZSTD_getErrorName(remaining));
+			}
+
+			if (output.pos > 0 && fio_write_async(out, out_buf, output.pos) != output.pos)
+			{
+				fio_unlink(to_fullpath_zst_part, FIO_BACKUP_HOST);
+				elog(ERROR, "Cannot write to destination temp file \"%s\": %s",
+							to_fullpath_zst_part, strerror(errno));
+			}
+		} while (last_chunk ? remaining != 0 : input.pos < input.size);
+
+		if (last_chunk)
+			break;
+	}
+
+	ZSTD_freeCCtx(cctx);
+
+	/* close source file */
+	fclose(in);
+
+	/* Writing is asynchronous in case of push in remote mode, so check agent status */
+	if (fio_check_error_fd(out, &errmsg))
+	{
+		fio_unlink(to_fullpath_zst_part, FIO_BACKUP_HOST);
+		elog(ERROR, "Cannot write to the remote file \"%s\": %s",
+					to_fullpath_zst_part, errmsg);
+	}
+
+	/* close temp file */
+	if (fio_close(out) != 0)
 	{
-		fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
-		elog(ERROR, "Cannot write to the remote compressed file \"%s\": %s",
-					to_fullpath_gz_part, errmsg);
+		fio_unlink(to_fullpath_zst_part, FIO_BACKUP_HOST);
+		elog(ERROR, "Cannot close temp WAL file \"%s\": %s",
+					to_fullpath_zst_part, strerror(errno));
 	}
 
-	/* close temp file, TODO: make it synchronous */
-	if (fio_gzclose(out) != 0)
+	/* in group commit mode temp file is synced and renamed by the caller */
+	if (group_commit)
 	{
-		fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
-		elog(ERROR, "Cannot close compressed temp WAL file \"%s\": %s",
-				to_fullpath_gz_part, strerror(errno));
+		pg_free(buf);
+		pg_free(out_buf);
+		return 0;
 	}
 
 	/* sync temp file to disk */
 	if (!no_sync)
 	{
-		if (fio_sync(to_fullpath_gz_part, FIO_BACKUP_HOST) != 0)
+		if (fio_sync(to_fullpath_zst_part, FIO_BACKUP_HOST) != 0)
 			elog(ERROR, "Failed to sync file \"%s\": %s",
-					to_fullpath_gz_part, strerror(errno));
+						to_fullpath_zst_part, strerror(errno));
 	}
 
-	elog(VERBOSE, "Rename \"%s\" to \"%s\"",
-			to_fullpath_gz_part, to_fullpath_gz);
-
-	//copy_file_attributes(from_path, FIO_DB_HOST, to_path_temp, FIO_BACKUP_HOST, true);
+	elog(VERBOSE, "Rename \"%s\" to \"%s\"", to_fullpath_zst_part, to_fullpath_zst);
 
 	/* Rename temp file to destination file */
-	if (fio_rename(to_fullpath_gz_part, to_fullpath_gz, FIO_BACKUP_HOST) < 0)
+	if (fio_rename(to_fullpath_zst_part, to_fullpath_zst, FIO_BACKUP_HOST) < 0)
 	{
-		fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
+		fio_unlink(to_fullpath_zst_part, FIO_BACKUP_HOST);
 		elog(ERROR, "Cannot rename file \"%s\" to \"%s\": %s",
-				to_fullpath_gz_part, to_fullpath_gz, strerror(errno));
+					to_fullpath_zst_part, to_fullpath_zst, strerror(errno));
 	}
 
 	pg_free(buf);
-
+	pg_free(out_buf);
 	return 0;
 }
 #endif
@@ -921,6 +2444,7 @@ setup_push_filelist(const char *archive_status_dir, const char *first_file,
 	/* guarantee that first filename is in batch list */
 	xlogfile = palloc(sizeof(WALSegno));
 	pg_atomic_init_flag(&xlogfile->lock);
+	xlogfile->push_rc = -1;
 	snprintf(xlogfile->name, MAXFNAMELEN, "%s", first_file);
 	parray_append(batch_files, xlogfile);
 
@@ -953,6 +2477,7 @@ setup_push_filelist(const char *archive_status_dir, const char *first_file,
 
 		xlogfile = palloc(sizeof(WALSegno));
 		pg_atomic_init_flag(&xlogfile->lock);
+		xlogfile->push_rc = -1;
 
 		snprintf(xlogfile->name, MAXFNAMELEN, "%s", filename);
 		parray_append(batch_files, xlogfile);
@@ -1001,6 +2526,11 @@ do_archive_get(InstanceState *instanceState, InstanceConfig *instance, const cha
 	int         n_actual_threads = num_threads;
 	uint32      n_files_in_prefetch = 0;
 
+	/* adaptive prefetch */
+	int         prefetch_depth = batch_size;
+	int         low_watermark = batch_size / 2;
+	double      fetch_latency = 0;
+
 	/* time reporting */
 	instr_time  start_time, end_time;
 	double      get_time;
@@ -1036,6 +2566,10 @@ do_archive_get(InstanceState *instanceState, InstanceConfig *instance, const cha
 	elog(VERBOSE, "Obtaining XLOG_SEG_SIZE from pg_control file");
 	instance->xlog_seg_size = get_xlog_seg_size(current_dir);
 
+	/* we use it to extend partial file and to read segments from pack */
+	xlog_seg_size = instance->xlog_seg_size;
+	wal_pack_size = instance->wal_pack_size;
+
 	/* Prefetch optimization kicks in only if simple XLOG segments is requested
 	 * and batching is enabled.
 	 *
@@ -1047,6 +2581,10 @@ do_archive_get(InstanceState *instanceState, InstanceConfig *instance, const cha
 	{
 		XLogSegNo segno;
 		TimeLineID tli;
+		XLogSegNo last_segno;
+		TimeLineID last_tli;
+		prefetch_state state;
+		double now;
 
 		GetXLogFromFileName(wal_file_name, &tli, &segno, instance->xlog_seg_size);
 
@@ -1062,8 +2600,52 @@ do_archive_get(InstanceState *instanceState, InstanceConfig *instance, const cha
 		 */
 		join_path_components(prefetched_file, prefetch_dir, wal_file_name);
 
+		mkdir(prefetch_dir, DIR_PERMISSION); /* In case prefetch directory do not exists yet */
+
+		/*
+		 * Measure replay rate as time between requests of consecutive
+		 * segments and adjust prefetch depth and number of threads to it.
+		 */
+		now = prefetch_clock();
+		read_prefetch_state(prefetch_dir, &state);
+
+		if (IsXLogFileName(state.last_wal_file))
+		{
+			GetXLogFromFileName(state.last_wal_file, &last_tli, &last_segno,
+								instance->xlog_seg_size);
+
+			if (last_tli == tli && last_segno + 1 == segno && now > state.last_time)
+			{
+				if (state.replay_interval > 0)
+					state.replay_interval += PREFETCH_SAMPLE_WEIGHT *
+						(now - state.last_time - state.replay_interval);
+				else
+					state.replay_interval = now - state.last_time;
+			}
+		}
+
+		snprintf(state.last_wal_file, MAXFNAMELEN, "%s", wal_file_name);
+		state.last_time = now;
+		write_prefetch_state(prefetch_dir, &state);
+
+		plan_prefetch(&state, batch_size, num_threads,
+					  &prefetch_depth, &num_threads, &low_watermark);
+
+		elog(LOG, "Prefetch plan: depth %i, threads %i, low watermark %i, "
+				"replay interval %.3fs, fetch latency %.3fs",
+				prefetch_depth, num_threads, low_watermark,
+				state.replay_interval, state.fetch_latency);
+
+		/*
+		 * Let background refill deliver requested segment, if it is in progress.
+		 * If it is stuck, do not touch prefetch directory under its feet and
+		 * copy requested segment from archive directly.
+		 */
+		if (!wait_prefetch_refill(prefetch_dir, tli, segno, instance->xlog_seg_size))
+			elog(LOG, "Background prefetch did not deliver WAL segment %s in %i seconds, "
+					"copy it directly", wal_file_name, PREFETCH_WAIT_TIMEOUT);
 		/* check if file is available in prefetch directory */
-		if (access(prefetched_file, F_OK) == 0)
+		else if (access(prefetched_file, F_OK) == 0)
 		{
 			/* Prefetched WAL segment is available, before using it, we must validate it.
 			 * But for validation to work properly(because of contrecord), we must be sure
@@ -1074,11 +2656,15 @@ do_archive_get(InstanceState *instanceState, InstanceConfig *instance, const cha
 			 * copy requested file directly from archive.
 			 */
 			if (!next_wal_segment_exists(tli, segno, prefetch_dir, instance->xlog_seg_size))
+			{
 				n_fetched = run_wal_prefetch(prefetch_dir, instanceState->instance_wal_subdir_path,
-											 tli, segno, num_threads, false, batch_size,
-											 instance->xlog_seg_size);
+											 tli, segno, num_threads, false, prefetch_depth,
+											 instance->xlog_seg_size, &fetch_latency);
+				update_prefetch_latency(prefetch_dir, fetch_latency);
+			}
 
-			n_files_in_prefetch = maintain_prefetch(prefetch_dir, segno, instance->xlog_seg_size);
+			n_files_in_prefetch = maintain_prefetch(prefetch_dir, segno, instance->xlog_seg_size,
+													prefetch_refill_running(prefetch_dir));
 
 			if (wal_satisfy_from_prefetch(tli, segno, wal_file_name, prefetch_dir,
 										  absolute_wal_file_path, instance->xlog_seg_size,
@@ -1086,10 +2672,16 @@ do_archive_get(InstanceState *instanceState, InstanceConfig *instance, const cha
 			{
 				n_files_in_prefetch--;
 				elog(INFO, "pg_probackup archive-get used prefetched WAL segment %s, prefetch state: %u/%u",
-						wal_file_name, n_files_in_prefetch, batch_size);
+						wal_file_name, n_files_in_prefetch, prefetch_depth);
+
+				/* Top up prefetch before it runs out, without making recovery wait */
+				if (n_files_in_prefetch < (uint32) low_watermark)
+					start_prefetch_refill(prefetch_dir, instanceState->instance_wal_subdir_path,
+										  tli, segno, prefetch_depth, num_threads,
+										  instance->xlog_seg_size);
 				goto get_done;
 			}
-			else
+			else if (!prefetch_refill_running(prefetch_dir))
 			{
 				/* discard prefetch */
 //				n_fetched = 0;
@@ -1100,8 +2692,6 @@ do_archive_get(InstanceState *instanceState, InstanceConfig *instance, const cha
 		{
 			/* Do prefetch maintenance here */
 
-			mkdir(prefetch_dir, DIR_PERMISSION); /* In case prefetch directory do not exists yet */
-
 			/* We`ve failed to satisfy current request from prefetch directory,
 			 * therefore we can discard its content, since it may be corrupted or
 			 * contain stale files.
@@ -1114,17 +2704,19 @@ do_archive_get(InstanceState *instanceState, InstanceConfig *instance, const cha
 
 			/* prefetch files */
 			n_fetched = run_wal_prefetch(prefetch_dir, instanceState->instance_wal_subdir_path,
-										 tli, segno, num_threads, true, batch_size,
-										 instance->xlog_seg_size);
+										 tli, segno, num_threads, true, prefetch_depth,
+										 instance->xlog_seg_size, &fetch_latency);
+			update_prefetch_latency(prefetch_dir, fetch_latency);
 
-			n_files_in_prefetch = maintain_prefetch(prefetch_dir, segno, instance->xlog_seg_size);
+			n_files_in_prefetch = maintain_prefetch(prefetch_dir, segno, instance->xlog_seg_size,
+													prefetch_refill_running(prefetch_dir));
 
 			if (wal_satisfy_from_prefetch(tli, segno, wal_file_name, prefetch_dir, absolute_wal_file_path,
 										  instance->xlog_seg_size, validate_wal))
 			{
 				n_files_in_prefetch--;
 				elog(INFO, "pg_probackup archive-get copied WAL file %s, prefetch state: %u/%u",
-						wal_file_name, n_files_in_prefetch, batch_size);
+						wal_file_name, n_files_in_prefetch, prefetch_depth);
 				goto get_done;
 			}
 //			else
@@ -1136,9 +2728,6 @@ do_archive_get(InstanceState *instanceState, InstanceConfig *instance, const cha
 		}
 	}
 
-	/* we use it to extend partial file later  */
-	xlog_seg_size = instance->xlog_seg_size;
-
 	/* Either prefetch didn`t cut it, or batch mode is disabled or
 	 * the requested file is not WAL segment.
 	 * Copy file from the archive directly.
@@ -1184,7 +2773,7 @@ get_done:
 
 	if (fail_count == 0)
 		elog(INFO, "pg_probackup archive-get completed successfully, fetched: %i/%i, time elapsed: %s",
-				n_fetched, batch_size, pretty_time_str);
+				n_fetched, prefetch_depth, pretty_time_str);
 	else
 		elog(ERROR, "pg_probackup archive-get failed to deliver WAL file: %s, time elapsed: %s",
 				wal_file_name, pretty_time_str);
@@ -1192,18 +2781,25 @@ get_done:
 
 /*
  * Copy batch_size of regular WAL segments into prefetch directory,
- * starting with first_file.
+ * starting with first_file. Segments already prefetched are skipped.
  *
  * inclusive - should we copy first_file or not.
+ * fetch_latency - set to average time spent by one thread to fetch
+ * one segment, or 0 if nothing was fetched.
  */
 uint32 run_wal_prefetch(const char *prefetch_dir, const char *archive_dir,
 					 TimeLineID tli, XLogSegNo first_segno, int num_threads,
-					 bool inclusive, int batch_size, uint32 wal_seg_size)
+					 bool inclusive, int batch_size, uint32 wal_seg_size,
+					 double *fetch_latency)
 {
 	int         i;
 	XLogSegNo   segno;
 	parray     *batch_files = parray_new();
 	int 		n_total_fetched = 0;
+	instr_time  start_time, end_time;
+
+	*fetch_latency = 0;
+	INSTR_TIME_SET_CURRENT(start_time);
 
 	if (!inclusive)
 		first_segno++;
@@ -1225,23 +2821,21 @@ uint32 run_wal_prefetch(const char *prefetch_dir, const char *archive_dir,
 	{
 		for (i = 0; i < parray_num(batch_files); i++)
 		{
-			char    to_fullpath[MAXPGPATH];
-			char    from_fullpath[MAXPGPATH];
 			WALSegno *xlogfile = (WALSegno *) parray_get(batch_files, i);
+			int       rc;
 
-			join_path_components(to_fullpath, prefetch_dir, xlogfile->name);
-			join_path_components(from_fullpath, archive_dir, xlogfile->name);
+			rc = prefetch_wal_file(xlogfile->name, prefetch_dir, archive_dir);
 
 			/* It is ok, maybe requested batch is greater than the number of available
 			 * files in the archive
 			 */
-			if (!get_wal_file(xlogfile->name, from_fullpath, to_fullpath, true))
+			if (rc < 0)
 			{
 				elog(LOG, "Thread [%d]: Failed to prefetch WAL segment %s", 0, xlogfile->name);
 				break;
 			}
 
-			n_total_fetched++;
+			n_total_fetched += rc;
 		}
 	}
 	else
@@ -1279,10 +2873,53 @@ uint32 run_wal_prefetch(const char *prefetch_dir, const char *archive_dir,
 			n_total_fetched += threads_args[i].n_fetched;
 		}
 	}
+
+	if (n_total_fetched > 0)
+	{
+		INSTR_TIME_SET_CURRENT(end_time);
+		INSTR_TIME_SUBTRACT(end_time, start_time);
+		*fetch_latency = INSTR_TIME_GET_DOUBLE(end_time) *
+			Min(num_threads, n_total_fetched) / n_total_fetched;
+	}
+
 	/* TODO: free batch_files */
 	return n_total_fetched;
 }
 
+/*
+ * Copy WAL segment from archive into prefetch directory. The file is copied
+ * into temp file first, so partially copied segment is never used.
+ * Returns 1 if file was copied, 0 if it is already prefetched and -1 on failure.
+ */
+static int
+prefetch_wal_file(const char *wal_file_name, const char *prefetch_dir,
+				  const char *archive_dir)
+{
+	char    from_fullpath[MAXPGPATH];
+	char    to_fullpath[MAXPGPATH];
+	char    to_fullpath_part[MAXPGPATH];
+
+	join_path_components(from_fullpath, archive_dir, wal_file_name);
+	join_path_components(to_fullpath, prefetch_dir, wal_file_name);
+	snprintf(to_fullpath_part, sizeof(to_fullpath_part), "%s.part", to_fullpath);
+
+	if (access(to_fullpath, F_OK) == 0)
+		return 0;
+
+	if (!get_wal_file(wal_file_name, from_fullpath, to_fullpath_part, true))
+		return -1;
+
+	if (rename(to_fullpath_part, to_fullpath) < 0)
+	{
+		elog(WARNING, "Cannot rename file '%s' to '%s': %s",
+				to_fullpath_part, to_fullpath, strerror(errno));
+		unlink(to_fullpath_part);
+		return -1;
+	}
+
+	return 1;
+}
+
 /*
  * Copy files from archive catalog to pg_wal.
  */
@@ -1290,8 +2927,7 @@ static void *
 get_files(void *arg)
 {
 	int		i;
-	char    to_fullpath[MAXPGPATH];
-	char    from_fullpath[MAXPGPATH];
+	int		rc;
 	archive_get_arg *args = (archive_get_arg *) arg;
 
 	my_thread_num = args->thread_num;
@@ -1306,10 +2942,9 @@ get_files(void *arg)
 		if (!pg_atomic_test_set_flag(&xlogfile->lock))
 			continue;
 
-		join_path_components(from_fullpath, args->archive_dir, xlogfile->name);
-		join_path_components(to_fullpath, args->prefetch_dir, xlogfile->name);
+		rc = prefetch_wal_file(xlogfile->name, args->prefetch_dir, args->archive_dir);
 
-		if (!get_wal_file(xlogfile->name, from_fullpath, to_fullpath, true))
+		if (rc < 0)
 		{
 			/* It is ok, maybe requested batch is greater than the number of available
 			 * files in the archive
@@ -1319,7 +2954,7 @@ get_files(void *arg)
 			break;
 		}
 
-		args->n_fetched++;
+		args->n_fetched += rc;
 	}
 
 	/* close ssh connection */
@@ -1339,9 +2974,11 @@ get_wal_file(const char *filename, const char *from_fullpath,
 	int     rc = FILE_MISSING;
 	FILE   *out;
 	char    from_fullpath_gz[MAXPGPATH];
+	char    from_fullpath_zst[MAXPGPATH];
 	bool    src_partial = false;
 
 	snprintf(from_fullpath_gz, sizeof(from_fullpath_gz), "%s.gz", from_fullpath);
+	snprintf(from_fullpath_zst, sizeof(from_fullpath_zst), "%s.zst", from_fullpath);
 
 	/* open destination file */
 	out = fopen(to_fullpath, PG_BINARY_W);
@@ -1376,11 +3013,20 @@ get_wal_file(const char *filename, const char *from_fullpath,
 		/* If requested file is regular WAL segment, then try to open it with '.gz' suffix... */
 		if (IsXLogFileName(filename))
 			rc = fio_send_file_gz(from_fullpath_gz, to_fullpath, out, &errmsg);
-		if (rc == FILE_MISSING)
 #endif
-			/* ... failing that, use uncompressed */
+#ifdef HAVE_LIBZSTD
+		/* ... or with '.zst' suffix ... */
+		if (rc == FILE_MISSING && IsXLogFileName(filename))
+			rc = fio_send_file_zstd(from_fullpath_zst, to_fullpath, out, &errmsg);
+#endif
+		/* ... failing that, use uncompressed */
+		if (rc == FILE_MISSING)
 			rc = fio_send_file(from_fullpath, to_fullpath, out, NULL, &errmsg);
 
+		/* ... or look for it in pack */
+		if (rc == FILE_MISSING && IsXLogFileName(filename))
+			rc = get_wal_file_from_pack(filename, from_fullpath, out);
+
 		/* When not in prefetch mode, try to use partial file */
 		if (rc == FILE_MISSING && !prefetch_mode && IsXLogFileName(filename))
 		{
@@ -1390,8 +3036,16 @@ get_wal_file(const char *filename, const char *from_fullpath,
 			/* '.gz.partial' goes first ... */
 			snprintf(from_partial, sizeof(from_partial), "%s.gz.partial", from_fullpath);
 			rc = fio_send_file_gz(from_partial, to_fullpath, out, &errmsg);
+#endif
+#ifdef HAVE_LIBZSTD
+			/* ... then '.zst.partial' ... */
 			if (rc == FILE_MISSING)
+			{
+				snprintf(from_partial, sizeof(from_partial), "%s.zst.partial", from_fullpath);
+				rc = fio_send_file_zstd(from_partial, to_fullpath, out, &errmsg);
+			}
 #endif
+			if (rc == FILE_MISSING)
 			{
 				/* ... failing that, use '.partial' */
 				snprintf(from_partial, sizeof(from_partial), "%s.partial", from_fullpath);
@@ -1418,11 +3072,20 @@ get_wal_file(const char *filename, const char *from_fullpath,
 		/* If requested file is regular WAL segment, then try to open it with '.gz' suffix... */
 		if (IsXLogFileName(filename))
 			rc = get_wal_file_internal(from_fullpath_gz, to_fullpath, out, true);
-		if (rc == FILE_MISSING)
 #endif
-			/* ... failing that, use uncompressed */
+#ifdef HAVE_LIBZSTD
+		/* ... or with '.zst' suffix ... */
+		if (rc == FILE_MISSING && IsXLogFileName(filename))
+			rc = get_wal_file_internal_zstd(from_fullpath_zst, to_fullpath, out);
+#endif
+		/* ... failing that, use uncompressed */
+		if (rc == FILE_MISSING)
 			rc = get_wal_file_internal(from_fullpath, to_fullpath, out, false);
 
+		/* ... or look for it in pack */
+		if (rc == FILE_MISSING && IsXLogFileName(filename))
+			rc = get_wal_file_from_pack(filename, from_fullpath, out);
+
 		/* When not in prefetch mode, try to use partial file */
 		if (rc == FILE_MISSING && !prefetch_mode && IsXLogFileName(filename))
 		{
@@ -1432,8 +3095,16 @@ get_wal_file(const char *filename, const char *from_fullpath,
 			/* '.gz.partial' goes first ... */
 			snprintf(from_partial, sizeof(from_partial), "%s.gz.partial", from_fullpath);
 			rc = get_wal_file_internal(from_partial, to_fullpath, out, true);
+#endif
+#ifdef HAVE_LIBZSTD
+			/* ... then '.zst.partial' ... */
 			if (rc == FILE_MISSING)
+			{
+				snprintf(from_partial, sizeof(from_partial), "%s.zst.partial", from_fullpath);
+				rc = get_wal_file_internal_zstd(from_partial, to_fullpath, out);
+			}
 #endif
+			if (rc == FILE_MISSING)
 			{
 				/* ... failing that, use '.partial' */
 				snprintf(from_partial, sizeof(from_partial), "%s.partial", from_fullpath);
@@ -1618,6 +3289,117 @@ cleanup:
 	return exit_code;
 }
 
+#ifdef HAVE_LIBZSTD
+/*
+ * Copy zstd-compressed WAL segment from local archive with decompression.
+ * Return codes are the same as for get_wal_file_internal(), plus
+ *   ZSTD_ERROR   (-7)
+ */
+int
+get_wal_file_internal_zstd(const char *from_path, const char *to_path, FILE *out)
+{
+	FILE       *in = NULL;
+	char       *buf = pgut_malloc(OUT_BUF_SIZE); /* 1MB buffer */
+	size_t      out_buf_size = ZSTD_DStreamOutSize();
+	char       *out_buf = pgut_malloc(out_buf_size);
+	ZSTD_DCtx  *dctx = NULL;
+	size_t      rc = 0;
+	int         exit_code = 0;
+
+	elog(VERBOSE, "Attempting to open compressed WAL file '%s'", from_path);
+
+	in = fopen(from_path, PG_BINARY_R);
+	if (in == NULL)
+	{
+		if (errno == ENOENT)
+			exit_code = FILE_MISSING;
+		else
+		{
+			elog(WARNING, "Cannot open compressed WAL file \"%s\": %s",
+					from_path, strerror(errno));
+			exit_code = OPEN_FAILED;
+		}
+		goto cleanup;
+	}
+
+	dctx = ZSTD_createDCtx();
+	if (dctx == NULL)
+	{
+		elog(WARNING, "Cannot create zstd decompression context");
+		exit_code = ZSTD_ERROR;
+		goto cleanup;
+	}
+
+	/* copy content */
+	for (;;)
+	{
+		ZSTD_inBuffer input;
+		size_t read_len = fread(buf, 1, OUT_BUF_SIZE, in);
+
+		if (ferror(in))
+		{
+			elog(WARNING, "Cannot read compressed WAL file \"%s\": %s",
+				from_path, strerror(errno));
+			exit_code = READ_FAILED;
+			break;
+		}
+
+		if (read_len == 0 && feof(in))
+		{
+			/* decoder returns 0 only when the last frame is complete */
+			if (rc != 0)
+			{
+				elog(WARNING, "Cannot decompress WAL file \"%s\": "
+					"unexpected end of file", from_path);
+				exit_code = ZSTD_ERROR;
+			}
+			break;
+		}
+
+		input.src = buf;
+		input.size = read_len;
+		input.pos = 0;
+
+		/* full output buffer means that decoder may have more data to flush */
+		for (;;)
+		{
+			ZSTD_outBuffer output = { out_buf, out_buf_size, 0 };
+
+			rc = ZSTD_decompressStream(dctx, &output, &input);
+
+			if (ZSTD_isError(rc))
+			{
+				elog(WARNING, "Cannot decompress WAL file \"%s\": %s",
+					from_path, ZSTD_getErrorName(rc));
+				exit_code = ZSTD_ERROR;
+				goto cleanup;
+			}
+
+			if (output.pos > 0 && fwrite(out_buf, 1, output.pos, out) != output.pos)
+			{
+				elog(WARNING, "Cannot write to WAL file '%s': %s",
+					to_path, strerror(errno));
+				exit_code = WRITE_FAILED;
+				goto cleanup;
+			}
+
+			if (input.pos == input.size && output.pos < output.size)
+				break;
+		}
+	}
+
+cleanup:
+	if (dctx)
+		ZSTD_freeDCtx(dctx);
+	if (in)
+		fclose(in);
+
+	pg_free(buf);
+	pg_free(out_buf);
+	return exit_code;
+}
+#endif
+
 bool next_wal_segment_exists(TimeLineID tli, XLogSegNo segno, const char *prefetch_dir, uint32 wal_seg_size)
 {
 	char        next_wal_filename[MAXFNAMELEN];
@@ -1681,8 +3463,12 @@ bool wal_satisfy_from_prefetch(TimeLineID tli, XLogSegNo segno, const char *wal_
 /*
  * Maintain prefetch directory: drop redundant files
  * Return number of files in prefetch directory.
+ *
+ * refill_running - temp files are being written by background refill,
+ * keep them.
  */
-uint32 maintain_prefetch(const char *prefetch_dir, XLogSegNo first_segno, uint32 wal_seg_size)
+uint32 maintain_prefetch(const char *prefetch_dir, XLogSegNo first_segno, uint32 wal_seg_size,
+						 bool refill_running)
 {
 	DIR		   *dir;
 	struct dirent *dir_ent;
@@ -1709,6 +3495,15 @@ uint32 maintain_prefetch(const char *prefetch_dir, XLogSegNo first_segno, uint32
 			strcmp(dir_ent->d_name, "..") == 0)
 			continue;
 
+		/* Skip prefetch state and lock */
+		if (strcmp(dir_ent->d_name, PREFETCH_STATE_FILE) == 0 ||
+			strcmp(dir_ent->d_name, PREFETCH_LOCK_FILE) == 0)
+			continue;
+
+		/* Keep temp files of background refill */
+		if (refill_running && !IsXLogFileName(dir_ent->d_name))
+			continue;
+
 		if (IsXLogFileName(dir_ent->d_name))
 		{
 
@@ -1730,3 +3525,278 @@ uint32 maintain_prefetch(const char *prefetch_dir, XLogSegNo first_segno, uint32
 
 	return n_files;
 }
+
+/* Wall clock time in seconds, comparable between processes */
+static double
+prefetch_clock(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Read state of adaptive prefetch, zeroed state is returned if there is none */
+static void
+read_prefetch_state(const char *prefetch_dir, prefetch_state *state)
+{
+	char	path[MAXPGPATH];
+	char	wal_file[MAXFNAMELEN];
+	FILE   *fp;
+
+	MemSet(state, 0, sizeof(prefetch_state));
+
+	join_path_components(path, prefetch_dir, PREFETCH_STATE_FILE);
+	fp = fopen(path, PG_BINARY_R);
+	if (fp == NULL)
+		return;
+
+	if (fscanf(fp, "%24s %lf %lf %lf", wal_file, &state->last_time,
+			   &state->replay_interval, &state->fetch_latency) == 4 &&
+		IsXLogFileName(wal_file))
+		snprintf(state->last_wal_file, MAXFNAMELEN, "%s", wal_file);
+	else
+		MemSet(state, 0, sizeof(prefetch_state));
+
+	fclose(fp);
+}
+
+/*
+ * Write state of adaptive prefetch. It is used only to tune prefetch,
+ * so errors are not fatal and state is not synced.
+ */
+static void
+write_prefetch_state(const char *prefetch_dir, prefetch_state *state)
+{
+	char	path[MAXPGPATH];
+	char	path_temp[MAXPGPATH];
+	FILE   *fp;
+
+	join_path_components(path, prefetch_dir, PREFETCH_STATE_FILE);
+	snprintf(path_temp, sizeof(path_temp), "%s.%d", path, (int) getpid());
+
+	fp = fopen(path_temp, PG_BINARY_W);
+	if (fp == NULL)
+	{
+		elog(LOG, "Cannot open file \"%s\": %s", path_temp, strerror(errno));
+		return;
+	}
+
+	fprintf(fp, "%s %f %f %f\n", IsXLogFileName(state->last_wal_file) ?
+			state->last_wal_file : "none", state->last_time,
+			state->replay_interval, state->fetch_latency);
+
+	if (fclose(fp) != 0 || rename(path_temp, path) < 0)
+	{
+		elog(LOG, "Cannot write file \"%s\": %s", path, strerror(errno));
+		unlink(path_temp);
+	}
+}
+
+/* Add new sample of fetch latency to prefetch state */
+static void
+update_prefetch_latency(const char *prefetch_dir, double fetch_latency)
+{
+	prefetch_state state;
+
+	if (fetch_latency <= 0)
+		return;
+
+	read_prefetch_state(prefetch_dir, &state);
+
+	if (state.fetch_latency > 0)
+		state.fetch_latency += PREFETCH_SAMPLE_WEIGHT * (fetch_latency - state.fetch_latency);
+	else
+		state.fetch_latency = fetch_latency;
+
+	write_prefetch_state(prefetch_dir, &state);
+}
+
+/*
+ * Choose prefetch depth, number of threads and the number of prefetched
+ * segments, below which prefetch is topped up in background.
+ *
+ * Prefetch must stay ahead of recovery: threads fetch at least twice as
+ * fast as segments are replayed, and low watermark covers twice the time
+ * needed to fetch a segment. Until replay interval and fetch latency
+ * are known, configured batch size and number of threads are used.
+ */
+static void
+plan_prefetch(prefetch_state *state, int max_depth, int max_threads,
+			  int *depth, int *n_threads, int *low_watermark)
+{
+	double	replayed_per_fetch;
+
+	if (state->replay_interval <= 0 || state->fetch_latency <= 0)
+	{
+		*depth = max_depth;
+		*n_threads = Min(max_threads, max_depth);
+		*low_watermark = max_depth / 2;
+		return;
+	}
+
+	/* segments replayed while one segment is fetched */
+	replayed_per_fetch = state->fetch_latency / state->replay_interval;
+
+	*n_threads = (int) Min(ceil(2 * replayed_per_fetch), (double) max_threads);
+	*n_threads = Max(*n_threads, 1);
+
+	*low_watermark = (int) Min(ceil(2 * replayed_per_fetch) + 1, (double) (max_depth - 1));
+	*low_watermark = Max(*low_watermark, 1);
+
+	*depth = Max(2 * (*low_watermark), 2 * (*n_threads));
+	*depth = Min(Max(*depth, 2), max_depth);
+	*n_threads = Min(*n_threads, *depth);
+}
+
+/*
+ * Check if background refill of prefetch directory is running.
+ * Stale lock file is removed.
+ */
+static bool
+prefetch_refill_running(const char *prefetch_dir)
+{
+	char	lock_path[MAXPGPATH];
+	char	buf[64];
+	FILE   *fp;
+	struct stat st;
+	int		pid = 0;
+	bool	running;
+
+	join_path_components(lock_path, prefetch_dir, PREFETCH_LOCK_FILE);
+
+	fp = fopen(lock_path, PG_BINARY_R);
+	if (fp == NULL)
+		return false;
+
+	if (fgets(buf, sizeof(buf), fp) != NULL)
+		pid = atoi(buf);
+	fclose(fp);
+
+#ifndef WIN32
+	if (pid > 0)
+		running = kill(pid, 0) == 0 || errno == EPERM;
+	else
+#endif
+		/* pid is not written yet, unless refill failed to start long ago */
+		running = stat(lock_path, &st) == 0 &&
+			time(NULL) - st.st_mtime < PREFETCH_LOCK_TIMEOUT;
+
+	if (!running)
+	{
+		elog(LOG, "Remove stale prefetch lock file \"%s\"", lock_path);
+		unlink(lock_path);
+	}
+
+	return running;
+}
+
+/*
+ * If background refill is running, wait until it delivers requested
+ * segment and the next one (required for validation) or finishes.
+ * Return false, if refill is still running after PREFETCH_WAIT_TIMEOUT.
+ */
+static bool
+wait_prefetch_refill(const char *prefetch_dir, TimeLineID tli, XLogSegNo segno,
+					 uint32 wal_seg_size)
+{
+	char	wal_file_name[MAXFNAMELEN];
+	char	prefetched_file[MAXPGPATH];
+	bool	waited = false;
+	time_t	start_time = time(NULL);
+
+	GetXLogFileName(wal_file_name, tli, segno, wal_seg_size);
+	join_path_components(prefetched_file, prefetch_dir, wal_file_name);
+
+	while (prefetch_refill_running(prefetch_dir))
+	{
+		if (access(prefetched_file, F_OK) == 0 &&
+			next_wal_segment_exists(tli, segno, prefetch_dir, wal_seg_size))
+			break;
+
+		if (interrupted)
+			elog(ERROR, "Interrupted while waiting for WAL prefetch");
+
+		if (time(NULL) - start_time >= PREFETCH_WAIT_TIMEOUT)
+			return false;
+
+		if (!waited)
+			elog(LOG, "Waiting for background prefetch of WAL segment %s", wal_file_name);
+		waited = true;
+
+		pg_usleep(PREFETCH_WAIT_INTERVAL);
+	}
+
+	return true;
+}
+
+/*
+ * Fetch up to depth segments following segno into prefetch directory
+ * in detached child process, so archive-get can return the current
+ * segment to recovery at once. Only one refill runs at a time.
+ */
+static void
+start_prefetch_refill(const char *prefetch_dir, const char *archive_dir,
+					  TimeLineID tli, XLogSegNo segno, int depth, int n_threads,
+					  uint32 wal_seg_size)
+{
+#ifndef WIN32
+	char	lock_path[MAXPGPATH];
+	char	buf[64];
+	int		fd;
+	pid_t	pid;
+	uint32	n_fetched;
+	double	fetch_latency;
+
+	if (prefetch_refill_running(prefetch_dir))
+		return;
+
+	join_path_components(lock_path, prefetch_dir, PREFETCH_LOCK_FILE);
+	fd = open(lock_path, O_CREAT | O_EXCL | O_WRONLY | PG_BINARY, FILE_PERMISSION);
+	if (fd < 0)
+	{
+		if (errno != EEXIST)
+			elog(LOG, "Cannot create file \"%s\": %s", lock_path, strerror(errno));
+		return;
+	}
+
+	/* Child must not share remote connection, it will open its own */
+	fio_disconnect();
+	fflush(NULL);
+
+	pid = fork();
+	if (pid < 0)
+	{
+		elog(LOG, "Cannot start background prefetch: %s", strerror(errno));
+		close(fd);
+		unlink(lock_path);
+		return;
+	}
+
+	if (pid > 0)
+	{
+		snprintf(buf, sizeof(buf), "%d\n", (int) pid);
+		if (write(fd, buf, strlen(buf)) != strlen(buf))
+			elog(LOG, "Cannot write file \"%s\": %s", lock_path, strerror(errno));
+		close(fd);
+		elog(LOG, "Started background prefetch of %i WAL segments, pid %d",
+				depth, (int) pid);
+		return;
+	}
+
+	/* Detach from restore_command, so recovery does not wait for us */
+	close(fd);
+	setsid();
+	ssh_mux_reset_after_fork();
+
+	n_fetched = run_wal_prefetch(prefetch_dir, archive_dir, tli, segno,
+								 n_threads, false, depth, wal_seg_size,
+								 &fetch_latency);
+	update_prefetch_latency(prefetch_dir, fetch_latency);
+	elog(LOG, "Background prefetch is done, fetched: %u", n_fetched);
+
+	fio_disconnect();
+	unlink(lock_path);
+	exit(0);
+#endif
+}
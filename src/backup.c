@@ -29,9 +29,6 @@
 /* list of files contained in backup */
 parray *backup_files_list = NULL;
 
-/* We need critical section for datapagemap_add() in case of using threads */
-static pthread_mutex_t backup_pagemap_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 // TODO: move to PGnodeInfo
 bool exclusive_backup = false;
 
@@ -100,6 +97,7 @@ do_backup_pg(InstanceState *instanceState, PGconn *backup_conn,
 	/* arrays with meta info for multi threaded backup */
 	pthread_t	*threads;
 	backup_files_arg *threads_args;
+	IoQueues   *queues;
 	bool		backup_isok = true;
 
 	pgBackup   *prev_backup = NULL;
@@ -435,6 +433,13 @@ do_backup_pg(InstanceState *instanceState, PGconn *backup_conn,
 	/* Init backup page header map */
 	init_header_map(&current);
 
+	/*
+	 * Group files by the device of PGDATA, tablespace or external directory
+	 * they are read from; order by size is kept within each group.
+	 */
+	queues = io_queues_new(backup_files_list, instance_config.pgdata,
+						   external_dirs, device_threads, FIO_DB_HOST);
+
 	/* init thread args with own file lists */
 	threads = (pthread_t *) palloc(sizeof(pthread_t) * num_threads);
 	threads_args = (backup_files_arg *) palloc(sizeof(backup_files_arg)*num_threads);
@@ -452,6 +457,7 @@ do_backup_pg(InstanceState *instanceState, PGconn *backup_conn,
 		arg->prev_filelist = prev_backup_filelist;
 		arg->prev_start_lsn = prev_backup_start_lsn;
 		arg->hdr_map = &(current.hdr_map);
+		arg->queues = queues;
 		arg->thread_num = i+1;
 		/* By default there are some error */
 		arg->ret = 1;
@@ -477,6 +483,8 @@ do_backup_pg(InstanceState *instanceState, PGconn *backup_conn,
 			backup_isok = false;
 	}
 
+	io_queues_free(queues);
+
 	time(&end_time);
 	pretty_time_interval(difftime(end_time, start_time),
 						 pretty_time, lengthof(pretty_time));
@@ -1247,6 +1255,9 @@ wait_wal_lsn(const char *wal_segment_dir, XLogRecPtr target_lsn, bool is_start_l
 #ifdef HAVE_LIBZ
 	char		gz_wal_segment_path[MAXPGPATH];
 #endif
+#ifdef HAVE_LIBZSTD
+	char		zst_wal_segment_path[MAXPGPATH];
+#endif
 
 	/* Compute the name of the WAL file containing requested LSN */
 	GetXLogSegNo(target_lsn, targetSegNo, instance_config.xlog_seg_size);
@@ -1280,6 +1291,10 @@ wait_wal_lsn(const char *wal_segment_dir, XLogRecPtr target_lsn, bool is_start_l
 	snprintf(gz_wal_segment_path, sizeof(gz_wal_segment_path), "%s.gz",
 			 wal_segment_path);
 #endif
+#ifdef HAVE_LIBZSTD
+	snprintf(zst_wal_segment_path, sizeof(zst_wal_segment_path), "%s.zst",
+			 wal_segment_path);
+#endif
 
 	/* Wait until target LSN is archived or streamed */
 	while (true)
@@ -1296,6 +1311,26 @@ wait_wal_lsn(const char *wal_segment_dir, XLogRecPtr target_lsn, bool is_start_l
 				if (file_exists)
 					elog(LOG, "Found compressed WAL segment: %s", wal_segment_path);
 #endif
+#ifdef HAVE_LIBZSTD
+				if (!file_exists)
+				{
+					file_exists = fileExists(zst_wal_segment_path, FIO_BACKUP_HOST);
+					if (file_exists)
+						elog(LOG, "Found compressed WAL segment: %s", wal_segment_path);
+				}
+#endif
+				/* Try to find WAL file in pack */
+				if (!file_exists)
+				{
+					char	pack_path[MAXPGPATH];
+
+					file_exists = get_wal_pack_path(pack_path, wal_segment_dir, wal_segment,
+													instance_config.xlog_seg_size,
+													instance_config.wal_pack_size,
+													FIO_BACKUP_HOST);
+					if (file_exists)
+						elog(LOG, "Found WAL segment %s in pack: %s", wal_segment, pack_path);
+				}
 			}
 			else
 				elog(LOG, "Found WAL segment: %s", wal_segment_path);
@@ -1951,26 +1986,23 @@ backup_cleanup(bool fatal, void *userdata)
 static void *
 backup_files(void *arg)
 {
-	int			i;
+	int			file_num;
+	int			queue_num = -1;
 	char		from_fullpath[MAXPGPATH];
 	char		to_fullpath[MAXPGPATH];
 	static time_t prev_time;
+	pgFile	   *file;
 
 	backup_files_arg *arguments = (backup_files_arg *) arg;
-	int 		n_backup_files_list = parray_num(arguments->files_list);
+	int 		n_backup_files_list = io_queues_num_files(arguments->queues);
 
 	prev_time = current.start_time;
 
-	/* backup a file */
-	for (i = 0; i < n_backup_files_list; i++)
+	/* backup a file, directories have already been copied */
+	while ((file = io_queues_next(arguments->queues, &queue_num, &file_num)) != NULL)
 	{
-		pgFile	*file = (pgFile *) parray_get(arguments->files_list, i);
 		pgFile	*prev_file = NULL;
 
-		/* We have already copied all directories */
-		if (S_ISDIR(file->mode))
-			continue;
-
 		if (arguments->thread_num == 1)
 		{
 			/* update backup_content.control every 60 seconds */
@@ -1985,16 +2017,13 @@ backup_files(void *arg)
 			}
 		}
 
-		if (!pg_atomic_test_set_flag(&file->lock))
-			continue;
-
 		/* check for interrupt */
 		if (interrupted || thread_interrupted)
 			elog(ERROR, "interrupted during backup");
 
 		if (progress)
 			elog(INFO, "Progress: (%d/%d). Process file \"%s\"",
-				 i + 1, n_backup_files_list, file->rel_path);
+				 file_num, n_backup_files_list, file->rel_path);
 
 		/* Handle zero sized files */
 		if (file->size == 0)
@@ -2213,56 +2242,59 @@ set_cfs_datafiles(parray *files, const char *root, char *relative, size_t i)
 }
 
 /*
- * Find pgfile by given rnode in the backup_files_list
- * and add given blkno to its pagemap.
+ * Find pgfiles by given rnode in the backup_files_list
+ * and add blocks [blkno, blkno + nblocks) to their pagemaps.
+ * Pagemaps are not locked: WAL reader threads collect block references
+ * by themselves and they are added here after the threads finish.
  */
 void
-process_block_change(ForkNumber forknum, RelFileNode rnode, BlockNumber blkno)
+process_block_change(ForkNumber forknum, RelFileNode rnode, BlockNumber blkno,
+					 BlockNumber nblocks)
 {
-//	char	   *path;
 	char	   *rel_path;
-	BlockNumber blkno_inseg;
-	int			segno;
-	pgFile	  **file_item;
-	pgFile		f;
-
-	segno = blkno / RELSEG_SIZE;
-	blkno_inseg = blkno % RELSEG_SIZE;
+	uint64		end = (uint64) blkno + nblocks;
+	uint64		blk = blkno;
 
 	rel_path = relpathperm(rnode, forknum);
-	if (segno > 0)
-		f.rel_path = psprintf("%s.%u", rel_path, segno);
-	else
-		f.rel_path = rel_path;
 
-	f.external_dir_num = 0;
+	/* Look up each relation segment file only once */
+	while (blk < end)
+	{
+		int			segno = blk / RELSEG_SIZE;
+		uint64		seg_end = Min(end, (uint64) (segno + 1) * RELSEG_SIZE);
+		pgFile	  **file_item;
+		pgFile		f;
 
-	/* backup_files_list should be sorted before */
-	file_item = (pgFile **) parray_bsearch(backup_files_list, &f,
-										   pgFileCompareRelPathWithExternal);
+		if (segno > 0)
+			f.rel_path = psprintf("%s.%u", rel_path, segno);
+		else
+			f.rel_path = rel_path;
 
-	/*
-	 * If we don't have any record of this file in the file map, it means
-	 * that it's a relation that did not have much activity since the last
-	 * backup. We can safely ignore it. If it is a new relation file, the
-	 * backup would simply copy it as-is.
-	 */
-	if (file_item)
-	{
-		/* We need critical section only we use more than one threads */
-		if (num_threads > 1)
-			pthread_lock(&backup_pagemap_mutex);
+		f.external_dir_num = 0;
 
-		datapagemap_add(&(*file_item)->pagemap, blkno_inseg);
+		/* backup_files_list should be sorted before */
+		file_item = (pgFile **) parray_bsearch(backup_files_list, &f,
+											   pgFileCompareRelPathWithExternal);
+
+		/*
+		 * If we don't have any record of this file in the file map, it means
+		 * that it's a relation that did not have much activity since the last
+		 * backup. We can safely ignore it. If it is a new relation file, the
+		 * backup would simply copy it as-is.
+		 */
+		if (file_item)
+		{
+			for (; blk < seg_end; blk++)
+				datapagemap_add(&(*file_item)->pagemap,
+								(BlockNumber) (blk % RELSEG_SIZE));
+		}
+		blk = seg_end;
 
-		if (num_threads > 1)
-			pthread_mutex_unlock(&backup_pagemap_mutex);
+		if (segno > 0)
+			pg_free(f.rel_path);
 	}
 
-	if (segno > 0)
-		pg_free(f.rel_path);
 	pg_free(rel_path);
-
 }
 
 void
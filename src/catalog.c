@@ -21,6 +21,12 @@
 
 static pgBackup* get_closest_backup(timelineInfo *tlinfo);
 static pgBackup* get_oldest_backup(timelineInfo *tlinfo);
+static timelineInfo *catalog_add_wal_segment(parray *timelineinfos, timelineInfo *tlinfo,
+											 pgFile *file, TimeLineID tli, XLogSegNo segno,
+											 char *pack_name);
+static timelineInfo *catalog_add_wal_pack(parray *timelineinfos, timelineInfo *tlinfo,
+										  const char *archive_dir, pgFile *file,
+										  uint32 xlog_seg_size);
 static const char *backupModes[] = {"", "PAGE", "PTRACK", "DELTA", "FULL"};
 static pgBackup *readBackupControlFile(const char *path);
 static time_t create_backup_dir(pgBackup *backup, const char *backup_instance_path);
@@ -709,6 +715,10 @@ unlock_backup(const char *backup_dir, const char *backup_id, bool exclusive)
 		return;
 	}
 
+	/* Backup may have been deleted after upgrading shared lock to exclusive */
+	if (!fileExists(backup_dir, FIO_BACKUP_HOST))
+		return;
+
 	/* To remove shared lock, we must briefly obtain exclusive lock, ... */
 	if (grab_excl_lock_file(backup_dir, backup_id, false) != LOCK_OK)
 		/* ... if it's not possible then leave shared lock */
@@ -1035,6 +1045,92 @@ err_proc:
 	return NULL;
 }
 
+/*
+ * Contiguous range of DATABASE_FILE_LIST lines belonging to one database,
+ * as recorded in DATABASE_FILE_LIST_INDEX.
+ */
+typedef struct FileListRun
+{
+	Oid			dbOid;
+	int64		offset;
+	int64		size;
+	pg_crc32	crc;
+} FileListRun;
+
+/*
+ * Parse one line of DATABASE_FILE_LIST into a new pgFile.
+ */
+pgFile *
+parse_filelist_line(const char *buf)
+{
+	char		path[MAXPGPATH];
+	char		linked[MAXPGPATH];
+	char		compress_alg_string[MAXPGPATH];
+	int64		write_size,
+				mode,		/* bit length of mode_t depends on platforms */
+				is_datafile,
+				is_cfs,
+				external_dir_num,
+				crc,
+				segno,
+				n_blocks,
+				n_headers,
+				dbOid,		/* used for partial restore */
+				hdr_crc,
+				hdr_off,
+				hdr_size;
+	pgFile	   *file;
+
+	get_control_value_str(buf, "path", path, sizeof(path),true);
+	get_control_value_int64(buf, "size", &write_size, true);
+	get_control_value_int64(buf, "mode", &mode, true);
+	get_control_value_int64(buf, "is_datafile", &is_datafile, true);
+	get_control_value_int64(buf, "is_cfs", &is_cfs, false);
+	get_control_value_int64(buf, "crc", &crc, true);
+	get_control_value_str(buf, "compress_alg", compress_alg_string, sizeof(compress_alg_string), false);
+	get_control_value_int64(buf, "external_dir_num", &external_dir_num, false);
+	get_control_value_int64(buf, "dbOid", &dbOid, false);
+
+	file = pgFileInit(path);
+	file->write_size = (int64) write_size;
+	file->mode = (mode_t) mode;
+	file->is_datafile = is_datafile ? true : false;
+	file->is_cfs = is_cfs ? true : false;
+	file->crc = (pg_crc32) crc;
+	file->compress_alg = parse_compress_alg(compress_alg_string);
+	file->external_dir_num = external_dir_num;
+	file->dbOid = dbOid ? dbOid : 0;
+
+	/*
+	 * Optional fields
+	 */
+	if (get_control_value_str(buf, "linked", linked, sizeof(linked), false) && linked[0])
+	{
+		file->linked = pgut_strdup(linked);
+		canonicalize_path(file->linked);
+	}
+
+	if (get_control_value_int64(buf, "segno", &segno, false))
+		file->segno = (int) segno;
+
+	if (get_control_value_int64(buf, "n_blocks", &n_blocks, false))
+		file->n_blocks = (int64) n_blocks;
+
+	if (get_control_value_int64(buf, "n_headers", &n_headers, false))
+		file->n_headers = (int) n_headers;
+
+	if (get_control_value_int64(buf, "hdr_crc", &hdr_crc, false))
+		file->hdr_crc = (pg_crc32) hdr_crc;
+
+	if (get_control_value_int64(buf, "hdr_off", &hdr_off, false))
+		file->hdr_off = hdr_off;
+
+	if (get_control_value_int64(buf, "hdr_size", &hdr_size, false))
+		file->hdr_size = (int) hdr_size;
+
+	return file;
+}
+
 /*
  * Get list of files in the backup from the DATABASE_FILE_LIST.
  */
@@ -1064,74 +1160,9 @@ get_backup_filelist(pgBackup *backup, bool strict)
 
 	while (fgets(buf, lengthof(buf), fp))
 	{
-		char		path[MAXPGPATH];
-		char		linked[MAXPGPATH];
-		char		compress_alg_string[MAXPGPATH];
-		int64		write_size,
-					mode,		/* bit length of mode_t depends on platforms */
-					is_datafile,
-					is_cfs,
-					external_dir_num,
-					crc,
-					segno,
-					n_blocks,
-					n_headers,
-					dbOid,		/* used for partial restore */
-					hdr_crc,
-					hdr_off,
-					hdr_size;
-		pgFile	   *file;
-
 		COMP_FILE_CRC32(true, content_crc, buf, strlen(buf));
 
-        get_control_value_str(buf, "path", path, sizeof(path),true);
-        get_control_value_int64(buf, "size", &write_size, true);
-        get_control_value_int64(buf, "mode", &mode, true);
-        get_control_value_int64(buf, "is_datafile", &is_datafile, true);
-        get_control_value_int64(buf, "is_cfs", &is_cfs, false);
-        get_control_value_int64(buf, "crc", &crc, true);
-        get_control_value_str(buf, "compress_alg", compress_alg_string, sizeof(compress_alg_string), false);
-        get_control_value_int64(buf, "external_dir_num", &external_dir_num, false);
-        get_control_value_int64(buf, "dbOid", &dbOid, false);
-
-		file = pgFileInit(path);
-		file->write_size = (int64) write_size;
-		file->mode = (mode_t) mode;
-		file->is_datafile = is_datafile ? true : false;
-		file->is_cfs = is_cfs ? true : false;
-		file->crc = (pg_crc32) crc;
-		file->compress_alg = parse_compress_alg(compress_alg_string);
-		file->external_dir_num = external_dir_num;
-		file->dbOid = dbOid ? dbOid : 0;
-
-		/*
-		 * Optional fields
-		 */
-		if (get_control_value_str(buf, "linked", linked, sizeof(linked), false) && linked[0])
-		{
-			file->linked = pgut_strdup(linked);
-			canonicalize_path(file->linked);
-		}
-
-		if (get_control_value_int64(buf, "segno", &segno, false))
-			file->segno = (int) segno;
-
-		if (get_control_value_int64(buf, "n_blocks", &n_blocks, false))
-			file->n_blocks = (int64) n_blocks;
-
-		if (get_control_value_int64(buf, "n_headers", &n_headers, false))
-			file->n_headers = (int) n_headers;
-
-		if (get_control_value_int64(buf, "hdr_crc", &hdr_crc, false))
-			file->hdr_crc = (pg_crc32) hdr_crc;
-
-		if (get_control_value_int64(buf, "hdr_off", &hdr_off, false))
-			file->hdr_off = hdr_off;
-
-		if (get_control_value_int64(buf, "hdr_size", &hdr_size, false))
-			file->hdr_size = (int) hdr_size;
-
-		parray_append(files, file);
+		parray_append(files, parse_filelist_line(buf));
 	}
 
 	FIN_FILE_CRC32(true, content_crc);
@@ -1158,6 +1189,178 @@ get_backup_filelist(pgBackup *backup, bool strict)
 	return files;
 }
 
+/*
+ * Read DATABASE_FILE_LIST_INDEX of the backup.
+ * Returns NULL if the index is missing or does not match
+ * the current DATABASE_FILE_LIST.
+ */
+static parray *
+read_filelist_index(pgBackup *backup)
+{
+	char		path[MAXPGPATH];
+	char		buf[BLCKSZ];
+	FILE	   *fp;
+	parray	   *runs = NULL;
+	int64		content_crc;
+	int64		content_size;
+	struct stat	st;
+
+	if (backup->content_crc == 0)
+		return NULL;
+
+	join_path_components(path, backup->root_dir, DATABASE_FILE_LIST);
+	if (fio_stat(path, &st, true, FIO_BACKUP_HOST) != 0)
+		return NULL;
+
+	join_path_components(path, backup->root_dir, DATABASE_FILE_LIST_INDEX);
+	fp = fio_open_stream(path, FIO_BACKUP_HOST);
+	if (fp == NULL)
+		return NULL;
+
+	/* the first line describes the file list the index was built for */
+	if (!fgets(buf, lengthof(buf), fp) ||
+		!get_control_value_int64(buf, "content_crc", &content_crc, false) ||
+		!get_control_value_int64(buf, "size", &content_size, false) ||
+		(pg_crc32) content_crc != backup->content_crc ||
+		content_size != st.st_size)
+	{
+		elog(VERBOSE, "File list index of backup %s is outdated",
+			 base36enc(backup->start_time));
+		fio_close_stream(fp);
+		return NULL;
+	}
+
+	runs = parray_new();
+
+	while (fgets(buf, lengthof(buf), fp))
+	{
+		int64		dbOid,
+					offset,
+					size,
+					crc;
+		FileListRun *run;
+
+		if (!get_control_value_int64(buf, "dbOid", &dbOid, false) ||
+			!get_control_value_int64(buf, "offset", &offset, false) ||
+			!get_control_value_int64(buf, "size", &size, false) ||
+			!get_control_value_int64(buf, "crc", &crc, false))
+		{
+			elog(WARNING, "Invalid line in \"%s\"", path);
+			parray_walk(runs, pg_free);
+			parray_free(runs);
+			runs = NULL;
+			break;
+		}
+
+		run = pgut_new(FileListRun);
+		run->dbOid = (Oid) dbOid;
+		run->offset = offset;
+		run->size = size;
+		run->crc = (pg_crc32) crc;
+		parray_append(runs, run);
+	}
+
+	if (ferror(fp))
+		elog(ERROR, "Failed to read from file: \"%s\"", path);
+
+	fio_close_stream(fp);
+
+	return runs;
+}
+
+/*
+ * Get list of files in the backup, skipping the files of databases
+ * listed in 'dbOid_exclude_list' (sorted, as for partial restore).
+ * Only the ranges of DATABASE_FILE_LIST that belong to the remaining
+ * databases are parsed, with the help of DATABASE_FILE_LIST_INDEX.
+ * Falls back to get_backup_filelist() if the index cannot be used.
+ */
+parray *
+get_backup_filelist_partial(pgBackup *backup, parray *dbOid_exclude_list,
+							bool strict)
+{
+	parray	   *runs;
+	parray	   *files;
+	char		backup_filelist_path[MAXPGPATH];
+	FILE	   *fp;
+	char		buf[BLCKSZ];
+	char		stdio_buf[STDIO_BUFSIZE];
+	int			i;
+	int			n_skipped = 0;
+
+	if (dbOid_exclude_list == NULL ||
+		(runs = read_filelist_index(backup)) == NULL)
+		return get_backup_filelist(backup, strict);
+
+	join_path_components(backup_filelist_path, backup->root_dir, DATABASE_FILE_LIST);
+
+	fp = fio_open_stream(backup_filelist_path, FIO_BACKUP_HOST);
+	if (fp == NULL)
+		elog(ERROR, "cannot open \"%s\": %s", backup_filelist_path, strerror(errno));
+
+	/* enable stdio buffering for local file */
+	if (!fio_is_remote(FIO_BACKUP_HOST))
+		setvbuf(fp, stdio_buf, _IOFBF, STDIO_BUFSIZE);
+
+	files = parray_new();
+
+	for (i = 0; i < parray_num(runs); i++)
+	{
+		FileListRun *run = (FileListRun *) parray_get(runs, i);
+		pg_crc32	crc;
+		int64		read_len = 0;
+
+		if (run->dbOid != 0 &&
+			parray_bsearch(dbOid_exclude_list, &run->dbOid, pgCompareOid))
+		{
+			n_skipped++;
+			continue;
+		}
+
+		if (fseeko(fp, run->offset, SEEK_SET) != 0)
+			elog(ERROR, "Cannot seek in file \"%s\": %s",
+				 backup_filelist_path, strerror(errno));
+
+		INIT_FILE_CRC32(true, crc);
+
+		while (read_len < run->size && fgets(buf, lengthof(buf), fp))
+		{
+			read_len += strlen(buf);
+			COMP_FILE_CRC32(true, crc, buf, strlen(buf));
+			parray_append(files, parse_filelist_line(buf));
+		}
+
+		FIN_FILE_CRC32(true, crc);
+
+		if (ferror(fp))
+			elog(ERROR, "Failed to read from file: \"%s\"", backup_filelist_path);
+
+		if (read_len != run->size || crc != run->crc)
+		{
+			elog(WARNING, "Invalid CRC of the range " INT64_FORMAT "-" INT64_FORMAT
+				 " in file \"%s\", reading the whole file list",
+				 run->offset, run->offset + run->size, backup_filelist_path);
+
+			fio_close_stream(fp);
+			parray_walk(files, pgFileFree);
+			parray_free(files);
+			parray_walk(runs, pg_free);
+			parray_free(runs);
+			return get_backup_filelist(backup, strict);
+		}
+	}
+
+	fio_close_stream(fp);
+
+	elog(VERBOSE, "Backup %s: %i of %i file list ranges are skipped by partial restore",
+		 base36enc(backup->start_time), n_skipped, (int) parray_num(runs));
+
+	parray_walk(runs, pg_free);
+	parray_free(runs);
+
+	return files;
+}
+
 /*
  * Lock list of backups. Function goes in backward direction.
  */
@@ -1502,6 +1705,141 @@ create_backup_dir(pgBackup *backup, const char *backup_instance_path)
 	return 0;
 }
 
+/*
+ * Add regular WAL segment to the list of timelines.
+ * pack_name is the name of pack file containing the segment, or NULL.
+ * Returns timeline of the segment.
+ */
+static timelineInfo *
+catalog_add_wal_segment(parray *timelineinfos, timelineInfo *tlinfo, pgFile *file,
+						TimeLineID tli, XLogSegNo segno, char *pack_name)
+{
+	xlogFile *wal_file;
+
+	/* new file belongs to new timeline */
+	if (!tlinfo || tlinfo->tli != tli)
+	{
+		tlinfo = timelineInfoNew(tli);
+		parray_append(timelineinfos, tlinfo);
+	}
+	/*
+	 * As it is impossible to detect if segments before segno are lost,
+	 * or just do not exist, do not report them as lost.
+	 */
+	else if (tlinfo->n_xlog_files != 0)
+	{
+		/* check, if segments are consequent */
+		XLogSegNo expected_segno = tlinfo->end_segno + 1;
+
+		/*
+		 * Segment is already packed, but it was not removed, e.g. because
+		 * packing was interrupted. Do not count it, but let purge remove it.
+		 */
+		if (segno < tlinfo->end_segno)
+		{
+			wal_file = palloc(sizeof(xlogFile));
+			wal_file->file = *file;
+			wal_file->segno = segno;
+			wal_file->type = SEGMENT;
+			wal_file->keep = false;
+			wal_file->pack_name = pack_name;
+			parray_append(tlinfo->xlog_filelist, wal_file);
+			return tlinfo;
+		}
+
+		/*
+		 * Some segments are missing. remember them in lost_segments to report.
+		 * Normally we expect that segment numbers form an increasing sequence,
+		 * though it's legal to find two files with equal segno in case there
+		 * are both compressed and non-compessed versions. For example
+		 * 000000010000000000000002 and 000000010000000000000002.gz
+		 * or 000000010000000000000002.zst
+		 *
+		 */
+		if (segno != expected_segno && segno != tlinfo->end_segno)
+		{
+			xlogInterval *interval = palloc(sizeof(xlogInterval));;
+			interval->begin_segno = expected_segno;
+			interval->end_segno = segno - 1;
+
+			if (tlinfo->lost_segments == NULL)
+				tlinfo->lost_segments = parray_new();
+
+			parray_append(tlinfo->lost_segments, interval);
+		}
+	}
+
+	if (tlinfo->begin_segno == 0)
+		tlinfo->begin_segno = segno;
+
+	/* this file is the last for this timeline so far */
+	tlinfo->end_segno = segno;
+	/* update counters */
+	tlinfo->n_xlog_files++;
+	tlinfo->size += file->size;
+
+	/* append file to xlog file list */
+	wal_file = palloc(sizeof(xlogFile));
+	wal_file->file = *file;
+	wal_file->segno = segno;
+	wal_file->type = SEGMENT;
+	wal_file->keep = false;
+	wal_file->pack_name = pack_name;
+	parray_append(tlinfo->xlog_filelist, wal_file);
+
+	return tlinfo;
+}
+
+/*
+ * Add segments stored in WAL pack file to the list of timelines.
+ * Returns timeline of the last segment.
+ */
+static timelineInfo *
+catalog_add_wal_pack(parray *timelineinfos, timelineInfo *tlinfo,
+					 const char *archive_dir, pgFile *file, uint32 xlog_seg_size)
+{
+	char		pack_path[MAXPGPATH];
+	WalPackEntry *entries;
+	int			n_entries;
+	int			i;
+	char	   *pack_name;
+
+	join_path_components(pack_path, archive_dir, file->name);
+
+	entries = read_wal_pack_index(pack_path, &n_entries, FIO_BACKUP_HOST);
+	if (entries == NULL)
+		return tlinfo;
+
+	pack_name = pgut_strdup(file->name);
+
+	for (i = 0; i < n_entries; i++)
+	{
+		pgFile		member = *file;
+		TimeLineID	tli;
+		XLogSegNo	segno;
+
+		if (strspn(entries[i].name, "0123456789ABCDEF") != XLOG_FNAME_LEN)
+		{
+			elog(WARNING, "unexpected WAL file name \"%s\" in pack \"%s\"",
+				 entries[i].name, pack_path);
+			continue;
+		}
+
+		GetXLogFromFileName(entries[i].name, &tli, &segno, xlog_seg_size);
+
+		member.rel_path = pgut_strdup(entries[i].name);
+		member.name = member.rel_path;
+		member.linked = NULL;
+		member.size = entries[i].size;
+
+		tlinfo = catalog_add_wal_segment(timelineinfos, tlinfo, &member,
+										 tli, segno, pack_name);
+	}
+
+	pg_free(entries);
+	return tlinfo;
+}
+
 /*
  * Create list of timelines.
  * TODO: '.partial' and '.part' segno information should be added to tlinfo.
@@ -1579,6 +1917,7 @@ catalog_get_timelines(InstanceState *instanceState, InstanceConfig *instance)
 					wal_file->segno = segno;
 					wal_file->type = BACKUP_HISTORY_FILE;
 					wal_file->keep = false;
+					wal_file->pack_name = NULL;
 					parray_append(tlinfo->xlog_filelist, wal_file);
 					continue;
 				}
@@ -1600,12 +1939,46 @@ catalog_get_timelines(InstanceState *instanceState, InstanceConfig *instance)
 					wal_file->segno = segno;
 					wal_file->type = PARTIAL_SEGMENT;
 					wal_file->keep = false;
+					wal_file->pack_name = NULL;
 					parray_append(tlinfo->xlog_filelist, wal_file);
 					continue;
 				}
-				/* temp WAL segment */
+				/* pack of WAL segments */
+				else if (IsWalPackFileName(file->name))
+				{
+					elog(VERBOSE, "WAL pack file \"%s\"", file->name);
+
+					tlinfo = catalog_add_wal_pack(timelineinfos, tlinfo,
+												  instanceState->instance_wal_subdir_path,
+												  file, instance->xlog_seg_size);
+					continue;
+				}
+				/* summary of data blocks, referenced by WAL segment */
+				else if (IsWalSummaryFileName(file->name))
+				{
+					elog(VERBOSE, "WAL summary file \"%s\"", file->name);
+
+					if (!tlinfo || tlinfo->tli != tli)
+					{
+						tlinfo = timelineInfoNew(tli);
+						parray_append(timelineinfos, tlinfo);
+					}
+
+					/* append file to xlog file list */
+					wal_file = palloc(sizeof(xlogFile));
+					wal_file->file = *file;
+					wal_file->segno = segno;
+					wal_file->type = WAL_SUMMARY_FILE;
+					wal_file->keep = false;
+					wal_file->pack_name = NULL;
+					parray_append(tlinfo->xlog_filelist, wal_file);
+					continue;
+				}
+				/* temp WAL segment, pack or summary */
 				else if (IsTempXLogFileName(file->name) ||
-						 IsTempCompressXLogFileName(file->name))
+						 IsTempCompressXLogFileName(file->name) ||
+						 IsTempWalPackFileName(file->name) ||
+						 IsTempWalSummaryFileName(file->name))
 				{
 					elog(VERBOSE, "temp WAL file \"%s\"", file->name);
 
@@ -1621,69 +1994,20 @@ catalog_get_timelines(InstanceState *instanceState, InstanceConfig *instance)
 					wal_file->segno = segno;
 					wal_file->type = TEMP_SEGMENT;
 					wal_file->keep = false;
+					wal_file->pack_name = NULL;
 					parray_append(tlinfo->xlog_filelist, wal_file);
 					continue;
 				}
-				/* we only expect compressed wal files with .gz suffix */
-				else if (strcmp(suffix, "gz") != 0)
+				/* we only expect compressed wal files with .gz or .zst suffix */
+				else if (strcmp(suffix, "gz") != 0 && strcmp(suffix, "zst") != 0)
 				{
 					elog(WARNING, "unexpected WAL file name \"%s\"", file->name);
 					continue;
 				}
 			}
 
-			/* new file belongs to new timeline */
-			if (!tlinfo || tlinfo->tli != tli)
-			{
-				tlinfo = timelineInfoNew(tli);
-				parray_append(timelineinfos, tlinfo);
-			}
-			/*
-			 * As it is impossible to detect if segments before segno are lost,
-			 * or just do not exist, do not report them as lost.
-			 */
-			else if (tlinfo->n_xlog_files != 0)
-			{
-				/* check, if segments are consequent */
-				XLogSegNo expected_segno = tlinfo->end_segno + 1;
-
-				/*
-				 * Some segments are missing. remember them in lost_segments to report.
-				 * Normally we expect that segment numbers form an increasing sequence,
-				 * though it's legal to find two files with equal segno in case there
-				 * are both compressed and non-compessed versions. For example
-				 * 000000010000000000000002 and 000000010000000000000002.gz
-				 *
-				 */
-				if (segno != expected_segno && segno != tlinfo->end_segno)
-				{
-					xlogInterval *interval = palloc(sizeof(xlogInterval));;
-					interval->begin_segno = expected_segno;
-					interval->end_segno = segno - 1;
-
-					if (tlinfo->lost_segments == NULL)
-						tlinfo->lost_segments = parray_new();
-
-					parray_append(tlinfo->lost_segments, interval);
-				}
-			}
-
-			if (tlinfo->begin_segno == 0)
-				tlinfo->begin_segno = segno;
-
-			/* this file is the last for this timeline so far */
-			tlinfo->end_segno = segno;
-			/* update counters */
-			tlinfo->n_xlog_files++;
-			tlinfo->size += file->size;
-
-			/* append file to xlog file list */
-			wal_file = palloc(sizeof(xlogFile));
-			wal_file->file = *file;
-			wal_file->segno = segno;
-			wal_file->type = SEGMENT;
-			wal_file->keep = false;
-			parray_append(tlinfo->xlog_filelist, wal_file);
+			tlinfo = catalog_add_wal_segment(timelineinfos, tlinfo, file,
+											 tli, segno, NULL);
 		}
 		/* timeline history file */
 		else if (IsTLHistoryFileName(file->name))
@@ -2481,6 +2805,106 @@ write_backup(pgBackup *backup, bool strict)
 			 path_temp, path, strerror(errno));
 }
 
+/*
+ * Write DATABASE_FILE_LIST_INDEX: ranges of DATABASE_FILE_LIST lines
+ * grouped by dbOid, so partial restore can parse only the ranges of
+ * databases being restored. The first line binds the index to the
+ * content_crc and size of the file list.
+ */
+static void
+write_filelist_index(pgBackup *backup, parray *runs, int64 content_size)
+{
+	FILE	   *out;
+	char		path[MAXPGPATH];
+	char		path_temp[MAXPGPATH];
+	char		buf[8192];
+	int			i;
+
+	join_path_components(path, backup->root_dir, DATABASE_FILE_LIST_INDEX);
+	snprintf(path_temp, sizeof(path_temp), "%s.tmp", path);
+
+	out = fopen(path_temp, PG_BINARY_W);
+	if (out == NULL)
+		elog(ERROR, "Cannot open file list index \"%s\": %s", path_temp,
+			 strerror(errno));
+
+	if (chmod(path_temp, FILE_PERMISSION) == -1)
+		elog(ERROR, "Cannot change mode of \"%s\": %s", path_temp,
+			 strerror(errno));
+
+	setvbuf(out, buf, _IOFBF, sizeof(buf));
+
+	fprintf(out, "{\"content_crc\":\"%u\", \"size\":\"" INT64_FORMAT "\"}\n",
+			backup->content_crc, content_size);
+
+	for (i = 0; i < parray_num(runs); i++)
+	{
+		FileListRun *run = (FileListRun *) parray_get(runs, i);
+
+		fprintf(out, "{\"dbOid\":\"%u\", \"offset\":\"" INT64_FORMAT "\", "
+				"\"size\":\"" INT64_FORMAT "\", \"crc\":\"%u\"}\n",
+				run->dbOid, run->offset, run->size, run->crc);
+	}
+
+	if (fflush(out) != 0)
+		elog(ERROR, "Cannot flush file list index \"%s\": %s",
+			 path_temp, strerror(errno));
+
+	if (fsync(fileno(out)) < 0)
+		elog(ERROR, "Cannot sync file list index \"%s\": %s",
+			 path_temp, strerror(errno));
+
+	if (fclose(out) != 0)
+		elog(ERROR, "Cannot close file list index \"%s\": %s",
+			 path_temp, strerror(errno));
+
+	if (rename(path_temp, path) < 0)
+		elog(ERROR, "Cannot rename file \"%s\" to \"%s\": %s",
+			 path_temp, path, strerror(errno));
+}
+
+/*
+ * Print attributes of the file in DATABASE_FILE_LIST format into the line,
+ * without closing brace. Returns the length of the line.
+ */
+int
+print_filelist_line(char *line, pgFile *file)
+{
+	int			len;
+
+	len = sprintf(line, "{\"path\":\"%s\", \"size\":\"" INT64_FORMAT "\", "
+				 "\"mode\":\"%u\", \"is_datafile\":\"%u\", "
+				 "\"is_cfs\":\"%u\", \"crc\":\"%u\", "
+				 "\"compress_alg\":\"%s\", \"external_dir_num\":\"%d\", "
+				 "\"dbOid\":\"%u\"",
+				file->rel_path, file->write_size, file->mode,
+				file->is_datafile ? 1 : 0,
+				file->is_cfs ? 1 : 0,
+				file->crc,
+				deparse_compress_alg(file->compress_alg),
+				file->external_dir_num,
+				file->dbOid);
+
+	if (file->is_datafile)
+		len += sprintf(line+len, ",\"segno\":\"%d\"", file->segno);
+
+	if (file->linked)
+		len += sprintf(line+len, ",\"linked\":\"%s\"", file->linked);
+
+	if (file->n_blocks > 0)
+		len += sprintf(line+len, ",\"n_blocks\":\"" INT64_FORMAT "\"", file->n_blocks);
+
+	if (file->n_headers > 0)
+	{
+		len += sprintf(line+len, ",\"n_headers\":\"%i\"", file->n_headers);
+		len += sprintf(line+len, ",\"hdr_crc\":\"%u\"", file->hdr_crc);
+		len += sprintf(line+len, ",\"hdr_off\":\"%llu\"", file->hdr_off);
+		len += sprintf(line+len, ",\"hdr_size\":\"%i\"", file->hdr_size);
+	}
+
+	return len;
+}
+
 /*
  * Output the list of files to backup catalog DATABASE_FILE_LIST
  */
@@ -2497,6 +2921,9 @@ write_backup_filelist(pgBackup *backup, parray *files, const char *root,
 	int64 		backup_size_on_disk = 0;
 	int64 		uncompressed_size_on_disk = 0;
 	int64 		wal_size_on_disk = 0;
+	int64		offset = 0;
+	parray	   *runs = parray_new();
+	FileListRun *run = NULL;
 
 	join_path_components(control_path, backup->root_dir, DATABASE_FILE_LIST);
 	snprintf(control_path_temp, sizeof(control_path_temp), "%s.tmp", control_path);
@@ -2549,46 +2976,40 @@ write_backup_filelist(pgBackup *backup, parray *files, const char *root,
 			}
 		}
 
-		len = sprintf(line, "{\"path\":\"%s\", \"size\":\"" INT64_FORMAT "\", "
-					 "\"mode\":\"%u\", \"is_datafile\":\"%u\", "
-					 "\"is_cfs\":\"%u\", \"crc\":\"%u\", "
-					 "\"compress_alg\":\"%s\", \"external_dir_num\":\"%d\", "
-					 "\"dbOid\":\"%u\"",
-					file->rel_path, file->write_size, file->mode,
-					file->is_datafile ? 1 : 0,
-					file->is_cfs ? 1 : 0,
-					file->crc,
-					deparse_compress_alg(file->compress_alg),
-					file->external_dir_num,
-					file->dbOid);
-
-		if (file->is_datafile)
-			len += sprintf(line+len, ",\"segno\":\"%d\"", file->segno);
-
-		if (file->linked)
-			len += sprintf(line+len, ",\"linked\":\"%s\"", file->linked);
-
-		if (file->n_blocks > 0)
-			len += sprintf(line+len, ",\"n_blocks\":\"" INT64_FORMAT "\"", file->n_blocks);
-
-		if (file->n_headers > 0)
+		len = print_filelist_line(line, file);
+		len += sprintf(line+len, "}\n");
+
+		if (sync)
 		{
-			len += sprintf(line+len, ",\"n_headers\":\"%i\"", file->n_headers);
-			len += sprintf(line+len, ",\"hdr_crc\":\"%u\"", file->hdr_crc);
-			len += sprintf(line+len, ",\"hdr_off\":\"%llu\"", file->hdr_off);
-			len += sprintf(line+len, ",\"hdr_size\":\"%i\"", file->hdr_size);
-		}
+			COMP_FILE_CRC32(true, backup->content_crc, line, len);
 
-		sprintf(line+len, "}\n");
+			/* start a new range of the index when database changes */
+			if (run == NULL || run->dbOid != file->dbOid)
+			{
+				if (run)
+					FIN_FILE_CRC32(true, run->crc);
+
+				run = pgut_new0(FileListRun);
+				run->dbOid = file->dbOid;
+				run->offset = offset;
+				INIT_FILE_CRC32(true, run->crc);
+				parray_append(runs, run);
+			}
 
-		if (sync)
-			COMP_FILE_CRC32(true, backup->content_crc, line, strlen(line));
+			COMP_FILE_CRC32(true, run->crc, line, len);
+			run->size += len;
+		}
 
 		fprintf(out, "%s", line);
+		offset += len;
 	}
 
 	if (sync)
+	{
 		FIN_FILE_CRC32(true, backup->content_crc);
+		if (run)
+			FIN_FILE_CRC32(true, run->crc);
+	}
 
 	if (fflush(out) != 0)
 		elog(ERROR, "Cannot flush file list \"%s\": %s",
@@ -2606,6 +3027,23 @@ write_backup_filelist(pgBackup *backup, parray *files, const char *root,
 		elog(ERROR, "Cannot rename file \"%s\" to \"%s\": %s",
 			 control_path_temp, control_path, strerror(errno));
 
+	/*
+	 * Index is written only for the final file list, intermediate
+	 * ones have no content_crc to bind it to.
+	 */
+	if (sync)
+		write_filelist_index(backup, runs, offset);
+	else
+	{
+		join_path_components(control_path, backup->root_dir, DATABASE_FILE_LIST_INDEX);
+		if (remove(control_path) != 0 && errno != ENOENT)
+			elog(ERROR, "Cannot remove file \"%s\": %s",
+				 control_path, strerror(errno));
+	}
+
+	parray_walk(runs, pg_free);
+	parray_free(runs);
+
 	/* use extra variable to avoid reset of previous data_bytes value in case of error */
 	backup->data_bytes = backup_size_on_disk;
 	backup->uncompressed_bytes = uncompressed_size_on_disk;
@@ -2849,6 +3287,8 @@ parse_compress_alg(const char *arg)
 		return ZLIB_COMPRESS;
 	else if (pg_strncasecmp("pglz", arg, len) == 0)
 		return PGLZ_COMPRESS;
+	else if (pg_strncasecmp("zstd", arg, len) == 0)
+		return ZSTD_COMPRESS;
 	else if (pg_strncasecmp("none", arg, len) == 0)
 		return NONE_COMPRESS;
 	else
@@ -2869,6 +3309,8 @@ deparse_compress_alg(int alg)
 			return "zlib";
 		case PGLZ_COMPRESS:
 			return "pglz";
+		case ZSTD_COMPRESS:
+			return "zstd";
 	}
 
 	return NULL;
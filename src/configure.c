@@ -142,6 +142,11 @@ ConfigOption instance_options[] =
 		&instance_config.restore_command, SOURCE_CMD, SOURCE_DEFAULT,
 		OPTION_ARCHIVE_GROUP, 0, option_get_value
 	},
+	{
+		'u', 231, "wal-pack-size",
+		&instance_config.wal_pack_size, SOURCE_CMD, 0,
+		OPTION_ARCHIVE_GROUP, 0, option_get_value
+	},
 	/* Logging options */
 	{
 		'f', 212, "log-level-console",
@@ -241,6 +246,11 @@ ConfigOption instance_options[] =
 		&instance_config.remote.ssh_config, SOURCE_CMD, 0,
 		OPTION_REMOTE_GROUP, 0, option_get_value
 	},
+	{
+		'u', 232, "remote-compress-level",
+		&instance_config.remote.compress_level, SOURCE_CMD, 0,
+		OPTION_REMOTE_GROUP, 0, option_get_value
+	},
 	{ 0 }
 };
 
@@ -489,6 +499,11 @@ readInstanceConfigFile(InstanceState *instanceState)
 			&instance->restore_command, SOURCE_CMD, 0,
 			OPTION_ARCHIVE_GROUP, 0, option_get_value
 		},
+		{
+			'u', 231, "wal-pack-size",
+			&instance->wal_pack_size, SOURCE_CMD, 0,
+			OPTION_ARCHIVE_GROUP, 0, option_get_value
+		},
 
 		/* Instance options */
 		{
@@ -596,6 +611,11 @@ readInstanceConfigFile(InstanceState *instanceState)
 			&instance->remote.ssh_config, SOURCE_CMD, 0,
 			OPTION_REMOTE_GROUP, 0, option_get_value
 		},
+		{
+			'u', 232, "remote-compress-level",
+			&instance->remote.compress_level, SOURCE_CMD, 0,
+			OPTION_REMOTE_GROUP, 0, option_get_value
+		},
 		{ 0 }
 	};
 
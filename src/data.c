@@ -83,6 +83,20 @@ do_compress(void *dst, size_t dst_size, void const *src, size_t src_size,
 				*errormsg = zError(ret);
 			return ret;
 		}
+#endif
+#ifdef HAVE_LIBZSTD
+		case ZSTD_COMPRESS:
+		{
+			size_t ret;
+			ret = ZSTD_compress(dst, dst_size, src, src_size, level);
+			if (ZSTD_isError(ret))
+			{
+				if (errormsg)
+					*errormsg = ZSTD_getErrorName(ret);
+				return -1;
+			}
+			return ret;
+		}
 #endif
 		case PGLZ_COMPRESS:
 			return pglz_compress(src, src_size, dst, PGLZ_strategy_always);
@@ -115,6 +129,20 @@ do_decompress(void *dst, size_t dst_size, void const *src, size_t src_size,
 				*errormsg = zError(ret);
 			return ret;
 		}
+#endif
+#ifdef HAVE_LIBZSTD
+		case ZSTD_COMPRESS:
+		{
+			size_t ret;
+			ret = ZSTD_decompress(dst, dst_size, src, src_size);
+			if (ZSTD_isError(ret))
+			{
+				if (errormsg)
+					*errormsg = ZSTD_getErrorName(ret);
+				return -1;
+			}
+			return ret;
+		}
 #endif
 		case PGLZ_COMPRESS:
 
@@ -805,7 +833,7 @@ backup_non_data_file(pgFile *file, pgFile *prev_file,
 		 file->mtime <= parent_backup_time))
 	{
 
-		file->crc = fio_get_crc32(from_fullpath, FIO_DB_HOST, false);
+		file->crc = fio_get_crc32(from_fullpath, FIO_DB_HOST, NONE_COMPRESS);
 
 		/* ...and checksum is the same... */
 		if (EQ_TRADITIONAL_CRC32(file->crc, prev_file->crc))
@@ -966,6 +994,10 @@ restore_data_file_internal(FILE *in, FILE *out, pgFile *file, uint32 backup_vers
 	/* should not be possible */
 	Assert(!(backup_version >= 20400 && file->n_headers <= 0));
 
+	/* Incremental restore in LSN mode: valid pages are not restored */
+	if (map && lsn_map)
+		datapagemap_union(map, lsn_map);
+
 	/*
 	 * We rely on stdio buffering of input and output.
 	 * For buffering to be efficient, we try to minimize the
@@ -1092,10 +1124,6 @@ restore_data_file_internal(FILE *in, FILE *out, pgFile *file, uint32 backup_vers
 		if (compressed_size > BLCKSZ)
 			elog(ERROR, "Size of a blknum %i exceed BLCKSZ: %i", blknum, compressed_size);
 
-		/* Incremental restore in LSN mode */
-		if (map && lsn_map && datapagemap_is_set(lsn_map, blknum))
-			datapagemap_add(map, blknum);
-
 		if (map && checksum_map && checksum_map[blknum].checksum != 0)
 		{
 			//elog(INFO, "HDR CRC: %u, MAP CRC: %u", page_crc, checksum_map[blknum].checksum);
@@ -1248,15 +1276,15 @@ restore_non_data_file_internal(FILE *in, FILE *out, pgFile *file,
 	elog(VERBOSE, "Copied file \"%s\": %lu bytes", from_fullpath, file->write_size);
 }
 
-size_t
-restore_non_data_file(parray *parent_chain, pgBackup *dest_backup,
-					  pgFile *dest_file, FILE *out, const char *to_fullpath,
-					  bool already_exists)
+/*
+ * Find the latest full copy of nonedata file in parent chain of destination
+ * backup. Full copy is latest possible destination file with size equal or
+ * greater than zero. Backup containing the copy is returned via "backup".
+ */
+pgFile *
+get_non_data_file_full_copy(pgBackup *dest_backup, pgFile *dest_file,
+							pgBackup **backup)
 {
-	char		from_root[MAXPGPATH];
-	char		from_fullpath[MAXPGPATH];
-	FILE		*in = NULL;
-
 	pgFile		*tmp_file = NULL;
 	pgBackup	*tmp_backup = NULL;
 
@@ -1272,8 +1300,6 @@ restore_non_data_file(parray *parent_chain, pgBackup *dest_backup,
 		 * Iterate over parent chain starting from direct parent of destination
 		 * backup to oldest backup in chain, and look for the first
 		 * full copy of destination file.
-		 * Full copy is latest possible destination file with size equal or
-		 * greater than zero.
 		 */
 		tmp_backup = dest_backup->parent_backup_link;
 		while (tmp_backup)
@@ -1289,24 +1315,11 @@ restore_non_data_file(parray *parent_chain, pgBackup *dest_backup,
 			 * backup, without encountering full copy first.
 			 */
 			if (!tmp_file)
-			{
 				elog(ERROR, "Failed to locate nonedata file \"%s\" in backup %s",
 					dest_file->rel_path, base36enc(tmp_backup->start_time));
-				continue;
-			}
-
-			/* Full copy is found and it is null sized, nothing to do here */
-			if (tmp_file->write_size == 0)
-			{
-				/* In case of incremental restore truncate file just to be safe */
-				if (already_exists && fio_ftruncate(out, 0))
-					elog(ERROR, "Cannot truncate file \"%s\": %s",
-							to_fullpath, strerror(errno));
-				return 0;
-			}
 
 			/* Full copy is found */
-			if (tmp_file->write_size > 0)
+			if (tmp_file->write_size >= 0)
 				break;
 
 			tmp_backup = tmp_backup->parent_backup_link;
@@ -1316,12 +1329,40 @@ restore_non_data_file(parray *parent_chain, pgBackup *dest_backup,
 	/* sanity */
 	if (!tmp_backup)
 		elog(ERROR, "Failed to locate a backup containing full copy of nonedata file \"%s\"",
-			to_fullpath);
+			dest_file->rel_path);
 
 	if (!tmp_file)
-		elog(ERROR, "Failed to locate a full copy of nonedata file \"%s\"", to_fullpath);
+		elog(ERROR, "Failed to locate a full copy of nonedata file \"%s\"", dest_file->rel_path);
+
+	*backup = tmp_backup;
+	return tmp_file;
+}
+
+size_t
+restore_non_data_file(parray *parent_chain, pgBackup *dest_backup,
+					  pgFile *dest_file, FILE *out, const char *to_fullpath,
+					  bool already_exists)
+{
+	char		from_root[MAXPGPATH];
+	char		from_fullpath[MAXPGPATH];
+	FILE		*in = NULL;
 
-	if (tmp_file->write_size <= 0)
+	pgFile		*tmp_file = NULL;
+	pgBackup	*tmp_backup = NULL;
+
+	tmp_file = get_non_data_file_full_copy(dest_backup, dest_file, &tmp_backup);
+
+	/* Full copy is found and it is null sized, nothing to do here */
+	if (tmp_file->write_size == 0)
+	{
+		/* In case of incremental restore truncate file just to be safe */
+		if (already_exists && fio_ftruncate(out, 0))
+			elog(ERROR, "Cannot truncate file \"%s\": %s",
+					to_fullpath, strerror(errno));
+		return 0;
+	}
+
+	if (tmp_file->write_size < 0)
 		elog(ERROR, "Full copy of nonedata file has invalid size: %li. "
 				"Metadata corruption in backup %s in file: \"%s\"",
 				tmp_file->write_size, base36enc(tmp_backup->start_time),
@@ -1331,7 +1372,7 @@ restore_non_data_file(parray *parent_chain, pgBackup *dest_backup,
 	if (already_exists)
 	{
 		/* compare checksums of already existing file and backup file */
-		pg_crc32 file_crc = fio_get_crc32(to_fullpath, FIO_DB_HOST, false);
+		pg_crc32 file_crc = fio_get_crc32(to_fullpath, FIO_DB_HOST, NONE_COMPRESS);
 
 		if (file_crc == tmp_file->crc)
 		{
@@ -1376,6 +1417,364 @@ restore_non_data_file(parray *parent_chain, pgBackup *dest_backup,
 	return tmp_file->write_size;
 }
 
+/*
+ * Write destination data file into sequential stream "out", which cannot be
+ * seeked, e.g. stdout. Unlike restore_data_file(), which applies backups
+ * one after another, we first find the backup in parent chain containing
+ * the latest version of every block, and only then write the blocks in order.
+ * Exactly dest_file->n_blocks blocks are written, blocks missing in
+ * every backup of the chain are written as zeroed pages.
+ *
+ * Only one segment of relation is kept in memory at a time: block map
+ * and page headers of each backup in chain, so memory usage does not
+ * depend on the size of the backup.
+ */
+size_t
+stream_data_file(parray *parent_chain, pgFile *dest_file, FILE *out,
+				 const char *to_path)
+{
+	int			i;
+	int			n_backups = parray_num(parent_chain);
+	BlockNumber	blknum;
+	BlockNumber	nblocks = (BlockNumber) dest_file->n_blocks;
+	BlockNumber	n_located = 0;
+	/* backup seq and header number for every block, -1 if block is missing */
+	int		   *block_backup = NULL;
+	int		   *block_hdr = NULL;
+	/* per backup state */
+	pgFile	  **files = (pgFile **) pgut_malloc0(sizeof(pgFile *) * n_backups);
+	BackupPageHeader2 **headers = (BackupPageHeader2 **) pgut_malloc0(sizeof(BackupPageHeader2 *) * n_backups);
+	FILE	  **in = (FILE **) pgut_malloc0(sizeof(FILE *) * n_backups);
+	char	  **in_bufs = (char **) pgut_malloc0(sizeof(char *) * n_backups);
+	off_t	   *cur_pos_in = (off_t *) pgut_malloc0(sizeof(off_t) * n_backups);
+	char		zero_page[BLCKSZ];
+
+	if (nblocks == 0)
+		goto cleanup;
+
+	block_backup = pgut_malloc(nblocks * sizeof(int));
+	block_hdr = pgut_malloc(nblocks * sizeof(int));
+
+	for (blknum = 0; blknum < nblocks; blknum++)
+		block_backup[blknum] = -1;
+
+	/*
+	 * FULL -> INCR -> DEST
+	 *  2       1       0
+	 * Go from destination backup to FULL, the first backup
+	 * containing the block has the latest version of it.
+	 */
+	for (i = 0; i < n_backups && n_located < nblocks; i++)
+	{
+		int			n_hdr;
+		pgFile	  **res_file = NULL;
+		pgFile	   *tmp_file = NULL;
+		pgBackup   *backup = (pgBackup *) parray_get(parent_chain, i);
+
+		/* lookup file in intermediate backup */
+		res_file = parray_bsearch(backup->files, dest_file, pgFileCompareRelPathWithExternal);
+		tmp_file = (res_file) ? *res_file : NULL;
+
+		/* Destination file is not exists yet at this moment or it was not changed */
+		if (tmp_file == NULL ||
+			tmp_file->write_size == BYTES_INVALID ||
+			tmp_file->write_size == 0)
+			continue;
+
+		if (tmp_file->n_headers <= 0)
+			elog(ERROR, "Cannot stream file \"%s\" from backup %s, page headers are missing",
+				 tmp_file->rel_path, base36enc(backup->start_time));
+
+		headers[i] = get_data_file_headers(&(backup->hdr_map), tmp_file,
+										   parse_program_version(backup->program_version),
+										   true, backup->large_file);
+
+		if (!headers[i])
+			elog(ERROR, "Failed to get page headers for file \"%s\" from backup %s",
+				 tmp_file->rel_path, base36enc(backup->start_time));
+
+		files[i] = tmp_file;
+
+		for (n_hdr = 0; n_hdr < tmp_file->n_headers; n_hdr++)
+		{
+			BlockNumber hdr_blknum = (BlockNumber) headers[i][n_hdr].block;
+
+			/* no point in locating redundant blocks */
+			if (hdr_blknum >= nblocks || block_backup[hdr_blknum] >= 0)
+				continue;
+
+			block_backup[hdr_blknum] = i;
+			block_hdr[hdr_blknum] = n_hdr;
+			n_located++;
+		}
+	}
+
+	if (n_located < nblocks)
+		elog(VERBOSE, "File \"%s\": %u of %u blocks are not found in backup chain, "
+			 "they will be zeroed", to_path, nblocks - n_located, nblocks);
+
+	MemSet(zero_page, 0, BLCKSZ);
+
+	for (blknum = 0; blknum < nblocks; blknum++)
+	{
+		int			seq = block_backup[blknum];
+		int			n_hdr = block_hdr[blknum];
+		size_t		read_len;
+		int32		compressed_size;
+		DataPage	page;
+		char		buf[BLCKSZ];
+		char	   *out_page = buf;
+		pgBackup   *backup;
+		pgFile	   *tmp_file;
+		uint32		backup_version;
+
+		/* check for interrupt */
+		if (interrupted || thread_interrupted)
+			elog(ERROR, "Interrupted during data file streaming");
+
+		if (seq < 0)
+		{
+			if (fwrite(zero_page, 1, BLCKSZ, out) != BLCKSZ)
+				elog(ERROR, "Cannot write block %u of \"%s\": %s",
+					 blknum, to_path, strerror(errno));
+			continue;
+		}
+
+		backup = (pgBackup *) parray_get(parent_chain, seq);
+		tmp_file = files[seq];
+		backup_version = parse_program_version(backup->program_version);
+
+		/* open source file lazily */
+		if (in[seq] == NULL)
+		{
+			char	from_root[MAXPGPATH];
+			char	from_fullpath[MAXPGPATH];
+
+			join_path_components(from_root, backup->root_dir, DATABASE_DIR);
+			join_path_components(from_fullpath, from_root, tmp_file->rel_path);
+
+			in[seq] = fopen(from_fullpath, PG_BINARY_R);
+			if (in[seq] == NULL)
+				elog(ERROR, "Cannot open backup file \"%s\": %s", from_fullpath,
+					 strerror(errno));
+
+			in_bufs[seq] = pgut_malloc(STDIO_BUFSIZE);
+			setvbuf(in[seq], in_bufs[seq], _IOFBF, STDIO_BUFSIZE);
+		}
+
+		/* calculate payload size by comparing current and next page positions,
+		 * page header is not included */
+		compressed_size = headers[seq][n_hdr+1].pos - headers[seq][n_hdr].pos - sizeof(BackupPageHeader);
+
+		if (compressed_size <= 0 || compressed_size > BLCKSZ)
+			elog(ERROR, "Invalid size of block %u in backup %s file \"%s\": %i",
+				 blknum, base36enc(backup->start_time), tmp_file->rel_path, compressed_size);
+
+		read_len = compressed_size + sizeof(BackupPageHeader);
+
+		/* blocks in one backup file are mostly requested sequentially */
+		if (cur_pos_in[seq] != headers[seq][n_hdr].pos)
+		{
+			if (fseek(in[seq], headers[seq][n_hdr].pos, SEEK_SET) != 0)
+				elog(ERROR, "Cannot seek to offset " INT64_FORMAT " of \"%s\" in backup %s: %s",
+					 headers[seq][n_hdr].pos, tmp_file->rel_path,
+					 base36enc(backup->start_time), strerror(errno));
+
+			cur_pos_in[seq] = headers[seq][n_hdr].pos;
+		}
+
+		if (fread(&page, 1, read_len, in[seq]) != read_len)
+			elog(ERROR, "Cannot read block %u of \"%s\" in backup %s: %s",
+				 blknum, tmp_file->rel_path, base36enc(backup->start_time),
+				 strerror(errno));
+
+		cur_pos_in[seq] += read_len;
+
+		if (compressed_size != BLCKSZ
+			|| page_may_be_compressed(page.data, tmp_file->compress_alg, backup_version))
+		{
+			const char *errormsg = NULL;
+			int32		uncompressed_size;
+
+			uncompressed_size = do_decompress(buf, BLCKSZ, page.data, compressed_size,
+											  tmp_file->compress_alg, &errormsg);
+			if (uncompressed_size != BLCKSZ)
+			{
+				if (errormsg)
+					elog(ERROR, "An error occured during decompressing block %u of file \"%s\": %s",
+						 blknum, tmp_file->rel_path, errormsg);
+				else
+					elog(ERROR, "Page of file \"%s\" uncompressed to %d bytes. != BLCKSZ",
+						 tmp_file->rel_path, uncompressed_size);
+			}
+		}
+		else
+			out_page = page.data;
+
+		if (fwrite(out_page, 1, BLCKSZ, out) != BLCKSZ)
+			elog(ERROR, "Cannot write block %u of \"%s\": %s",
+				 blknum, to_path, strerror(errno));
+	}
+
+cleanup:
+	pg_free(block_backup);
+	pg_free(block_hdr);
+
+	for (i = 0; i < n_backups; i++)
+	{
+		if (in[i] && fclose(in[i]) != 0)
+			elog(ERROR, "Cannot close file \"%s\": %s", files[i]->rel_path,
+				 strerror(errno));
+		pg_free(in_bufs[i]);
+		pg_free(headers[i]);
+	}
+
+	pg_free(files);
+	pg_free(headers);
+	pg_free(in);
+	pg_free(in_bufs);
+	pg_free(cur_pos_in);
+
+	return ((size_t) nblocks) * BLCKSZ;
+}
+
+/*
+ * Get LSN of every block of data file as it will be restored, i.e.
+ * LSN of the latest copy of the block in backup chain, using page
+ * headers only. Returns array of dest_file->n_blocks elements,
+ * InvalidXLogRecPtr for blocks without a known LSN.
+ * Backups without page headers (made before 2.4.0) are ignored.
+ */
+XLogRecPtr *
+get_data_file_block_lsns(parray *parent_chain, pgFile *dest_file)
+{
+	int			i;
+	BlockNumber	nblocks = (BlockNumber) dest_file->n_blocks;
+	BlockNumber	n_located = 0;
+	XLogRecPtr *lsns;
+
+	if (nblocks == 0)
+		return NULL;
+
+	lsns = (XLogRecPtr *) pgut_malloc0(sizeof(XLogRecPtr) * nblocks);
+
+	/* Go from destination backup to FULL, first found copy is the latest */
+	for (i = 0; i < parray_num(parent_chain) && n_located < nblocks; i++)
+	{
+		int			n_hdr;
+		pgFile	  **res_file = NULL;
+		pgFile	   *tmp_file = NULL;
+		BackupPageHeader2 *headers;
+		pgBackup   *backup = (pgBackup *) parray_get(parent_chain, i);
+
+		res_file = parray_bsearch(backup->files, dest_file, pgFileCompareRelPathWithExternal);
+		tmp_file = (res_file) ? *res_file : NULL;
+
+		if (tmp_file == NULL ||
+			tmp_file->write_size == BYTES_INVALID ||
+			tmp_file->write_size == 0 ||
+			tmp_file->n_headers <= 0)
+			continue;
+
+		headers = get_data_file_headers(&(backup->hdr_map), tmp_file,
+										parse_program_version(backup->program_version),
+										false, backup->large_file);
+		if (!headers)
+			continue;
+
+		for (n_hdr = 0; n_hdr < tmp_file->n_headers; n_hdr++)
+		{
+			BlockNumber blknum = (BlockNumber) headers[n_hdr].block;
+
+			if (blknum >= nblocks || lsns[blknum] != InvalidXLogRecPtr)
+				continue;
+
+			lsns[blknum] = headers[n_hdr].lsn;
+			if (lsns[blknum] != InvalidXLogRecPtr)
+				n_located++;
+		}
+
+		pg_free(headers);
+	}
+
+	return lsns;
+}
+
+/*
+ * Write exactly file->write_size bytes of full copy of nonedata file
+ * from backup into sequential stream "out".
+ */
+size_t
+stream_non_data_file(pgBackup *backup, pgFile *file, FILE *out,
+					 const char *to_path)
+{
+	char		from_root[MAXPGPATH];
+	char		from_fullpath[MAXPGPATH];
+	FILE	   *in = NULL;
+	char	   *buf;
+	int64		left = file->write_size;
+
+	if (file->write_size <= 0)
+		return 0;
+
+	if (file->external_dir_num == 0)
+		join_path_components(from_root, backup->root_dir, DATABASE_DIR);
+	else
+	{
+		char		external_prefix[MAXPGPATH];
+
+		join_path_components(external_prefix, backup->root_dir, EXTERNAL_DIR);
+		makeExternalDirPathByNum(from_root, external_prefix, file->external_dir_num);
+	}
+
+	join_path_components(from_fullpath, from_root, file->rel_path);
+
+	in = fopen(from_fullpath, PG_BINARY_R);
+	if (in == NULL)
+		elog(ERROR, "Cannot open backup file \"%s\": %s", from_fullpath,
+			 strerror(errno));
+
+	/* disable stdio buffering for nonedata files */
+	setvbuf(in, NULL, _IONBF, BUFSIZ);
+
+	buf = pgut_malloc(STDIO_BUFSIZE);
+
+	while (left > 0)
+	{
+		size_t	read_len;
+
+		/* check for interrupt */
+		if (interrupted || thread_interrupted)
+			elog(ERROR, "Interrupted during nonedata file streaming");
+
+		read_len = fread(buf, 1, Min(left, STDIO_BUFSIZE), in);
+
+		if (ferror(in))
+			elog(ERROR, "Cannot read backup file \"%s\": %s",
+				 from_fullpath, strerror(errno));
+
+		/* size of the file must match the metadata, tar header is already written */
+		if (read_len == 0)
+			elog(ERROR, "Backup file \"%s\" is shorter than expected: " INT64_FORMAT " bytes are missing",
+				 from_fullpath, left);
+
+		if (fwrite(buf, 1, read_len, out) != read_len)
+			elog(ERROR, "Cannot write to \"%s\": %s", to_path, strerror(errno));
+
+		left -= read_len;
+	}
+
+	pg_free(buf);
+
+	if (fclose(in) != 0)
+		elog(ERROR, "Cannot close file \"%s\": %s", from_fullpath,
+			strerror(errno));
+
+	elog(VERBOSE, "Copied file \"%s\": " INT64_FORMAT " bytes", from_fullpath, file->write_size);
+
+	return file->write_size;
+}
+
 /*
  * Copy file to backup.
  * We do not apply compression to these files, because
@@ -2644,11 +3043,10 @@ write_page_headers(BackupPageHeader2 *headers, pgFile *file, HeaderMap *hdr_map,
 		if (chmod(map_path, FILE_PERMISSION) == -1)
 			elog(ERROR, "Cannot change mode of \"%s\": %s", map_path,
 				 strerror(errno));
-
-		file->hdr_off = 0;
 	}
-	else
-		file->hdr_off = hdr_map->offset;
+
+	/* offset is not zero, when map is reopened to continue interrupted merge */
+	file->hdr_off = hdr_map->offset;
 
 	if (z_len <= 0)
 	{
@@ -2680,6 +3078,7 @@ init_header_map(pgBackup *backup)
 {
 	backup->hdr_map.fp = NULL;
 	backup->hdr_map.buf = NULL;
+	backup->hdr_map.offset = 0;
 	join_path_components(backup->hdr_map.path, backup->root_dir, HEADER_MAP);
 	join_path_components(backup->hdr_map.path_tmp, backup->root_dir, HEADER_MAP_TMP);
 	backup->hdr_map.mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
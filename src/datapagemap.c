@@ -3,7 +3,9 @@
  * datapagemap.c
  *	  A data structure for keeping track of data pages that have changed.
  *
- * This is a fairly simple bitmap.
+ * This is a fairly simple bitmap. Maps with a few blocks set far from the
+ * beginning of the file are kept as a sorted array of block numbers,
+ * until the array becomes larger than the bitmap would be.
  *
  * Copyright (c) 2013-2019, PostgreSQL Global Development Group
  *
@@ -14,12 +16,20 @@
 
 #include "datapagemap.h"
 
+/* Minimal number of entries allocated for a sparse map */
+#define SPARSE_MIN_ENTRIES	16
+
 struct datapagemap_iterator
 {
 	datapagemap_t *map;
-	BlockNumber nextblkno;
+	BlockNumber nextblkno;		/* next block of a bitmap */
+	int			nextidx;		/* next entry of a sparse map */
 };
 
+static void datapagemap_add_bit(datapagemap_t *map, BlockNumber blkno);
+static void datapagemap_make_dense(datapagemap_t *map, BlockNumber max_blkno);
+static int	datapagemap_sparse_search(datapagemap_t *map, BlockNumber blkno);
+
 /*****
  * Public functions
  */
@@ -29,40 +39,99 @@ struct datapagemap_iterator
  */
 void
 datapagemap_add(datapagemap_t *map, BlockNumber blkno)
+{
+	BlockNumber *blocks;
+	int			nentries;
+	int			pos;
+
+	if (map->bitmapsize == 0)
+		map->sparse = true;
+
+	if (!map->sparse)
+	{
+		datapagemap_add_bit(map, blkno);
+		return;
+	}
+
+	blocks = (BlockNumber *) map->bitmap;
+	nentries = map->bitmapsize / sizeof(BlockNumber);
+
+	pos = datapagemap_sparse_search(map, blkno);
+	if (pos < nentries && blocks[pos] == blkno)
+		return;
+
+	/* Switch to bitmap, once it takes less space than the array */
+	if ((nentries + 1) * sizeof(BlockNumber) >
+		Max(blkno, nentries > 0 ? blocks[nentries - 1] : 0) / 8 + 1)
+	{
+		datapagemap_make_dense(map, Max(blkno, nentries > 0 ? blocks[nentries - 1] : 0));
+		datapagemap_add_bit(map, blkno);
+		return;
+	}
+
+	/* Array is enlarged by doubling, as the bitmap is */
+	if (nentries == 0 ||
+		(nentries >= SPARSE_MIN_ENTRIES && (nentries & (nentries - 1)) == 0))
+	{
+		map->bitmap = pg_realloc(map->bitmap,
+								 Max(nentries * 2, SPARSE_MIN_ENTRIES) * sizeof(BlockNumber));
+		blocks = (BlockNumber *) map->bitmap;
+	}
+
+	memmove(&blocks[pos + 1], &blocks[pos], (nentries - pos) * sizeof(BlockNumber));
+	blocks[pos] = blkno;
+	map->bitmapsize += sizeof(BlockNumber);
+}
+
+/*
+ * Check if the block is in the map.
+ */
+bool
+datapagemap_is_set(datapagemap_t *map, BlockNumber blkno)
 {
 	int			offset;
 	int			bitno;
-	int			oldsize = map->bitmapsize;
+
+	if (map->sparse)
+	{
+		int			pos = datapagemap_sparse_search(map, blkno);
+
+		return pos < map->bitmapsize / (int) sizeof(BlockNumber) &&
+			((BlockNumber *) map->bitmap)[pos] == blkno;
+	}
 
 	offset = blkno / 8;
 	bitno = blkno % 8;
 
-	/* enlarge or create bitmap if needed */
-	if (oldsize <= offset)
-	{
-		int			newsize;
-
-		/*
-		 * The minimum to hold the new bit is offset + 1. But add some
-		 * headroom, so that we don't need to repeatedly enlarge the bitmap in
-		 * the common case that blocks are modified in order, from beginning
-		 * of a relation to the end.
-		 */
-		newsize = (oldsize == 0) ? 16 : oldsize;
-		while (newsize <= offset) {
-			newsize <<= 1;
-		}
+	return (map->bitmapsize <= offset) ? false : (map->bitmap[offset] & (1 << bitno)) != 0;
+}
 
-		map->bitmap = pg_realloc(map->bitmap, newsize);
+/*
+ * Add all blocks of 'src' to 'dst'.
+ */
+void
+datapagemap_union(datapagemap_t *dst, datapagemap_t *src)
+{
+	datapagemap_iterator_t *iter;
+	BlockNumber blkno;
+	int			i;
 
-		/* zero out the newly allocated region */
-		memset(&map->bitmap[oldsize], 0, newsize - oldsize);
+	if (src->bitmapsize == 0)
+		return;
 
-		map->bitmapsize = newsize;
+	if (!src->sparse)
+	{
+		/* Bitmaps are simply OR-ed */
+		datapagemap_make_dense(dst, (src->bitmapsize - 1) * 8);
+		for (i = 0; i < src->bitmapsize; i++)
+			dst->bitmap[i] |= src->bitmap[i];
+		return;
 	}
 
-	/* Set the bit */
-	map->bitmap[offset] |= (1 << bitno);
+	iter = datapagemap_iterate(src);
+	while (datapagemap_next(iter, &blkno))
+		datapagemap_add(dst, blkno);
+	pg_free(iter);
 }
 
 /*
@@ -80,6 +149,7 @@ datapagemap_iterate(datapagemap_t *map)
 	iter = pg_malloc(sizeof(datapagemap_iterator_t));
 	iter->map = map;
 	iter->nextblkno = 0;
+	iter->nextidx = 0;
 
 	return iter;
 }
@@ -89,6 +159,15 @@ datapagemap_next(datapagemap_iterator_t *iter, BlockNumber *blkno)
 {
 	datapagemap_t *map = iter->map;
 
+	if (map->sparse)
+	{
+		if (iter->nextidx >= map->bitmapsize / (int) sizeof(BlockNumber))
+			return false;
+
+		*blkno = ((BlockNumber *) map->bitmap)[iter->nextidx++];
+		return true;
+	}
+
 	for (;;)
 	{
 		BlockNumber blk = iter->nextblkno;
@@ -98,6 +177,13 @@ datapagemap_next(datapagemap_iterator_t *iter, BlockNumber *blkno)
 		if (nextoff >= map->bitmapsize)
 			break;
 
+		/* Skip empty bytes at once */
+		if (bitno == 0 && map->bitmap[nextoff] == 0)
+		{
+			iter->nextblkno += 8;
+			continue;
+		}
+
 		iter->nextblkno++;
 
 		if (map->bitmap[nextoff] & (1 << bitno))
@@ -111,3 +197,111 @@ datapagemap_next(datapagemap_iterator_t *iter, BlockNumber *blkno)
 	return false;
 }
 
+/*****
+ * Internal functions
+ */
+
+/*
+ * Set the bit of a plain bitmap.
+ */
+static void
+datapagemap_add_bit(datapagemap_t *map, BlockNumber blkno)
+{
+	int			offset;
+	int			bitno;
+	int			oldsize = map->bitmapsize;
+
+	offset = blkno / 8;
+	bitno = blkno % 8;
+
+	/* enlarge or create bitmap if needed */
+	if (oldsize <= offset)
+	{
+		int			newsize;
+
+		/*
+		 * The minimum to hold the new bit is offset + 1. But add some
+		 * headroom, so that we don't need to repeatedly enlarge the bitmap in
+		 * the common case that blocks are modified in order, from beginning
+		 * of a relation to the end.
+		 */
+		newsize = (oldsize == 0) ? 16 : oldsize;
+		while (newsize <= offset) {
+			newsize <<= 1;
+		}
+
+		map->bitmap = pg_realloc(map->bitmap, newsize);
+
+		/* zero out the newly allocated region */
+		memset(&map->bitmap[oldsize], 0, newsize - oldsize);
+
+		map->bitmapsize = newsize;
+	}
+
+	/* Set the bit */
+	map->bitmap[offset] |= (1 << bitno);
+}
+
+/*
+ * Convert the map into a plain bitmap, large enough to hold max_blkno.
+ */
+static void
+datapagemap_make_dense(datapagemap_t *map, BlockNumber max_blkno)
+{
+	BlockNumber *blocks;
+	int			nentries;
+	int			i;
+
+	if (!map->sparse)
+	{
+		/* Just enlarge the bitmap */
+		if (map->bitmapsize <= max_blkno / 8)
+		{
+			bool		was_set = datapagemap_is_set(map, max_blkno);
+
+			datapagemap_add_bit(map, max_blkno);
+			if (!was_set)
+				map->bitmap[max_blkno / 8] &= ~(1 << (max_blkno % 8));
+		}
+		return;
+	}
+
+	blocks = (BlockNumber *) map->bitmap;
+	nentries = map->bitmapsize / sizeof(BlockNumber);
+
+	map->bitmap = NULL;
+	map->bitmapsize = 0;
+	map->sparse = false;
+
+	datapagemap_add_bit(map, max_blkno);
+	map->bitmap[max_blkno / 8] &= ~(1 << (max_blkno % 8));
+
+	for (i = 0; i < nentries; i++)
+		datapagemap_add_bit(map, blocks[i]);
+
+	pg_free(blocks);
+}
+
+/*
+ * Find position of the block in a sparse map, or the position where
+ * it should be inserted.
+ */
+static int
+datapagemap_sparse_search(datapagemap_t *map, BlockNumber blkno)
+{
+	BlockNumber *blocks = (BlockNumber *) map->bitmap;
+	int			low = 0;
+	int			high = map->bitmapsize / sizeof(BlockNumber);
+
+	while (low < high)
+	{
+		int			mid = (low + high) / 2;
+
+		if (blocks[mid] < blkno)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
@@ -13,16 +13,25 @@
 #include "storage/block.h"
 
 
+/*
+ * Page map is kept either as a plain bitmap, or, if only a few blocks are
+ * set, as a sorted array of block numbers. In both cases 'bitmap' points
+ * to bitmapsize bytes, so the map can be sent as is together with the
+ * 'sparse' flag. Zero bitmapsize means that the map is empty.
+ */
 struct datapagemap
 {
 	char	   *bitmap;
 	int			bitmapsize;
+	bool		sparse;			/* 'bitmap' is an array of BlockNumber */
 };
 
 typedef struct datapagemap datapagemap_t;
 typedef struct datapagemap_iterator datapagemap_iterator_t;
 
 extern void datapagemap_add(datapagemap_t *map, BlockNumber blkno);
+extern bool datapagemap_is_set(datapagemap_t *map, BlockNumber blkno);
+extern void datapagemap_union(datapagemap_t *dst, datapagemap_t *src);
 extern datapagemap_iterator_t *datapagemap_iterate(datapagemap_t *map);
 extern bool datapagemap_next(datapagemap_iterator_t *iter, BlockNumber *blkno);
 
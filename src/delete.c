@@ -23,6 +23,8 @@ static void do_retention_merge(InstanceState *instanceState, parray *backup_list
 							   bool no_validate, bool no_sync);
 static void do_retention_purge(parray *to_keep_list, parray *to_purge_list);
 static void do_retention_wal(InstanceState *instanceState, bool dry_run);
+static bool wal_pack_is_removable(timelineInfo *tlinfo, int first,
+								  XLogSegNo OldestToKeepSegNo, bool purge_all);
 
 // TODO: more useful messages for dry run.
 static bool backup_deleted = false;   /* At least one backup was deleted */
@@ -825,6 +827,8 @@ delete_walfiles_in_tli(InstanceState *instanceState, XLogRecPtr keep_lsn, timeli
 	size_t		wal_size_actual = 0;
 	char		wal_pretty_size[20];
 	bool		purge_all = false;
+	const char *last_pack_name = NULL;
+	bool		pack_removable = false;
 
 
 	/* Timeline is completely empty */
@@ -909,7 +913,19 @@ delete_walfiles_in_tli(InstanceState *instanceState, XLogRecPtr keep_lsn, timeli
 	{
 		xlogFile *wal_file = (xlogFile *) parray_get(tlinfo->xlog_filelist, i);
 
-		if (purge_all || wal_file->segno < OldestToKeepSegNo)
+		if (wal_file->pack_name)
+		{
+			if (!last_pack_name || strcmp(last_pack_name, wal_file->pack_name) != 0)
+			{
+				last_pack_name = wal_file->pack_name;
+				pack_removable = wal_pack_is_removable(tlinfo, i, OldestToKeepSegNo,
+													   purge_all);
+			}
+
+			if (pack_removable)
+				wal_size_actual += wal_file->file.size;
+		}
+		else if (purge_all || wal_file->segno < OldestToKeepSegNo)
 			wal_size_actual += wal_file->file.size;
 	}
 
@@ -924,6 +940,7 @@ delete_walfiles_in_tli(InstanceState *instanceState, XLogRecPtr keep_lsn, timeli
 	if (dry_run)
 		return;
 
+	last_pack_name = NULL;
 	for (i = 0; i < parray_num(tlinfo->xlog_filelist); i++)
 	{
 		xlogFile *wal_file = (xlogFile *) parray_get(tlinfo->xlog_filelist, i);
@@ -938,6 +955,38 @@ delete_walfiles_in_tli(InstanceState *instanceState, XLogRecPtr keep_lsn, timeli
 		{
 			char wal_fullpath[MAXPGPATH];
 
+			/*
+			 * Packed segment. Pack is removed as a whole, when the last of
+			 * its segments becomes unnecessary.
+			 */
+			if (wal_file->pack_name)
+			{
+				if (last_pack_name && strcmp(last_pack_name, wal_file->pack_name) == 0)
+					continue;
+				last_pack_name = wal_file->pack_name;
+
+				join_path_components(wal_fullpath, instanceState->instance_wal_subdir_path,
+									 wal_file->pack_name);
+
+				if (!wal_pack_is_removable(tlinfo, i, OldestToKeepSegNo, purge_all))
+				{
+					elog(VERBOSE, "Retain WAL pack \"%s\"", wal_fullpath);
+					continue;
+				}
+
+				if (fio_unlink(wal_fullpath, FIO_BACKUP_HOST) < 0)
+				{
+					if (errno != ENOENT)
+						elog(ERROR, "Could not remove file \"%s\": %s",
+								wal_fullpath, strerror(errno));
+				}
+				else
+					elog(VERBOSE, "Removed WAL pack \"%s\"", wal_fullpath);
+
+				wal_deleted = true;
+				continue;
+			}
+
 			join_path_components(wal_fullpath, instanceState->instance_wal_subdir_path, wal_file->file.name);
 
 			/* save segment from purging */
@@ -965,6 +1014,8 @@ delete_walfiles_in_tli(InstanceState *instanceState, XLogRecPtr keep_lsn, timeli
 					elog(VERBOSE, "Removed partial WAL segment \"%s\"", wal_fullpath);
 				else if (wal_file->type == BACKUP_HISTORY_FILE)
 					elog(VERBOSE, "Removed backup history file \"%s\"", wal_fullpath);
+				else if (wal_file->type == WAL_SUMMARY_FILE)
+					elog(VERBOSE, "Removed WAL summary file \"%s\"", wal_fullpath);
 			}
 
 			wal_deleted = true;
@@ -972,6 +1023,36 @@ delete_walfiles_in_tli(InstanceState *instanceState, XLogRecPtr keep_lsn, timeli
 	}
 }
 
+/*
+ * Check if WAL pack, whose first segment is located at position 'first'
+ * of timeline file list, can be removed: all its segments must be
+ * unnecessary and none of them must be retained by backups.
+ * Segments of pack are placed in the list one after another.
+ */
+static bool
+wal_pack_is_removable(timelineInfo *tlinfo, int first,
+					  XLogSegNo OldestToKeepSegNo, bool purge_all)
+{
+	xlogFile   *first_file = (xlogFile *) parray_get(tlinfo->xlog_filelist, first);
+	int			i;
+
+	for (i = first; i < parray_num(tlinfo->xlog_filelist); i++)
+	{
+		xlogFile *wal_file = (xlogFile *) parray_get(tlinfo->xlog_filelist, i);
+
+		if (wal_file->pack_name == NULL ||
+			strcmp(wal_file->pack_name, first_file->pack_name) != 0)
+			break;
+
+		if (wal_file->keep)
+			return false;
+
+		if (!purge_all && wal_file->segno >= OldestToKeepSegNo)
+			return false;
+	}
+
+	return true;
+}
 
 /* Delete all backup files and wal files of given instance. */
 int
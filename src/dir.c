@@ -393,6 +393,90 @@ pgFileGetCRCgz(const char *file_path, bool use_crc32c, bool missing_ok)
 	return crc;
 }
 
+#ifdef HAVE_LIBZSTD
+/*
+ * Read the local zstd-compressed file to compute CRC of its content.
+ */
+pg_crc32
+pgFileGetCRCzstd(const char *file_path, bool use_crc32c, bool missing_ok)
+{
+	FILE	   *fp;
+	pg_crc32	crc = 0;
+	size_t		len;
+	size_t		out_size = ZSTD_DStreamOutSize();
+	char	   *in_buf;
+	char	   *out_buf;
+	ZSTD_DCtx  *dctx;
+	size_t		rc = 0;
+
+	INIT_FILE_CRC32(use_crc32c, crc);
+
+	/* open file in binary read mode */
+	fp = fopen(file_path, PG_BINARY_R);
+	if (fp == NULL)
+	{
+		if (errno == ENOENT && missing_ok)
+		{
+			FIN_FILE_CRC32(use_crc32c, crc);
+			return crc;
+		}
+
+		elog(ERROR, "Cannot open file \"%s\": %s",
+			file_path, strerror(errno));
+	}
+
+	in_buf = pgut_malloc(STDIO_BUFSIZE);
+	out_buf = pgut_malloc(out_size);
+
+	dctx = ZSTD_createDCtx();
+	if (dctx == NULL)
+		elog(ERROR, "Cannot create zstd decompression context");
+
+	/* calc CRC of decompressed content */
+	while ((len = fread(in_buf, 1, STDIO_BUFSIZE, fp)) > 0)
+	{
+		ZSTD_inBuffer input = { in_buf, len, 0 };
+
+		if (interrupted)
+			elog(ERROR, "interrupted during CRC calculation");
+
+		/* full output buffer means that decoder may have more data to flush */
+		for (;;)
+		{
+			ZSTD_outBuffer output = { out_buf, out_size, 0 };
+
+			rc = ZSTD_decompressStream(dctx, &output, &input);
+
+			if (ZSTD_isError(rc))
+				elog(ERROR, "Cannot decompress file \"%s\": %s",
+					 file_path, ZSTD_getErrorName(rc));
+
+			/* update CRC */
+			COMP_FILE_CRC32(use_crc32c, crc, out_buf, output.pos);
+
+			if (input.pos == input.size && output.pos < output.size)
+				break;
+		}
+	}
+
+	if (ferror(fp))
+		elog(ERROR, "Cannot read \"%s\": %s", file_path, strerror(errno));
+
+	/* decoder returns 0 only when the last frame is complete */
+	if (rc != 0)
+		elog(ERROR, "Cannot decompress file \"%s\": unexpected end of file",
+			 file_path);
+
+	FIN_FILE_CRC32(use_crc32c, crc);
+	ZSTD_freeDCtx(dctx);
+	fclose(fp);
+	pg_free(in_buf);
+	pg_free(out_buf);
+
+	return crc;
+}
+#endif
+
 void
 pgFileFree(void *file)
 {
@@ -409,16 +493,6 @@ pgFileFree(void *file)
 	pfree(file);
 }
 
-/* Compare two pgFile with their path in ascending order of ASCII code. */
-int
-pgFileMapComparePath(const void *f1, const void *f2)
-{
-	page_map_entry *f1p = *(page_map_entry **)f1;
-	page_map_entry *f2p = *(page_map_entry **)f2;
-
-	return strcmp(f1p->path, f2p->path);
-}
-
 /* Compare two pgFile with their name in ascending order of ASCII code. */
 int
 pgFileCompareName(const void *f1, const void *f2)
@@ -1023,6 +1097,45 @@ opt_externaldir_map(ConfigOption *opt, const char *arg)
 	opt_path_map(opt, arg, &external_remap_list, "external directory");
 }
 
+/*
+ * Add directory to the batch of mkdir requests. Batch holds up to
+ * FIO_BATCH_MAX_ITEMS items, the full one is flushed at once.
+ */
+void
+batch_mkdir(fio_batch_item *batch, int *n_batch, const char *path, mode_t mode,
+			fio_location location)
+{
+	batch[*n_batch].cop = FIO_MKDIR;
+	batch[*n_batch].arg = mode;
+	batch[*n_batch].path = pgut_strdup(path);
+	(*n_batch)++;
+
+	if (*n_batch == FIO_BATCH_MAX_ITEMS)
+		flush_mkdir_batch(batch, n_batch, location);
+}
+
+/* Create all directories in the batch and reset it */
+void
+flush_mkdir_batch(fio_batch_item *batch, int *n_batch, fio_location location)
+{
+	int			i;
+
+	if (*n_batch == 0)
+		return;
+
+	fio_batch(batch, *n_batch, location);
+
+	for (i = 0; i < *n_batch; i++)
+	{
+		if (batch[i].errnum != 0)
+			elog(ERROR, "Cannot create directory \"%s\": %s",
+				 batch[i].path, strerror(batch[i].errnum));
+		pg_free((char *) batch[i].path);
+	}
+
+	*n_batch = 0;
+}
+
 /*
  * Create directories from **dest_files** in **data_dir**.
  *
@@ -1046,6 +1159,8 @@ create_data_directories(parray *dest_files, const char *data_dir, const char *ba
 	parray		*links = NULL;
 	mode_t		pg_tablespace_mode = DIR_PERMISSION;
 	char		to_path[MAXPGPATH];
+	fio_batch_item *batch;
+	int			n_batch = 0;
 
 	/* get tablespace map */
 	if (extract_tablespaces)
@@ -1099,6 +1214,9 @@ create_data_directories(parray *dest_files, const char *data_dir, const char *ba
 
 	elog(LOG, "Restore directories and symlinks...");
 
+	/* directories are created by batches to save remote round trips */
+	batch = pgut_malloc(FIO_BATCH_MAX_ITEMS * sizeof(fio_batch_item));
+
 	/* create directories */
 	for (i = 0; i < parray_num(dest_files); i++)
 	{
@@ -1142,7 +1260,9 @@ create_data_directories(parray *dest_files, const char *data_dir, const char *ba
 							 linked_path, to_path);
 
 					/* create tablespace directory */
-					fio_mkdir(linked_path, pg_tablespace_mode, location);
+					batch_mkdir(batch, &n_batch, linked_path, pg_tablespace_mode,
+								location);
+					flush_mkdir_batch(batch, &n_batch, location);
 
 					/* create link to linked_path */
 					if (fio_symlink(linked_path, to_path, incremental, location) < 0)
@@ -1159,10 +1279,12 @@ create_data_directories(parray *dest_files, const char *data_dir, const char *ba
 
 		join_path_components(to_path, data_dir, dir->rel_path);
 
-		// TODO check exit code
-		fio_mkdir(to_path, dir->mode, location);
+		batch_mkdir(batch, &n_batch, to_path, dir->mode, location);
 	}
 
+	flush_mkdir_batch(batch, &n_batch, location);
+	pg_free(batch);
+
 	if (extract_tablespaces)
 	{
 		parray_walk(links, pgFileFree);
@@ -1926,3 +2048,265 @@ pfilearray_clear_locks(parray *file_list)
 		pg_atomic_clear_flag(&file->lock);
 	}
 }
+
+/*
+ * Per-device I/O queues.
+ *
+ * Files are split into queues by the device (st_dev) of the directory
+ * they are read from or written to: PGDATA, each tablespace and each
+ * external directory. Worker threads take the next file from the queue
+ * with the fewest active workers, so several tablespaces on separate
+ * disks are processed in parallel instead of one after another.
+ * If max_active is positive, no more than max_active threads work on
+ * the same device at once.
+ */
+typedef struct IoQueue
+{
+	dev_t		dev;
+	parray	   *files;
+	size_t		next;		/* index of the next file to hand out */
+	int			active;		/* number of threads working on this device */
+} IoQueue;
+
+struct IoQueues
+{
+	parray	   *queues;
+	int			max_active;
+	int			n_files;
+	int			n_claimed;
+	pthread_mutex_t lock;
+};
+
+typedef struct IoQueueRoot
+{
+	char		path[MAXPGPATH];
+	IoQueue	   *queue;
+} IoQueueRoot;
+
+static IoQueue *
+io_queues_get_queue(IoQueues *queues, parray *roots, const char *path,
+					fio_location location)
+{
+	int			i;
+	struct stat	st;
+	dev_t		dev;
+	IoQueue	   *queue;
+	IoQueueRoot *root;
+
+	for (i = 0; i < parray_num(roots); i++)
+	{
+		root = (IoQueueRoot *) parray_get(roots, i);
+		if (strcmp(root->path, path) == 0)
+			return root->queue;
+	}
+
+	/*
+	 * Follow symlinks, so pg_tblspc/OID resolves to the device of
+	 * the tablespace location. If the directory cannot be examined,
+	 * put its files into the first queue.
+	 */
+	if (fio_stat(path, &st, true, location) == 0)
+		dev = st.st_dev;
+	else
+	{
+		elog(VERBOSE, "Cannot stat \"%s\": %s", path, strerror(errno));
+		dev = parray_num(queues->queues) > 0 ?
+			((IoQueue *) parray_get(queues->queues, 0))->dev : 0;
+	}
+
+	queue = NULL;
+	for (i = 0; i < parray_num(queues->queues); i++)
+	{
+		IoQueue	   *cur = (IoQueue *) parray_get(queues->queues, i);
+
+		if (cur->dev == dev)
+		{
+			queue = cur;
+			break;
+		}
+	}
+
+	if (queue == NULL)
+	{
+		queue = pgut_new0(IoQueue);
+		queue->dev = dev;
+		queue->files = parray_new();
+		parray_append(queues->queues, queue);
+	}
+
+	root = pgut_new(IoQueueRoot);
+	strlcpy(root->path, path, MAXPGPATH);
+	root->queue = queue;
+	parray_append(roots, root);
+
+	return queue;
+}
+
+/*
+ * Build I/O queues for the regular files in 'files'.
+ * 'root' is the data directory and 'external_dirs' is the list of external
+ * directories, both located on 'location'. Order of files within a queue
+ * follows the order of 'files'.
+ */
+IoQueues *
+io_queues_new(parray *files, const char *root, parray *external_dirs,
+			  int max_active, fio_location location)
+{
+	int			i;
+	IoQueues   *queues = pgut_new0(IoQueues);
+	parray	   *roots = parray_new();
+
+	queues->queues = parray_new();
+	queues->max_active = max_active;
+	queues->lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+
+	/* PGDATA always gets the first queue */
+	io_queues_get_queue(queues, roots, root, location);
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		char		path[MAXPGPATH];
+		IoQueue	   *queue;
+
+		if (S_ISDIR(file->mode))
+			continue;
+
+		if (file->external_dir_num > 0 && external_dirs &&
+			file->external_dir_num <= parray_num(external_dirs))
+			strlcpy(path, parray_get(external_dirs, file->external_dir_num - 1),
+					MAXPGPATH);
+		else if (file->external_dir_num == 0 &&
+				 path_is_prefix_of_path(PG_TBLSPC_DIR, file->rel_path))
+		{
+			/* pg_tblspc/OID/... */
+			char		tblspc[MAXPGPATH];
+			char	   *sep;
+
+			strlcpy(tblspc, file->rel_path, MAXPGPATH);
+			sep = strchr(tblspc + strlen(PG_TBLSPC_DIR) + 1, '/');
+			if (sep)
+				*sep = '\0';
+			join_path_components(path, root, tblspc);
+		}
+		else
+			strlcpy(path, root, MAXPGPATH);
+
+		queue = io_queues_get_queue(queues, roots, path, location);
+		parray_append(queue->files, file);
+		queues->n_files++;
+	}
+
+	parray_walk(roots, pg_free);
+	parray_free(roots);
+
+	if (parray_num(queues->queues) > 1)
+		elog(INFO, "Files are spread over %i devices",
+			 (int) parray_num(queues->queues));
+
+	return queues;
+}
+
+/*
+ * Release the device the thread worked on (*queue_num, -1 if none)
+ * and take the next file. The chosen queue is the one with the fewest
+ * active threads among queues that still have files and are below
+ * the limit; on a tie the queue with more remaining files wins.
+ * Sleeps while every such queue is at the limit.
+ * Returns NULL when all files are handed out. If 'file_num' is not
+ * NULL, it is set to the ordinal number of the returned file.
+ */
+pgFile *
+io_queues_next(IoQueues *queues, int *queue_num, int *file_num)
+{
+	for (;;)
+	{
+		int			i;
+		int			best = -1;
+		bool		pending = false;
+		pgFile	   *file = NULL;
+
+		pthread_lock(&queues->lock);
+
+		if (*queue_num >= 0)
+		{
+			((IoQueue *) parray_get(queues->queues, *queue_num))->active--;
+			*queue_num = -1;
+		}
+
+		for (i = 0; i < parray_num(queues->queues); i++)
+		{
+			IoQueue	   *queue = (IoQueue *) parray_get(queues->queues, i);
+			IoQueue	   *best_queue;
+
+			if (queue->next >= parray_num(queue->files))
+				continue;
+
+			pending = true;
+
+			if (queues->max_active > 0 && queue->active >= queues->max_active)
+				continue;
+
+			if (best < 0)
+			{
+				best = i;
+				continue;
+			}
+
+			best_queue = (IoQueue *) parray_get(queues->queues, best);
+			if (queue->active < best_queue->active ||
+				(queue->active == best_queue->active &&
+				 parray_num(queue->files) - queue->next >
+				 parray_num(best_queue->files) - best_queue->next))
+				best = i;
+		}
+
+		if (best >= 0)
+		{
+			IoQueue	   *queue = (IoQueue *) parray_get(queues->queues, best);
+
+			file = (pgFile *) parray_get(queue->files, queue->next++);
+			queue->active++;
+			*queue_num = best;
+			if (file_num)
+				*file_num = ++queues->n_claimed;
+		}
+
+		pthread_mutex_unlock(&queues->lock);
+
+		if (file || !pending)
+			return file;
+
+		/* all devices with remaining files are busy, wait for a slot */
+		if (interrupted || thread_interrupted)
+			elog(ERROR, "Interrupted while waiting for an I/O queue");
+		pg_usleep(10000L);
+	}
+}
+
+/* Total number of files in the queues */
+int
+io_queues_num_files(IoQueues *queues)
+{
+	return queues->n_files;
+}
+
+void
+io_queues_free(IoQueues *queues)
+{
+	int			i;
+
+	if (queues == NULL)
+		return;
+
+	for (i = 0; i < parray_num(queues->queues); i++)
+	{
+		IoQueue	   *queue = (IoQueue *) parray_get(queues->queues, i);
+
+		/* files belong to the caller */
+		parray_free(queue->files);
+		pg_free(queue);
+	}
+	parray_free(queues->queues);
+	pg_free(queues);
+}
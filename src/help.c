@@ -30,6 +30,7 @@ static void help_checkdb(void);
 static void help_help(void);
 static void help_version(void);
 static void help_catchup(void);
+static void help_synthesize(void);
 
 void
 help_print_version(void)
@@ -72,6 +73,7 @@ help_command(ProbackupSubcmd const subcmd)
 		&help_help,
 		&help_version,
 		&help_catchup,
+		&help_synthesize,
 	};
 
 	Assert((int)subcmd < sizeof(help_functions) / sizeof(help_functions[0]));
@@ -105,6 +107,7 @@ help_pg_probackup(void)
 	printf(_("                 [--compress-algorithm=compress-algorithm]\n"));
 	printf(_("                 [--compress-level=compress-level]\n"));
 	printf(_("                 [--archive-timeout=timeout]\n"));
+	printf(_("                 [--wal-pack-size=wal-pack-size]\n"));
 	printf(_("                 [-d dbname] [-h host] [-p port] [-U username]\n"));
 	printf(_("                 [--remote-proto] [--remote-host]\n"));
 	printf(_("                 [--remote-port] [--remote-path] [--remote-user]\n"));
@@ -126,6 +129,8 @@ help_pg_probackup(void)
 	printf(_("                 [-D pgdata-path] [-C]\n"));
 	printf(_("                 [--stream [-S slot-name] [--temp-slot]]\n"));
 	printf(_("                 [--backup-pg-log] [-j num-threads] [--progress]\n"));
+	printf(_("                 [--device-threads=num-threads]\n"));
+	printf(_("                 [--agent-threads=num-threads]\n"));
 	printf(_("                 [--no-validate] [--skip-block-validation]\n"));
 	printf(_("                 [--external-dirs=external-directories-paths]\n"));
 	printf(_("                 [--no-sync]\n"));
@@ -155,6 +160,7 @@ help_pg_probackup(void)
 
 	printf(_("\n  %s restore -B backup-path --instance=instance_name\n"), PROGRAM_NAME);
 	printf(_("                 [-D pgdata-path] [-i backup-id] [-j num-threads]\n"));
+	printf(_("                 [--device-threads=num-threads]\n"));
 	printf(_("                 [--recovery-target-time=time|--recovery-target-xid=xid\n"));
 	printf(_("                  |--recovery-target-lsn=lsn [--recovery-target-inclusive=boolean]]\n"));
 	printf(_("                 [--recovery-target-timeline=timeline]\n"));
@@ -171,6 +177,7 @@ help_pg_probackup(void)
 	printf(_("                 [--skip-external-dirs] [--no-sync]\n"));
 	printf(_("                 [-I | --incremental-mode=none|checksum|lsn]\n"));
 	printf(_("                 [--db-include | --db-exclude]\n"));
+	printf(_("                 [--to-stdout] [--prewarm-blocks=num-blocks]\n"));
 	printf(_("                 [--remote-proto] [--remote-host]\n"));
 	printf(_("                 [--remote-port] [--remote-path] [--remote-user]\n"));
 	printf(_("                 [--ssh-options]\n"));
@@ -213,6 +220,11 @@ help_pg_probackup(void)
 	printf(_("                 [--no-validate] [--no-sync]\n"));
 	printf(_("                 [--help]\n"));
 
+	printf(_("\n  %s synthesize -B backup-path --instance=instance_name\n"), PROGRAM_NAME);
+	printf(_("                 -i backup-id [--progress] [-j num-threads]\n"));
+	printf(_("                 [--no-validate] [--no-sync]\n"));
+	printf(_("                 [--help]\n"));
+
 	printf(_("\n  %s add-instance -B backup-path -D pgdata-path\n"), PROGRAM_NAME);
 	printf(_("                 --instance=instance_name\n"));
 	printf(_("                 [--external-dirs=external-directories-paths]\n"));
@@ -228,8 +240,10 @@ help_pg_probackup(void)
 	printf(_("\n  %s archive-push -B backup-path --instance=instance_name\n"), PROGRAM_NAME);
 	printf(_("                 --wal-file-name=wal-file-name\n"));
 	printf(_("                 [--wal-file-path=wal-file-path]\n"));
+	printf(_("                 [--daemon] [--wal-summary]\n"));
 	printf(_("                 [-j num-threads] [--batch-size=batch_size]\n"));
 	printf(_("                 [--archive-timeout=timeout]\n"));
+	printf(_("                 [--wal-pack-size=wal-pack-size]\n"));
 	printf(_("                 [--no-ready-rename] [--no-sync]\n"));
 	printf(_("                 [--overwrite] [--compress]\n"));
 	printf(_("                 [--compress-algorithm=compress-algorithm]\n"));
@@ -300,6 +314,8 @@ help_backup(void)
 	printf(_("                 [-D pgdata-path] [-C]\n"));
 	printf(_("                 [--stream [-S slot-name] [--temp-slot]]\n"));
 	printf(_("                 [--backup-pg-log] [-j num-threads] [--progress]\n"));
+	printf(_("                 [--device-threads=num-threads]\n"));
+	printf(_("                 [--agent-threads=num-threads]\n"));
 	printf(_("                 [--no-validate] [--skip-block-validation]\n"));
 	printf(_("                 [-E external-directories-paths]\n"));
 	printf(_("                 [--no-sync]\n"));
@@ -335,6 +351,10 @@ help_backup(void)
 	printf(_("      --temp-slot                  use temporary replication slot\n"));
 	printf(_("      --backup-pg-log              backup of '%s' directory\n"), PG_LOG_DIR);
 	printf(_("  -j, --threads=NUM                number of parallel threads\n"));
+	printf(_("      --device-threads=NUM         maximum number of threads reading from one device\n"));
+	printf(_("                                   (default: 0, no limit)\n"));
+	printf(_("      --agent-threads=NUM          number of threads compressing pages on remote host\n"));
+	printf(_("                                   for every connection (default: 1)\n"));
 	printf(_("      --progress                   show progress\n"));
 	printf(_("      --no-validate                disable validation after backup\n"));
 	printf(_("      --skip-block-validation      set to validate only file-level checksum\n"));
@@ -391,7 +411,7 @@ help_backup(void)
 	printf(_("\n  Compression options:\n"));
 	printf(_("      --compress                   alias for --compress-algorithm='zlib' and --compress-level=1\n"));
 	printf(_("      --compress-algorithm=compress-algorithm\n"));
-	printf(_("                                   available options: 'zlib', 'pglz', 'none' (default: none)\n"));
+	printf(_("                                   available options: 'zlib', 'pglz', 'zstd', 'none' (default: none)\n"));
 	printf(_("      --compress-level=compress-level\n"));
 	printf(_("                                   level of compression [0-9] (default: 1)\n"));
 
@@ -416,6 +436,8 @@ help_backup(void)
 	printf(_("      --remote-user=username       user name for ssh connection (default: current user)\n"));
 	printf(_("      --ssh-options=ssh_options    additional ssh options (default: none)\n"));
 	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n"));
+	printf(_("      --remote-compress-level=compress-level\n"));
+	printf(_("                                   zstd level for traffic with remote agent (default: 0, disabled)\n"));
 
 	printf(_("\n  Replica options:\n"));
 	printf(_("      --master-user=user_name      user name to connect to master (deprecated)\n"));
@@ -430,6 +452,7 @@ help_restore(void)
 {
 	printf(_("\n%s restore -B backup-path --instance=instance_name\n"), PROGRAM_NAME);
 	printf(_("                 [-D pgdata-path] [-i backup-id] [-j num-threads]\n"));
+	printf(_("                 [--device-threads=num-threads]\n"));
 	printf(_("                 [--progress] [--force] [--no-sync]\n"));
 	printf(_("                 [--no-validate] [--skip-block-validation]\n"));
 	printf(_("                 [-T OLDDIR=NEWDIR]\n"));
@@ -437,6 +460,7 @@ help_restore(void)
 	printf(_("                 [--skip-external-dirs]\n"));
 	printf(_("                 [-I | --incremental-mode=none|checksum|lsn]\n"));
 	printf(_("                 [--db-include dbname | --db-exclude dbname]\n"));
+	printf(_("                 [--to-stdout] [--prewarm-blocks=num-blocks]\n"));
 	printf(_("                 [--recovery-target-time=time|--recovery-target-xid=xid\n"));
 	printf(_("                  |--recovery-target-lsn=lsn [--recovery-target-inclusive=boolean]]\n"));
 	printf(_("                 [--recovery-target-timeline=timeline]\n"));
@@ -459,6 +483,8 @@ help_restore(void)
 	printf(_("  -D, --pgdata=pgdata-path         location of the database storage area\n"));
 	printf(_("  -i, --backup-id=backup-id        backup to restore\n"));
 	printf(_("  -j, --threads=NUM                number of parallel threads\n"));
+	printf(_("      --device-threads=NUM         maximum number of threads writing to one device\n"));
+	printf(_("                                   (default: 0, no limit)\n"));
 
 	printf(_("      --progress                   show progress\n"));
 	printf(_("      --force                      ignore invalid status of the restored backup\n"));
@@ -471,6 +497,8 @@ help_restore(void)
 	printf(_("      --external-mapping=OLDDIR=NEWDIR\n"));
 	printf(_("                                   relocate the external directory from OLDDIR to NEWDIR\n"));
 	printf(_("      --skip-external-dirs         do not restore all external directories\n"));
+	printf(_("      --prewarm-blocks=NUM         create autoprewarm.blocks with NUM most recently\n"));
+	printf(_("                                   changed blocks (default: 0, do not create)\n"));
 
 	printf(_("\n  Incremental restore options:\n"));
 	printf(_("  -I, --incremental-mode=none|checksum|lsn\n"));
@@ -481,6 +509,10 @@ help_restore(void)
 	printf(_("      --db-include dbname          restore only specified databases\n"));
 	printf(_("      --db-exclude dbname          do not restore specified databases\n"));
 
+	printf(_("\n  Streaming restore options:\n"));
+	printf(_("      --to-stdout                  write restored data directory to stdout as tar archive\n"));
+	printf(_("                                   instead of PGDATA\n"));
+
 	printf(_("\n  Recovery options:\n"));
 	printf(_("      --recovery-target-time=time  time stamp up to which recovery will proceed\n"));
 	printf(_("      --recovery-target-xid=xid    transaction ID up to which recovery will proceed\n"));
@@ -538,6 +570,8 @@ help_restore(void)
 	printf(_("      --remote-user=username       user name for ssh connection (default: current user)\n"));
 	printf(_("      --ssh-options=ssh_options    additional ssh options (default: none)\n"));
 	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n"));
+	printf(_("      --remote-compress-level=compress-level\n"));
+	printf(_("                                   zstd level for traffic with remote agent (default: 0, disabled)\n"));
 
 	printf(_("\n  Remote WAL archive options:\n"));
 	printf(_("      --archive-host=destination   address or hostname for ssh connection to archive host\n"));
@@ -769,6 +803,52 @@ help_merge(void)
 	printf(_("      --no-color                   disable the coloring of error and warning console messages\n\n"));
 }
 
+static void
+help_synthesize(void)
+{
+	printf(_("\n%s synthesize -B backup-path --instance=instance_name\n"), PROGRAM_NAME);
+	printf(_("                 -i backup-id [-j num-threads] [--progress]\n"));
+	printf(_("                 [--no-validate] [--no-sync]\n"));
+	printf(_("                 [--log-level-console=log-level-console]\n"));
+	printf(_("                 [--log-level-file=log-level-file]\n"));
+	printf(_("                 [--log-filename=log-filename]\n"));
+	printf(_("                 [--error-log-filename=error-log-filename]\n"));
+	printf(_("                 [--log-directory=log-directory]\n"));
+	printf(_("                 [--log-rotation-size=log-rotation-size]\n"));
+	printf(_("                 [--log-rotation-age=log-rotation-age]\n\n"));
+
+	printf(_("  -B, --backup-path=backup-path    location of the backup storage area\n"));
+	printf(_("      --instance=instance_name     name of the instance\n"));
+	printf(_("  -i, --backup-id=backup-id        incremental backup to build full backup from\n"));
+
+	printf(_("  -j, --threads=NUM                number of parallel threads\n"));
+	printf(_("      --progress                   show progress\n"));
+	printf(_("      --no-validate                disable validation of the backup chain\n"));
+	printf(_("      --no-sync                    do not sync synthesized files to disk\n"));
+
+	printf(_("\n  Logging options:\n"));
+	printf(_("      --log-level-console=log-level-console\n"));
+	printf(_("                                   level for console logging (default: info)\n"));
+	printf(_("                                   available options: 'off', 'error', 'warning', 'info', 'log', 'verbose'\n"));
+	printf(_("      --log-level-file=log-level-file\n"));
+	printf(_("                                   level for file logging (default: off)\n"));
+	printf(_("                                   available options: 'off', 'error', 'warning', 'info', 'log', 'verbose'\n"));
+	printf(_("      --log-filename=log-filename\n"));
+	printf(_("                                   filename for file logging (default: 'pg_probackup.log')\n"));
+	printf(_("                                   support strftime format (example: pg_probackup-%%Y-%%m-%%d_%%H%%M%%S.log)\n"));
+	printf(_("      --error-log-filename=error-log-filename\n"));
+	printf(_("                                   filename for error logging (default: none)\n"));
+	printf(_("      --log-directory=log-directory\n"));
+	printf(_("                                   directory for file logging (default: BACKUP_PATH/log)\n"));
+	printf(_("      --log-rotation-size=log-rotation-size\n"));
+	printf(_("                                   rotate logfile if its size exceeds this value; 0 disables; (default: 0)\n"));
+	printf(_("                                   available units: 'kB', 'MB', 'GB', 'TB' (default: kB)\n"));
+	printf(_("      --log-rotation-age=log-rotation-age\n"));
+	printf(_("                                   rotate logfile if its age exceeds this value; 0 disables; (default: 0)\n"));
+	printf(_("                                   available units: 'ms', 's', 'min', 'h', 'd' (default: min)\n"));
+	printf(_("      --no-color                   disable the coloring of error and warning console messages\n\n"));
+}
+
 static void
 help_set_backup(void)
 {
@@ -805,6 +885,7 @@ help_set_config(void)
 	printf(_("                 [--compress-algorithm=compress-algorithm]\n"));
 	printf(_("                 [--compress-level=compress-level]\n"));
 	printf(_("                 [--archive-timeout=timeout]\n"));
+	printf(_("                 [--wal-pack-size=wal-pack-size]\n"));
 	printf(_("                 [-d dbname] [-h host] [-p port] [-U username]\n"));
 	printf(_("                 [--remote-proto] [--remote-host]\n"));
 	printf(_("                 [--remote-port] [--remote-path] [--remote-user]\n"));
@@ -850,12 +931,14 @@ help_set_config(void)
 	printf(_("\n  Compression options:\n"));
 	printf(_("      --compress                   alias for --compress-algorithm='zlib' and --compress-level=1\n"));
 	printf(_("      --compress-algorithm=compress-algorithm\n"));
-	printf(_("                                   available options: 'zlib','pglz','none' (default: 'none')\n"));
+	printf(_("                                   available options: 'zlib','pglz','zstd','none' (default: 'none')\n"));
 	printf(_("      --compress-level=compress-level\n"));
 	printf(_("                                   level of compression [0-9] (default: 1)\n"));
 
 	printf(_("\n  Archive options:\n"));
 	printf(_("      --archive-timeout=timeout    wait timeout for WAL segment archiving (default: 5min)\n"));
+	printf(_("      --wal-pack-size=NUM          number of archived WAL segments to store in one pack file;\n"));
+	printf(_("                                   power of two; 0 disables (default: 0)\n"));
 
 	printf(_("\n  Connection options:\n"));
 	printf(_("  -U, --pguser=USERNAME            user name to connect as (default: current local user)\n"));
@@ -873,6 +956,8 @@ help_set_config(void)
 	printf(_("      --remote-user=username       user name for ssh connection (default: current user)\n"));
 	printf(_("      --ssh-options=ssh_options    additional ssh options (default: none)\n"));
 	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n"));
+	printf(_("      --remote-compress-level=compress-level\n"));
+	printf(_("                                   zstd level for traffic with remote agent (default: 0, disabled)\n"));
 
 	printf(_("\n  Remote WAL archive options:\n"));
 	printf(_("      --archive-host=destination   address or hostname for ssh connection to archive host\n"));
@@ -924,7 +1009,9 @@ help_add_instance(void)
 	printf(_("                                   (default: current binary path)\n"));
 	printf(_("      --remote-user=username       user name for ssh connection (default: current user)\n"));
 	printf(_("      --ssh-options=ssh_options    additional ssh options (default: none)\n"));
-	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n\n"));
+	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n"));
+	printf(_("      --remote-compress-level=compress-level\n"));
+	printf(_("                                   zstd level for traffic with remote agent (default: 0, disabled)\n\n"));
 }
 
 static void
@@ -942,8 +1029,10 @@ help_archive_push(void)
 	printf(_("\n%s archive-push -B backup-path --instance=instance_name\n"), PROGRAM_NAME);
 	printf(_("                 --wal-file-name=wal-file-name\n"));
 	printf(_("                 [--wal-file-path=wal-file-path]\n"));
+	printf(_("                 [--daemon] [--wal-summary]\n"));
 	printf(_("                 [-j num-threads] [--batch-size=batch_size]\n"));
 	printf(_("                 [--archive-timeout=timeout]\n"));
+	printf(_("                 [--wal-pack-size=wal-pack-size]\n"));
 	printf(_("                 [--no-ready-rename] [--no-sync]\n"));
 	printf(_("                 [--overwrite] [--compress]\n"));
 	printf(_("                 [--compress-algorithm=compress-algorithm]\n"));
@@ -958,9 +1047,14 @@ help_archive_push(void)
 	printf(_("                                   name of the file to copy into WAL archive\n"));
 	printf(_("      --wal-file-path=wal-file-path\n"));
 	printf(_("                                   relative destination path of the WAL archive\n"));
+	printf(_("      --daemon                     keep running and push files as soon as they are ready\n"));
+	printf(_("      --wal-summary                save summaries of data blocks changed by archived WAL,\n"));
+	printf(_("                                   used by PAGE backup instead of reading WAL\n"));
 	printf(_("  -j, --threads=NUM                number of parallel threads\n"));
 	printf(_("      --batch-size=NUM             number of files to be copied\n"));
 	printf(_("      --archive-timeout=timeout    wait timeout before discarding stale temp file(default: 5min)\n"));
+	printf(_("      --wal-pack-size=NUM          number of archived WAL segments to store in one pack file;\n"));
+	printf(_("                                   power of two; 0 disables (default: 0)\n"));
 	printf(_("      --no-ready-rename            do not rename '.ready' files in 'archive_status' directory\n"));
 	printf(_("      --no-sync                    do not sync WAL file to disk\n"));
 	printf(_("      --overwrite                  overwrite archived WAL file\n"));
@@ -968,7 +1062,7 @@ help_archive_push(void)
 	printf(_("\n  Compression options:\n"));
 	printf(_("      --compress                   alias for --compress-algorithm='zlib' and --compress-level=1\n"));
 	printf(_("      --compress-algorithm=compress-algorithm\n"));
-	printf(_("                                   available options: 'zlib','pglz','none' (default: 'none')\n"));
+	printf(_("                                   available options: 'zlib','pglz','zstd','none' (default: 'none')\n"));
 	printf(_("      --compress-level=compress-level\n"));
 	printf(_("                                   level of compression [0-9] (default: 1)\n"));
 
@@ -981,7 +1075,9 @@ help_archive_push(void)
 	printf(_("                                   (default: current binary path)\n"));
 	printf(_("      --remote-user=username       user name for ssh connection (default: current user)\n"));
 	printf(_("      --ssh-options=ssh_options    additional ssh options (default: none)\n"));
-	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n\n"));
+	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n"));
+	printf(_("      --remote-compress-level=compress-level\n"));
+	printf(_("                                   zstd level for traffic with remote agent (default: 0, disabled)\n\n"));
 }
 
 static void
@@ -1016,7 +1112,9 @@ help_archive_get(void)
 	printf(_("                                   (default: current binary path)\n"));
 	printf(_("      --remote-user=username       user name for ssh connection (default: current user)\n"));
 	printf(_("      --ssh-options=ssh_options    additional ssh options (default: none)\n"));
-	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n\n"));
+	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n"));
+	printf(_("      --remote-compress-level=compress-level\n"));
+	printf(_("                                   zstd level for traffic with remote agent (default: 0, disabled)\n\n"));
 }
 
 static void
@@ -1082,7 +1180,9 @@ help_catchup(void)
 	printf(_("                                   (default: current binary path)\n"));
 	printf(_("      --remote-user=username       user name for ssh connection (default: current user)\n"));
 	printf(_("      --ssh-options=ssh_options    additional ssh options (default: none)\n"));
-	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n\n"));
+	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n"));
+	printf(_("      --remote-compress-level=compress-level\n"));
+	printf(_("                                   zstd level for traffic with remote agent (default: 0, disabled)\n\n"));
 
 	printf(_("      --dry-run                    perform a trial run without any changes\n\n"));
 }
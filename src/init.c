@@ -117,6 +117,8 @@ do_add_instance(InstanceState *instanceState, InstanceConfig *instance)
 				   SOURCE_DEFAULT);
 	config_set_opt(instance_options, &instance_config.remote.ssh_config,
 				   SOURCE_DEFAULT);
+	config_set_opt(instance_options, &instance_config.remote.compress_level,
+				   SOURCE_DEFAULT);
 
 	/* pgdata was set through command line */
 	do_set_config(instanceState, true);
@@ -14,6 +14,27 @@
 
 #include "utils/thread.h"
 
+/*
+ * Journal of files, which are already merged into FULL backup.
+ * Every line is a DATABASE_FILE_LIST entry of merged file, so interrupted
+ * merge can be continued from the point it stopped instead of merging
+ * every file again.
+ */
+typedef struct MergeJournal
+{
+	char		path[MAXPGPATH];
+	FILE	   *fp;
+	parray	   *files;		/* files merged by previous attempts, sorted */
+	parray	   *pending;	/* lines of merged files, not written yet */
+	time_t		last_flush;
+	bool		no_sync;
+	pthread_mutex_t lock;
+} MergeJournal;
+
+/* Journal is written in batches, to avoid fsync after every file */
+#define MERGE_JOURNAL_BATCH		256
+#define MERGE_JOURNAL_TIMEOUT	10		/* seconds */
+
 typedef struct
 {
 	parray		*merge_filelist;
@@ -32,6 +53,8 @@ typedef struct
 	bool        is_retry;
 	bool        no_sync;
 
+	MergeJournal *journal;
+
 	/*
 	 * Return value from the thread.
 	 * 0 means there is no error, 1 - there is an error.
@@ -42,10 +65,19 @@ typedef struct
 
 static void *merge_files(void *arg);
 static void
+merge_journal_open(MergeJournal *journal, pgBackup *full_backup,
+				   bool is_retry, bool no_sync);
+static void
+merge_journal_append(MergeJournal *journal, HeaderMap *hdr_map, pgFile *file);
+static void
+merge_journal_close(MergeJournal *journal);
+static void
 reorder_external_dirs(pgBackup *to_backup, parray *to_external,
 					  parray *from_external);
 static int
 get_external_index(const char *key, const parray *list);
+static void
+remove_dir_with_files(const char *path);
 
 static void
 merge_data_file(parray *parent_chain, pgBackup *full_backup,
@@ -53,6 +85,17 @@ merge_data_file(parray *parent_chain, pgBackup *full_backup,
 				pgFile *tmp_file, const char *to_root, bool use_bitmap,
 				bool is_retry, bool no_sync);
 
+static bool
+merge_data_file_as_is(parray *parent_chain, pgBackup *full_backup,
+					  pgBackup *dest_backup, pgFile *dest_file,
+					  pgFile *tmp_file, const char *full_database_dir,
+					  bool no_sync);
+static bool
+merge_data_file_splice(parray *parent_chain, pgBackup *full_backup,
+					   pgBackup *dest_backup, pgFile *dest_file,
+					   pgFile *tmp_file, const char *full_database_dir,
+					   bool no_sync);
+
 static void
 merge_non_data_file(parray *parent_chain, pgBackup *full_backup,
 				pgBackup *dest_backup, pgFile *dest_file,
@@ -454,6 +497,7 @@ merge_chain(InstanceState *instanceState,
 
 	pthread_t	*threads = NULL;
 	merge_files_arg *threads_args = NULL;
+	MergeJournal journal;
 	time_t		merge_time;
 	bool		merge_isok = true;
 	/* for fancy reporting */
@@ -652,6 +696,9 @@ merge_chain(InstanceState *instanceState,
 		pg_atomic_init_flag(&file->lock);
 	}
 
+	/* Find out files merged by previous attempt */
+	merge_journal_open(&journal, full_backup, is_retry, no_sync);
+
 	threads = (pthread_t *) palloc(sizeof(pthread_t) * num_threads);
 	threads_args = (merge_files_arg *) palloc(sizeof(merge_files_arg) * num_threads);
 
@@ -673,6 +720,7 @@ merge_chain(InstanceState *instanceState,
 		arg->use_bitmap = use_bitmap;
 		arg->is_retry = is_retry;
 		arg->no_sync = no_sync;
+		arg->journal = &journal;
 		/* By default there are some error */
 		arg->ret = 1;
 
@@ -697,6 +745,8 @@ merge_chain(InstanceState *instanceState,
 		//total_in_place_merge_bytes += threads_args[i].in_place_merge_bytes;
 	}
 
+	merge_journal_close(&journal);
+
 	time(&end_time);
 	pretty_time_interval(difftime(end_time, merge_time),
 						 pretty_time, lengthof(pretty_time));
@@ -814,6 +864,11 @@ merge_chain(InstanceState *instanceState,
 		}
 	}
 
+	/* File list of FULL backup is up to date, journal is not needed anymore */
+	if (unlink(journal.path) == -1 && errno != ENOENT)
+		elog(ERROR, "Cannot remove file \"%s\": %s", journal.path,
+			 strerror(errno));
+
 	/* Critical section starts.
 	 * Change status of FULL backup.
 	 * Files are merged into FULL backup. It is time to remove incremental chain.
@@ -922,6 +977,400 @@ merge_rename:
 	}
 }
 
+/*
+ * Build a new FULL backup from the parent chain of backup_id in a separate
+ * directory, so the chain stays untouched and can be used by concurrent
+ * restores. Only when the new backup is complete, the chain is locked in
+ * exclusive mode and replaced: the new FULL backup takes ID of the
+ * destination backup, so its descendants stay valid, and the rest of
+ * the chain is deleted.
+ *
+ * Directories with names starting with dot are skipped by catalog,
+ * so the new backup is invisible until the swap.
+ */
+void
+do_synthesize(InstanceState *instanceState, time_t backup_id, bool no_validate, bool no_sync)
+{
+	parray	   *backups;
+	parray	   *chain = parray_new();
+	parray	   *result_filelist = NULL;
+	pgBackup   *dest_backup = NULL;
+	pgBackup   *full_backup = NULL;
+	pgBackup   *tmp_backup = NULL;
+	pgBackup   *synthetic = NULL;
+	char		dest_dir[MAXPGPATH];
+	char		synthetic_dir[MAXPGPATH];
+	char		replaced_dir[MAXPGPATH];
+	char		external_prefix[MAXPGPATH];
+	bool		use_bitmap = true;
+	bool		synthesize_isok = true;
+	pthread_t  *threads = NULL;
+	merge_files_arg *threads_args = NULL;
+	MergeJournal journal;
+	time_t		start_time;
+	time_t		end_time;
+	char		pretty_time[20];
+	int			i;
+
+	if (backup_id == INVALID_BACKUP_ID)
+		elog(ERROR, "required parameter is not specified: --backup-id");
+
+	if (instanceState == NULL)
+		elog(ERROR, "required parameter is not specified: --instance");
+
+	elog(INFO, "Synthesize started");
+
+	/* It's redundant to check block checksumms, as in merge */
+	skip_block_validation = true;
+
+	join_path_components(dest_dir, instanceState->instance_backup_subdir_path,
+						 base36enc(backup_id));
+	snprintf(synthetic_dir, MAXPGPATH, "%s/.%s.synthetic",
+			 instanceState->instance_backup_subdir_path, base36enc(backup_id));
+	snprintf(replaced_dir, MAXPGPATH, "%s/.%s.replaced",
+			 instanceState->instance_backup_subdir_path, base36enc(backup_id));
+
+	/*
+	 * Previous run was interrupted after destination backup was moved away,
+	 * but before the new FULL backup took its place. Finish the swap.
+	 */
+	if (!fileExists(dest_dir, FIO_BACKUP_HOST) &&
+		fileExists(synthetic_dir, FIO_BACKUP_HOST))
+	{
+		tmp_backup = read_backup(synthetic_dir);
+
+		if (tmp_backup && tmp_backup->status == BACKUP_STATUS_OK)
+		{
+			elog(WARNING, "Finish interrupted synthesize of backup %s",
+				 base36enc(backup_id));
+
+			if (rename(synthetic_dir, dest_dir) == -1)
+				elog(ERROR, "Could not rename directory \"%s\" to \"%s\": %s",
+					 synthetic_dir, dest_dir, strerror(errno));
+		}
+
+		if (tmp_backup)
+			pgBackupFree(tmp_backup);
+	}
+
+	/* Remove leftovers of previous runs */
+	if (fileExists(dest_dir, FIO_BACKUP_HOST))
+	{
+		if (fileExists(replaced_dir, FIO_BACKUP_HOST))
+		{
+			elog(LOG, "Remove replaced backup directory \"%s\"", replaced_dir);
+			remove_dir_with_files(replaced_dir);
+		}
+
+		if (fileExists(synthetic_dir, FIO_BACKUP_HOST))
+		{
+			elog(LOG, "Remove unfinished synthetic backup \"%s\"", synthetic_dir);
+			remove_dir_with_files(synthetic_dir);
+		}
+	}
+
+	/* Get list of all backups sorted in order of descending start time */
+	backups = catalog_get_backup_list(instanceState, INVALID_BACKUP_ID);
+
+	for (i = 0; i < parray_num(backups); i++)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(backups, i);
+
+		if (backup->start_time == backup_id)
+		{
+			dest_backup = backup;
+			break;
+		}
+	}
+
+	if (dest_backup == NULL)
+		elog(ERROR, "Target backup %s was not found", base36enc(backup_id));
+
+	if (dest_backup->backup_mode == BACKUP_MODE_FULL)
+	{
+		elog(INFO, "Backup %s is full backup already, nothing to do",
+			 base36enc(backup_id));
+		goto cleanup;
+	}
+
+	full_backup = find_parent_full_backup(dest_backup);
+	if (full_backup == NULL)
+		elog(ERROR, "Failed to find parent full backup for %s",
+			 base36enc(dest_backup->start_time));
+
+	/* Form the chain from destination backup to FULL */
+	for (tmp_backup = dest_backup; tmp_backup; tmp_backup = tmp_backup->parent_backup_link)
+	{
+		if (tmp_backup->status != BACKUP_STATUS_OK &&
+			tmp_backup->status != BACKUP_STATUS_DONE)
+			elog(ERROR, "Backup %s has status: %s",
+				 base36enc(tmp_backup->start_time), status2str(tmp_backup->status));
+
+		/* Other descendants would be orphaned, when parent is deleted */
+		if (tmp_backup != dest_backup && is_prolific(backups, tmp_backup))
+			elog(ERROR, "Backup %s has multiple direct children, it cannot be "
+				 "replaced by synthetic full backup", base36enc(tmp_backup->start_time));
+
+		parray_append(chain, tmp_backup);
+
+		if (tmp_backup == full_backup)
+			break;
+	}
+
+	/* Only shared lock is needed until the swap, restore can use the chain */
+	catalog_lock_backup_list(chain, parray_num(chain) - 1, 0, true, false);
+
+	if (!no_validate)
+	{
+		elog(INFO, "Validate parent chain for backup %s",
+			 base36enc(dest_backup->start_time));
+
+		for (i = parray_num(chain) - 1; i >= 0; i--)
+		{
+			pgBackup   *backup = (pgBackup *) parray_get(chain, i);
+
+			pgBackupValidate(backup, NULL);
+
+			if (backup->status != BACKUP_STATUS_OK)
+				elog(ERROR, "Backup %s has status %s, synthesize is aborted",
+					 base36enc(backup->start_time), status2str(backup->status));
+		}
+	}
+
+	for (i = parray_num(chain) - 1; i >= 0; i--)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(chain, i);
+
+		backup->files = get_backup_filelist(backup, true);
+		parray_qsort(backup->files, pgFileCompareRelPathWithExternal);
+	}
+
+	/* New FULL backup describes the same state as destination backup */
+	synthetic = pgut_new0(pgBackup);
+	pgBackupInit(synthetic);
+
+	synthetic->backup_mode = BACKUP_MODE_FULL;
+	synthetic->status = BACKUP_STATUS_RUNNING;
+	synthetic->start_time = dest_backup->start_time;
+	synthetic->backup_id = dest_backup->backup_id;
+	synthetic->tli = dest_backup->tli;
+	synthetic->start_lsn = dest_backup->start_lsn;
+	synthetic->stop_lsn = dest_backup->stop_lsn;
+	synthetic->recovery_time = dest_backup->recovery_time;
+	synthetic->recovery_xid = dest_backup->recovery_xid;
+	synthetic->expire_time = dest_backup->expire_time;
+	synthetic->pgdata_bytes = dest_backup->pgdata_bytes;
+	synthetic->compress_alg = dest_backup->compress_alg;
+	synthetic->compress_level = dest_backup->compress_level;
+	synthetic->block_size = dest_backup->block_size;
+	synthetic->wal_block_size = dest_backup->wal_block_size;
+	synthetic->checksum_version = dest_backup->checksum_version;
+	synthetic->stream = dest_backup->stream;
+	synthetic->from_replica = dest_backup->from_replica;
+	synthetic->primary_conninfo = pgut_strdup(dest_backup->primary_conninfo);
+	synthetic->external_dir_str = pgut_strdup(dest_backup->external_dir_str);
+	synthetic->note = pgut_strdup(dest_backup->note);
+	strlcpy(synthetic->program_version, PROGRAM_VERSION,
+			sizeof(synthetic->program_version));
+	strlcpy(synthetic->server_version, dest_backup->server_version,
+			sizeof(synthetic->server_version));
+
+	/* STREAM backup will have its wal_bytes calculated by write_backup_filelist() */
+	if (!dest_backup->stream)
+		synthetic->wal_bytes = dest_backup->wal_bytes;
+
+	synthetic->root_dir = pgut_strdup(synthetic_dir);
+	synthetic->database_dir = pgut_malloc(MAXPGPATH);
+	join_path_components(synthetic->database_dir, synthetic->root_dir, DATABASE_DIR);
+	join_path_components(external_prefix, synthetic->root_dir, EXTERNAL_DIR);
+	init_header_map(synthetic);
+
+	if (fio_mkdir(synthetic->root_dir, DIR_PERMISSION, FIO_BACKUP_HOST) != 0)
+		elog(ERROR, "Cannot create directory \"%s\": %s",
+			 synthetic->root_dir, strerror(errno));
+	dir_create_dir(synthetic->database_dir, DIR_PERMISSION, false);
+
+	write_backup(synthetic, true);
+
+	create_data_directories(dest_backup->files, synthetic->database_dir,
+							dest_backup->root_dir, false, false, FIO_BACKUP_HOST);
+
+	/* bitmap optimization rely on n_blocks, which is generally available since 2.3.0 */
+	if (parse_program_version(dest_backup->program_version) < 20300)
+		use_bitmap = false;
+
+	for (i = 0; i < parray_num(dest_backup->files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(dest_backup->files, i);
+
+		/* if the entry was an external directory, create it in the backup */
+		if (file->external_dir_num && S_ISDIR(file->mode))
+		{
+			char		dirpath[MAXPGPATH];
+			char		new_container[MAXPGPATH];
+
+			makeExternalDirPathByNum(new_container, external_prefix,
+									 file->external_dir_num);
+			join_path_components(dirpath, new_container, file->rel_path);
+			dir_create_dir(dirpath, DIR_PERMISSION, false);
+		}
+
+		pg_atomic_init_flag(&file->lock);
+	}
+
+	merge_journal_open(&journal, synthetic, false, no_sync);
+
+	threads = (pthread_t *) palloc(sizeof(pthread_t) * num_threads);
+	threads_args = (merge_files_arg *) palloc(sizeof(merge_files_arg) * num_threads);
+
+	thread_interrupted = false;
+	start_time = time(NULL);
+	synthetic->merge_time = start_time;
+	elog(INFO, "Start synthesizing backup files");
+	for (i = 0; i < num_threads; i++)
+	{
+		merge_files_arg *arg = &(threads_args[i]);
+		arg->merge_filelist = parray_new();
+		arg->parent_chain = chain;
+		arg->dest_backup = dest_backup;
+		arg->full_backup = synthetic;
+		arg->full_database_dir = synthetic->database_dir;
+		arg->full_external_prefix = external_prefix;
+
+		/* there is nothing to keep in place, every file is written anew */
+		arg->compression_match = false;
+		arg->program_version_match = is_forward_compatible(chain);
+		arg->use_bitmap = use_bitmap;
+		arg->is_retry = false;
+		arg->no_sync = no_sync;
+		arg->journal = &journal;
+		/* By default there are some error */
+		arg->ret = 1;
+
+		elog(VERBOSE, "Start thread: %d", i);
+
+		pthread_create(&threads[i], NULL, merge_files, arg);
+	}
+
+	/* Wait threads */
+	result_filelist = parray_new();
+	for (i = 0; i < num_threads; i++)
+	{
+		pthread_join(threads[i], NULL);
+		if (threads_args[i].ret == 1)
+			synthesize_isok = false;
+
+		parray_concat(result_filelist, threads_args[i].merge_filelist);
+		parray_free(threads_args[i].merge_filelist);
+	}
+
+	merge_journal_close(&journal);
+
+	time(&end_time);
+	pretty_time_interval(difftime(end_time, start_time),
+						 pretty_time, lengthof(pretty_time));
+
+	if (synthesize_isok)
+		elog(INFO, "Backup files are successfully synthesized, time elapsed: %s",
+			 pretty_time);
+	else
+		elog(ERROR, "Backup files synthesizing failed, time elapsed: %s",
+			 pretty_time);
+
+	/* Synthesize is not resumable, journal is useless */
+	if (unlink(journal.path) == -1 && errno != ENOENT)
+		elog(ERROR, "Cannot remove file \"%s\": %s", journal.path,
+			 strerror(errno));
+
+	if (synthetic->hdr_map.fp)
+	{
+		cleanup_header_map(&(synthetic->hdr_map));
+
+		if (!no_sync && fio_sync(synthetic->hdr_map.path_tmp, FIO_BACKUP_HOST) != 0)
+			elog(ERROR, "Cannot sync temp header map \"%s\": %s",
+				 synthetic->hdr_map.path_tmp, strerror(errno));
+
+		if (rename(synthetic->hdr_map.path_tmp, synthetic->hdr_map.path))
+			elog(ERROR, "Could not rename file \"%s\" to \"%s\": %s",
+				 synthetic->hdr_map.path_tmp, synthetic->hdr_map.path, strerror(errno));
+	}
+
+	for (i = parray_num(chain) - 1; i >= 0; i--)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(chain, i);
+		cleanup_header_map(&(backup->hdr_map));
+	}
+
+	parray_qsort(result_filelist, pgFileCompareRelPathWithExternal);
+	write_backup_filelist(synthetic, result_filelist, synthetic->database_dir, NULL, true);
+
+	synthetic->end_time = time(NULL);
+	synthetic->status = BACKUP_STATUS_OK;
+	write_backup(synthetic, true);
+
+	if (!no_validate)
+	{
+		pgBackupValidate(synthetic, NULL);
+		if (synthetic->status != BACKUP_STATUS_OK)
+			elog(ERROR, "Synthetic full backup %s is corrupt, the chain is left intact",
+				 base36enc(backup_id));
+	}
+
+	/* Wait for readers of the chain to go away */
+	catalog_lock_backup_list(chain, parray_num(chain) - 1, 0, true, true);
+
+	/* Critical section starts, see the recovery at the top of function */
+	elog(LOG, "Rename %s to %s", dest_backup->root_dir, replaced_dir);
+	if (rename(dest_backup->root_dir, replaced_dir) == -1)
+		elog(ERROR, "Could not rename directory \"%s\" to \"%s\": %s",
+			 dest_backup->root_dir, replaced_dir, strerror(errno));
+
+	elog(LOG, "Rename %s to %s", synthetic_dir, dest_backup->root_dir);
+	if (rename(synthetic_dir, dest_backup->root_dir) == -1)
+		elog(ERROR, "Could not rename directory \"%s\" to \"%s\": %s",
+			 synthetic_dir, dest_backup->root_dir, strerror(errno));
+	/* Critical section end */
+
+	elog(INFO, "Backup %s is replaced by synthetic full backup", base36enc(backup_id));
+
+	/*
+	 * If we crash now, old chain members are left as valid backups,
+	 * they can be deleted as usual.
+	 */
+	remove_dir_with_files(replaced_dir);
+
+	for (i = parray_num(chain) - 1; i > 0; i--)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(chain, i);
+		delete_backup_files(backup);
+	}
+
+	elog(INFO, "Synthesize of backup %s completed", base36enc(backup_id));
+
+	/* Cleanup */
+	pfree(threads_args);
+	pfree(threads);
+
+	parray_walk(result_filelist, pgFileFree);
+	parray_free(result_filelist);
+
+	for (i = 0; i < parray_num(chain); i++)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(chain, i);
+
+		parray_walk(backup->files, pgFileFree);
+		parray_free(backup->files);
+		backup->files = NULL;
+	}
+
+	pgBackupFree(synthetic);
+
+cleanup:
+	parray_walk(backups, pgBackupFree);
+	parray_free(backups);
+	parray_free(chain);
+}
+
 /*
  * Thread worker of merge_chain().
  */
@@ -936,6 +1385,7 @@ merge_files(void *arg)
 	{
 		pgFile	   *dest_file = (pgFile *) parray_get(arguments->dest_backup->files, i);
 		pgFile	   *tmp_file;
+		pgFile	  **journal_file = NULL;
 		bool		in_place = false; /* keep file as it is */
 
 		/* check for interrupt */
@@ -956,6 +1406,19 @@ merge_files(void *arg)
 		if (S_ISDIR(dest_file->mode))
 			goto done;
 
+		/* File was merged by previous attempt, take its metadata from journal */
+		if (parray_num(arguments->journal->files) > 0)
+			journal_file = (pgFile **) parray_bsearch(arguments->journal->files, dest_file,
+													  pgFileCompareRelPathWithExternal);
+		if (journal_file)
+		{
+			elog(VERBOSE, "The file was merged by previous attempt, skip merge: \"%s\"",
+				 dest_file->rel_path);
+			pgFileFree(tmp_file);
+			tmp_file = *journal_file;
+			goto done;
+		}
+
 		if (progress)
 			elog(INFO, "Progress: (%d/%lu). Merging file \"%s\"",
 				i + 1, n_files, dest_file->rel_path);
@@ -1100,6 +1563,30 @@ merge_files(void *arg)
 		}
 
 		if (dest_file->is_datafile && !dest_file->is_cfs)
+		{
+			/*
+			 * Compressed blocks can be copied as they are, if every backup in
+			 * chain has page headers in current storage format. As with in-place
+			 * merge, header map of FULL backup cannot be trusted when retrying.
+			 */
+			if (arguments->program_version_match && !arguments->is_retry &&
+				merge_data_file_as_is(arguments->parent_chain,
+									  arguments->full_backup,
+									  arguments->dest_backup,
+									  dest_file, tmp_file,
+									  arguments->full_database_dir,
+									  arguments->no_sync))
+				goto done;
+
+			if (arguments->program_version_match && !arguments->is_retry &&
+				merge_data_file_splice(arguments->parent_chain,
+									   arguments->full_backup,
+									   arguments->dest_backup,
+									   dest_file, tmp_file,
+									   arguments->full_database_dir,
+									   arguments->no_sync))
+				goto done;
+
 			merge_data_file(arguments->parent_chain,
 							arguments->full_backup,
 							arguments->dest_backup,
@@ -1108,6 +1595,7 @@ merge_files(void *arg)
 							arguments->use_bitmap,
 							arguments->is_retry,
 							arguments->no_sync);
+		}
 		else
 			merge_non_data_file(arguments->parent_chain,
 								arguments->full_backup,
@@ -1118,6 +1606,10 @@ merge_files(void *arg)
 								arguments->no_sync);
 
 done:
+		if (!journal_file && S_ISREG(tmp_file->mode) && tmp_file->write_size > 0)
+			merge_journal_append(arguments->journal,
+								 &(arguments->full_backup->hdr_map), tmp_file);
+
 		parray_append(arguments->merge_filelist, tmp_file);
 	}
 
@@ -1127,6 +1619,213 @@ done:
 	return NULL;
 }
 
+/*
+ * Prepare merge journal of FULL backup.
+ *
+ * When retrying failed merge, load files merged by previous attempt.
+ * Their page headers were written into the temp header map, so the map
+ * is reused and new headers are appended after its end. If the map
+ * doesn't contain them, the journal cannot be trusted and every file
+ * is merged again.
+ */
+static void
+merge_journal_open(MergeJournal *journal, pgBackup *full_backup,
+				   bool is_retry, bool no_sync)
+{
+	int			i;
+	struct stat	st;
+	int64		hdr_end = 0;
+	HeaderMap  *hdr_map = &(full_backup->hdr_map);
+
+	join_path_components(journal->path, full_backup->root_dir, MERGE_JOURNAL);
+	journal->files = parray_new();
+	journal->pending = parray_new();
+	journal->last_flush = time(NULL);
+	journal->no_sync = no_sync;
+	journal->lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+
+	if (is_retry)
+	{
+		FILE	   *fp = fopen(journal->path, PG_BINARY_R);
+
+		if (fp == NULL && errno != ENOENT)
+			elog(ERROR, "Cannot open merge journal \"%s\": %s",
+				 journal->path, strerror(errno));
+
+		if (fp)
+		{
+			char		buf[BLCKSZ];
+
+			while (fgets(buf, lengthof(buf), fp))
+			{
+				pgFile	   *file;
+				int64		uncompressed_size;
+				size_t		len = strlen(buf);
+
+				/* line can be torn by crash, the rest of journal is useless */
+				if (len == 0 || buf[len - 1] != '\n')
+					break;
+
+				file = parse_filelist_line(buf);
+				get_control_value_int64(buf, "uncompressed_size", &uncompressed_size, true);
+				file->uncompressed_size = uncompressed_size;
+
+				if (file->n_headers > 0)
+					hdr_end = Max(hdr_end, (int64) (file->hdr_off + file->hdr_size));
+
+				parray_append(journal->files, file);
+			}
+
+			if (ferror(fp))
+				elog(ERROR, "Cannot read merge journal \"%s\": %s",
+					 journal->path, strerror(errno));
+			fclose(fp);
+		}
+	}
+
+	if (stat(hdr_map->path_tmp, &st) == -1)
+	{
+		if (errno != ENOENT)
+			elog(ERROR, "Cannot stat file \"%s\": %s",
+				 hdr_map->path_tmp, strerror(errno));
+		st.st_size = 0;
+	}
+
+	if (st.st_size < hdr_end)
+	{
+		elog(WARNING, "Page header map \"%s\" doesn't match merge journal, "
+			 "all files will be merged again", hdr_map->path_tmp);
+		parray_walk(journal->files, pgFileFree);
+		parray_free(journal->files);
+		journal->files = parray_new();
+	}
+
+	if (parray_num(journal->files) > 0)
+	{
+		elog(INFO, "Continue merge, %lu files were merged by previous attempt",
+			 parray_num(journal->files));
+		parray_qsort(journal->files, pgFileCompareRelPathWithExternal);
+
+		/* append new headers after the ones written by previous attempt */
+		hdr_map->offset = st.st_size;
+	}
+	else if (unlink(hdr_map->path_tmp) == -1 && errno != ENOENT)
+		elog(ERROR, "Cannot remove file \"%s\": %s",
+			 hdr_map->path_tmp, strerror(errno));
+
+	/* Rewrite journal with the valid entries only */
+	journal->fp = fopen(journal->path, PG_BINARY_W);
+	if (journal->fp == NULL)
+		elog(ERROR, "Cannot open merge journal \"%s\": %s",
+			 journal->path, strerror(errno));
+
+	for (i = 0; i < parray_num(journal->files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(journal->files, i);
+		char		line[BLCKSZ];
+		int			len;
+
+		len = print_filelist_line(line, file);
+		sprintf(line + len, ",\"uncompressed_size\":\"" INT64_FORMAT "\"}\n",
+				file->uncompressed_size);
+
+		if (fputs(line, journal->fp) == EOF)
+			elog(ERROR, "Cannot write merge journal \"%s\": %s",
+				 journal->path, strerror(errno));
+	}
+
+	if (fflush(journal->fp) != 0 ||
+		(!no_sync && fsync(fileno(journal->fp)) != 0))
+		elog(ERROR, "Cannot sync merge journal \"%s\": %s",
+			 journal->path, strerror(errno));
+}
+
+/*
+ * Write pending entries to the journal.
+ * Headers of merged files must reach the disk before their entries,
+ * data files were already synced and renamed by merge routines.
+ */
+static void
+merge_journal_flush(MergeJournal *journal, HeaderMap *hdr_map)
+{
+	int			i;
+
+	if (parray_num(journal->pending) == 0)
+		return;
+
+	pthread_lock(&(hdr_map->mutex));
+	if (hdr_map->fp)
+	{
+		if (fflush(hdr_map->fp) != 0 ||
+			(!journal->no_sync && fsync(fileno(hdr_map->fp)) != 0))
+			elog(ERROR, "Cannot sync file \"%s\": %s",
+				 hdr_map->path_tmp, strerror(errno));
+	}
+	pthread_mutex_unlock(&(hdr_map->mutex));
+
+	for (i = 0; i < parray_num(journal->pending); i++)
+	{
+		char	   *line = (char *) parray_get(journal->pending, i);
+
+		if (fputs(line, journal->fp) == EOF)
+			elog(ERROR, "Cannot write merge journal \"%s\": %s",
+				 journal->path, strerror(errno));
+	}
+
+	if (fflush(journal->fp) != 0 ||
+		(!journal->no_sync && fsync(fileno(journal->fp)) != 0))
+		elog(ERROR, "Cannot sync merge journal \"%s\": %s",
+			 journal->path, strerror(errno));
+
+	parray_walk(journal->pending, pg_free);
+	parray_free(journal->pending);
+	journal->pending = parray_new();
+	journal->last_flush = time(NULL);
+}
+
+/*
+ * Record file, merged into FULL backup.
+ */
+static void
+merge_journal_append(MergeJournal *journal, HeaderMap *hdr_map, pgFile *file)
+{
+	char		line[BLCKSZ];
+	int			len;
+
+	len = print_filelist_line(line, file);
+	sprintf(line + len, ",\"uncompressed_size\":\"" INT64_FORMAT "\"}\n",
+			file->uncompressed_size);
+
+	pthread_lock(&journal->lock);
+
+	parray_append(journal->pending, pgut_strdup(line));
+
+	if (parray_num(journal->pending) >= MERGE_JOURNAL_BATCH ||
+		time(NULL) - journal->last_flush >= MERGE_JOURNAL_TIMEOUT)
+		merge_journal_flush(journal, hdr_map);
+
+	pthread_mutex_unlock(&journal->lock);
+}
+
+/*
+ * Close merge journal. Journal file itself is kept until file list
+ * of FULL backup is updated.
+ */
+static void
+merge_journal_close(MergeJournal *journal)
+{
+	if (journal->fp && fclose(journal->fp) != 0)
+		elog(ERROR, "Cannot close merge journal \"%s\": %s",
+			 journal->path, strerror(errno));
+	journal->fp = NULL;
+
+	parray_walk(journal->pending, pg_free);
+	parray_free(journal->pending);
+
+	/* loaded entries are owned by the result file list now */
+	parray_free(journal->files);
+}
+
 /* Recursively delete a directory and its contents */
 static void
 remove_dir_with_files(const char *path)
@@ -1204,6 +1903,8 @@ reorder_external_dirs(pgBackup *to_backup, parray *to_external,
 /* Merge is usually happens as usual backup/restore via temp files, unless
  * file didn`t changed since FULL backup AND full a dest backup have the
  * same compression algorithm. In this case file can be left as it is.
+ * Files, copied completely by intermediate incremental backup and not changed
+ * since, are handled by merge_data_file_as_is().
  */
 void
 merge_data_file(parray *parent_chain, pgBackup *full_backup,
@@ -1217,11 +1918,6 @@ merge_data_file(parray *parent_chain, pgBackup *full_backup,
 	char    to_fullpath_tmp1[MAXPGPATH]; /* used for restore */
 	char    to_fullpath_tmp2[MAXPGPATH]; /* used for backup */
 
-	/* The next possible optimization is copying "as is" the file
-	 * from intermediate incremental backup, that didn`t changed in
-	 * subsequent incremental backups. TODO.
-	 */
-
 	/* set fullpath of destination file and temp files */
 	join_path_components(to_fullpath, full_database_dir, tmp_file->rel_path);
 	snprintf(to_fullpath_tmp1, MAXPGPATH, "%s_tmp1", to_fullpath);
@@ -1293,6 +1989,371 @@ merge_data_file(parray *parent_chain, pgBackup *full_backup,
 	unlink(to_fullpath_tmp1);
 }
 
+/*
+ * Copy "as is" the file from intermediate incremental backup, that didn`t
+ * changed in subsequent incremental backups, if this backup contains every
+ * block of the file, e.g. relation was created after its parent backup.
+ * The file is hardlinked into FULL backup, so the chain stays intact if merge
+ * is interrupted, and its page headers are transplanted into the new map.
+ *
+ * Returns false, if the file must be merged some other way.
+ */
+static bool
+merge_data_file_as_is(parray *parent_chain, pgBackup *full_backup,
+					  pgBackup *dest_backup, pgFile *dest_file, pgFile *tmp_file,
+					  const char *full_database_dir, bool no_sync)
+{
+	int			i;
+	pgFile	   *file = NULL;
+	pgBackup   *backup = NULL;
+	BackupPageHeader2 *headers = NULL;
+	char		from_root[MAXPGPATH];
+	char		from_fullpath[MAXPGPATH];
+	char		to_fullpath[MAXPGPATH];
+	char		to_fullpath_tmp[MAXPGPATH];
+
+	if (dest_file->n_blocks <= 0)
+		return false;
+
+	/* Lookup the newest backup, which copied something from the file */
+	for (i = 0; i < parray_num(parent_chain); i++)
+	{
+		pgFile	  **res_file = NULL;
+
+		backup = (pgBackup *) parray_get(parent_chain, i);
+
+		res_file = parray_bsearch(backup->files, dest_file, pgFileCompareRelPathWithExternal);
+		file = (res_file) ? *res_file : NULL;
+
+		if (file == NULL)
+			return false;
+
+		if (file->write_size != BYTES_INVALID && file->write_size != 0)
+			break;
+
+		file = NULL;
+	}
+
+	/* Unchanged files from FULL backup are handled by in-place merge */
+	if (file == NULL || backup->backup_mode == BACKUP_MODE_FULL)
+		return false;
+
+	if (file->compress_alg != dest_backup->compress_alg ||
+		file->n_headers != dest_file->n_blocks)
+		return false;
+
+	headers = get_data_file_headers(&(backup->hdr_map), file,
+									parse_program_version(backup->program_version),
+									false, backup->large_file);
+	if (!headers)
+		return false;
+
+	/* Every block must be present exactly once and in order */
+	for (i = 0; i < file->n_headers; i++)
+	{
+		if (headers[i].block != i)
+		{
+			pg_free(headers);
+			return false;
+		}
+	}
+
+	join_path_components(from_root, backup->root_dir, DATABASE_DIR);
+	join_path_components(from_fullpath, from_root, file->rel_path);
+	join_path_components(to_fullpath, full_database_dir, tmp_file->rel_path);
+	snprintf(to_fullpath_tmp, MAXPGPATH, "%s_tmp2", to_fullpath);
+
+	/* leftover from previous attempt */
+	if (unlink(to_fullpath_tmp) == -1 && errno != ENOENT)
+		elog(ERROR, "Cannot remove file \"%s\": %s", to_fullpath_tmp,
+			 strerror(errno));
+
+	if (link(from_fullpath, to_fullpath_tmp) == -1)
+	{
+		elog(VERBOSE, "Cannot create hard link \"%s\" to \"%s\": %s, "
+			 "file will be copied", to_fullpath_tmp, from_fullpath, strerror(errno));
+		pg_free(headers);
+		return false;
+	}
+
+	tmp_file->crc = file->crc;
+	tmp_file->write_size = file->write_size;
+	tmp_file->read_size = file->read_size;
+	tmp_file->n_blocks = dest_file->n_blocks;
+	tmp_file->compress_alg = file->compress_alg;
+	tmp_file->uncompressed_size = dest_file->n_blocks * BLCKSZ;
+	tmp_file->n_headers = file->n_headers;
+
+	write_page_headers(headers, tmp_file, &(full_backup->hdr_map), true);
+	pg_free(headers);
+
+	/* backup could be taken with --no-sync */
+	if (!no_sync && fio_sync(to_fullpath_tmp, FIO_BACKUP_HOST) != 0)
+		elog(ERROR, "Cannot sync merge temp file \"%s\": %s",
+			 to_fullpath_tmp, strerror(errno));
+
+	if (rename(to_fullpath_tmp, to_fullpath) == -1)
+		elog(ERROR, "Could not rename file \"%s\" to \"%s\": %s",
+			 to_fullpath_tmp, to_fullpath, strerror(errno));
+
+	elog(VERBOSE, "The file didn`t changed since backup %s, copy it as is: \"%s\"",
+		 base36enc(backup->start_time), file->rel_path);
+
+	return true;
+}
+
+/*
+ * Merge data file by splicing page records: for every block take the record
+ * from the newest backup in chain containing it and copy it into the new file
+ * as it is, without decompression and recompression. Page headers for the new
+ * file are built from headers of the source records.
+ *
+ * Returns false, if nothing was done and the file must be merged the usual way:
+ * some backup stores the file with a compression algorithm other than
+ * the one of destination backup, or page headers are not available.
+ */
+static bool
+merge_data_file_splice(parray *parent_chain, pgBackup *full_backup,
+					   pgBackup *dest_backup, pgFile *dest_file, pgFile *tmp_file,
+					   const char *full_database_dir, bool no_sync)
+{
+	int			i;
+	bool		result = false;
+	int			n_backups = parray_num(parent_chain);
+	BlockNumber	blknum;
+	BlockNumber	nblocks;
+	int			n_headers = 0;
+	off_t		cur_pos_out = 0;
+	char		to_fullpath[MAXPGPATH];
+	char		to_fullpath_tmp[MAXPGPATH];
+	FILE	   *out = NULL;
+	char	   *out_buf = NULL;
+	/* backup seq and header number for every block, -1 if block is missing */
+	int		   *block_backup = NULL;
+	int		   *block_hdr = NULL;
+	BackupPageHeader2 *new_headers = NULL;
+	/* per backup state */
+	pgFile	  **files = (pgFile **) pgut_malloc0(sizeof(pgFile *) * n_backups);
+	BackupPageHeader2 **headers = (BackupPageHeader2 **) pgut_malloc0(sizeof(BackupPageHeader2 *) * n_backups);
+	FILE	  **in = (FILE **) pgut_malloc0(sizeof(FILE *) * n_backups);
+	char	  **in_bufs = (char **) pgut_malloc0(sizeof(char *) * n_backups);
+	off_t	   *cur_pos_in = (off_t *) pgut_malloc0(sizeof(off_t) * n_backups);
+
+	/* bitmap of blocks is built from n_blocks, it must be known */
+	if (dest_file->n_blocks <= 0)
+		goto cleanup;
+
+	nblocks = (BlockNumber) dest_file->n_blocks;
+	block_backup = pgut_malloc(nblocks * sizeof(int));
+	block_hdr = pgut_malloc(nblocks * sizeof(int));
+
+	for (blknum = 0; blknum < nblocks; blknum++)
+		block_backup[blknum] = -1;
+
+	/* Locate the latest record of every block, going from destination to FULL */
+	for (i = 0; i < n_backups; i++)
+	{
+		int			n_hdr;
+		pgFile	  **res_file = NULL;
+		pgFile	   *file = NULL;
+		pgBackup   *backup = (pgBackup *) parray_get(parent_chain, i);
+
+		res_file = parray_bsearch(backup->files, dest_file, pgFileCompareRelPathWithExternal);
+		file = (res_file) ? *res_file : NULL;
+
+		if (file == NULL ||
+			file->write_size == BYTES_INVALID ||
+			file->write_size == 0)
+			continue;
+
+		/* record payload is usable only in the same compression */
+		if (file->compress_alg != dest_backup->compress_alg &&
+			file->compress_alg != NONE_COMPRESS)
+			goto cleanup;
+
+		if (file->n_headers <= 0)
+			goto cleanup;
+
+		headers[i] = get_data_file_headers(&(backup->hdr_map), file,
+										   parse_program_version(backup->program_version),
+										   false, backup->large_file);
+		if (!headers[i])
+			goto cleanup;
+
+		files[i] = file;
+
+		for (n_hdr = 0; n_hdr < file->n_headers; n_hdr++)
+		{
+			BlockNumber hdr_blknum = (BlockNumber) headers[i][n_hdr].block;
+
+			if (hdr_blknum >= nblocks || block_backup[hdr_blknum] >= 0)
+				continue;
+
+			block_backup[hdr_blknum] = i;
+			block_hdr[hdr_blknum] = n_hdr;
+		}
+	}
+
+	/* From this point the file is merged here, so errors are fatal */
+	result = true;
+
+	join_path_components(to_fullpath, full_database_dir, tmp_file->rel_path);
+	snprintf(to_fullpath_tmp, MAXPGPATH, "%s_tmp2", to_fullpath);
+
+	out = fopen(to_fullpath_tmp, PG_BINARY_W);
+	if (out == NULL)
+		elog(ERROR, "Cannot open merge target file \"%s\": %s",
+			 to_fullpath_tmp, strerror(errno));
+
+	out_buf = pgut_malloc(STDIO_BUFSIZE);
+	setvbuf(out, out_buf, _IOFBF, STDIO_BUFSIZE);
+
+	new_headers = (BackupPageHeader2 *) pgut_malloc0((nblocks + 1) * sizeof(BackupPageHeader2));
+
+	tmp_file->write_size = 0;
+	tmp_file->uncompressed_size = 0;
+	INIT_FILE_CRC32(true, tmp_file->crc);
+
+	for (blknum = 0; blknum < nblocks; blknum++)
+	{
+		int			seq = block_backup[blknum];
+		char		record[sizeof(BackupPageHeader) + BLCKSZ];
+		BackupPageHeader *bph = (BackupPageHeader *) record;
+		size_t		record_len;
+
+		if (interrupted || thread_interrupted)
+			elog(ERROR, "Interrupted during merge");
+
+		if (seq < 0)
+		{
+			/* block is missing in the whole chain, store it as zeroed page */
+			MemSet(record, 0, sizeof(record));
+			bph->block = blknum;
+			bph->compressed_size = BLCKSZ;
+			record_len = sizeof(record);
+
+			new_headers[n_headers] = (BackupPageHeader2){
+				.block = blknum,
+				.pos = cur_pos_out,
+			};
+		}
+		else
+		{
+			int			n_hdr = block_hdr[blknum];
+			BackupPageHeader2 *hdr = &headers[seq][n_hdr];
+
+			record_len = headers[seq][n_hdr + 1].pos - hdr->pos;
+
+			if (record_len <= sizeof(BackupPageHeader) || record_len > sizeof(record))
+				elog(ERROR, "Invalid size %zu of block %u record in file \"%s\"",
+					 record_len, blknum, files[seq]->rel_path);
+
+			/* open source file lazily */
+			if (in[seq] == NULL)
+			{
+				char		from_root[MAXPGPATH];
+				char		from_fullpath[MAXPGPATH];
+				pgBackup   *backup = (pgBackup *) parray_get(parent_chain, seq);
+
+				join_path_components(from_root, backup->root_dir, DATABASE_DIR);
+				join_path_components(from_fullpath, from_root, files[seq]->rel_path);
+
+				in[seq] = fopen(from_fullpath, PG_BINARY_R);
+				if (in[seq] == NULL)
+					elog(ERROR, "Cannot open backup file \"%s\": %s", from_fullpath,
+						 strerror(errno));
+
+				in_bufs[seq] = pgut_malloc(STDIO_BUFSIZE);
+				setvbuf(in[seq], in_bufs[seq], _IOFBF, STDIO_BUFSIZE);
+			}
+
+			if (cur_pos_in[seq] != hdr->pos)
+			{
+				if (fseeko(in[seq], hdr->pos, SEEK_SET) != 0)
+					elog(ERROR, "Cannot seek to offset " INT64_FORMAT " of \"%s\": %s",
+						 hdr->pos, files[seq]->rel_path, strerror(errno));
+				cur_pos_in[seq] = hdr->pos;
+			}
+
+			if (fread(record, 1, record_len, in[seq]) != record_len)
+				elog(ERROR, "Cannot read block %u of \"%s\": %s",
+					 blknum, files[seq]->rel_path, strerror(errno));
+
+			cur_pos_in[seq] += record_len;
+
+			if (bph->block != blknum)
+				elog(ERROR, "Block %u record in file \"%s\" has wrong block number %u",
+					 blknum, files[seq]->rel_path, bph->block);
+
+			new_headers[n_headers] = *hdr;
+			new_headers[n_headers].pos = cur_pos_out;
+		}
+
+		COMP_FILE_CRC32(true, tmp_file->crc, record, record_len);
+
+		if (fwrite(record, 1, record_len, out) != record_len)
+			elog(ERROR, "Cannot write block %u of \"%s\": %s",
+				 blknum, to_fullpath_tmp, strerror(errno));
+
+		n_headers++;
+		cur_pos_out += record_len;
+		tmp_file->write_size += record_len;
+		tmp_file->uncompressed_size += BLCKSZ;
+	}
+
+	/* dummy header to get the length of the last record */
+	new_headers[n_headers] = (BackupPageHeader2){.pos = cur_pos_out};
+
+	FIN_FILE_CRC32(true, tmp_file->crc);
+
+	if (fclose(out) != 0)
+		elog(ERROR, "Cannot close file \"%s\": %s",
+			 to_fullpath_tmp, strerror(errno));
+	out = NULL;
+
+	tmp_file->n_blocks = nblocks;
+	tmp_file->read_size = ((int64) nblocks) * BLCKSZ;
+	tmp_file->compress_alg = dest_backup->compress_alg;
+	tmp_file->n_headers = n_headers;
+
+	write_page_headers(new_headers, tmp_file, &(full_backup->hdr_map), true);
+
+	/* sync temp file to disk */
+	if (!no_sync && fio_sync(to_fullpath_tmp, FIO_BACKUP_HOST) != 0)
+		elog(ERROR, "Cannot sync merge temp file \"%s\": %s",
+			 to_fullpath_tmp, strerror(errno));
+
+	/* Do atomic rename from temp file to destination file */
+	if (rename(to_fullpath_tmp, to_fullpath) == -1)
+		elog(ERROR, "Could not rename file \"%s\" to \"%s\": %s",
+			 to_fullpath_tmp, to_fullpath, strerror(errno));
+
+	elog(VERBOSE, "Merged file \"%s\" by copying %i page records",
+		 tmp_file->rel_path, n_headers);
+
+cleanup:
+	for (i = 0; i < n_backups; i++)
+	{
+		if (in[i] && fclose(in[i]) != 0)
+			elog(ERROR, "Cannot close backup file \"%s\": %s",
+				 files[i]->rel_path, strerror(errno));
+		pg_free(in_bufs[i]);
+		pg_free(headers[i]);
+	}
+
+	pg_free(block_backup);
+	pg_free(block_hdr);
+	pg_free(new_headers);
+	pg_free(out_buf);
+	pg_free(files);
+	pg_free(headers);
+	pg_free(in);
+	pg_free(in_bufs);
+	pg_free(cur_pos_in);
+
+	return result;
+}
+
 /*
  * For every destionation file lookup the newest file in chain and
  * copy it.
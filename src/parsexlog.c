@@ -115,8 +115,78 @@ typedef struct XLogReaderData
 	gzFile		 gz_xlogfile;
 	char		 gz_xlogpath[MAXPGPATH];
 #endif
+
+#ifdef HAVE_LIBZSTD
+	/* zstd segment is decompressed into memory as a whole */
+	char		*zst_xlogbuf;
+	char		 zst_xlogpath[MAXPGPATH];
+#endif
+
+	/* segment read from WAL pack is decompressed into memory as a whole */
+	char		*pack_xlogbuf;
+
+	/* segment loaded into memory by WAL read-ahead */
+	char		*prefetch_xlogbuf;
+	/* the segment is opened to finish a record started in previous one */
+	bool		 reading_contrecord;
+
+	/* block references collected by the thread for the pagemap */
+	struct WalBlockRefs *block_refs;
 } XLogReaderData;
 
+/*
+ * WAL summary contains data blocks of the main fork, referenced by WAL
+ * records, which start in a single WAL segment. Blocks are stored as
+ * sorted ranges. Summary is built by archive-push and allows PAGE backup
+ * to collect its pagemap without reading the segment.
+ *
+ * Summary header also serves as a sparse recovery target index: it keeps
+ * the latest timestamp, the range of xids and the last record LSN of the
+ * segment, so validation can skip segments, which cannot contain the
+ * recovery target.
+ */
+#define WAL_SUMMARY_MAGIC	0x4D555357	/* "WSUM" */
+
+/* Segment has records of unknown type, blocks are not summarized */
+#define WAL_SUMMARY_NO_PAGEMAP	0x01
+
+typedef struct WalSummaryHeader
+{
+	uint32		magic;
+	uint32		flags;
+	TimeLineID	tli;
+	XLogSegNo	segno;
+
+	XLogRecPtr	last_rec_lsn;	/* start of the last record */
+	TimestampTz	max_rec_time;	/* latest commit, abort or restore point time */
+	TimestampTz	last_rec_time;	/* time of the last such record */
+	TransactionId min_xid;		/* range of xids of records */
+	TransactionId max_xid;
+	TransactionId last_xid;		/* xid of the last record having one */
+
+	uint32		n_entries;
+	pg_crc32	crc;			/* CRC of header and entries */
+} WalSummaryHeader;
+
+typedef struct WalSummaryEntry
+{
+	RelFileNode	rnode;
+	BlockNumber	blkno;			/* first block of the range */
+	BlockNumber	nblocks;		/* number of blocks in the range */
+} WalSummaryEntry;
+
+/*
+ * Block references collected by a single WAL reader thread. Threads do not
+ * touch the pagemap of backup files, references of all threads are added
+ * to it at once after threads finish.
+ */
+typedef struct WalBlockRefs
+{
+	WalSummaryEntry *refs;
+	uint32		n_refs;
+	uint32		max_refs;
+} WalBlockRefs;
+
 /* Function to process a WAL record */
 typedef void (*xlog_record_function) (XLogReaderState *record,
 									  XLogReaderData *reader_data,
@@ -126,6 +196,7 @@ typedef void (*xlog_record_function) (XLogReaderState *record,
 typedef struct
 {
 	XLogReaderData reader_data;
+	WalBlockRefs block_refs;
 
 	xlog_record_function process_record;
 
@@ -186,6 +257,23 @@ static void extractPageInfo(XLogReaderState *record,
 static void validateXLogRecord(XLogReaderState *record,
 							   XLogReaderData *reader_data, bool *stop_reading);
 static bool getRecordTimestamp(XLogReaderState *record, TimestampTz *recordXtime);
+static bool checkRecordRelUpdate(XLogReaderState *record);
+
+static bool summarize_wal_segment(const char *wal_dir, TimeLineID tli, XLogSegNo segno,
+								  uint32 seg_size, WalSummaryHeader *header,
+								  WalSummaryEntry **entries, uint32 *n_entries);
+static WalSummaryHeader *read_wal_summary(const char *archivedir, TimeLineID tli,
+										  XLogSegNo segno, uint32 seg_size);
+static bool skip_summarized_segments(TimeLineID tli, XLogSegNo endSegNo,
+									 WalBlockRefs *block_refs);
+static uint32 mergeWalSummaryEntries(WalSummaryEntry *entries, uint32 n_entries);
+static void addWalBlockRef(WalBlockRefs *block_refs, RelFileNode rnode,
+						   BlockNumber blkno, BlockNumber nblocks);
+static void applyWalBlockRefs(xlog_thread_arg *thread_args, int n_args);
+static XLogRecPtr seek_recovery_target(const char *archivedir, TimeLineID tli,
+									   uint32 seg_size, XLogRecPtr startpoint,
+									   time_t target_time, TransactionId target_xid,
+									   XLogRecPtr target_lsn, XLogRecTarget *last_rec);
 
 static XLogSegNo segno_start = 0;
 /* Segment number where target record is located */
@@ -197,6 +285,56 @@ static uint32 segnum_read = 0;
 /* Number of detected corrupted or absent segments */
 static uint32 segnum_corrupted = 0;
 static pthread_mutex_t wal_segment_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* If true, segments having WAL summary are not read by threads */
+static bool wal_use_summaries = false;
+/* WAL reader state is static, so summaries are built one at a time */
+static pthread_mutex_t wal_summary_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * WAL read-ahead. While reader threads decode records, a pool of loader
+ * threads loads segments, which are going to be read next, into memory and
+ * decompresses them. Every loader claims the next segment not loaded yet,
+ * so decompression keeps up with any number of readers. A reader thread
+ * takes the buffer when it starts reading the segment. Buffers of segments,
+ * which were read by readers without using the buffer, are dropped.
+ */
+#define WAL_PREFETCH_MAX_SIZE	(256 * 1024 * 1024)
+
+typedef enum WalPrefetchState
+{
+	WAL_PREFETCH_EMPTY,
+	WAL_PREFETCH_LOADING,
+	WAL_PREFETCH_READY
+} WalPrefetchState;
+
+typedef struct WalPrefetchSlot
+{
+	XLogSegNo	segno;
+	char	   *buf;
+	WalPrefetchState state;
+} WalPrefetchSlot;
+
+static WalPrefetchSlot *wal_prefetch_slots = NULL;
+static int wal_prefetch_depth = 0;
+static pthread_t *wal_prefetch_threads = NULL;
+static int wal_prefetch_loaders = 0;
+static bool wal_prefetch_stop = false;
+static TimeLineID wal_prefetch_tli = 0;
+/* Next segment to be claimed by a loader */
+static XLogSegNo wal_prefetch_next = 0;
+static XLogSegNo wal_prefetch_end = 0;
+static pthread_mutex_t wal_prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signaled when a loader is done with a slot */
+static pthread_cond_t wal_prefetch_loaded = PTHREAD_COND_INITIALIZER;
+/* Signaled when a slot is taken or readers move to the next segments */
+static pthread_cond_t wal_prefetch_moved = PTHREAD_COND_INITIALIZER;
+
+static bool start_wal_prefetch(TimeLineID tli, XLogSegNo endSegNo, int n_readers);
+static void stop_wal_prefetch(void);
+static void wake_wal_prefetch(void);
+static void *WalPrefetchWorker(void *arg);
+static char *load_wal_segment(XLogSegNo segno);
+static char *take_prefetched_segment(XLogSegNo segno);
 
 /* copied from timestamp.c */
 static pg_time_t
@@ -214,6 +352,13 @@ timestamptz_to_time_t(TimestampTz t)
 	return result;
 }
 
+/* Wraparound-aware comparison of normal transaction ids */
+static bool
+xid_precedes(TransactionId xid1, TransactionId xid2)
+{
+	return (int32) (xid1 - xid2) < 0;
+}
+
 static const char	   *wal_archivedir = NULL;
 static uint32			wal_seg_size = 0;
 /*
@@ -412,6 +557,8 @@ validate_wal(pgBackup *backup, const char *archivedir,
 	char		last_timestamp[100],
 				target_timestamp[100];
 	bool		all_wal = false;
+	XLogRecPtr	startpoint;
+	TimestampTz	seek_rec_time;
 
 	/* We need free() this later */
 	backup_id = base36enc(backup->start_time);
@@ -487,10 +634,23 @@ validate_wal(pgBackup *backup, const char *archivedir,
 		|| (XRecOffIsValid(target_lsn) && last_rec.rec_lsn >= target_lsn))
 		all_wal = true;
 
-	all_wal = all_wal ||
-		RunXLogThreads(archivedir, target_time, target_xid, target_lsn,
-					   tli, wal_seg_size, backup->stop_lsn,
-					   InvalidXLogRecPtr, true, validateXLogRecord, &last_rec, true);
+	if (!all_wal)
+	{
+		/* Do not read segments, which cannot contain the target */
+		startpoint = seek_recovery_target(archivedir, tli, wal_seg_size,
+										  backup->stop_lsn, target_time,
+										  target_xid, target_lsn, &last_rec);
+		seek_rec_time = last_rec.rec_time;
+
+		all_wal = RunXLogThreads(archivedir, target_time, target_xid, target_lsn,
+								 tli, wal_seg_size, startpoint,
+								 InvalidXLogRecPtr, true, validateXLogRecord,
+								 &last_rec, true);
+
+		/* Threads know timestamps only of records they have read */
+		if (last_rec.rec_time == 0)
+			last_rec.rec_time = seek_rec_time;
+	}
 	if (last_rec.rec_time > 0)
 		time2iso(last_timestamp, lengthof(last_timestamp),
 				 timestamptz_to_time_t(last_rec.rec_time), false);
@@ -946,6 +1106,59 @@ get_gz_error(gzFile gzf)
 }
 #endif
 
+#ifdef HAVE_LIBZSTD
+/*
+ * Read zstd-compressed WAL segment and decompress it into memory.
+ * Returns NULL on error.
+ */
+static char *
+read_zstd_wal_segment(const char *path, uint32 seg_size, int thread_num)
+{
+	FILE	   *fp;
+	struct stat st;
+	char	   *src = NULL;
+	char	   *dst = NULL;
+	size_t		rc;
+
+	fp = fopen(path, PG_BINARY_R);
+	if (fp == NULL || fstat(fileno(fp), &st) < 0)
+	{
+		elog(WARNING, "Thread [%d]: Could not open compressed WAL segment \"%s\": %s",
+			 thread_num, path, strerror(errno));
+		goto error;
+	}
+
+	src = pgut_malloc(st.st_size);
+	if (fread(src, 1, st.st_size, fp) != st.st_size)
+	{
+		elog(WARNING, "Thread [%d]: Could not read from compressed WAL segment \"%s\": %s",
+			 thread_num, path, strerror(errno));
+		goto error;
+	}
+
+	dst = pgut_malloc(seg_size);
+	rc = ZSTD_decompress(dst, seg_size, src, st.st_size);
+	if (ZSTD_isError(rc) || rc != seg_size)
+	{
+		elog(WARNING, "Thread [%d]: Could not decompress WAL segment \"%s\": %s",
+			 thread_num, path,
+			 ZSTD_isError(rc) ? ZSTD_getErrorName(rc) : "unexpected segment size");
+		goto error;
+	}
+
+	pg_free(src);
+	fclose(fp);
+	return dst;
+
+error:
+	pg_free(src);
+	pg_free(dst);
+	if (fp)
+		fclose(fp);
+	return NULL;
+}
+#endif
+
 /* XLogreader callback function, to read a WAL page */
 static int
 SimpleXLogPageRead(XLogReaderState *xlogreader, XLogRecPtr targetPagePtr,
@@ -985,6 +1198,7 @@ SimpleXLogPageRead(XLogReaderState *xlogreader, XLogRecPtr targetPagePtr,
 			xlogreader->currRecPtr < targetPagePtr)
 		{
 			CleanupXLogPageRead(xlogreader);
+			reader_data->reading_contrecord = true;
 
 			/*
 			 * Switch to the next WAL segment after reading contrecord.
@@ -1019,6 +1233,9 @@ SimpleXLogPageRead(XLogReaderState *xlogreader, XLogRecPtr targetPagePtr,
 
 		join_path_components(reader_data->xlogpath, wal_archivedir, xlogfname);
 		snprintf(reader_data->gz_xlogpath, MAXPGPATH, "%s.gz", reader_data->xlogpath);
+#ifdef HAVE_LIBZSTD
+		snprintf(reader_data->zst_xlogpath, MAXPGPATH, "%s.zst", reader_data->xlogpath);
+#endif
 
 		/* We fall back to using .partial segment in case if we are running
 		 * multi-timeline incremental backup right after standby promotion.
@@ -1034,7 +1251,19 @@ SimpleXLogPageRead(XLogReaderState *xlogreader, XLogRecPtr targetPagePtr,
 			snprintf(reader_data->xlogpath, MAXPGPATH, "%s", partial_file);
 		}
 
-		if (fileExists(reader_data->xlogpath, FIO_LOCAL_HOST))
+		/*
+		 * Segment is usually loaded by read-ahead already. Do not
+		 * take it to read a contrecord, it is done by another reader.
+		 */
+		if (!reader_data->reading_contrecord &&
+			(reader_data->prefetch_xlogbuf =
+			 take_prefetched_segment(reader_data->xlogsegno)) != NULL)
+		{
+			elog(LOG, "Thread [%d]: Opening WAL segment \"%s\" loaded by read-ahead",
+				 reader_data->thread_num, xlogfname);
+			reader_data->xlogexists = true;
+		}
+		else if (fileExists(reader_data->xlogpath, FIO_LOCAL_HOST))
 		{
 			elog(LOG, "Thread [%d]: Opening WAL segment \"%s\"",
 				 reader_data->thread_num, reader_data->xlogpath);
@@ -1070,6 +1299,36 @@ SimpleXLogPageRead(XLogReaderState *xlogreader, XLogRecPtr targetPagePtr,
 			}
 		}
 #endif
+#ifdef HAVE_LIBZSTD
+		else if (fileExists(reader_data->zst_xlogpath, FIO_LOCAL_HOST))
+		{
+			elog(LOG, "Thread [%d]: Opening compressed WAL segment \"%s\"",
+				 reader_data->thread_num, reader_data->zst_xlogpath);
+
+			reader_data->zst_xlogbuf = read_zstd_wal_segment(reader_data->zst_xlogpath,
+															 wal_seg_size,
+															 reader_data->thread_num);
+			if (reader_data->zst_xlogbuf == NULL)
+				return -1;
+
+			reader_data->xlogexists = true;
+		}
+#endif
+		/* Try to find WAL segment in pack */
+		else
+		{
+			reader_data->pack_xlogbuf = read_wal_pack_segment(wal_archivedir, xlogfname,
+															  wal_seg_size,
+															  instance_config.wal_pack_size,
+															  FIO_LOCAL_HOST);
+			if (reader_data->pack_xlogbuf != NULL)
+			{
+				elog(LOG, "Thread [%d]: Opening WAL segment \"%s\" from pack",
+					 reader_data->thread_num, xlogfname);
+				reader_data->xlogexists = true;
+			}
+		}
+
 		/* Exit without error if WAL segment doesn't exist */
 		if (!reader_data->xlogexists)
 			return -1;
@@ -1094,7 +1353,11 @@ SimpleXLogPageRead(XLogReaderState *xlogreader, XLogRecPtr targetPagePtr,
 	}
 
 	/* Read the requested page */
-	if (reader_data->xlogfile != -1)
+	if (reader_data->prefetch_xlogbuf != NULL)
+		memcpy(readBuf, reader_data->prefetch_xlogbuf + targetPageOff, XLOG_BLCKSZ);
+	else if (reader_data->pack_xlogbuf != NULL)
+		memcpy(readBuf, reader_data->pack_xlogbuf + targetPageOff, XLOG_BLCKSZ);
+	else if (reader_data->xlogfile != -1)
 	{
 		if (fio_seek(reader_data->xlogfile, (off_t) targetPageOff) < 0)
 		{
@@ -1110,6 +1373,10 @@ SimpleXLogPageRead(XLogReaderState *xlogreader, XLogRecPtr targetPagePtr,
 			return -1;
 		}
 	}
+#ifdef HAVE_LIBZSTD
+	else if (reader_data->zst_xlogbuf != NULL)
+		memcpy(readBuf, reader_data->zst_xlogbuf + targetPageOff, XLOG_BLCKSZ);
+#endif
 #ifdef HAVE_LIBZ
 	else
 	{
@@ -1199,6 +1466,7 @@ RunXLogThreads(const char *archivedir, time_t target_time,
 	int			threads_need = 0;
 	XLogSegNo	endSegNo = 0;
 	bool		result = true;
+	bool		prefetch_started;
 
 	if (!XRecOffIsValid(startpoint) && !XRecOffIsNull(startpoint))
 		elog(ERROR, "Invalid startpoint value %X/%X",
@@ -1237,9 +1505,10 @@ RunXLogThreads(const char *archivedir, time_t target_time,
 	GetXLogSegNo(startpoint, segno_next, segment_size);
 	segnum_read = 0;
 	segnum_corrupted = 0;
+	wal_use_summaries = (process_record == extractPageInfo);
 
 	threads = (pthread_t *) pgut_malloc(sizeof(pthread_t) * num_threads);
-	thread_args = (xlog_thread_arg *) pgut_malloc(sizeof(xlog_thread_arg) * num_threads);
+	thread_args = (xlog_thread_arg *) pgut_malloc0(sizeof(xlog_thread_arg) * num_threads);
 
 	/*
 	 * Initialize thread args.
@@ -1251,10 +1520,23 @@ RunXLogThreads(const char *archivedir, time_t target_time,
 	{
 		xlog_thread_arg *arg = &thread_args[i];
 
+		/* Segments having WAL summary are not read at all */
+		if (wal_use_summaries)
+		{
+			wal_archivedir = archivedir;
+			wal_seg_size = segment_size;
+
+			if (skip_summarized_segments(tli, endSegNo, &arg->block_refs))
+				GetXLogRecPtr(segno_next, 0, segment_size, startpoint);
+			if (endSegNo != 0 && segno_next > endSegNo)
+				break;
+		}
+
 		InitXLogPageRead(&arg->reader_data, archivedir, tli, segment_size, true,
 						 consistent_read, false);
 		arg->reader_data.xlogsegno = segno_next;
 		arg->reader_data.thread_num = i + 1;
+		arg->reader_data.block_refs = &arg->block_refs;
 		arg->process_record = process_record;
 		arg->startpoint = startpoint;
 		arg->endpoint = endpoint;
@@ -1277,6 +1559,8 @@ RunXLogThreads(const char *archivedir, time_t target_time,
 
 	/* Run threads */
 	thread_interrupted = false;
+	prefetch_started = threads_need > 0 &&
+		start_wal_prefetch(tli, endSegNo, threads_need);
 	for (i = 0; i < threads_need; i++)
 	{
 		elog(VERBOSE, "Start WAL reader thread: %d", i + 1);
@@ -1290,6 +1574,8 @@ RunXLogThreads(const char *archivedir, time_t target_time,
 		if (thread_args[i].ret == 1)
 			result = false;
 	}
+	if (prefetch_started)
+		stop_wal_prefetch();
 	thread_interrupted = false;
 
 //  TODO: we must detect difference between actual error (failed to read WAL) and interrupt signal
@@ -1300,6 +1586,10 @@ RunXLogThreads(const char *archivedir, time_t target_time,
 	pfree(threads);
 	threads = NULL;
 
+	/* Add block references, collected by threads, to the pagemap */
+	if (process_record == extractPageInfo)
+		applyWalBlockRefs(thread_args, num_threads);
+
 	if (last_rec)
 	{
 		/*
@@ -1351,6 +1641,278 @@ RunXLogThreads(const char *archivedir, time_t target_time,
 	return result;
 }
 
+/*
+ * Start WAL read-ahead threads for segments up to endSegNo (0 means no
+ * limit). Read-ahead depth is the number of reader threads, but buffers
+ * take no more than WAL_PREFETCH_MAX_SIZE. There is a loader per reader,
+ * but no more than depth, as each loader fills one slot at a time.
+ * Returns false if read-ahead is not used.
+ */
+static bool
+start_wal_prefetch(TimeLineID tli, XLogSegNo endSegNo, int n_readers)
+{
+	int			i;
+
+	wal_prefetch_depth = Min(num_threads, WAL_PREFETCH_MAX_SIZE / wal_seg_size);
+	if (wal_prefetch_depth <= 0)
+		return false;
+
+	wal_prefetch_slots = pgut_malloc0(sizeof(WalPrefetchSlot) * wal_prefetch_depth);
+	wal_prefetch_stop = false;
+	wal_prefetch_tli = tli;
+	wal_prefetch_next = 0;
+	wal_prefetch_end = endSegNo;
+
+	wal_prefetch_loaders = Max(Min(n_readers, wal_prefetch_depth), 1);
+	wal_prefetch_threads = pgut_malloc(sizeof(pthread_t) * wal_prefetch_loaders);
+
+	elog(VERBOSE, "Start %d WAL read-ahead threads, depth: %d segments",
+		 wal_prefetch_loaders, wal_prefetch_depth);
+	for (i = 0; i < wal_prefetch_loaders; i++)
+		pthread_create(&wal_prefetch_threads[i], NULL, WalPrefetchWorker, NULL);
+
+	return true;
+}
+
+/*
+ * Stop WAL read-ahead threads and release buffers nobody has taken.
+ */
+static void
+stop_wal_prefetch(void)
+{
+	int			i;
+
+	pthread_lock(&wal_prefetch_mutex);
+	wal_prefetch_stop = true;
+	pthread_cond_broadcast(&wal_prefetch_moved);
+	pthread_mutex_unlock(&wal_prefetch_mutex);
+
+	for (i = 0; i < wal_prefetch_loaders; i++)
+		pthread_join(wal_prefetch_threads[i], NULL);
+	pg_free(wal_prefetch_threads);
+	wal_prefetch_threads = NULL;
+	wal_prefetch_loaders = 0;
+
+	for (i = 0; i < wal_prefetch_depth; i++)
+		pg_free(wal_prefetch_slots[i].buf);
+	pg_free(wal_prefetch_slots);
+	wal_prefetch_slots = NULL;
+	wal_prefetch_depth = 0;
+}
+
+/*
+ * WAL read-ahead worker. Loaders together keep wal_prefetch_depth segments,
+ * starting with the next segment to be claimed by reader threads, loaded
+ * into memory.
+ */
+static void *
+WalPrefetchWorker(void *arg)
+{
+	pthread_lock(&wal_prefetch_mutex);
+	while (!wal_prefetch_stop && !interrupted && !thread_interrupted)
+	{
+		WalPrefetchSlot *slot = NULL;
+		XLogSegNo	first;
+		char	   *buf;
+		int			i;
+
+		pthread_lock(&wal_segment_mutex);
+		first = segno_next;
+		pthread_mutex_unlock(&wal_segment_mutex);
+
+		/*
+		 * Segment claimed by a reader is taken right after that. If it is
+		 * not taken yet, while other readers moved further, the reader has
+		 * read it by itself.
+		 */
+		for (i = 0; i < wal_prefetch_depth; i++)
+		{
+			if (wal_prefetch_slots[i].state == WAL_PREFETCH_READY &&
+				wal_prefetch_slots[i].segno + num_threads < first)
+			{
+				pg_free(wal_prefetch_slots[i].buf);
+				wal_prefetch_slots[i].buf = NULL;
+				wal_prefetch_slots[i].state = WAL_PREFETCH_EMPTY;
+			}
+		}
+
+		if (wal_prefetch_next < first)
+			wal_prefetch_next = first;
+
+		if (wal_prefetch_next < first + wal_prefetch_depth &&
+			(wal_prefetch_end == 0 || wal_prefetch_next <= wal_prefetch_end))
+		{
+			for (i = 0; i < wal_prefetch_depth; i++)
+			{
+				if (wal_prefetch_slots[i].state == WAL_PREFETCH_EMPTY)
+				{
+					slot = &wal_prefetch_slots[i];
+					slot->segno = wal_prefetch_next++;
+					slot->state = WAL_PREFETCH_LOADING;
+					break;
+				}
+			}
+		}
+
+		/* Read-ahead window is full, wait for readers to move it */
+		if (slot == NULL)
+		{
+			pthread_cond_wait(&wal_prefetch_moved, &wal_prefetch_mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&wal_prefetch_mutex);
+
+		buf = load_wal_segment(slot->segno);
+
+		pthread_lock(&wal_prefetch_mutex);
+		slot->buf = buf;
+		slot->state = (buf != NULL) ? WAL_PREFETCH_READY : WAL_PREFETCH_EMPTY;
+		pthread_cond_broadcast(&wal_prefetch_loaded);
+	}
+	pthread_mutex_unlock(&wal_prefetch_mutex);
+
+	return NULL;
+}
+
+/*
+ * Wake up read-ahead threads waiting for readers to move to the next
+ * segments. Segment mutex must not be held, see WalPrefetchWorker().
+ */
+static void
+wake_wal_prefetch(void)
+{
+	if (wal_prefetch_slots == NULL)
+		return;
+
+	pthread_lock(&wal_prefetch_mutex);
+	pthread_cond_broadcast(&wal_prefetch_moved);
+	pthread_mutex_unlock(&wal_prefetch_mutex);
+}
+
+/*
+ * Load WAL segment from the archive into memory. Segments having WAL
+ * summary are not loaded if summaries are used, as readers skip them.
+ * Returns NULL if the segment is not loaded, reader thread will try to
+ * read the segment by itself and report the problem.
+ */
+static char *
+load_wal_segment(XLogSegNo segno)
+{
+	char		xlogfname[MAXFNAMELEN];
+	char		path[MAXPGPATH];
+	char		gz_path[MAXPGPATH];
+	char		zst_path[MAXPGPATH];
+	char	   *buf = NULL;
+
+	GetXLogFileName(xlogfname, wal_prefetch_tli, segno, wal_seg_size);
+	join_path_components(path, wal_archivedir, xlogfname);
+	snprintf(gz_path, MAXPGPATH, "%s.gz", path);
+	snprintf(zst_path, MAXPGPATH, "%s.zst", path);
+
+	if (wal_use_summaries)
+	{
+		char		summary_path[MAXPGPATH];
+
+		snprintf(summary_path, MAXPGPATH, "%s.summary", path);
+		if (fileExists(summary_path, FIO_LOCAL_HOST))
+			return NULL;
+	}
+
+	if (fileExists(path, FIO_LOCAL_HOST))
+	{
+		int			fd = fio_open(path, O_RDONLY | PG_BINARY, FIO_LOCAL_HOST);
+
+		if (fd < 0)
+			return NULL;
+
+		buf = pgut_malloc(wal_seg_size);
+		if (fio_read(fd, buf, wal_seg_size) != wal_seg_size)
+		{
+			pg_free(buf);
+			buf = NULL;
+		}
+		fio_close(fd);
+	}
+#ifdef HAVE_LIBZ
+	else if (fileExists(gz_path, FIO_LOCAL_HOST))
+	{
+		gzFile		gz = fio_gzopen(gz_path, "rb", -1, FIO_LOCAL_HOST);
+
+		if (gz == NULL)
+			return NULL;
+
+		buf = pgut_malloc(wal_seg_size);
+		if (fio_gzread(gz, buf, wal_seg_size) != wal_seg_size)
+		{
+			pg_free(buf);
+			buf = NULL;
+		}
+		fio_gzclose(gz);
+	}
+#endif
+#ifdef HAVE_LIBZSTD
+	else if (fileExists(zst_path, FIO_LOCAL_HOST))
+		buf = read_zstd_wal_segment(zst_path, wal_seg_size, 0);
+#endif
+	else
+		buf = read_wal_pack_segment(wal_archivedir, xlogfname, wal_seg_size,
+									instance_config.wal_pack_size, FIO_LOCAL_HOST);
+
+	if (buf != NULL)
+		elog(VERBOSE, "WAL segment \"%s\" is loaded by read-ahead", xlogfname);
+
+	return buf;
+}
+
+/*
+ * Take buffer of WAL segment loaded by read-ahead threads. Waits for the
+ * segment being loaded. Returns NULL if read-ahead has no such segment.
+ */
+static char *
+take_prefetched_segment(XLogSegNo segno)
+{
+	char	   *buf = NULL;
+
+	if (wal_prefetch_slots == NULL)
+		return NULL;
+
+	pthread_lock(&wal_prefetch_mutex);
+	for (;;)
+	{
+		bool		loading = false;
+		int			i;
+
+		for (i = 0; i < wal_prefetch_depth; i++)
+		{
+			WalPrefetchSlot *slot = &wal_prefetch_slots[i];
+
+			if (slot->segno != segno)
+				continue;
+
+			if (slot->state == WAL_PREFETCH_READY)
+			{
+				buf = slot->buf;
+				slot->buf = NULL;
+				slot->state = WAL_PREFETCH_EMPTY;
+				break;
+			}
+			else if (slot->state == WAL_PREFETCH_LOADING)
+				loading = true;
+		}
+
+		if (buf != NULL || !loading || interrupted || thread_interrupted)
+			break;
+
+		pthread_cond_wait(&wal_prefetch_loaded, &wal_prefetch_mutex);
+	}
+
+	/* slot is free now, or the reader has moved past the segment */
+	pthread_cond_broadcast(&wal_prefetch_moved);
+	pthread_mutex_unlock(&wal_prefetch_mutex);
+
+	return buf;
+}
+
 /*
  * WAL reader worker.
  */
@@ -1581,11 +2143,16 @@ SwitchThreadToNextWal(XLogReaderState *xlogreader, xlog_thread_arg *arg)
 	/* Critical section */
 	pthread_lock(&wal_segment_mutex);
 	Assert(segno_next);
+	if (wal_use_summaries)
+		skip_summarized_segments(reader_data->tli, arg->endSegNo,
+								 &arg->block_refs);
 	reader_data->xlogsegno = segno_next;
 	segnum_read++;
 	segno_next++;
 	pthread_mutex_unlock(&wal_segment_mutex);
 
+	wake_wal_prefetch();
+
 	/* We've reached the end */
 	if (arg->endSegNo != 0 && reader_data->xlogsegno > arg->endSegNo)
 		return false;
@@ -1708,7 +2275,17 @@ CleanupXLogPageRead(XLogReaderState *xlogreader)
 	XLogReaderData *reader_data;
 
 	reader_data = (XLogReaderData *) xlogreader->private_data;
-	if (reader_data->xlogfile >= 0)
+	if (reader_data->prefetch_xlogbuf != NULL)
+	{
+		pg_free(reader_data->prefetch_xlogbuf);
+		reader_data->prefetch_xlogbuf = NULL;
+	}
+	else if (reader_data->pack_xlogbuf != NULL)
+	{
+		pg_free(reader_data->pack_xlogbuf);
+		reader_data->pack_xlogbuf = NULL;
+	}
+	else if (reader_data->xlogfile >= 0)
 	{
 		fio_close(reader_data->xlogfile);
 		reader_data->xlogfile = -1;
@@ -1719,9 +2296,17 @@ CleanupXLogPageRead(XLogReaderState *xlogreader)
 		fio_gzclose(reader_data->gz_xlogfile);
 		reader_data->gz_xlogfile = NULL;
 	}
+#endif
+#ifdef HAVE_LIBZSTD
+	else if (reader_data->zst_xlogbuf != NULL)
+	{
+		pg_free(reader_data->zst_xlogbuf);
+		reader_data->zst_xlogbuf = NULL;
+	}
 #endif
 	reader_data->prev_page_off = 0;
 	reader_data->xlogexists = false;
+	reader_data->reading_contrecord = false;
 }
 
 static void
@@ -1736,6 +2321,14 @@ PrintXLogCorruptionMsg(XLogReaderData *reader_data, int elevel)
 		if (!reader_data->xlogexists)
 			elog(elevel, "Thread [%d]: WAL segment \"%s\" is absent",
 				 reader_data->thread_num, reader_data->xlogpath);
+		else if (reader_data->pack_xlogbuf != NULL)
+			elog(elevel, "Thread [%d]: Possible WAL corruption. "
+						 "Error has occured during reading packed WAL segment \"%s\"",
+				 reader_data->thread_num, reader_data->xlogpath);
+		else if (reader_data->prefetch_xlogbuf != NULL)
+			elog(elevel, "Thread [%d]: Possible WAL corruption. "
+						 "Error has occured during reading WAL segment \"%s\"",
+				 reader_data->thread_num, reader_data->xlogpath);
 		else if (reader_data->xlogfile != -1)
 			elog(elevel, "Thread [%d]: Possible WAL corruption. "
 						 "Error has occured during reading WAL segment \"%s\"",
@@ -1745,6 +2338,12 @@ PrintXLogCorruptionMsg(XLogReaderData *reader_data, int elevel)
 			elog(elevel, "Thread [%d]: Possible WAL corruption. "
 						 "Error has occured during reading WAL segment \"%s\"",
 				 reader_data->thread_num, reader_data->gz_xlogpath);
+#endif
+#ifdef HAVE_LIBZSTD
+		else if (reader_data->zst_xlogbuf != NULL)
+			elog(elevel, "Thread [%d]: Possible WAL corruption. "
+						 "Error has occured during reading WAL segment \"%s\"",
+				 reader_data->thread_num, reader_data->zst_xlogpath);
 #endif
 	}
 	else
@@ -1763,6 +2362,119 @@ extractPageInfo(XLogReaderState *record, XLogReaderData *reader_data,
 				bool *stop_reading)
 {
 	uint8		block_id;
+
+	if (!checkRecordRelUpdate(record))
+	{
+		/*
+		 * This record type modifies a relation file in some special way, but
+		 * we don't recognize the type. That's bad - we don't know how to
+		 * track that change.
+		 */
+		elog(ERROR, "WAL record modifies a relation, but record type is not recognized\n"
+			 "lsn: %X/%X, rmgr: %s, info: %02X",
+		  (uint32) (record->ReadRecPtr >> 32), (uint32) (record->ReadRecPtr),
+				 RmgrNames[XLogRecGetRmid(record)], XLogRecGetInfo(record));
+	}
+
+	for (block_id = 0; block_id <= record->max_block_id; block_id++)
+	{
+		RelFileNode rnode;
+		ForkNumber	forknum;
+		BlockNumber blkno;
+
+		if (!XLogRecGetBlockTag(record, block_id, &rnode, &forknum, &blkno))
+			continue;
+
+		/* We only care about the main fork; others are copied as is */
+		if (forknum != MAIN_FORKNUM)
+			continue;
+
+		addWalBlockRef(reader_data->block_refs, rnode, blkno, 1);
+	}
+}
+
+/*
+ * Remember block range referenced by WAL. When the array is full, it is
+ * compacted first, as WAL references the same blocks many times.
+ */
+static void
+addWalBlockRef(WalBlockRefs *block_refs, RelFileNode rnode, BlockNumber blkno,
+			   BlockNumber nblocks)
+{
+	WalSummaryEntry *ref;
+
+	if (block_refs->n_refs == block_refs->max_refs)
+	{
+		block_refs->n_refs = mergeWalSummaryEntries(block_refs->refs,
+													block_refs->n_refs);
+
+		/* Grow, if array is not allocated yet or compaction did not free enough space */
+		if (block_refs->max_refs == 0 ||
+			block_refs->n_refs > block_refs->max_refs / 2)
+		{
+			block_refs->max_refs = (block_refs->max_refs == 0) ? 1024 :
+				block_refs->max_refs * 2;
+			block_refs->refs = pgut_realloc(block_refs->refs,
+								sizeof(WalSummaryEntry) * block_refs->max_refs);
+		}
+	}
+
+	ref = &block_refs->refs[block_refs->n_refs++];
+	ref->rnode = rnode;
+	ref->blkno = blkno;
+	ref->nblocks = nblocks;
+}
+
+/*
+ * Add block references collected by WAL reader threads to the pagemap of
+ * backup files. Each range is looked up in the file list only once.
+ */
+static void
+applyWalBlockRefs(xlog_thread_arg *thread_args, int n_args)
+{
+	WalSummaryEntry *refs;
+	uint32		n_refs = 0;
+	uint32		i;
+	int			j;
+
+	for (j = 0; j < n_args; j++)
+		n_refs += thread_args[j].block_refs.n_refs;
+
+	refs = pgut_malloc(sizeof(WalSummaryEntry) * Max(n_refs, 1));
+
+	n_refs = 0;
+	for (j = 0; j < n_args; j++)
+	{
+		WalBlockRefs *block_refs = &thread_args[j].block_refs;
+
+		if (block_refs->n_refs > 0)
+			memcpy(refs + n_refs, block_refs->refs,
+				   sizeof(WalSummaryEntry) * block_refs->n_refs);
+		n_refs += block_refs->n_refs;
+
+		pg_free(block_refs->refs);
+		block_refs->refs = NULL;
+		block_refs->n_refs = block_refs->max_refs = 0;
+	}
+
+	n_refs = mergeWalSummaryEntries(refs, n_refs);
+
+	for (i = 0; i < n_refs; i++)
+		process_block_change(MAIN_FORKNUM, refs[i].rnode, refs[i].blkno,
+							 refs[i].nblocks);
+
+	pg_free(refs);
+}
+
+/*
+ * Check that all changes of relation files, made by the record, are
+ * described by its block references or are of the kind, that backup
+ * detects by itself. Returns false, if record modifies relation in some
+ * special way we don't recognize.
+ */
+static bool
+checkRecordRelUpdate(XLogReaderState *record)
+{
 	RmgrId		rmid = XLogRecGetRmid(record);
 	uint8		info = XLogRecGetInfo(record);
 	uint8		rminfo = info & ~XLR_INFO_MASK;
@@ -1811,33 +2523,517 @@ extractPageInfo(XLogReaderState *record, XLogReaderData *reader_data,
 		 */
 	}
 	else if (info & XLR_SPECIAL_REL_UPDATE)
+		return false;
+
+	return true;
+}
+
+/*
+ * Comparison function to sort WAL summary entries by relation and block.
+ */
+static int
+walSummaryEntryCompare(const void *a1, const void *a2)
+{
+	const WalSummaryEntry *e1 = (const WalSummaryEntry *) a1;
+	const WalSummaryEntry *e2 = (const WalSummaryEntry *) a2;
+
+	if (e1->rnode.spcNode != e2->rnode.spcNode)
+		return e1->rnode.spcNode < e2->rnode.spcNode ? -1 : 1;
+	if (e1->rnode.dbNode != e2->rnode.dbNode)
+		return e1->rnode.dbNode < e2->rnode.dbNode ? -1 : 1;
+	if (e1->rnode.relNode != e2->rnode.relNode)
+		return e1->rnode.relNode < e2->rnode.relNode ? -1 : 1;
+	if (e1->blkno != e2->blkno)
+		return e1->blkno < e2->blkno ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Sort block ranges and merge overlapping and adjacent ones.
+ * Returns the number of ranges left.
+ */
+static uint32
+mergeWalSummaryEntries(WalSummaryEntry *entries, uint32 n_entries)
+{
+	uint32		n_ranges;
+	uint32		i;
+
+	if (n_entries == 0)
+		return 0;
+
+	qsort(entries, n_entries, sizeof(WalSummaryEntry), walSummaryEntryCompare);
+
+	for (i = 1, n_ranges = 1; i < n_entries; i++)
 	{
-		/*
-		 * This record type modifies a relation file in some special way, but
-		 * we don't recognize the type. That's bad - we don't know how to
-		 * track that change.
-		 */
-		elog(ERROR, "WAL record modifies a relation, but record type is not recognized\n"
-			 "lsn: %X/%X, rmgr: %s, info: %02X",
-		  (uint32) (record->ReadRecPtr >> 32), (uint32) (record->ReadRecPtr),
-				 RmgrNames[rmid], info);
+		WalSummaryEntry *range = &entries[n_ranges - 1];
+
+		if (RelFileNodeEquals(range->rnode, entries[i].rnode) &&
+			entries[i].blkno <= range->blkno + range->nblocks)
+		{
+			if (entries[i].blkno + entries[i].nblocks > range->blkno + range->nblocks)
+				range->nblocks = entries[i].blkno + entries[i].nblocks - range->blkno;
+		}
+		else
+			entries[n_ranges++] = entries[i];
 	}
 
-	for (block_id = 0; block_id <= record->max_block_id; block_id++)
+	return n_ranges;
+}
+
+/*
+ * Collect block references of main fork from WAL records, which start in
+ * the segment 'segno', located in 'wal_dir'. Record, which continues into
+ * the next segment, is read from it as well.
+ * Recovery target index is collected into 'header'. If the segment contains
+ * a record, which changes are not described by block references, only the
+ * index is collected and WAL_SUMMARY_NO_PAGEMAP flag is set.
+ * Returns false if segment cannot be read completely.
+ */
+static bool
+summarize_wal_segment(const char *wal_dir, TimeLineID tli, XLogSegNo segno,
+					  uint32 seg_size, WalSummaryHeader *header,
+					  WalSummaryEntry **entries, uint32 *n_entries)
+{
+	XLogReaderState *xlogreader;
+	XLogReaderData	reader_data;
+	XLogRecPtr		startpoint;
+	XLogRecPtr		endpoint;
+	uint32			max_entries = 1024;
+	bool			result = false;
+
+	*entries = pgut_malloc(sizeof(WalSummaryEntry) * max_entries);
+	*n_entries = 0;
+
+	header->flags = 0;
+	header->last_rec_lsn = InvalidXLogRecPtr;
+	header->max_rec_time = 0;
+	header->last_rec_time = 0;
+	header->min_xid = InvalidTransactionId;
+	header->max_xid = InvalidTransactionId;
+	header->last_xid = InvalidTransactionId;
+
+	GetXLogRecPtr(segno, 0, seg_size, startpoint);
+	GetXLogRecPtr(segno + 1, 0, seg_size, endpoint);
+
+	pthread_lock(&wal_summary_mutex);
+
+	xlogreader = InitXLogPageRead(&reader_data, wal_dir, tli, seg_size,
+								  false, false, true);
+
+#if PG_VERSION_NUM >= 130000
+	if (XLogRecPtrIsInvalid(startpoint))
+		startpoint = SizeOfXLogShortPHD;
+	XLogBeginRead(xlogreader, startpoint);
+#endif
+
+	startpoint = XLogFindNextRecord(xlogreader, startpoint);
+	if (XLogRecPtrIsInvalid(startpoint))
+		goto cleanup;
+
+	/* Segment is occupied by a single record, started in previous segment */
+	if (startpoint >= endpoint)
 	{
-		RelFileNode rnode;
-		ForkNumber	forknum;
-		BlockNumber blkno;
+		result = true;
+		goto cleanup;
+	}
 
-		if (!XLogRecGetBlockTag(record, block_id, &rnode, &forknum, &blkno))
-			continue;
+	while (true)
+	{
+		XLogRecord *record;
+		char	   *errormsg;
+		uint8		block_id;
+		TimestampTz	rec_time;
+		TransactionId rec_xid;
 
-		/* We only care about the main fork; others are copied as is */
-		if (forknum != MAIN_FORKNUM)
+		if (interrupted || thread_interrupted)
+			goto cleanup;
+
+		record = WalReadRecord(xlogreader, startpoint, &errormsg);
+		if (record == NULL)
+		{
+			elog(LOG, "Could not read WAL record at %X/%X: %s",
+				 (uint32) (xlogreader->EndRecPtr >> 32), (uint32) (xlogreader->EndRecPtr),
+				 errormsg ? errormsg : "unexpected end of WAL");
+			goto cleanup;
+		}
+		startpoint = InvalidXLogRecPtr;
+
+		/* Records, which start in the next segment, are not summarized */
+		if (xlogreader->ReadRecPtr >= endpoint)
+			break;
+
+		/* Recovery target index */
+		header->last_rec_lsn = xlogreader->ReadRecPtr;
+		if (getRecordTimestamp(xlogreader, &rec_time))
+		{
+			header->last_rec_time = rec_time;
+			if (rec_time > header->max_rec_time)
+				header->max_rec_time = rec_time;
+		}
+		rec_xid = XLogRecGetXid(xlogreader);
+		if (TransactionIdIsValid(rec_xid))
+		{
+			if (!TransactionIdIsValid(header->min_xid) ||
+				xid_precedes(rec_xid, header->min_xid))
+				header->min_xid = rec_xid;
+			if (!TransactionIdIsValid(header->max_xid) ||
+				xid_precedes(header->max_xid, rec_xid))
+				header->max_xid = rec_xid;
+			header->last_xid = rec_xid;
+		}
+
+		if (!(header->flags & WAL_SUMMARY_NO_PAGEMAP) &&
+			!checkRecordRelUpdate(xlogreader))
+		{
+			elog(LOG, "WAL record at %X/%X modifies a relation, but record type is not recognized",
+				 (uint32) (xlogreader->ReadRecPtr >> 32), (uint32) (xlogreader->ReadRecPtr));
+			header->flags |= WAL_SUMMARY_NO_PAGEMAP;
+			*n_entries = 0;
+		}
+
+		if (header->flags & WAL_SUMMARY_NO_PAGEMAP)
+		{
+			if (xlogreader->EndRecPtr >= endpoint)
+				break;
 			continue;
+		}
+
+		for (block_id = 0; block_id <= xlogreader->max_block_id; block_id++)
+		{
+			WalSummaryEntry *entry;
+			ForkNumber	forknum;
+
+			if (*n_entries == max_entries)
+			{
+				max_entries *= 2;
+				*entries = pgut_realloc(*entries, sizeof(WalSummaryEntry) * max_entries);
+			}
+
+			entry = &(*entries)[*n_entries];
+			if (!XLogRecGetBlockTag(xlogreader, block_id, &entry->rnode,
+									&forknum, &entry->blkno))
+				continue;
+
+			/* We only care about the main fork; others are copied as is */
+			if (forknum != MAIN_FORKNUM)
+				continue;
+
+			entry->nblocks = 1;
+			(*n_entries)++;
+		}
+
+		if (xlogreader->EndRecPtr >= endpoint)
+			break;
+	}
+
+	result = true;
+
+cleanup:
+	CleanupXLogPageRead(xlogreader);
+	XLogReaderFree(xlogreader);
+	pthread_mutex_unlock(&wal_summary_mutex);
+
+	return result;
+}
+
+/*
+ * Build WAL summary of the segment 'segno' located in 'wal_dir' and put
+ * it into WAL archive 'archive_dir'.
+ * Returns false if summary cannot be built. It is not an error, because
+ * PAGE backup reads the segment itself, if there is no summary for it.
+ */
+bool
+build_wal_summary(const char *wal_dir, const char *archive_dir, TimeLineID tli,
+				  XLogSegNo segno, uint32 seg_size, bool no_sync)
+{
+	char		wal_name[MAXFNAMELEN];
+	char		summary_name[MAXFNAMELEN];
+	char		wal_path[MAXPGPATH];
+	char		summary_path[MAXPGPATH];
+	char		summary_part_path[MAXPGPATH];
+	WalSummaryEntry *entries;
+	WalSummaryHeader header;
+	pg_crc32	crc;
+	uint32		n_entries;
+	uint32		n_ranges;
+	int			out;
+	bool		result = false;
+
+	GetXLogFileName(wal_name, tli, segno, seg_size);
+	snprintf(summary_name, sizeof(summary_name), "%s.summary", wal_name);
+	join_path_components(wal_path, wal_dir, wal_name);
+	join_path_components(summary_path, archive_dir, summary_name);
+	snprintf(summary_part_path, sizeof(summary_part_path), "%s.part", summary_path);
+
+	/* Summary could be built by previous run */
+	if (fileExists(summary_path, FIO_BACKUP_HOST))
+		return true;
+
+	/* Segment is already removed or recycled */
+	if (!fileExists(wal_path, FIO_LOCAL_HOST))
+		return false;
+
+	memset(&header, 0, sizeof(header));
+	if (!summarize_wal_segment(wal_dir, tli, segno, seg_size, &header,
+							   &entries, &n_entries))
+	{
+		elog(LOG, "Cannot build summary of WAL segment \"%s\"", wal_name);
+		pg_free(entries);
+		return false;
+	}
+
+	/* Merge block references into ranges */
+	n_ranges = mergeWalSummaryEntries(entries, n_entries);
+
+	header.magic = WAL_SUMMARY_MAGIC;
+	header.tli = tli;
+	header.segno = segno;
+	header.n_entries = n_ranges;
+	header.crc = 0;
+	INIT_FILE_CRC32(true, crc);
+	COMP_FILE_CRC32(true, crc, &header, sizeof(header));
+	COMP_FILE_CRC32(true, crc, entries, sizeof(WalSummaryEntry) * n_ranges);
+	FIN_FILE_CRC32(true, crc);
+	header.crc = crc;
+
+	out = fio_open(summary_part_path, O_RDWR | O_CREAT | O_TRUNC | PG_BINARY,
+				   FIO_BACKUP_HOST);
+	if (out < 0)
+	{
+		elog(WARNING, "Cannot open WAL summary file \"%s\": %s",
+			 summary_part_path, strerror(errno));
+		goto cleanup;
+	}
+
+	if (fio_write(out, &header, sizeof(header)) != sizeof(header) ||
+		(n_ranges > 0 &&
+		 fio_write(out, entries, sizeof(WalSummaryEntry) * n_ranges) !=
+			sizeof(WalSummaryEntry) * n_ranges))
+	{
+		elog(WARNING, "Cannot write WAL summary file \"%s\": %s",
+			 summary_part_path, strerror(errno));
+		fio_close(out);
+		fio_unlink(summary_part_path, FIO_BACKUP_HOST);
+		goto cleanup;
+	}
+
+	if (fio_close(out) != 0 ||
+		(!no_sync && fio_sync(summary_part_path, FIO_BACKUP_HOST) != 0) ||
+		fio_rename(summary_part_path, summary_path, FIO_BACKUP_HOST) < 0)
+	{
+		elog(WARNING, "Cannot save WAL summary file \"%s\": %s",
+			 summary_path, strerror(errno));
+		fio_unlink(summary_part_path, FIO_BACKUP_HOST);
+		goto cleanup;
+	}
+
+	if (header.flags & WAL_SUMMARY_NO_PAGEMAP)
+		elog(LOG, "Built summary of WAL segment \"%s\" without block ranges",
+			 wal_name);
+	else
+		elog(LOG, "Built summary of WAL segment \"%s\": %u block ranges",
+			 wal_name, n_ranges);
+	result = true;
+
+cleanup:
+	pg_free(entries);
+	return result;
+}
+
+/*
+ * Read WAL summary of the segment 'segno' from WAL archive.
+ * Entries follow the returned header in the same buffer.
+ * Returns NULL if there is no summary or it is corrupted.
+ */
+static WalSummaryHeader *
+read_wal_summary(const char *archivedir, TimeLineID tli, XLogSegNo segno,
+				 uint32 seg_size)
+{
+	char		wal_name[MAXFNAMELEN];
+	char		summary_name[MAXFNAMELEN];
+	char	   *buf;
+	size_t		size;
+	WalSummaryHeader *header;
+	WalSummaryEntry *entries;
+	pg_crc32	crc;
+	pg_crc32	stored_crc;
+
+	GetXLogFileName(wal_name, tli, segno, seg_size);
+	snprintf(summary_name, sizeof(summary_name), "%s.summary", wal_name);
+
+	buf = slurpFile(archivedir, summary_name, &size, true, FIO_BACKUP_HOST);
+	if (buf == NULL)
+		return NULL;
+
+	header = (WalSummaryHeader *) buf;
+	entries = (WalSummaryEntry *) (buf + sizeof(WalSummaryHeader));
+
+	if (size < sizeof(WalSummaryHeader) ||
+		header->magic != WAL_SUMMARY_MAGIC ||
+		header->tli != tli || header->segno != segno ||
+		size != sizeof(WalSummaryHeader) + sizeof(WalSummaryEntry) * header->n_entries)
+	{
+		elog(WARNING, "WAL summary file \"%s\" is corrupted", summary_name);
+		pg_free(buf);
+		return NULL;
+	}
+
+	stored_crc = header->crc;
+	header->crc = 0;
+	INIT_FILE_CRC32(true, crc);
+	COMP_FILE_CRC32(true, crc, header, sizeof(WalSummaryHeader));
+	COMP_FILE_CRC32(true, crc, entries, sizeof(WalSummaryEntry) * header->n_entries);
+	FIN_FILE_CRC32(true, crc);
+	header->crc = stored_crc;
+
+	if (crc != stored_crc)
+	{
+		elog(WARNING, "WAL summary file \"%s\" has wrong checksum", summary_name);
+		pg_free(buf);
+		return NULL;
+	}
+
+	return header;
+}
+
+/*
+ * Add blocks from WAL summaries of segments, starting with segno_next,
+ * to block_refs, and advance segno_next past them. Stops at the first
+ * segment without summary or after endSegNo.
+ * Must be called with wal_segment_mutex held or before threads are started.
+ * Returns true if at least one segment was skipped.
+ */
+static bool
+skip_summarized_segments(TimeLineID tli, XLogSegNo endSegNo,
+						 WalBlockRefs *block_refs)
+{
+	bool		skipped = false;
+
+	while (endSegNo == 0 || segno_next <= endSegNo)
+	{
+		WalSummaryHeader *header;
+		WalSummaryEntry *entries;
+		char		wal_name[MAXFNAMELEN];
+		uint32		i;
+
+		header = read_wal_summary(wal_archivedir, tli, segno_next, wal_seg_size);
+		if (header == NULL)
+			break;
+		if (header->flags & WAL_SUMMARY_NO_PAGEMAP)
+		{
+			pg_free(header);
+			break;
+		}
 
-		process_block_change(forknum, rnode, blkno);
+		entries = (WalSummaryEntry *) (header + 1);
+		for (i = 0; i < header->n_entries; i++)
+			addWalBlockRef(block_refs, entries[i].rnode, entries[i].blkno,
+						   entries[i].nblocks);
+		pg_free(header);
+
+		GetXLogFileName(wal_name, tli, segno_next, wal_seg_size);
+		elog(VERBOSE, "Use summary of WAL segment \"%s\"", wal_name);
+
+		segno_next++;
+		segnum_read++;
+		skipped = true;
 	}
+
+	return skipped;
+}
+
+/*
+ * Check that WAL segment 'segno' exists in WAL archive in any form.
+ */
+static bool
+wal_segment_archived(const char *archivedir, TimeLineID tli, XLogSegNo segno,
+					 uint32 seg_size)
+{
+	char		wal_name[MAXFNAMELEN];
+	char		path[MAXPGPATH];
+
+	GetXLogFileName(wal_name, tli, segno, seg_size);
+	join_path_components(path, archivedir, wal_name);
+
+	if (fileExists(path, FIO_LOCAL_HOST))
+		return true;
+#ifdef HAVE_LIBZ
+	snprintf(path, MAXPGPATH, "%s/%s.gz", archivedir, wal_name);
+	if (fileExists(path, FIO_LOCAL_HOST))
+		return true;
+#endif
+#ifdef HAVE_LIBZSTD
+	snprintf(path, MAXPGPATH, "%s/%s.zst", archivedir, wal_name);
+	if (fileExists(path, FIO_LOCAL_HOST))
+		return true;
+#endif
+	return get_wal_pack_path(path, archivedir, wal_name, seg_size,
+							 instance_config.wal_pack_size, FIO_LOCAL_HOST);
+}
+
+/*
+ * Use WAL summaries as a recovery target index: skip segments, starting
+ * with the one containing 'startpoint', which cannot contain the recovery
+ * target. Skipped segments must be present in the archive, but they are
+ * not read. 'last_rec' is advanced up to the last record of skipped segments.
+ * Returns the position to start reading WAL from.
+ */
+static XLogRecPtr
+seek_recovery_target(const char *archivedir, TimeLineID tli, uint32 seg_size,
+					 XLogRecPtr startpoint, time_t target_time,
+					 TransactionId target_xid, XLogRecPtr target_lsn,
+					 XLogRecTarget *last_rec)
+{
+	XLogSegNo	start_segno;
+	XLogSegNo	segno;
+	XLogRecPtr	result;
+
+	GetXLogSegNo(startpoint, start_segno, seg_size);
+
+	for (segno = start_segno;; segno++)
+	{
+		WalSummaryHeader *header;
+
+		if (interrupted)
+			elog(ERROR, "Interrupted during WAL validation");
+
+		header = read_wal_summary(archivedir, tli, segno, seg_size);
+		if (header == NULL)
+			break;
+
+		if (!wal_segment_archived(archivedir, tli, segno, seg_size) ||
+			(TransactionIdIsValid(target_xid) &&
+			 TransactionIdIsValid(header->min_xid) &&
+			 !xid_precedes(target_xid, header->min_xid) &&
+			 !xid_precedes(header->max_xid, target_xid)) ||
+			(target_time != 0 && header->max_rec_time != 0 &&
+			 timestamptz_to_time_t(header->max_rec_time) >= target_time) ||
+			(XRecOffIsValid(target_lsn) && header->last_rec_lsn >= target_lsn))
+		{
+			pg_free(header);
+			break;
+		}
+
+		/* Segment could be occupied by a record started before it */
+		if (header->last_rec_lsn > last_rec->rec_lsn)
+		{
+			last_rec->rec_lsn = header->last_rec_lsn;
+			if (header->last_rec_time != 0)
+				last_rec->rec_time = header->last_rec_time;
+			if (TransactionIdIsValid(header->last_xid))
+				last_rec->rec_xid = header->last_xid;
+		}
+		pg_free(header);
+	}
+
+	if (segno == start_segno)
+		return startpoint;
+
+	elog(LOG, "Skipped %lu WAL segments by their summaries",
+		 (unsigned long) (segno - start_segno));
+
+	GetXLogRecPtr(segno, 0, seg_size, result);
+	return result;
 }
 
 /*
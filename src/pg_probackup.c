@@ -70,6 +70,8 @@ static CatalogState *catalogState = NULL;
 
 /* common options */
 int			num_threads = 1;
+int			device_threads = 0;
+int			agent_threads = 1;
 bool		stream_wal = false;
 bool		no_color = false;
 bool 		show_color = true;
@@ -115,6 +117,8 @@ IncrRestoreMode incremental_mode = INCR_NONE;
 
 bool skip_block_validation = false;
 bool skip_external_dirs = false;
+static bool restore_to_stdout = false;
+static int	restore_prewarm_blocks = 0;
 
 /* array for datnames, provided via db-include and db-exclude */
 static parray *datname_exclude_list = NULL;
@@ -152,6 +156,8 @@ static char *wal_file_path;
 static char *wal_file_name;
 static bool file_overwrite = false;
 static bool no_ready_rename = false;
+static bool archive_push_daemon = false;
+static bool archive_push_wal_summary = false;
 static char archive_push_xlog_dir[MAXPGPATH] = "";
 
 /* archive get options */
@@ -195,6 +201,8 @@ static ConfigOption cmd_options[] =
 	{ 's', 'B', "backup-path",		&backup_path,		SOURCE_CMD_STRICT },
 	/* common options */
 	{ 'u', 'j', "threads",			&num_threads,		SOURCE_CMD_STRICT },
+	{ 'u', 135, "device-threads",	&device_threads,	SOURCE_CMD_STRICT },
+	{ 'u', 161, "agent-threads",	&agent_threads,		SOURCE_CMD_STRICT },
 	{ 'b', 131, "stream",			&stream_wal,		SOURCE_CMD_STRICT },
 	{ 'b', 132, "progress",			&progress,			SOURCE_CMD_STRICT },
 	{ 's', 'i', "backup-id",		&backup_id_string,	SOURCE_CMD_STRICT },
@@ -238,6 +246,8 @@ static ConfigOption cmd_options[] =
 	{ 's', 160, "primary-conninfo",	&primary_conninfo,	SOURCE_CMD_STRICT },
 	{ 's', 'S', "primary-slot-name",&replication_slot,	SOURCE_CMD_STRICT },
 	{ 'f', 'I', "incremental-mode", opt_incr_restore_mode,	SOURCE_CMD_STRICT },
+	{ 'b', 199, "to-stdout",		&restore_to_stdout,	SOURCE_CMD_STRICT },
+	{ 'u', 167, "prewarm-blocks",	&restore_prewarm_blocks,	SOURCE_CMD_STRICT },
 	/* checkdb options */
 	{ 'b', 195, "amcheck",			&need_amcheck,		SOURCE_CMD_STRICT },
 	{ 'b', 196, "heapallindexed",	&heapallindexed,	SOURCE_CMD_STRICT },
@@ -263,6 +273,8 @@ static ConfigOption cmd_options[] =
 	{ 'b', 152, "overwrite",		&file_overwrite,	SOURCE_CMD_STRICT },
 	{ 'b', 153, "no-ready-rename",	&no_ready_rename,	SOURCE_CMD_STRICT },
 	{ 'i', 162, "batch-size",		&batch_size,		SOURCE_CMD_STRICT },
+	{ 'b', 168, "daemon",			&archive_push_daemon,	SOURCE_CMD_STRICT },
+	{ 'b', 186, "wal-summary",		&archive_push_wal_summary,	SOURCE_CMD_STRICT },
 	/* archive-get options */
 	{ 's', 163, "prefetch-dir",		&prefetch_dir,		SOURCE_CMD_STRICT },
 	{ 'b', 164, "no-validate-wal",	&no_validate_wal,	SOURCE_CMD_STRICT },
@@ -391,6 +403,7 @@ main(int argc, char *argv[])
 		backup_subcmd == VALIDATE_CMD ||
 		backup_subcmd == DELETE_CMD ||
 		backup_subcmd == MERGE_CMD ||
+		backup_subcmd == SYNTHESIZE_CMD ||
 		backup_subcmd == SET_CONFIG_CMD ||
 		backup_subcmd == SET_BACKUP_CMD)
 	{
@@ -683,6 +696,7 @@ main(int argc, char *argv[])
 			backup_subcmd != VALIDATE_CMD &&
 			backup_subcmd != DELETE_CMD &&
 			backup_subcmd != MERGE_CMD &&
+			backup_subcmd != SYNTHESIZE_CMD &&
 			backup_subcmd != SET_BACKUP_CMD &&
 			backup_subcmd != SHOW_CMD)
 			elog(ERROR, "Cannot use -i (--backup-id) option together with the \"%s\" command",
@@ -739,6 +753,17 @@ main(int argc, char *argv[])
 		restore_params->partial_restore_type = NONE;
 		restore_params->primary_conninfo = primary_conninfo;
 		restore_params->incremental_mode = incremental_mode;
+		restore_params->to_stdout = restore_to_stdout;
+
+		if (restore_to_stdout && backup_subcmd != RESTORE_CMD)
+			elog(ERROR, "You cannot specify \"--to-stdout\" option with the \"%s\" command",
+				get_subcmd_name(backup_subcmd));
+
+		restore_params->prewarm_blocks = restore_prewarm_blocks;
+
+		if (restore_prewarm_blocks > 0 && backup_subcmd != RESTORE_CMD)
+			elog(ERROR, "You cannot specify \"--prewarm-blocks\" option with the \"%s\" command",
+				get_subcmd_name(backup_subcmd));
 
 		/* handle partial restore parameters */
 		if (datname_exclude_list && datname_include_list)
@@ -810,6 +835,14 @@ main(int argc, char *argv[])
 		elog(ERROR, "You cannot specify \"--no-validate\" option with the \"%s\" command",
 			get_subcmd_name(backup_subcmd));
 
+	/* must be checked before the first remote operation starts the agent */
+	if (instance_config.remote.compress_level > 22)
+		elog(ERROR, "--remote-compress-level value must be in the range from 0 to 22");
+#ifndef HAVE_LIBZSTD
+	if (instance_config.remote.compress_level > 0)
+		elog(ERROR, "This build does not support zstd compression");
+#endif
+
 	if (backup_subcmd == ARCHIVE_PUSH_CMD)
 	{
 		/* Check archive-push parameters and construct archive_push_xlog_dir
@@ -830,7 +863,13 @@ main(int argc, char *argv[])
 		uint64	system_id;
 		char	current_dir[MAXPGPATH];
 
-		if (wal_file_name == NULL)
+		if (archive_push_daemon)
+		{
+			if (wal_file_name != NULL || wal_file_path != NULL)
+				elog(ERROR, "You cannot specify \"--wal-file-name\" or \"--wal-file-path\" "
+							"option with the \"--daemon\" option");
+		}
+		else if (wal_file_name == NULL)
 			elog(ERROR, "Required parameter is not specified: --wal-file-name %%f");
 
 		if (instance_config.pgdata == NULL)
@@ -843,7 +882,13 @@ main(int argc, char *argv[])
 		if (!getcwd(current_dir, sizeof(current_dir)))
 			elog(ERROR, "getcwd() error");
 
-		if (wal_file_path == NULL)
+		if (archive_push_daemon)
+		{
+			/* daemon watches pg_wal of the instance stored in pg_probackup.conf */
+			system_id = get_system_identifier(instance_config.pgdata, FIO_DB_HOST, false);
+			join_path_components(archive_push_xlog_dir, instance_config.pgdata, XLOGDIR);
+		}
+		else if (wal_file_path == NULL)
 		{
 			/* 1st case */
 			system_id = get_system_identifier(current_dir, FIO_DB_HOST, false);
@@ -898,7 +943,8 @@ main(int argc, char *argv[])
 		if (check_system_id && system_id != instance_config.system_identifier)
 			elog(ERROR, "Refuse to push WAL segment %s into archive. Instance parameters mismatch."
 						"Instance '%s' should have SYSTEM_ID = " UINT64_FORMAT " instead of " UINT64_FORMAT,
-					wal_file_name, instanceState->instance_name, instance_config.system_identifier, system_id);
+					archive_push_daemon ? "files" : wal_file_name,
+					instanceState->instance_name, instance_config.system_identifier, system_id);
 	}
 
 #if PG_VERSION_NUM >= 100000
@@ -915,6 +961,12 @@ main(int argc, char *argv[])
 	if (num_threads < 1)
 		num_threads = 1;
 
+	if (device_threads < 0)
+		elog(ERROR, "--device-threads must be greater than or equal to 0");
+
+	if (agent_threads < 1)
+		agent_threads = 1;
+
 	if (batch_size < 1)
 		batch_size = 1;
 
@@ -924,8 +976,13 @@ main(int argc, char *argv[])
 	switch (backup_subcmd)
 	{
 		case ARCHIVE_PUSH_CMD:
-			do_archive_push(instanceState, &instance_config, archive_push_xlog_dir, wal_file_name,
-							batch_size, file_overwrite, no_sync, no_ready_rename);
+			if (archive_push_daemon)
+				do_archive_push_daemon(instanceState, &instance_config, archive_push_xlog_dir,
+									   file_overwrite, no_sync, archive_push_wal_summary);
+			else
+				do_archive_push(instanceState, &instance_config, archive_push_xlog_dir, wal_file_name,
+								batch_size, file_overwrite, no_sync, no_ready_rename,
+								archive_push_wal_summary);
 			break;
 		case ARCHIVE_GET_CMD:
 			do_archive_get(instanceState, &instance_config, prefetch_dir,
@@ -997,6 +1054,9 @@ main(int argc, char *argv[])
 		case MERGE_CMD:
 			do_merge(instanceState, current.backup_id, no_validate, no_sync);
 			break;
+		case SYNTHESIZE_CMD:
+			do_synthesize(instanceState, current.backup_id, no_validate, no_sync);
+			break;
 		case SHOW_CONFIG_CMD:
 			do_show_config();
 			break;
@@ -1110,6 +1170,11 @@ compress_init(ProbackupSubcmd const subcmd)
 		if (instance_config.compress_alg == ZLIB_COMPRESS)
 			elog(ERROR, "This build does not support zlib compression");
 		else
+#endif
+#ifndef HAVE_LIBZSTD
+		if (instance_config.compress_alg == ZSTD_COMPRESS)
+			elog(ERROR, "This build does not support zstd compression");
+		else
 #endif
 		if (instance_config.compress_alg == PGLZ_COMPRESS && num_threads > 1)
 			elog(ERROR, "Multithread backup does not support pglz compression");
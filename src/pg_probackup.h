@@ -78,6 +78,7 @@ extern const char  *PROGRAM_EMAIL;
 #define BACKUP_LOCK_FILE		"backup.pid"
 #define BACKUP_RO_LOCK_FILE		"backup_ro.pid"
 #define DATABASE_FILE_LIST		"backup_content.control"
+#define DATABASE_FILE_LIST_INDEX	"backup_content.index"
 #define PG_BACKUP_LABEL_FILE	"backup_label"
 #define PG_TABLESPACE_MAP_FILE	"tablespace_map"
 #define RELMAPPER_FILENAME		"pg_filenode.map"
@@ -85,6 +86,8 @@ extern const char  *PROGRAM_EMAIL;
 #define DATABASE_MAP			"database_map"
 #define HEADER_MAP  			"page_header_map"
 #define HEADER_MAP_TMP  		"page_header_map_tmp"
+#define MERGE_JOURNAL			"merge_journal"
+#define AUTOPREWARM_FILE		"autoprewarm.blocks"
 
 /* default replication slot names */
 #define DEFAULT_TEMP_SLOT_NAME	 "pg_probackup_slot";
@@ -205,6 +208,7 @@ typedef enum CompressAlg
 	NONE_COMPRESS,
 	PGLZ_COMPRESS,
 	ZLIB_COMPRESS,
+	ZSTD_COMPRESS,
 } CompressAlg;
 
 typedef enum ForkName
@@ -285,13 +289,6 @@ typedef struct pgFile
 	bool	excluded;	/* excluded via --exclude-path option */
 } pgFile;
 
-typedef struct page_map_entry
-{
-	const char	*path;		/* file or directory name */
-	char		*pagemap;
-	size_t		 pagemapsize;
-} page_map_entry;
-
 /* Special values of datapagemap_t bitmapsize */
 #define PageBitmapIsEmpty 0		/* Used to mark unchanged datafiles */
 
@@ -341,8 +338,8 @@ typedef enum ShowFormat
 #define PROGRAM_VERSION	"2.5.6"
 
 /* update when remote agent API or behaviour changes */
-#define AGENT_PROTOCOL_VERSION 20501
-#define AGENT_PROTOCOL_VERSION_STR "2.5.1"
+#define AGENT_PROTOCOL_VERSION 20512
+#define AGENT_PROTOCOL_VERSION_STR "2.5.12"
 
 /* update only when changing storage format */
 #define STORAGE_FORMAT_VERSION "2.4.4"
@@ -389,6 +386,9 @@ typedef struct InstanceConfig
 	/* Wait timeout for WAL segment archiving */
 	uint32		archive_timeout;
 
+	/* Number of WAL segments in pack file, 0 disables packing */
+	uint32		wal_pack_size;
+
 	/* cmdline to be used as restore_command */
 	char	   *restore_command;
 
@@ -567,6 +567,12 @@ typedef struct pgRestoreParams
 	/* options for partial restore */
 	PartialRestoreType partial_restore_type;
 	parray *partial_db_list;
+
+	/* write restored data directory into stdout as tar archive */
+	bool	to_stdout;
+	/* number of most recently changed blocks to list in autoprewarm.blocks,
+	 * 0 - do not create the file */
+	int		prewarm_blocks;
 } pgRestoreParams;
 
 /* Options needed for set-backup command */
@@ -582,6 +588,9 @@ typedef struct pgSetBackupParams
 	char   *note;
 } pgSetBackupParams;
 
+/* per-device I/O queues of files, see dir.c */
+typedef struct IoQueues IoQueues;
+
 typedef struct
 {
 	PGNodeInfo *nodeInfo;
@@ -597,6 +606,7 @@ typedef struct
 
 	int			thread_num;
 	HeaderMap   *hdr_map;
+	IoQueues   *queues;		/* per-device queues of files_list */
 
 	/*
 	 * Return value from the thread.
@@ -651,7 +661,8 @@ typedef enum xlogFileType
 	SEGMENT,
 	TEMP_SEGMENT,
 	PARTIAL_SEGMENT,
-	BACKUP_HISTORY_FILE
+	BACKUP_HISTORY_FILE,
+	WAL_SUMMARY_FILE
 } xlogFileType;
 
 typedef struct xlogFile
@@ -661,8 +672,36 @@ typedef struct xlogFile
 	xlogFileType type;
 	bool         keep; /* Used to prevent removal of WAL segments
                         * required by ARCHIVE backups. */
+	char        *pack_name; /* Name of the pack file, containing segment,
+	                         * NULL if segment is stored as separate file. */
 } xlogFile;
 
+/*
+ * WAL pack file contains consecutive WAL segments of one timeline,
+ * stored as they would be stored in the archive as separate files,
+ * followed by an array of WalPackEntry and WalPackTrailer.
+ * Pack of N segments is named after its first segment, which number
+ * is a multiple of N.
+ */
+#define WAL_PACK_MAGIC		0x4B415057	/* "WPAK" */
+#define WAL_PACK_MAX_SIZE	1024
+/* hidden file in archive directory, listing sizes of all created packs */
+#define WAL_PACK_SIZES_FILE	".pack_sizes"
+
+typedef struct WalPackEntry
+{
+	char		name[MAXFNAMELEN];	/* name of the file in archive */
+	uint64		offset;				/* offset of the file in pack */
+	uint64		size;				/* size of the file */
+	pg_crc32	crc;				/* CRC of the file */
+} WalPackEntry;
+
+typedef struct WalPackTrailer
+{
+	uint32		n_entries;
+	uint32		magic;
+} WalPackTrailer;
+
 
 /*
  * When copying datafiles to backup we validate and compress them block
@@ -761,10 +800,14 @@ typedef struct StopBackupCallbackParams
 		XLogFromFileName(fname, tli, logSegNo)
 #endif
 
-#define IsPartialCompressXLogFileName(fname)	\
-	(strlen(fname) == XLOG_FNAME_LEN + strlen(".gz.partial") && \
+#define IsXLogFileNameWithSuffix(fname, suffix)	\
+	(strlen(fname) == XLOG_FNAME_LEN + strlen(suffix) && \
 	 strspn(fname, "0123456789ABCDEF") == XLOG_FNAME_LEN &&		\
-	 strcmp((fname) + XLOG_FNAME_LEN, ".gz.partial") == 0)
+	 strcmp((fname) + XLOG_FNAME_LEN, suffix) == 0)
+
+#define IsPartialCompressXLogFileName(fname)	\
+	(IsXLogFileNameWithSuffix(fname, ".gz.partial") || \
+	 IsXLogFileNameWithSuffix(fname, ".zst.partial"))
 
 #define IsTempXLogFileName(fname)	\
 	(strlen(fname) == XLOG_FNAME_LEN + strlen(".part") &&	\
@@ -772,9 +815,14 @@ typedef struct StopBackupCallbackParams
 	 strcmp((fname) + XLOG_FNAME_LEN, ".part") == 0)
 
 #define IsTempCompressXLogFileName(fname)	\
-	(strlen(fname) == XLOG_FNAME_LEN + strlen(".gz.part") && \
-	 strspn(fname, "0123456789ABCDEF") == XLOG_FNAME_LEN &&		\
-	 strcmp((fname) + XLOG_FNAME_LEN, ".gz.part") == 0)
+	(IsXLogFileNameWithSuffix(fname, ".gz.part") || \
+	 IsXLogFileNameWithSuffix(fname, ".zst.part"))
+
+#define IsWalPackFileName(fname)	IsXLogFileNameWithSuffix(fname, ".pack")
+#define IsTempWalPackFileName(fname)	IsXLogFileNameWithSuffix(fname, ".pack.part")
+
+#define IsWalSummaryFileName(fname)	IsXLogFileNameWithSuffix(fname, ".summary")
+#define IsTempWalSummaryFileName(fname)	IsXLogFileNameWithSuffix(fname, ".summary.part")
 
 #define IsSshProtocol() (instance_config.remote.host && strcmp(instance_config.remote.proto, "ssh") == 0)
 
@@ -782,6 +830,8 @@ typedef struct StopBackupCallbackParams
 extern pid_t    my_pid;
 extern __thread int my_thread_num;
 extern int		num_threads;
+extern int		device_threads;
+extern int		agent_threads;
 extern bool		stream_wal;
 extern bool		show_color;
 extern bool		progress;
@@ -856,7 +906,7 @@ extern void do_checkdb(bool need_amcheck, ConnectionOptions conn_opt,
 extern BackupMode parse_backup_mode(const char *value);
 extern const char *deparse_backup_mode(BackupMode mode);
 extern void process_block_change(ForkNumber forknum, RelFileNode rnode,
-								 BlockNumber blkno);
+								 BlockNumber blkno, BlockNumber nblocks);
 
 /* in catchup.c */
 extern int do_catchup(const char *source_pgdata, const char *dest_pgdata, int num_threads, bool sync_dest_files,
@@ -881,6 +931,9 @@ extern parray *get_dbOid_exclude_list(pgBackup *backup, parray *datname_list,
 										PartialRestoreType partial_restore_type);
 
 extern parray *get_backup_filelist(pgBackup *backup, bool strict);
+extern parray *get_backup_filelist_partial(pgBackup *backup, parray *dbOid_exclude_list,
+										   bool strict);
+extern pgFile *parse_filelist_line(const char *buf);
 extern parray *read_timeline_history(const char *arclog_path, TimeLineID targetTLI, bool strict);
 extern bool tliIsPartOfHistory(const parray *timelines, TimeLineID tli);
 extern DestDirIncrCompatibility check_incremental_compatibility(const char *pgdata, uint64 system_identifier,
@@ -888,6 +941,7 @@ extern DestDirIncrCompatibility check_incremental_compatibility(const char *pgda
 
 /* in merge.c */
 extern void do_merge(InstanceState *instanceState, time_t backup_id, bool no_validate, bool no_sync);
+extern void do_synthesize(InstanceState *instanceState, time_t backup_id, bool no_validate, bool no_sync);
 extern void merge_backups(pgBackup *backup, pgBackup *next_backup);
 extern void merge_chain(InstanceState *instanceState, parray *parent_chain,
 						pgBackup *full_backup, pgBackup *dest_backup,
@@ -902,9 +956,19 @@ extern int do_add_instance(InstanceState *instanceState, InstanceConfig *instanc
 /* in archive.c */
 extern void do_archive_push(InstanceState *instanceState, InstanceConfig *instance, char *pg_xlog_dir,
 						   char *wal_file_name, int batch_size, bool overwrite,
-						   bool no_sync, bool no_ready_rename);
+						   bool no_sync, bool no_ready_rename, bool wal_summary);
+extern void do_archive_push_daemon(InstanceState *instanceState, InstanceConfig *instance,
+								   char *pg_xlog_dir, bool overwrite, bool no_sync,
+								   bool wal_summary);
 extern void do_archive_get(InstanceState *instanceState, InstanceConfig *instance, const char *prefetch_dir_arg, char *wal_file_path,
 						   char *wal_file_name, int batch_size, bool validate_wal);
+extern uint32 parse_wal_pack_sizes(const char *buf);
+extern bool get_wal_pack_path(char *pack_path, const char *archive_dir, const char *wal_file_name,
+							  uint32 wal_seg_size, uint32 pack_size, fio_location location);
+extern WalPackEntry *read_wal_pack_index(const char *pack_path, int *n_entries,
+										 fio_location location);
+extern char *read_wal_pack_segment(const char *archive_dir, const char *wal_file_name,
+								   uint32 wal_seg_size, uint32 pack_size, fio_location location);
 
 /* in configure.c */
 extern void do_show_config(void);
@@ -989,6 +1053,7 @@ extern void add_note(pgBackup *target_backup, char *note);
 extern void pgBackupWriteControl(FILE *out, pgBackup *backup, bool utc);
 extern void write_backup_filelist(pgBackup *backup, parray *files,
 								  const char *root, parray *external_list, bool sync);
+extern int print_filelist_line(char *line, pgFile *file);
 
 
 extern void pgBackupCreateDir(pgBackup *backup, const char *backup_instance_path);
@@ -1012,6 +1077,7 @@ extern void append_children(parray *backup_list, pgBackup *target_backup, parray
 extern bool launch_agent(void);
 extern void launch_ssh(char* argv[]);
 extern void wait_ssh(void);
+extern void ssh_mux_reset_after_fork(void);
 
 #define COMPRESS_ALG_DEFAULT NOT_DEFINED_COMPRESS
 #define COMPRESS_LEVEL_DEFAULT 1
@@ -1034,6 +1100,10 @@ extern void create_data_directories(parray *dest_files,
 										bool extract_tablespaces,
 										bool incremental,
 										fio_location location);
+extern void batch_mkdir(fio_batch_item *batch, int *n_batch, const char *path,
+						mode_t mode, fio_location location);
+extern void flush_mkdir_batch(fio_batch_item *batch, int *n_batch,
+							  fio_location location);
 
 extern void read_tablespace_map(parray *links, const char *backup_dir);
 extern void opt_tablespace_map(ConfigOption *opt, const char *arg);
@@ -1073,8 +1143,10 @@ extern void pgFileFree(void *file);
 
 extern pg_crc32 pgFileGetCRC(const char *file_path, bool use_crc32c, bool missing_ok);
 extern pg_crc32 pgFileGetCRCgz(const char *file_path, bool use_crc32c, bool missing_ok);
+#ifdef HAVE_LIBZSTD
+extern pg_crc32 pgFileGetCRCzstd(const char *file_path, bool use_crc32c, bool missing_ok);
+#endif
 
-extern int pgFileMapComparePath(const void *f1, const void *f2);
 extern int pgFileCompareName(const void *f1, const void *f2);
 extern int pgFileCompareNameWithString(const void *f1, const void *f2);
 extern int pgFileCompareRelPathWithString(const void *f1, const void *f2);
@@ -1088,6 +1160,12 @@ extern int pgPrefixCompareString(const void *str1, const void *str2);
 extern int pgCompareOid(const void *f1, const void *f2);
 extern void pfilearray_clear_locks(parray *file_list);
 
+extern IoQueues *io_queues_new(parray *files, const char *root, parray *external_dirs,
+							   int max_active, fio_location location);
+extern pgFile *io_queues_next(IoQueues *queues, int *queue_num, int *file_num);
+extern int io_queues_num_files(IoQueues *queues);
+extern void io_queues_free(IoQueues *queues);
+
 /* in data.c */
 extern bool check_data_file(ConnectionArgs *arguments, pgFile *file,
 							const char *from_fullpath, uint32 checksum_version);
@@ -1121,6 +1199,13 @@ extern size_t restore_non_data_file(parray *parent_chain, pgBackup *dest_backup,
 									bool already_exists);
 extern void restore_non_data_file_internal(FILE *in, FILE *out, pgFile *file,
 										   const char *from_fullpath, const char *to_fullpath);
+extern pgFile *get_non_data_file_full_copy(pgBackup *dest_backup, pgFile *dest_file,
+										   pgBackup **backup);
+extern size_t stream_data_file(parray *parent_chain, pgFile *dest_file, FILE *out,
+							   const char *to_path);
+extern size_t stream_non_data_file(pgBackup *backup, pgFile *file, FILE *out,
+								   const char *to_path);
+extern XLogRecPtr *get_data_file_block_lsns(parray *parent_chain, pgFile *dest_file);
 extern bool create_empty_file(fio_location from_location, const char *to_root,
 							  fio_location to_location, pgFile *file);
 
@@ -1160,6 +1245,9 @@ extern XLogRecPtr get_first_record_lsn(const char *archivedir, XLogRecPtr start_
 									   TimeLineID tli, uint32 wal_seg_size, int timeout);
 extern XLogRecPtr get_next_record_lsn(const char *archivedir, XLogSegNo	segno, TimeLineID tli,
 									  uint32 wal_seg_size, int timeout, XLogRecPtr target);
+extern bool build_wal_summary(const char *wal_dir, const char *archive_dir,
+							  TimeLineID tli, XLogSegNo segno, uint32 seg_size,
+							  bool no_sync);
 
 /* in util.c */
 extern TimeLineID get_current_timeline(PGconn *conn);
@@ -1208,8 +1296,6 @@ extern void get_ptrack_version(PGconn *backup_conn, PGNodeInfo *nodeInfo);
 extern bool pg_is_ptrack_enabled(PGconn *backup_conn, int ptrack_version_num);
 
 extern XLogRecPtr get_last_ptrack_lsn(PGconn *backup_conn, PGNodeInfo *nodeInfo);
-extern parray * pg_ptrack_get_pagemapset(PGconn *backup_conn, const char *ptrack_schema,
-										 int ptrack_version_num, XLogRecPtr lsn);
 
 /* open local file to writing */
 extern FILE* open_local_file_rw(const char *to_fullpath, char **out_buf, uint32 buf_size);
@@ -1235,6 +1321,9 @@ extern int fio_copy_pages(const char *to_fullpath, const char *from_fullpath, pg
 	                      bool use_pagemap, BlockNumber *err_blknum, char **errormsg);
 /* return codes for fio_send_pages */
 extern int fio_send_file_gz(const char *from_fullpath, const char *to_fullpath, FILE* out, char **errormsg);
+#ifdef HAVE_LIBZSTD
+extern int fio_send_file_zstd(const char *from_fullpath, const char *to_fullpath, FILE* out, char **errormsg);
+#endif
 extern int fio_send_file(const char *from_fullpath, const char *to_fullpath, FILE* out,
 														pgFile *file, char **errormsg);
 
@@ -1264,6 +1353,7 @@ extern int32 fio_decompress(void* dst, void const* src, size_t size, int compres
 #define WRITE_FAILED (-4)
 #define ZLIB_ERROR   (-5)
 #define REMOTE_ERROR (-6)
+#define ZSTD_ERROR   (-7)
 #define PAGE_CORRUPTION (-8)
 
 /* Check if specified location is local for current node */
@@ -1274,9 +1364,6 @@ extern void get_header_errormsg(Page page, char **errormsg);
 extern void get_checksum_errormsg(Page page, char **errormsg,
 								  BlockNumber absolute_blkno);
 
-extern bool
-datapagemap_is_set(datapagemap_t *map, BlockNumber blkno);
-
 extern void
 datapagemap_print_debug(datapagemap_t *map);
 
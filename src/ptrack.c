@@ -184,18 +184,27 @@ get_last_ptrack_lsn(PGconn *backup_conn, PGNodeInfo *nodeInfo)
  */
 
 /*
- * Fetch a list of changed files with their ptrack maps.
+ * Given a list of files in the instance to backup, build a pagemap for each
+ * data file that has ptrack. Result is saved in the pagemap field of pgFile.
+ *
+ * Changed files with their ptrack maps are received one row at a time in
+ * binary format and merged into the file list, which must be sorted by
+ * pgFileCompareRelPathWithExternal, as they arrive. File without bitmap is
+ * treated as unchanged.
  */
-parray *
-pg_ptrack_get_pagemapset(PGconn *backup_conn, const char *ptrack_schema,
-						 int ptrack_version_num, XLogRecPtr lsn)
+void
+make_pagemap_from_ptrack_2(parray *files,
+						   PGconn *backup_conn,
+						   const char *ptrack_schema,
+						   int ptrack_version_num,
+						   XLogRecPtr lsn)
 {
 	PGresult   *res;
 	char		lsn_buf[17 + 1];
 	char	   *params[1];
-	parray	   *pagemapset = NULL;
-	int			i;
 	char		query[512];
+	pgFile		dummy_file;
+	pgFile	   *dummy_file_ptr = &dummy_file;
 
 	snprintf(lsn_buf, sizeof lsn_buf, "%X/%X", (uint32) (lsn >> 32), (uint32) lsn);
 	params[0] = pstrdup(lsn_buf);
@@ -204,106 +213,59 @@ pg_ptrack_get_pagemapset(PGconn *backup_conn, const char *ptrack_schema,
 		elog(ERROR, "Schema name of ptrack extension is missing");
 
 	if (ptrack_version_num == 200)
-		sprintf(query, "SELECT path, pagemap FROM %s.pg_ptrack_get_pagemapset($1) ORDER BY 1",
+		sprintf(query, "SELECT path, pagemap FROM %s.pg_ptrack_get_pagemapset($1)",
 				ptrack_schema);
 	else
-		sprintf(query, "SELECT path, pagemap FROM %s.ptrack_get_pagemapset($1) ORDER BY 1",
+		sprintf(query, "SELECT path, pagemap FROM %s.ptrack_get_pagemapset($1)",
 				ptrack_schema);
 
-	res = pgut_execute(backup_conn, query, 1, (const char **) params);
+	pgut_send_extended(backup_conn, query, 1, (const char **) params,
+					   false, true, ERROR);
 	pfree(params[0]);
 
-	if (PQnfields(res) != 2)
-		elog(ERROR, "cannot get ptrack pagemapset");
+	memset(&dummy_file, 0, sizeof(pgFile));
 
-	/* sanity ? */
-
-	/* Construct database map */
-	for (i = 0; i < PQntuples(res); i++)
+	while ((res = PQgetResult(backup_conn)) != NULL)
 	{
-		page_map_entry *pm_entry = (page_map_entry *) pgut_malloc(sizeof(page_map_entry));
-
-		/* get path */
-		pm_entry->path = pgut_strdup(PQgetvalue(res, i, 0));
-
-		/* get bytea */
-		pm_entry->pagemap = (char *) PQunescapeBytea((unsigned char *) PQgetvalue(res, i, 1),
-													&pm_entry->pagemapsize);
-
-		if (pagemapset == NULL)
-			pagemapset = parray_new();
-
-		parray_append(pagemapset, pm_entry);
-	}
-
-	PQclear(res);
-
-	return pagemapset;
-}
-
-/*
- * Given a list of files in the instance to backup, build a pagemap for each
- * data file that has ptrack. Result is saved in the pagemap field of pgFile.
- *
- * We fetch a list of changed files with their ptrack maps.  After that files
- * are merged with their bitmaps.  File without bitmap is treated as unchanged.
- */
-void
-make_pagemap_from_ptrack_2(parray *files,
-						   PGconn *backup_conn,
-						   const char *ptrack_schema,
-						   int ptrack_version_num,
-						   XLogRecPtr lsn)
-{
-	parray *filemaps;
-	int		file_i = 0;
-	page_map_entry *dummy_map = NULL;
+		ExecStatusType res_status = PQresultStatus(res);
+		pgFile	  **file_item;
+		pgFile	   *file;
 
-	/* Receive all available ptrack bitmaps at once */
-	filemaps = pg_ptrack_get_pagemapset(backup_conn, ptrack_schema,
-										ptrack_version_num, lsn);
+		if (interrupted)
+			elog(ERROR, "Interrupted during receiving ptrack pagemapset");
 
-	if (filemaps != NULL)
-		parray_qsort(filemaps, pgFileMapComparePath);
-	else
-		return;
+		/* Result is over, PQgetResult() returns NULL next time */
+		if (res_status == PGRES_TUPLES_OK)
+		{
+			PQclear(res);
+			continue;
+		}
 
-	dummy_map = (page_map_entry *) pgut_malloc(sizeof(page_map_entry));
+		if (res_status != PGRES_SINGLE_TUPLE || PQnfields(res) != 2)
+			elog(ERROR, "cannot get ptrack pagemapset: %s",
+				 PQerrorMessage(backup_conn));
 
-	/* Iterate over files and look for corresponding pagemap if any */
-	for (file_i = 0; file_i < parray_num(files); file_i++)
-	{
-		pgFile *file = (pgFile *) parray_get(files, file_i);
-		page_map_entry **res_map = NULL;
-		page_map_entry *map = NULL;
+		/* Binary representation of text is the string itself */
+		dummy_file.rel_path = PQgetvalue(res, 0, 0);
+		file_item = (pgFile **) parray_bsearch(files, &dummy_file_ptr,
+											   pgFileCompareRelPathWithExternal);
+		file = file_item ? *file_item : NULL;
 
 		/*
 		 * For now nondata files are not entitled to have pagemap
 		 * TODO It's possible to use ptrack for incremental backup of
 		 * relation forks. Not implemented yet.
 		 */
-		if (!file->is_datafile || file->is_cfs)
-			continue;
-
-		/* Consider only files from PGDATA (this check is probably redundant) */
-		if (file->external_dir_num != 0)
-			continue;
-
-		if (filemaps)
-		{
-			dummy_map->path = file->rel_path;
-			res_map = parray_bsearch(filemaps, dummy_map, pgFileMapComparePath);
-			map = (res_map) ? *res_map : NULL;
-		}
-
-		/* Found map */
-		if (map)
+		if (file && file->is_datafile && !file->is_cfs &&
+			file->external_dir_num == 0 && PQgetlength(res, 0, 1) > 0)
 		{
 			elog(VERBOSE, "Using ptrack pagemap for file \"%s\"", file->rel_path);
-			file->pagemap.bitmapsize = map->pagemapsize;
-			file->pagemap.bitmap = map->pagemap;
+			file->pagemap.bitmapsize = PQgetlength(res, 0, 1);
+			file->pagemap.bitmap = pgut_malloc(file->pagemap.bitmapsize);
+			memcpy(file->pagemap.bitmap, PQgetvalue(res, 0, 1),
+				   file->pagemap.bitmapsize);
 		}
-	}
 
-	free(dummy_map);
+		PQclear(res);
+	}
 }
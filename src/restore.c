@@ -11,6 +11,9 @@
 #include "pg_probackup.h"
 
 #include "access/timeline.h"
+#include "catalog/pg_tablespace.h"
+#include "common/relpath.h"
+#include "pgtar.h"
 
 #include <sys/stat.h>
 #include <unistd.h>
@@ -31,6 +34,7 @@ typedef struct
 	bool        use_bitmap;
 	IncrRestoreMode        incremental_mode;
 	XLogRecPtr  shift_lsn;    /* used only in LSN incremental_mode */
+	IoQueues   *queues;       /* per-device queues of dest_files */
 
 	/*
 	 * Return value from the thread.
@@ -61,12 +65,78 @@ static void create_recovery_conf(InstanceState *instanceState, time_t backup_id,
 								 pgBackup *backup,
 								 pgRestoreParams *params);
 static void *restore_files(void *arg);
+static void write_prewarm_blocks(parray *dest_files, parray *parent_chain,
+								 parray *dbOid_exclude_list, const char *to_root,
+								 int max_blocks, fio_location location);
 static void set_orphan_status(parray *backups, pgBackup *parent_backup);
+static void batch_file_request(fio_batch_item *batch, int *n_batch,
+							   fio_operations cop, uint32 arg, const char *path);
+static void flush_file_batch(fio_batch_item *batch, int *n_batch);
 
 static void restore_chain(pgBackup *dest_backup, parray *parent_chain,
 						  parray *dbOid_exclude_list, pgRestoreParams *params,
 						  const char *pgdata_path, bool no_sync, bool cleanup_pgdata,
 						  bool backup_has_tblspc);
+static parray *get_chain_filelists(pgBackup *dest_backup, parray *parent_chain,
+								   parray *dbOid_exclude_list, bool force);
+
+static void restore_chain_to_stdout(InstanceState *instanceState, time_t backup_id,
+									pgRecoveryTarget *rt, pgBackup *dest_backup,
+									parray *parent_chain, parray *dbOid_exclude_list,
+									pgRestoreParams *params);
+static void tar_write_header(FILE *out, const char *name, mode_t mode,
+							 int64 size, time_t mtime);
+static void tar_write_padding(FILE *out, int64 size);
+static void tar_append_local_file(FILE *out, const char *fullpath,
+								  const char *name, time_t mtime);
+static void unlink_staging_dir_atexit(bool fatal, void *userdata);
+
+#ifndef TAR_BLOCK_SIZE
+#define TAR_BLOCK_SIZE 512
+#endif
+
+/*
+ * Add sync or chmod request for restored file to the batch. Batch holds up
+ * to FIO_BATCH_MAX_ITEMS items, the full one is flushed at once.
+ */
+static void
+batch_file_request(fio_batch_item *batch, int *n_batch, fio_operations cop,
+				   uint32 arg, const char *path)
+{
+	batch[*n_batch].cop = cop;
+	batch[*n_batch].arg = arg;
+	batch[*n_batch].path = pgut_strdup(path);
+	(*n_batch)++;
+
+	if (*n_batch == FIO_BATCH_MAX_ITEMS)
+		flush_file_batch(batch, n_batch);
+}
+
+/* Execute all requests in the batch and reset it */
+static void
+flush_file_batch(fio_batch_item *batch, int *n_batch)
+{
+	int			i;
+
+	if (*n_batch == 0)
+		return;
+
+	fio_batch(batch, *n_batch, FIO_DB_HOST);
+
+	for (i = 0; i < *n_batch; i++)
+	{
+		if (batch[i].errnum == 0)
+			pg_free((char *) batch[i].path);
+		else if (batch[i].cop == FIO_SYNC)
+			elog(ERROR, "Failed to sync file \"%s\": %s", batch[i].path,
+				 strerror(batch[i].errnum));
+		else
+			elog(ERROR, "Cannot change mode of \"%s\": %s", batch[i].path,
+				 strerror(batch[i].errnum));
+	}
+
+	*n_batch = 0;
+}
 
 /*
  * Iterate over backup list to find all ancestors of the broken parent_backup
@@ -137,7 +207,15 @@ do_restore_or_validate(InstanceState *instanceState, time_t target_backup_id, pg
 	if (instanceState == NULL)
 		elog(ERROR, "required parameter not specified: --instance");
 
-	if (params->is_restore)
+	if (params->is_restore && params->to_stdout)
+	{
+		if (params->incremental_mode != INCR_NONE)
+			elog(ERROR, "Incremental restore is not possible when restoring to stdout");
+
+		if (fio_is_remote_simple(FIO_DB_HOST))
+			elog(ERROR, "Restore to stdout is not possible in remote mode");
+	}
+	else if (params->is_restore)
 	{
 		if (instance_config.pgdata == NULL)
 			elog(ERROR,
@@ -404,8 +482,9 @@ do_restore_or_validate(InstanceState *instanceState, time_t target_backup_id, pg
 	/*
 	 * Ensure that directories provided in tablespace mapping are valid
 	 * i.e. empty or not exist.
+	 * There is nothing to check in case of restore to stdout.
 	 */
-	if (params->is_restore)
+	if (params->is_restore && !params->to_stdout)
 	{
 		int rc = check_tablespace_mapping(dest_backup,
 										  params->incremental_mode != INCR_NONE, params->force,
@@ -671,12 +750,18 @@ do_restore_or_validate(InstanceState *instanceState, time_t target_backup_id, pg
 					 base36enc(dest_backup->start_time),
 					 dest_backup->server_version);
 
-		restore_chain(dest_backup, parent_chain, dbOid_exclude_list, params,
-					  instance_config.pgdata, no_sync, cleanup_pgdata, backup_has_tblspc);
+		if (params->to_stdout)
+			restore_chain_to_stdout(instanceState, target_backup_id, rt, dest_backup,
+									parent_chain, dbOid_exclude_list, params);
+		else
+		{
+			restore_chain(dest_backup, parent_chain, dbOid_exclude_list, params,
+						  instance_config.pgdata, no_sync, cleanup_pgdata, backup_has_tblspc);
 
-		//TODO rename and update comment
-		/* Create recovery.conf with given recovery target parameters */
-		create_recovery_conf(instanceState, target_backup_id, rt, dest_backup, params);
+			//TODO rename and update comment
+			/* Create recovery.conf with given recovery target parameters */
+			create_recovery_conf(instanceState, target_backup_id, rt, dest_backup, params);
+		}
 	}
 
 	/* ssh connection to longer needed */
@@ -694,39 +779,19 @@ do_restore_or_validate(InstanceState *instanceState, time_t target_backup_id, pg
 }
 
 /*
- * Restore backup chain.
- * Flag 'cleanup_pgdata' demands the removing of already existing content in PGDATA.
+ * Lock backup chain, make sanity checks and populate file lists
+ * of every backup in chain. Returns the file list of destination backup.
+ * Destination backup file list is always complete, because files of
+ * excluded databases are restored as empty files. Intermediate backups
+ * are needed only for the files actually restored, so files of databases
+ * from 'dbOid_exclude_list' are not loaded for them.
  */
-void
-restore_chain(pgBackup *dest_backup, parray *parent_chain,
-			  parray *dbOid_exclude_list, pgRestoreParams *params,
-			  const char *pgdata_path, bool no_sync, bool cleanup_pgdata,
-			  bool backup_has_tblspc)
+static parray *
+get_chain_filelists(pgBackup *dest_backup, parray *parent_chain,
+					parray *dbOid_exclude_list, bool force)
 {
 	int			i;
-	char		timestamp[100];
-	parray      *pgdata_files = NULL;
-	parray		*dest_files = NULL;
-	parray		*external_dirs = NULL;
-	/* arrays with meta info for multi threaded backup */
-	pthread_t  *threads;
-	restore_files_arg *threads_args;
-	bool		restore_isok = true;
-	bool        use_bitmap = true;
-
-	/* fancy reporting */
-	char		pretty_dest_bytes[20];
-	char		pretty_total_bytes[20];
-	size_t		dest_bytes = 0;
-	size_t		total_bytes = 0;
-	char		pretty_time[20];
-	time_t		start_time, end_time;
-
-	/* Preparations for actual restoring */
-	time2iso(timestamp, lengthof(timestamp), dest_backup->start_time, false);
-	elog(INFO, "Restoring the database from backup at %s", timestamp);
-
-	dest_files = get_backup_filelist(dest_backup, true);
+	parray	   *dest_files = get_backup_filelist(dest_backup, true);
 
 	/* Lock backup chain and make sanity checks */
 	for (i = parray_num(parent_chain) - 1; i >= 0; i--)
@@ -739,7 +804,7 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 		if (backup->status != BACKUP_STATUS_OK &&
 			backup->status != BACKUP_STATUS_DONE)
 		{
-			if (params->force)
+			if (force)
 				elog(WARNING, "Backup %s is not valid, restore is forced",
 					 base36enc(backup->start_time));
 			else
@@ -760,7 +825,7 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 
 		/* populate backup filelist */
 		if (backup->start_time != dest_backup->start_time)
-			backup->files = get_backup_filelist(backup, true);
+			backup->files = get_backup_filelist_partial(backup, dbOid_exclude_list, true);
 		else
 			backup->files = dest_files;
 
@@ -772,6 +837,48 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 		parray_qsort(backup->files, pgFileCompareRelPathWithExternal);
 	}
 
+	return dest_files;
+}
+
+/*
+ * Restore backup chain.
+ * Flag 'cleanup_pgdata' demands the removing of already existing content in PGDATA.
+ */
+void
+restore_chain(pgBackup *dest_backup, parray *parent_chain,
+			  parray *dbOid_exclude_list, pgRestoreParams *params,
+			  const char *pgdata_path, bool no_sync, bool cleanup_pgdata,
+			  bool backup_has_tblspc)
+{
+	int			i;
+	char		timestamp[100];
+	parray      *pgdata_files = NULL;
+	parray		*dest_files = NULL;
+	parray		*external_dirs = NULL;
+	fio_batch_item *mkdir_batch;
+	int			n_mkdir = 0;
+	/* arrays with meta info for multi threaded backup */
+	pthread_t  *threads;
+	restore_files_arg *threads_args;
+	IoQueues   *queues;
+	bool		restore_isok = true;
+	bool        use_bitmap = true;
+
+	/* fancy reporting */
+	char		pretty_dest_bytes[20];
+	char		pretty_total_bytes[20];
+	size_t		dest_bytes = 0;
+	size_t		total_bytes = 0;
+	char		pretty_time[20];
+	time_t		start_time, end_time;
+
+	/* Preparations for actual restoring */
+	time2iso(timestamp, lengthof(timestamp), dest_backup->start_time, false);
+	elog(INFO, "Restoring the database from backup at %s", timestamp);
+
+	dest_files = get_chain_filelists(dest_backup, parent_chain,
+									 dbOid_exclude_list, params->force);
+
 	/* If dest backup version is older than 2.4.0, then bitmap optimization
 	 * is impossible to use, because bitmap restore rely on pgFile.n_blocks,
 	 * which is not always available in old backups.
@@ -803,6 +910,9 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 							params->incremental_mode != INCR_NONE,
 							FIO_DB_HOST);
 
+	/* external directories are created in batches, not one by one */
+	mkdir_batch = pgut_malloc(sizeof(fio_batch_item) * FIO_BATCH_MAX_ITEMS);
+
 	/*
 	 * Restore dest_backup external directories.
 	 */
@@ -817,8 +927,8 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 			elog(LOG, "Restore external directories");
 
 		for (i = 0; i < parray_num(external_dirs); i++)
-			fio_mkdir(parray_get(external_dirs, i),
-					  DIR_PERMISSION, FIO_DB_HOST);
+			batch_mkdir(mkdir_batch, &n_mkdir, parray_get(external_dirs, i),
+						DIR_PERMISSION, FIO_DB_HOST);
 	}
 
 	/*
@@ -844,9 +954,11 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 			join_path_components(dirpath, external_path, file->rel_path);
 
 			elog(VERBOSE, "Create external directory \"%s\"", dirpath);
-			fio_mkdir(dirpath, file->mode, FIO_DB_HOST);
+			batch_mkdir(mkdir_batch, &n_mkdir, dirpath, file->mode, FIO_DB_HOST);
 		}
 	}
+	flush_mkdir_batch(mkdir_batch, &n_mkdir, FIO_DB_HOST);
+	pg_free(mkdir_batch);
 
 	/* setup threads */
 	pfilearray_clear_locks(dest_files);
@@ -948,6 +1060,10 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 		elog(INFO, "Redundant files are removed, time elapsed: %s", pretty_time);
 	}
 
+	/* Group files by the device of PGDATA, tablespace or external directory */
+	queues = io_queues_new(dest_files, pgdata_path, external_dirs,
+						   device_threads, FIO_DB_HOST);
+
 	/*
 	 * Close ssh connection belonging to the main thread
 	 * to avoid the possibility of been killed for idleness
@@ -983,6 +1099,7 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 		arg->use_bitmap = use_bitmap;
 		arg->incremental_mode = params->incremental_mode;
 		arg->shift_lsn = params->shift_lsn;
+		arg->queues = queues;
 		threads_args[i].restored_bytes = 0;
 		/* By default there are some error */
 		threads_args[i].ret = 1;
@@ -1003,6 +1120,8 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 		total_bytes += threads_args[i].restored_bytes;
 	}
 
+	io_queues_free(queues);
+
 	time(&end_time);
 	pretty_time_interval(difftime(end_time, start_time),
 						 pretty_time, lengthof(pretty_time));
@@ -1021,6 +1140,10 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 		elog(ERROR, "Backup files restoring failed. Transfered bytes: %s, time elapsed: %s",
 			pretty_total_bytes, pretty_time);
 
+	if (params->prewarm_blocks > 0)
+		write_prewarm_blocks(dest_files, parent_chain, dbOid_exclude_list,
+							 pgdata_path, params->prewarm_blocks, FIO_DB_HOST);
+
 	/* Close page header maps */
 	for (i = parray_num(parent_chain) - 1; i >= 0; i--)
 	{
@@ -1032,6 +1155,10 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 		elog(WARNING, "Restored files are not synced to disk");
 	else
 	{
+		/* files are synced by batches to save remote round trips */
+		fio_batch_item *batch = pgut_malloc(FIO_BATCH_MAX_ITEMS * sizeof(fio_batch_item));
+		int			n_batch = 0;
+
 		elog(INFO, "Syncing restored files to disk");
 		time(&start_time);
 
@@ -1063,11 +1190,12 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 				join_path_components(to_fullpath, external_path, dest_file->rel_path);
 			}
 
-			/* TODO: write test for case: file to be synced is missing */
-			if (fio_sync(to_fullpath, FIO_DB_HOST) != 0)
-				elog(ERROR, "Failed to sync file \"%s\": %s", to_fullpath, strerror(errno));
+			batch_file_request(batch, &n_batch, FIO_SYNC, 0, to_fullpath);
 		}
 
+		flush_file_batch(batch, &n_batch);
+		pg_free(batch);
+
 		time(&end_time);
 		pretty_time_interval(difftime(end_time, start_time),
 							 pretty_time, lengthof(pretty_time));
@@ -1096,36 +1224,378 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 	}
 }
 
+/*
+ * Stream restored data directory into stdout as tar archive.
+ *
+ * Archive is deterministic: entries follow the order of sorted backup file
+ * list and all of them get the same owner and modification time, which is
+ * the start time of destination backup. Blocks of data files are merged
+ * from backup chain on the fly, so restored data is never written to disk,
+ * except the small configuration files, which are rewritten with recovery
+ * settings in temporary staging directory and appended to the end of archive.
+ *
+ * Tablespaces are written as directories inside pg_tblspc, external
+ * directories are not included.
+ */
+static void
+restore_chain_to_stdout(InstanceState *instanceState, time_t backup_id,
+						pgRecoveryTarget *rt, pgBackup *dest_backup,
+						parray *parent_chain, parray *dbOid_exclude_list,
+						pgRestoreParams *params)
+{
+	int			i;
+	FILE	   *out = stdout;
+	char		timestamp[100];
+	parray	   *dest_files = NULL;
+	parray	   *staged_files = NULL;
+	char		staging_dir[MAXPGPATH];
+	const char *tmpdir;
+	char	   *saved_pgdata = instance_config.pgdata;
+	char	   *out_buf = pgut_malloc(STDIO_BUFSIZE);
+	char		zero_block[TAR_BLOCK_SIZE];
+	time_t		mtime = dest_backup->start_time;
+
+	/* fancy reporting */
+	char		pretty_total_bytes[20];
+	size_t		total_bytes = 0;
+	char		pretty_time[20];
+	time_t		start_time, end_time;
+
+	if (isatty(fileno(out)))
+		elog(ERROR, "Refusing to write tar archive to terminal, redirect stdout "
+			 "to a file or a pipe");
+
+#ifdef WIN32
+	SYS_CHECK(setmode(fileno(out), _O_BINARY));
+#endif
+	setvbuf(out, out_buf, _IOFBF, STDIO_BUFSIZE);
+
+	time2iso(timestamp, lengthof(timestamp), dest_backup->start_time, false);
+	elog(INFO, "Streaming the database from backup at %s to stdout", timestamp);
+
+	dest_files = get_chain_filelists(dest_backup, parent_chain,
+									 dbOid_exclude_list, params->force);
+
+	/* Streaming relies on page headers, which are available since 2.4.0 */
+	for (i = parray_num(parent_chain) - 1; i >= 0; i--)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(parent_chain, i);
+
+		if (parse_program_version(backup->program_version) < 20400)
+			elog(ERROR, "Backup %s was created by pg_probackup %s, restore to stdout "
+				 "is supported only for backups created by version 2.4.0 or newer",
+				 base36enc(backup->start_time), backup->program_version);
+	}
+
+	if (dest_backup->external_dir_str && !params->skip_external_dirs)
+		elog(WARNING, "External directories of backup %s are not included into tar archive",
+			 base36enc(dest_backup->start_time));
+
+	/* configuration files are prepared for recovery in staging directory */
+	tmpdir = getenv("TMPDIR");
+	if (tmpdir == NULL || tmpdir[0] == '\0')
+		tmpdir = "/tmp";
+
+	snprintf(staging_dir, MAXPGPATH, "%s/pg_probackup_restore_XXXXXX", tmpdir);
+	if (mkdtemp(staging_dir) == NULL)
+		elog(ERROR, "Cannot create temporary directory \"%s\": %s",
+			 staging_dir, strerror(errno));
+
+	pgut_atexit_push(unlink_staging_dir_atexit, staging_dir);
+
+	elog(INFO, "Start streaming backup files");
+	time(&start_time);
+
+	for (i = 0; i < parray_num(dest_files); i++)
+	{
+		pgFile	   *dest_file = (pgFile *) parray_get(dest_files, i);
+		pgFile	   *tmp_file = NULL;
+		pgBackup   *tmp_backup = NULL;
+		int64		size = 0;
+
+		/* check for interrupt */
+		if (interrupted || thread_interrupted)
+			elog(ERROR, "Interrupted during restore");
+
+		/* External directories have no place in data directory */
+		if (dest_file->external_dir_num > 0)
+			continue;
+
+		/* Do not restore tablespace_map and database_map files */
+		if (strcmp(PG_TABLESPACE_MAP_FILE, dest_file->rel_path) == 0 ||
+			strcmp(DATABASE_MAP, dest_file->rel_path) == 0)
+			continue;
+
+		if (progress)
+			elog(INFO, "Progress: (%d/%lu). Stream file \"%s\"",
+				 i + 1, (unsigned long) parray_num(dest_files), dest_file->rel_path);
+
+		if (S_ISDIR(dest_file->mode))
+		{
+			tar_write_header(out, dest_file->rel_path, dest_file->mode, 0, mtime);
+			continue;
+		}
+
+#if PG_VERSION_NUM >= 120000
+		/*
+		 * postgresql.auto.conf is going to be updated with recovery settings,
+		 * restore it into staging directory and append it later.
+		 */
+		if (strcmp(dest_file->rel_path, "postgresql.auto.conf") == 0)
+		{
+			char		to_fullpath[MAXPGPATH];
+			FILE	   *staged;
+
+			join_path_components(to_fullpath, staging_dir, dest_file->rel_path);
+
+			staged = fopen(to_fullpath, PG_BINARY_W);
+			if (staged == NULL)
+				elog(ERROR, "Cannot open file \"%s\": %s", to_fullpath, strerror(errno));
+
+			if (dest_file->write_size != 0)
+				restore_non_data_file(parent_chain, dest_backup, dest_file,
+									  staged, to_fullpath, false);
+
+			if (fclose(staged) != 0)
+				elog(ERROR, "Cannot close file \"%s\": %s", to_fullpath, strerror(errno));
+			continue;
+		}
+#endif
+
+		/*
+		 * Files of the excluded databases are written as empty files,
+		 * just like create_empty_file() does for regular restore.
+		 */
+		if (dbOid_exclude_list &&
+			parray_bsearch(dbOid_exclude_list, &dest_file->dbOid, pgCompareOid))
+		{
+			elog(VERBOSE, "Skip file due to partial restore: \"%s\"",
+				 dest_file->rel_path);
+			tar_write_header(out, dest_file->rel_path, dest_file->mode, 0, mtime);
+			continue;
+		}
+
+		if (dest_file->write_size == 0)
+		{
+			tar_write_header(out, dest_file->rel_path, dest_file->mode, 0, mtime);
+			continue;
+		}
+
+		if (dest_file->is_datafile && !dest_file->is_cfs)
+		{
+			size = dest_file->n_blocks * BLCKSZ;
+
+			tar_write_header(out, dest_file->rel_path, dest_file->mode, size, mtime);
+			total_bytes += stream_data_file(parent_chain, dest_file, out,
+											dest_file->rel_path);
+		}
+		else
+		{
+			tmp_file = get_non_data_file_full_copy(dest_backup, dest_file, &tmp_backup);
+			size = tmp_file->write_size;
+
+			tar_write_header(out, dest_file->rel_path, dest_file->mode, size, mtime);
+			total_bytes += stream_non_data_file(tmp_backup, tmp_file, out,
+												dest_file->rel_path);
+		}
+
+		tar_write_padding(out, size);
+
+		/* free pagemap used for restore optimization */
+		pg_free(dest_file->pagemap.bitmap);
+		dest_file->pagemap.bitmap = NULL;
+	}
+
+	/* autoprewarm.blocks is appended together with recovery settings */
+	if (params->prewarm_blocks > 0)
+		write_prewarm_blocks(dest_files, parent_chain, dbOid_exclude_list,
+							 staging_dir, params->prewarm_blocks, FIO_LOCAL_HOST);
+
+	/* Close page header maps */
+	for (i = parray_num(parent_chain) - 1; i >= 0; i--)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(parent_chain, i);
+		cleanup_header_map(&(backup->hdr_map));
+	}
+
+	/* Prepare recovery settings in staging directory and append them */
+	instance_config.pgdata = staging_dir;
+	create_recovery_conf(instanceState, backup_id, rt, dest_backup, params);
+	instance_config.pgdata = saved_pgdata;
+
+	staged_files = parray_new();
+	dir_list_file(staged_files, staging_dir, false, false, false, false, false, 0,
+				  FIO_LOCAL_HOST);
+	parray_qsort(staged_files, pgFileCompareRelPathWithExternal);
+
+	for (i = 0; i < parray_num(staged_files); i++)
+	{
+		char		fullpath[MAXPGPATH];
+		pgFile	   *file = (pgFile *) parray_get(staged_files, i);
+
+		if (!S_ISREG(file->mode))
+			continue;
+
+		join_path_components(fullpath, staging_dir, file->rel_path);
+		tar_append_local_file(out, fullpath, file->rel_path, mtime);
+	}
+
+	/* End of archive is marked by two zero-filled blocks */
+	MemSet(zero_block, 0, TAR_BLOCK_SIZE);
+	for (i = 0; i < 2; i++)
+	{
+		if (fwrite(zero_block, 1, TAR_BLOCK_SIZE, out) != TAR_BLOCK_SIZE)
+			elog(ERROR, "Cannot write to stdout: %s", strerror(errno));
+	}
+
+	if (fflush(out) != 0)
+		elog(ERROR, "Cannot flush stdout: %s", strerror(errno));
+
+	pgut_rmtree(staging_dir, true, false);
+	pgut_atexit_pop(unlink_staging_dir_atexit, staging_dir);
+
+	time(&end_time);
+	pretty_time_interval(difftime(end_time, start_time),
+						 pretty_time, lengthof(pretty_time));
+	pretty_size(total_bytes, pretty_total_bytes, lengthof(pretty_total_bytes));
+
+	elog(INFO, "Backup files are streamed. Transfered bytes: %s, time elapsed: %s",
+		 pretty_total_bytes, pretty_time);
+
+	/* cleanup */
+	parray_walk(staged_files, pgFileFree);
+	parray_free(staged_files);
+
+	for (i = parray_num(parent_chain) - 1; i >= 0; i--)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(parent_chain, i);
+
+		parray_walk(backup->files, pgFileFree);
+		parray_free(backup->files);
+	}
+}
+
+/*
+ * Write tar header for the entry.
+ * Owner of every entry is the current user, so the tar stream
+ * extracted by the same user get the proper ownership.
+ */
+static void
+tar_write_header(FILE *out, const char *name, mode_t mode, int64 size,
+				 time_t mtime)
+{
+	char		h[TAR_BLOCK_SIZE];
+	uid_t		uid = 0;
+	gid_t		gid = 0;
+	enum tarError rc;
+
+#ifndef WIN32
+	uid = geteuid();
+	gid = getegid();
+#endif
+
+	rc = tarCreateHeader(h, name, NULL, (pgoff_t) size, mode, uid, gid, mtime);
+
+	if (rc == TAR_NAME_TOO_LONG)
+		elog(ERROR, "File name is too long for tar format: \"%s\"", name);
+	else if (rc != TAR_OK)
+		elog(ERROR, "Cannot create tar header for file \"%s\"", name);
+
+	if (fwrite(h, 1, TAR_BLOCK_SIZE, out) != TAR_BLOCK_SIZE)
+		elog(ERROR, "Cannot write to stdout: %s", strerror(errno));
+}
+
+/* Pad the entry of given size to the tar block boundary */
+static void
+tar_write_padding(FILE *out, int64 size)
+{
+	char		zeroes[TAR_BLOCK_SIZE];
+	size_t		pad = (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+
+	if (pad == 0)
+		return;
+
+	MemSet(zeroes, 0, pad);
+	if (fwrite(zeroes, 1, pad, out) != pad)
+		elog(ERROR, "Cannot write to stdout: %s", strerror(errno));
+}
+
+/* Append local file "fullpath" to tar stream under the name "name" */
+static void
+tar_append_local_file(FILE *out, const char *fullpath, const char *name,
+					  time_t mtime)
+{
+	FILE	   *in;
+	struct stat	st;
+	char		buf[STDIO_BUFSIZE];
+	int64		left;
+
+	in = fopen(fullpath, PG_BINARY_R);
+	if (in == NULL)
+		elog(ERROR, "Cannot open file \"%s\": %s", fullpath, strerror(errno));
+
+	if (fstat(fileno(in), &st) < 0)
+		elog(ERROR, "Cannot stat file \"%s\": %s", fullpath, strerror(errno));
+
+	tar_write_header(out, name, FILE_PERMISSION | S_IFREG, st.st_size, mtime);
+
+	left = st.st_size;
+	while (left > 0)
+	{
+		size_t	read_len = fread(buf, 1, Min(left, sizeof(buf)), in);
+
+		if (read_len == 0)
+			elog(ERROR, "Cannot read file \"%s\": %s", fullpath, strerror(errno));
+
+		if (fwrite(buf, 1, read_len, out) != read_len)
+			elog(ERROR, "Cannot write to stdout: %s", strerror(errno));
+
+		left -= read_len;
+	}
+
+	tar_write_padding(out, st.st_size);
+
+	if (fclose(in) != 0)
+		elog(ERROR, "Cannot close file \"%s\": %s", fullpath, strerror(errno));
+}
+
+/* Remove staging directory of the restore to stdout in case of error */
+static void
+unlink_staging_dir_atexit(bool fatal, void *userdata)
+{
+	pgut_rmtree((const char *) userdata, true, false);
+}
+
 /*
  * Restore files into $PGDATA.
  */
 static void *
 restore_files(void *arg)
 {
-	int         i;
+	int         file_num;
+	int         queue_num = -1;
 	uint64      n_files;
 	char        to_fullpath[MAXPGPATH];
 	FILE       *out = NULL;
 	char       *out_buf = pgut_malloc(STDIO_BUFSIZE);
+	pgFile     *dest_file;
+	fio_batch_item *chmod_batch;
+	int         n_chmod = 0;
 
 	restore_files_arg *arguments = (restore_files_arg *) arg;
 
-	n_files = (unsigned long) parray_num(arguments->dest_files);
+	n_files = (unsigned long) io_queues_num_files(arguments->queues);
+
+	/* chmod of restored files is sent in batches, not per file */
+	chmod_batch = pgut_malloc(sizeof(fio_batch_item) * FIO_BATCH_MAX_ITEMS);
 
-	for (i = 0; i < parray_num(arguments->dest_files); i++)
+	/* Directories were created before, so queues contain only files */
+	while ((dest_file = io_queues_next(arguments->queues, &queue_num, &file_num)) != NULL)
 	{
 		bool     already_exists = false;
 		PageState      *checksum_map = NULL; /* it should take ~1.5MB at most */
 		datapagemap_t  *lsn_map = NULL;      /* it should take 16kB at most */
 		char           *errmsg = NULL;       /* remote agent error message */
-		pgFile	*dest_file = (pgFile *) parray_get(arguments->dest_files, i);
-
-		/* Directories were created before */
-		if (S_ISDIR(dest_file->mode))
-			continue;
-
-		if (!pg_atomic_test_set_flag(&dest_file->lock))
-			continue;
 
 		/* check for interrupt */
 		if (interrupted || thread_interrupted)
@@ -1133,7 +1603,7 @@ restore_files(void *arg)
 
 		if (progress)
 			elog(INFO, "Progress: (%d/%lu). Restore file \"%s\"",
-				 i + 1, n_files, dest_file->rel_path);
+				 file_num, n_files, dest_file->rel_path);
 
 		/* Only files from pgdata can be skipped by partial restore */
 		if (arguments->dbOid_exclude_list && dest_file->external_dir_num == 0)
@@ -1233,10 +1703,9 @@ restore_files(void *arg)
 			elog(ERROR, "Cannot open restore target file \"%s\": %s",
 				 to_fullpath, strerror(errno));
 
-		/* update file permission */
-		if (fio_chmod(to_fullpath, dest_file->mode, FIO_DB_HOST) == -1)
-			elog(ERROR, "Cannot change mode of \"%s\": %s", to_fullpath,
-				 strerror(errno));
+		/* update file permission, the file exists already */
+		batch_file_request(chmod_batch, &n_chmod, FIO_CHMOD, dest_file->mode,
+						   to_fullpath);
 
 		if (!dest_file->is_datafile || dest_file->is_cfs)
 			elog(VERBOSE, "Restoring nonedata file: \"%s\"", to_fullpath);
@@ -1292,6 +1761,9 @@ done:
 
 	free(out_buf);
 
+	flush_file_batch(chmod_batch, &n_chmod);
+	pg_free(chmod_batch);
+
 	/* ssh connection to longer needed */
 	fio_disconnect();
 
@@ -1301,6 +1773,248 @@ done:
 	return NULL;
 }
 
+/* Entry of autoprewarm.blocks, see contrib/pg_prewarm/autoprewarm.c */
+typedef struct PrewarmBlock
+{
+	XLogRecPtr	lsn;
+	Oid			database;
+	Oid			tablespace;
+	Oid			filenode;
+	int			forknum;
+	BlockNumber	blocknum;
+} PrewarmBlock;
+
+/* restore heap property of min-heap by lsn for the element at 'i' */
+static void
+prewarm_heap_sift_down(PrewarmBlock *heap, int n, int i)
+{
+	for (;;)
+	{
+		int			smallest = i;
+		int			left = 2 * i + 1;
+		int			right = 2 * i + 2;
+		PrewarmBlock tmp;
+
+		if (left < n && heap[left].lsn < heap[smallest].lsn)
+			smallest = left;
+		if (right < n && heap[right].lsn < heap[smallest].lsn)
+			smallest = right;
+		if (smallest == i)
+			break;
+
+		tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+static void
+prewarm_heap_sift_up(PrewarmBlock *heap, int i)
+{
+	while (i > 0)
+	{
+		int			parent = (i - 1) / 2;
+		PrewarmBlock tmp;
+
+		if (heap[parent].lsn <= heap[i].lsn)
+			break;
+
+		tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+/* same order as autoprewarm uses for loading */
+static int
+prewarm_block_compare(const void *a, const void *b)
+{
+	const PrewarmBlock *b1 = (const PrewarmBlock *) a;
+	const PrewarmBlock *b2 = (const PrewarmBlock *) b;
+
+	if (b1->database != b2->database)
+		return b1->database > b2->database ? 1 : -1;
+	if (b1->tablespace != b2->tablespace)
+		return b1->tablespace > b2->tablespace ? 1 : -1;
+	if (b1->filenode != b2->filenode)
+		return b1->filenode > b2->filenode ? 1 : -1;
+	if (b1->forknum != b2->forknum)
+		return b1->forknum > b2->forknum ? 1 : -1;
+	if (b1->blocknum != b2->blocknum)
+		return b1->blocknum > b2->blocknum ? 1 : -1;
+	return 0;
+}
+
+/*
+ * Get relation identity of data file for autoprewarm.blocks.
+ * Only main, fsm and vm forks are of interest.
+ */
+static bool
+get_prewarm_relation(pgFile *file, Oid *tablespace, Oid *filenode, int *forknum)
+{
+	char	   *fork;
+
+	if (path_is_prefix_of_path("global", file->rel_path))
+		*tablespace = GLOBALTABLESPACE_OID;
+	else if (path_is_prefix_of_path("base", file->rel_path))
+		*tablespace = DEFAULTTABLESPACE_OID;
+	else if (path_is_prefix_of_path(PG_TBLSPC_DIR, file->rel_path))
+	{
+		if (sscanf(file->rel_path, PG_TBLSPC_DIR "/%u/", tablespace) != 1)
+			return false;
+	}
+	else
+		return false;
+
+	if (sscanf(file->name, "%u", filenode) != 1)
+		return false;
+
+	fork = strchr(file->name, '_');
+	if (fork == NULL)
+		*forknum = MAIN_FORKNUM;
+	else if (strncmp(fork + 1, "fsm", 3) == 0)
+		*forknum = FSM_FORKNUM;
+	else if (strncmp(fork + 1, "vm", 2) == 0)
+		*forknum = VISIBILITYMAP_FORKNUM;
+	else
+		return false;
+
+	return true;
+}
+
+/*
+ * Write autoprewarm.blocks into restored data directory, listing up to
+ * 'max_blocks' blocks with the highest LSN, i.e. changed most recently
+ * before the backup. LSNs are taken from page headers of the backup chain,
+ * so no data is read. With pg_prewarm in shared_preload_libraries the
+ * server loads these blocks into shared buffers right after the start.
+ */
+static void
+write_prewarm_blocks(parray *dest_files, parray *parent_chain,
+					 parray *dbOid_exclude_list, const char *to_root,
+					 int max_blocks, fio_location location)
+{
+	int			i;
+	int			n_blocks = 0;
+	PrewarmBlock *heap = (PrewarmBlock *) pgut_malloc(sizeof(PrewarmBlock) * max_blocks);
+	char		path[MAXPGPATH];
+	FILE	   *out;
+	char	   *buf;
+	size_t		buf_len = 0;
+	time_t		start_time, end_time;
+	char		pretty_time[20];
+
+	time(&start_time);
+
+	for (i = 0; i < parray_num(dest_files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(dest_files, i);
+		XLogRecPtr *lsns;
+		Oid			tablespace;
+		Oid			filenode;
+		int			forknum;
+		BlockNumber	blknum;
+
+		if (!S_ISREG(file->mode) || !file->is_datafile || file->is_cfs ||
+			file->external_dir_num != 0)
+			continue;
+
+		/* files of excluded databases are restored empty */
+		if (dbOid_exclude_list &&
+			parray_bsearch(dbOid_exclude_list, &file->dbOid, pgCompareOid))
+			continue;
+
+		if (!get_prewarm_relation(file, &tablespace, &filenode, &forknum))
+			continue;
+
+		if (interrupted)
+			elog(ERROR, "Interrupted during autoprewarm list creation");
+
+		lsns = get_data_file_block_lsns(parent_chain, file);
+		if (lsns == NULL)
+			continue;
+
+		for (blknum = 0; blknum < file->n_blocks; blknum++)
+		{
+			PrewarmBlock *block;
+
+			if (lsns[blknum] == InvalidXLogRecPtr)
+				continue;
+
+			if (n_blocks < max_blocks)
+			{
+				block = &heap[n_blocks];
+				n_blocks++;
+			}
+			else if (lsns[blknum] > heap[0].lsn)
+				block = &heap[0];
+			else
+				continue;
+
+			block->lsn = lsns[blknum];
+			block->database = file->dbOid;
+			block->tablespace = tablespace;
+			block->filenode = filenode;
+			block->forknum = forknum;
+			block->blocknum = file->segno * RELSEG_SIZE + blknum;
+
+			if (block == &heap[0])
+				prewarm_heap_sift_down(heap, n_blocks, 0);
+			else
+				prewarm_heap_sift_up(heap, n_blocks - 1);
+		}
+
+		pg_free(lsns);
+	}
+
+	qsort(heap, n_blocks, sizeof(PrewarmBlock), prewarm_block_compare);
+
+	join_path_components(path, to_root, AUTOPREWARM_FILE);
+
+	out = fio_fopen(path, PG_BINARY_W, location);
+	if (out == NULL)
+		elog(ERROR, "Cannot open file \"%s\": %s", path, strerror(errno));
+
+	buf = pgut_malloc(STDIO_BUFSIZE);
+
+	buf_len = snprintf(buf, STDIO_BUFSIZE, "<<%d>>\n", n_blocks);
+
+	for (i = 0; i < n_blocks; i++)
+	{
+		PrewarmBlock *block = &heap[i];
+
+		/* flush buffer if the next line may not fit */
+		if (STDIO_BUFSIZE - buf_len < 64)
+		{
+			if (fio_fwrite(out, buf, buf_len) != buf_len)
+				elog(ERROR, "Cannot write to \"%s\": %s", path, strerror(errno));
+			buf_len = 0;
+		}
+
+		buf_len += snprintf(buf + buf_len, STDIO_BUFSIZE - buf_len,
+							"%u,%u,%u,%d,%u\n",
+							block->database, block->tablespace,
+							block->filenode, block->forknum, block->blocknum);
+	}
+
+	if (buf_len > 0 && fio_fwrite(out, buf, buf_len) != buf_len)
+		elog(ERROR, "Cannot write to \"%s\": %s", path, strerror(errno));
+
+	if (fio_fflush(out) != 0 || fio_fclose(out) != 0)
+		elog(ERROR, "Cannot close file \"%s\": %s", path, strerror(errno));
+
+	time(&end_time);
+	pretty_time_interval(difftime(end_time, start_time),
+						 pretty_time, lengthof(pretty_time));
+	elog(INFO, "File \"%s\" with %i blocks is created, time elapsed: %s",
+		 AUTOPREWARM_FILE, n_blocks, pretty_time);
+
+	pg_free(buf);
+	pg_free(heap);
+}
+
 /*
  * Create recovery.conf (postgresql.auto.conf in case of PG12)
  * with given recovery target parameters
@@ -2010,33 +2724,21 @@ get_dbOid_exclude_list(pgBackup *backup, parray *datname_list,
 //	pg_crc32	crc;
 	parray		*database_map = NULL;
 	parray		*dbOid_exclude_list = NULL;
-	pgFile		*database_map_file = NULL;
 	char		path[MAXPGPATH];
 	char		database_map_path[MAXPGPATH];
-	parray		*files = NULL;
-
-	files = get_backup_filelist(backup, true);
-
-	/* look for 'database_map' file in backup_content.control */
-	for (i = 0; i < parray_num(files); i++)
-	{
-		pgFile	   *file = (pgFile *) parray_get(files, i);
 
-		if ((file->external_dir_num == 0) &&
-			strcmp(DATABASE_MAP, file->name) == 0)
-		{
-			database_map_file = file;
-			break;
-		}
-	}
+	join_path_components(path, backup->root_dir, DATABASE_DIR);
+	join_path_components(database_map_path, path, DATABASE_MAP);
 
-	if (!database_map_file)
+	/*
+	 * Look for 'database_map' file in backup directory. Do not load
+	 * the whole backup_content.control just for that, it can be huge
+	 * for a cluster with many databases.
+	 */
+	if (!fileExists(database_map_path, FIO_BACKUP_HOST))
 		elog(ERROR, "Backup %s doesn't contain a database_map, partial restore is impossible.",
 			base36enc(backup->start_time));
 
-	join_path_components(path, backup->root_dir, DATABASE_DIR);
-	join_path_components(database_map_path, path, DATABASE_MAP);
-
 	/* check database_map CRC */
 //	crc = pgFileGetCRC(database_map_path, true, true, NULL, FIO_LOCAL_HOST);
 //
@@ -2127,13 +2829,6 @@ get_dbOid_exclude_list(pgBackup *backup, parray *datname_list,
 		elog(ERROR, "Failed to find a match in database_map of backup %s for partial restore",
 					base36enc(backup->start_time));
 
-	/* clean backup filelist */
-	if (files)
-	{
-		parray_walk(files, pgFileFree);
-		parray_free(files);
-	}
-
 	/* sort dbOid array in ASC order */
 	parray_qsort(dbOid_exclude_list, pgCompareOid);
 
@@ -566,18 +566,6 @@ str2status(const char *status)
 	return BACKUP_STATUS_INVALID;
 }
 
-bool
-datapagemap_is_set(datapagemap_t *map, BlockNumber blkno)
-{
-	int			offset;
-	int			bitno;
-
-	offset = blkno / 8;
-	bitno = blkno % 8;
-
-	return (map->bitmapsize <= offset) ? false : (map->bitmap[offset] & (1 << bitno)) != 0;
-}
-
 /*
  * A debugging aid. Prints out the contents of the page map.
  */
@@ -111,6 +111,7 @@ static char const * const subcmd_names[] =
 	"help",
 	"version",
 	"catchup",
+	"synthesize",
 };
 
 ProbackupSubcmd
@@ -40,6 +40,7 @@ typedef enum ProbackupSubcmd
 	HELP_CMD,
 	VERSION_CMD,
 	CATCHUP_CMD,
+	SYNTHESIZE_CMD,
 } ProbackupSubcmd;
 
 typedef enum OptionSource
@@ -8,6 +8,14 @@
 #include "file.h"
 #include "storage/checksum.h"
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#endif
+#ifndef WIN32
+#include <sys/file.h>
+#endif
+
 #define PRINTF_BUF_SIZE  1024
 #define FILE_PERMISSIONS 0600
 
@@ -18,6 +26,61 @@ static __thread int fio_stdin = 0;
 static __thread int fio_stderr = 0;
 static char *async_errormsg = NULL;
 
+/*
+ * Batched metadata operations.
+ * Request body is an array of fio_batch_request, each followed by the path.
+ * Reply body is an array of errno values, one per item, followed by
+ * struct stat for every FIO_STAT item.
+ */
+
+typedef struct
+{
+	uint32		cop;
+	uint32		arg;
+	uint32		path_len;
+} fio_batch_request;
+
+#ifdef HAVE_LIBZSTD
+/*
+ * Streaming compression of the channel between master and agent.
+ * Compression is negotiated by FIO_CHANNEL_COMPRESS right after the agent
+ * is started. Compressed data is buffered and flushed only before waiting
+ * for the peer, i.e. before blocking on a read from the channel, and at the
+ * end of session, so small messages are compressed together. Compression
+ * context is kept for the whole session.
+ */
+#define FIO_CHANNEL_BUFSIZE (64*1024)
+
+typedef struct
+{
+	int			in;
+	int			out;
+	ZSTD_CStream *cstream;
+	ZSTD_DStream *dstream;
+	char	   *outbuf;
+	char	   *inbuf;
+	ZSTD_inBuffer input;	/* compressed data read from the channel */
+	bool		pending;	/* data written, but not flushed yet */
+} fio_channel;
+
+static __thread fio_channel *fio_chan = NULL;
+
+static void fio_channel_start(int in, int out, int level);
+static void fio_channel_flush(void);
+static void fio_channel_stop(void);
+
+#define fio_channel_compressed(fd) (fio_chan != NULL && \
+									((fd) == fio_chan->in || (fd) == fio_chan->out))
+#else
+#define fio_channel_compressed(fd) false
+#endif
+
+#ifdef __linux__
+/* set if sendfile() or splice() is not supported for our descriptors */
+static __thread bool fio_sendfile_disabled = false;
+static __thread bool fio_splice_disabled = false;
+#endif
+
 fio_location MyLocation;
 
 typedef struct
@@ -29,7 +92,9 @@ typedef struct
 	int         calg;
 	int         clevel;
 	int         bitmapsize;
+	bool        bitmap_sparse;
 	int         path_len;
+	int         agent_threads;
 } fio_send_request;
 
 typedef struct
@@ -225,9 +290,10 @@ fio_is_remote_simple(fio_location location)
 
 /* Try to read specified amount of bytes unless error or EOF are encountered */
 static ssize_t
-fio_read_all(int fd, void* buf, size_t size)
+fio_read_raw(int fd, void* buf, size_t size)
 {
 	size_t offs = 0;
+
 	while (offs < size)
 	{
 		ssize_t rc = read(fd, (char*)buf + offs, size - offs);
@@ -248,7 +314,7 @@ fio_read_all(int fd, void* buf, size_t size)
 
 /* Try to write specified amount of bytes unless error is encountered */
 static ssize_t
-fio_write_all(int fd, void const* buf, size_t size)
+fio_write_raw(int fd, void const* buf, size_t size)
 {
 	size_t offs = 0;
 	while (offs < size)
@@ -268,6 +334,269 @@ fio_write_all(int fd, void const* buf, size_t size)
 	return offs;
 }
 
+#ifdef HAVE_LIBZSTD
+/*
+ * Compress data and send it to the channel. Only complete blocks produced
+ * by the compressor are sent, the rest is sent by fio_channel_flush().
+ */
+static ssize_t
+fio_channel_write(void const* buf, size_t size)
+{
+	ZSTD_inBuffer input = { buf, size, 0 };
+
+	while (input.pos < input.size)
+	{
+		ZSTD_outBuffer output = { fio_chan->outbuf, FIO_CHANNEL_BUFSIZE, 0 };
+		size_t		rc;
+
+		rc = ZSTD_compressStream2(fio_chan->cstream, &output, &input, ZSTD_e_continue);
+		if (ZSTD_isError(rc))
+			elog(ERROR, "Cannot compress data for remote channel: %s",
+				 ZSTD_getErrorName(rc));
+
+		if (output.pos > 0 &&
+			fio_write_raw(fio_chan->out, fio_chan->outbuf, output.pos) != output.pos)
+			return -1;
+	}
+
+	fio_chan->pending = true;
+	return size;
+}
+
+/* Send all data buffered by the compressor */
+static void
+fio_channel_flush(void)
+{
+	ZSTD_inBuffer input = { NULL, 0, 0 };
+	size_t		remaining;
+
+	if (!fio_chan->pending)
+		return;
+
+	do
+	{
+		ZSTD_outBuffer output = { fio_chan->outbuf, FIO_CHANNEL_BUFSIZE, 0 };
+
+		remaining = ZSTD_compressStream2(fio_chan->cstream, &output, &input, ZSTD_e_flush);
+		if (ZSTD_isError(remaining))
+			elog(ERROR, "Cannot compress data for remote channel: %s",
+				 ZSTD_getErrorName(remaining));
+
+		if (output.pos > 0)
+			IO_CHECK(fio_write_raw(fio_chan->out, fio_chan->outbuf, output.pos),
+					 output.pos);
+	} while (remaining != 0);
+
+	fio_chan->pending = false;
+}
+
+/* Receive data from the channel and decompress it */
+static ssize_t
+fio_channel_read(void* buf, size_t size)
+{
+	ZSTD_outBuffer output = { buf, size, 0 };
+
+	while (output.pos < output.size)
+	{
+		size_t		rc;
+
+		rc = ZSTD_decompressStream(fio_chan->dstream, &output, &fio_chan->input);
+		if (ZSTD_isError(rc))
+			elog(ERROR, "Cannot decompress data from remote channel: %s",
+				 ZSTD_getErrorName(rc));
+
+		/* decompressor has flushed everything it could, need more input */
+		if (output.pos < output.size &&
+			fio_chan->input.pos == fio_chan->input.size)
+		{
+			ssize_t		n;
+
+			/* peer may be waiting for our data to reply */
+			fio_channel_flush();
+
+			n = read(fio_chan->in, fio_chan->inbuf, FIO_CHANNEL_BUFSIZE);
+
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				elog(ERROR, "fio_read_all error, fd %i: %s", fio_chan->in, strerror(errno));
+			}
+			else if (n == 0)
+				break;
+
+			fio_chan->input.size = n;
+			fio_chan->input.pos = 0;
+		}
+	}
+
+	return output.pos;
+}
+
+/* Switch channel to compressed mode */
+static void
+fio_channel_start(int in, int out, int level)
+{
+	size_t		rc;
+
+	fio_chan = pgut_malloc0(sizeof(fio_channel));
+	fio_chan->in = in;
+	fio_chan->out = out;
+	fio_chan->outbuf = pgut_malloc(FIO_CHANNEL_BUFSIZE);
+	fio_chan->inbuf = pgut_malloc(FIO_CHANNEL_BUFSIZE);
+	fio_chan->input.src = fio_chan->inbuf;
+	fio_chan->cstream = ZSTD_createCStream();
+	fio_chan->dstream = ZSTD_createDStream();
+
+	if (fio_chan->cstream == NULL || fio_chan->dstream == NULL)
+		elog(ERROR, "Cannot create zstd context for remote channel");
+
+	rc = ZSTD_CCtx_setParameter(fio_chan->cstream, ZSTD_c_compressionLevel, level);
+	if (ZSTD_isError(rc))
+		elog(ERROR, "Cannot set remote channel compression level %d: %s",
+			 level, ZSTD_getErrorName(rc));
+}
+
+static void
+fio_channel_stop(void)
+{
+	if (fio_chan == NULL)
+		return;
+
+	ZSTD_freeCStream(fio_chan->cstream);
+	ZSTD_freeDStream(fio_chan->dstream);
+	pg_free(fio_chan->outbuf);
+	pg_free(fio_chan->inbuf);
+	pg_free(fio_chan);
+	fio_chan = NULL;
+}
+#endif
+
+/* Read data from the channel or from a local file */
+static ssize_t
+fio_read_all(int fd, void* buf, size_t size)
+{
+#ifdef HAVE_LIBZSTD
+	if (fio_chan && fd == fio_chan->in)
+		return fio_channel_read(buf, size);
+#endif
+	return fio_read_raw(fd, buf, size);
+}
+
+/* Write data to the channel or to a local file */
+static ssize_t
+fio_write_all(int fd, void const* buf, size_t size)
+{
+#ifdef HAVE_LIBZSTD
+	if (fio_chan && fd == fio_chan->out)
+		return fio_channel_write(buf, size);
+#endif
+	return fio_write_raw(fd, buf, size);
+}
+
+/*
+ * Copy len bytes from the current position of file fd to the channel.
+ * When the channel is not compressed, sendfile() is used to avoid copying
+ * data through userspace. Returns number of bytes copied, which is less
+ * than len on error (errno is set) or EOF (errno is 0).
+ */
+static size_t
+fio_copy_to_channel(int out, int fd, size_t len)
+{
+	size_t		offs = 0;
+	char	   *buf;
+
+#ifdef __linux__
+	if (!fio_sendfile_disabled && !fio_channel_compressed(out))
+	{
+		while (offs < len)
+		{
+			ssize_t		rc = sendfile(out, fd, NULL, len - offs);
+
+			if (rc < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				/* not supported for these descriptors, copy it as usual */
+				if (offs == 0 && (errno == EINVAL || errno == ENOSYS))
+				{
+					fio_sendfile_disabled = true;
+					break;
+				}
+				return offs;
+			}
+			else if (rc == 0)
+			{
+				errno = 0;
+				return offs;
+			}
+			offs += rc;
+		}
+
+		if (offs == len)
+			return len;
+	}
+#endif
+
+	buf = pgut_malloc(Min(len, CHUNK_SIZE));
+	while (offs < len)
+	{
+		ssize_t		rc = read(fd, buf, Min(len - offs, CHUNK_SIZE));
+
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		else if (rc == 0)
+		{
+			errno = 0;
+			break;
+		}
+
+		IO_CHECK(fio_write_all(out, buf, rc), rc);
+		offs += rc;
+	}
+	pg_free(buf);
+
+	return offs;
+}
+
+/*
+ * Enable compression of the channel to the remote agent with specified
+ * zstd level. Must be called right after the agent is started.
+ */
+void
+fio_set_channel_compression(int level)
+{
+#ifdef HAVE_LIBZSTD
+	fio_header hdr;
+
+	hdr.cop = FIO_CHANNEL_COMPRESS;
+	hdr.handle = -1;
+	hdr.size = 0;
+	hdr.arg = level;
+
+	IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+	IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
+	Assert(hdr.cop == FIO_CHANNEL_COMPRESS);
+
+	if (hdr.arg != 0)
+	{
+		elog(WARNING, "Remote agent does not support channel compression, "
+			 "data is transferred uncompressed");
+		return;
+	}
+
+	fio_channel_start(fio_stdin, fio_stdout, level);
+	elog(LOG, "Remote channel compression is enabled, level %d", level);
+#else
+	/* --remote-compress-level is rejected at startup, do not ask the agent */
+	elog(ERROR, "This build does not support zstd compression");
+#endif
+}
+
 /* Get version of remote agent */
 int
 fio_get_agent_version(void)
@@ -487,6 +816,9 @@ fio_disconnect(void)
 		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
 		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
 		Assert(hdr.cop == FIO_DISCONNECTED);
+#ifdef HAVE_LIBZSTD
+		fio_channel_stop();
+#endif
 		SYS_CHECK(close(fio_stdin));
 		SYS_CHECK(close(fio_stdout));
 		SYS_CHECK(close(fio_stderr));
@@ -1320,6 +1652,7 @@ fio_sync(char const* path, fio_location location)
 	{
 		fio_header hdr;
 		size_t path_len = strlen(path) + 1;
+
 		hdr.cop = FIO_SYNC;
 		hdr.handle = -1;
 		hdr.size = path_len;
@@ -1355,116 +1688,672 @@ fio_sync(char const* path, fio_location location)
 	}
 }
 
-/* Get crc32 of file */
-pg_crc32
-fio_get_crc32(const char *file_path, fio_location location, bool decompress)
+/* Flush whole filesystem containing the path */
+static int
+fio_syncfs_impl(char const* path)
 {
-	if (fio_is_remote(location))
-	{
-		fio_header hdr;
-		size_t path_len = strlen(file_path) + 1;
-		pg_crc32 crc = 0;
-		hdr.cop = FIO_GET_CRC32;
-		hdr.handle = -1;
-		hdr.size = path_len;
-		hdr.arg = 0;
+#ifdef __linux__
+	int		fd;
+	int		rc;
+	int		save_errno;
 
-		if (decompress)
-			hdr.arg = 1;
+	fd = open(path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+		return -1;
 
-		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
-		IO_CHECK(fio_write_all(fio_stdout, file_path, path_len), path_len);
-		IO_CHECK(fio_read_all(fio_stdin, &crc, sizeof(crc)), sizeof(crc));
+	rc = syncfs(fd);
+	save_errno = errno;
+	close(fd);
+	errno = save_errno;
 
-		return crc;
-	}
-	else
-	{
-		if (decompress)
-			return pgFileGetCRCgz(file_path, true, true);
-		else
-			return pgFileGetCRC(file_path, true, true);
-	}
+	return rc;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
 }
 
-/* Remove file */
+/*
+ * Sync filesystem, containing the path. Allows to flush many files
+ * with a single system call.
+ * Returns -1 with errno set to ENOSYS, if it is not supported.
+ */
 int
-fio_unlink(char const* path, fio_location location)
+fio_syncfs(char const* path, fio_location location)
 {
 	if (fio_is_remote(location))
 	{
 		fio_header hdr;
 		size_t path_len = strlen(path) + 1;
-		hdr.cop = FIO_UNLINK;
+		hdr.cop = FIO_SYNCFS;
 		hdr.handle = -1;
 		hdr.size = path_len;
 
 		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
 		IO_CHECK(fio_write_all(fio_stdout, path, path_len), path_len);
+		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
+
+		if (hdr.arg != 0)
+		{
+			errno = hdr.arg;
+			return -1;
+		}
 
-		// TODO: error is swallowed ?
 		return 0;
 	}
 	else
-	{
-		return remove_file_or_dir(path);
-	}
+		return fio_syncfs_impl(path);
 }
 
-/* Create directory
- * TODO: add strict flag
+/* Request to pack WAL segments */
+typedef struct
+{
+	int		n_segments;
+	uint32	wal_seg_size;
+	bool	no_sync;
+	char	first_wal_file_name[MAXFNAMELEN];
+} fio_wal_pack_request;
+
+/*
+ * Add size of the pack to WAL_PACK_SIZES_FILE in archive directory,
+ * so that packs can be found after --wal-pack-size is changed.
  */
-int
-fio_mkdir(char const* path, int mode, fio_location location)
+static int
+fio_register_wal_pack_size(char const* archive_dir, int n_segments, bool no_sync)
 {
-	if (fio_is_remote(location))
-	{
-		fio_header hdr;
-		size_t path_len = strlen(path) + 1;
-		hdr.cop = FIO_MKDIR;
-		hdr.handle = -1;
-		hdr.size = path_len;
-		hdr.arg = mode;
+	char		path[MAXPGPATH];
+	char		buf[256];
+	ssize_t		len = 0;
+	ssize_t		rc;
+	int			fd;
+	int			save_errno;
 
-		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
-		IO_CHECK(fio_write_all(fio_stdout, path, path_len), path_len);
+	join_path_components(path, archive_dir, WAL_PACK_SIZES_FILE);
 
-		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
-		Assert(hdr.cop == FIO_MKDIR);
+	fd = open(path, O_RDWR | O_CREAT | O_APPEND | PG_BINARY, FILE_PERMISSIONS);
+	if (fd < 0)
+		return -1;
 
-		return hdr.arg;
+	while (len < sizeof(buf) - 1 &&
+		   (rc = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += rc;
+	buf[len] = '\0';
+
+	if (parse_wal_pack_sizes(buf) & n_segments)
+	{
+		close(fd);
+		return 0;
 	}
-	else
+
+	len = snprintf(buf, sizeof(buf), "%d\n", n_segments);
+	if (write(fd, buf, len) != len ||
+		(!no_sync && fsync(fd) != 0))
 	{
-		return dir_create_dir(path, mode, false);
+		save_errno = errno;
+		close(fd);
+		errno = save_errno ? save_errno : ENOSPC;
+		return -1;
 	}
+
+	return close(fd);
 }
 
-/* Change file mode */
-int
-fio_chmod(char const* path, int mode, fio_location location)
+/*
+ * Copy n_segments WAL segments, starting with first_wal_file_name,
+ * into pack file and remove them. See WalPackEntry for the format.
+ * Returns 0 if pack is created or already exists. If some segment is
+ * missing, returns -1 with errno set to ENOENT and does nothing.
+ * If the group is being packed by another process, returns -1 with
+ * errno set to EBUSY.
+ */
+static int
+fio_wal_pack_impl(char const* archive_dir, fio_wal_pack_request *req)
 {
-	if (fio_is_remote(location))
-	{
-		fio_header hdr;
-		size_t path_len = strlen(path) + 1;
-		hdr.cop = FIO_CHMOD;
-		hdr.handle = -1;
-		hdr.size = path_len;
-		hdr.arg = mode;
+	static const char *suffixes[] = {"", ".gz", ".zst"};
+	TimeLineID	tli;
+	XLogSegNo	first_segno;
+	WalPackEntry *entries = NULL;
+	WalPackTrailer trailer;
+	struct stat	pack_st;
+	struct stat	part_st;
+	char		pack_path[MAXPGPATH];
+	char		pack_path_part[MAXPGPATH];
+	char		path[MAXPGPATH];
+	char		wal_file_name[MAXFNAMELEN];
+	char	   *buf = NULL;
+	FILE	   *in = NULL;
+	FILE	   *out = NULL;
+	uint64		offset = 0;
+	size_t		read_len;
+	int			fd = -1;
+	int			save_errno;
+	int			i, j;
+
+	GetXLogFromFileName(req->first_wal_file_name, &tli, &first_segno, req->wal_seg_size);
+
+	join_path_components(pack_path, archive_dir, req->first_wal_file_name);
+	strncat(pack_path, ".pack", MAXPGPATH - strlen(pack_path) - 1);
+	snprintf(pack_path_part, MAXPGPATH, "%s.part", pack_path);
+
+	if (access(pack_path, F_OK) == 0)
+		return 0;
 
-		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
-		IO_CHECK(fio_write_all(fio_stdout, path, path_len), path_len);
+	/*
+	 * Part file is locked until it is renamed, so concurrent packers of
+	 * the same group never write into one file. Lock of a crashed packer
+	 * is released by the kernel and its part file is simply rewritten.
+	 */
+	fd = open(pack_path_part, O_WRONLY | O_CREAT | PG_BINARY, FILE_PERMISSIONS);
+	if (fd < 0)
+		return -1;
 
-		return 0;
-	}
-	else
+#ifndef WIN32
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0)
 	{
-		return chmod(path, mode);
+		save_errno = errno;
+		close(fd);
+		errno = (save_errno == EWOULDBLOCK) ? EBUSY : save_errno;
+		return -1;
 	}
-}
-
-#ifdef HAVE_LIBZ
+#endif
+
+	/* pack could be completed while we were opening the part file */
+	if (stat(pack_path, &pack_st) == 0)
+	{
+		/* remove our own empty part file, but not the renamed pack */
+		if (fstat(fd, &part_st) == 0 && part_st.st_ino != pack_st.st_ino)
+			unlink(pack_path_part);
+		close(fd);
+		return 0;
+	}
+
+	/* every segment must be present in the archive */
+	entries = pgut_malloc(sizeof(WalPackEntry) * req->n_segments);
+	for (i = 0; i < req->n_segments; i++)
+	{
+		GetXLogFileName(wal_file_name, tli, first_segno + i, req->wal_seg_size);
+
+		for (j = 0; j < lengthof(suffixes); j++)
+		{
+			snprintf(entries[i].name, MAXFNAMELEN, "%s%s", wal_file_name, suffixes[j]);
+			join_path_components(path, archive_dir, entries[i].name);
+			if (access(path, F_OK) == 0)
+				break;
+		}
+
+		if (j == lengthof(suffixes))
+		{
+			errno = ENOENT;
+			goto error;
+		}
+	}
+
+	if (fio_register_wal_pack_size(archive_dir, req->n_segments, req->no_sync) != 0 ||
+		ftruncate(fd, 0) != 0)
+		goto error;
+
+	out = fdopen(fd, PG_BINARY_W);
+	if (out == NULL)
+		goto error;
+	fd = -1;
+
+	buf = pgut_malloc(STDIO_BUFSIZE);
+
+	for (i = 0; i < req->n_segments; i++)
+	{
+		join_path_components(path, archive_dir, entries[i].name);
+
+		in = fopen(path, PG_BINARY_R);
+		if (in == NULL)
+			goto error;
+
+		entries[i].offset = offset;
+		entries[i].size = 0;
+		INIT_FILE_CRC32(true, entries[i].crc);
+
+		while ((read_len = fread(buf, 1, STDIO_BUFSIZE, in)) > 0)
+		{
+			if (fwrite(buf, 1, read_len, out) != read_len)
+				goto error;
+
+			COMP_FILE_CRC32(true, entries[i].crc, buf, read_len);
+			entries[i].size += read_len;
+		}
+
+		if (ferror(in))
+			goto error;
+
+		FIN_FILE_CRC32(true, entries[i].crc);
+		offset += entries[i].size;
+
+		fclose(in);
+		in = NULL;
+	}
+
+	trailer.n_entries = req->n_segments;
+	trailer.magic = WAL_PACK_MAGIC;
+
+	if (fwrite(entries, sizeof(WalPackEntry), req->n_segments, out) != req->n_segments ||
+		fwrite(&trailer, sizeof(trailer), 1, out) != 1 ||
+		fflush(out) != 0)
+		goto error;
+
+	if (!req->no_sync && fsync(fileno(out)) != 0)
+		goto error;
+
+	/* rename under the lock, so nobody can truncate the part file */
+	if (rename(pack_path_part, pack_path) != 0)
+		goto error;
+
+	if (fclose(out) != 0)
+	{
+		out = NULL;
+		goto error;
+	}
+	out = NULL;
+
+	/* make rename durable before removing the only other copy of segments */
+	if (!req->no_sync)
+	{
+		int		dir_fd = open(archive_dir, O_RDONLY | PG_BINARY, 0);
+
+		if (dir_fd < 0)
+			goto error;
+
+		if (fsync(dir_fd) != 0)
+		{
+			save_errno = errno;
+			close(dir_fd);
+			errno = save_errno;
+			goto error;
+		}
+		close(dir_fd);
+	}
+
+	/* segments are in pack now */
+	for (i = 0; i < req->n_segments; i++)
+	{
+		join_path_components(path, archive_dir, entries[i].name);
+		unlink(path);
+	}
+
+	pg_free(buf);
+	pg_free(entries);
+	return 0;
+
+error:
+	save_errno = errno;
+	if (in)
+		fclose(in);
+	if (access(pack_path, F_OK) != 0)
+		unlink(pack_path_part);
+	if (out)
+		fclose(out);
+	if (fd >= 0)
+		close(fd);
+	pg_free(buf);
+	pg_free(entries);
+	errno = save_errno;
+	return -1;
+}
+
+/*
+ * Pack n_segments WAL segments, starting with first_wal_file_name.
+ * Packing is done where archive is located, segments are not transferred.
+ */
+int
+fio_wal_pack(char const* archive_dir, char const* first_wal_file_name,
+			 int n_segments, uint32 wal_seg_size, bool no_sync,
+			 fio_location location)
+{
+	fio_wal_pack_request req;
+
+	memset(&req, 0, sizeof(req));
+	req.n_segments = n_segments;
+	req.wal_seg_size = wal_seg_size;
+	req.no_sync = no_sync;
+	strncpy(req.first_wal_file_name, first_wal_file_name, MAXFNAMELEN - 1);
+
+	if (fio_is_remote(location))
+	{
+		fio_header hdr;
+		size_t dir_len = strlen(archive_dir) + 1;
+
+		hdr.cop = FIO_WAL_PACK;
+		hdr.handle = -1;
+		hdr.size = sizeof(req) + dir_len;
+
+		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+		IO_CHECK(fio_write_all(fio_stdout, &req, sizeof(req)), sizeof(req));
+		IO_CHECK(fio_write_all(fio_stdout, archive_dir, dir_len), dir_len);
+		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
+
+		if (hdr.arg != 0)
+		{
+			errno = hdr.arg;
+			return -1;
+		}
+
+		return 0;
+	}
+	else
+		return fio_wal_pack_impl(archive_dir, &req);
+}
+
+static pg_crc32
+fio_get_crc32_impl(const char *file_path, int compress_alg)
+{
+	switch (compress_alg)
+	{
+		case ZLIB_COMPRESS:
+			return pgFileGetCRCgz(file_path, true, true);
+#ifdef HAVE_LIBZSTD
+		case ZSTD_COMPRESS:
+			return pgFileGetCRCzstd(file_path, true, true);
+#endif
+		default:
+			return pgFileGetCRC(file_path, true, true);
+	}
+}
+
+/*
+ * Get crc32 of file. If compress_alg is ZLIB_COMPRESS or ZSTD_COMPRESS,
+ * crc32 of decompressed content is calculated.
+ */
+pg_crc32
+fio_get_crc32(const char *file_path, fio_location location, int compress_alg)
+{
+	if (fio_is_remote(location))
+	{
+		fio_header hdr;
+		size_t path_len = strlen(file_path) + 1;
+		pg_crc32 crc = 0;
+		hdr.cop = FIO_GET_CRC32;
+		hdr.handle = -1;
+		hdr.size = path_len;
+		hdr.arg = compress_alg;
+
+		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+		IO_CHECK(fio_write_all(fio_stdout, file_path, path_len), path_len);
+		IO_CHECK(fio_read_all(fio_stdin, &crc, sizeof(crc)), sizeof(crc));
+
+		return crc;
+	}
+	else
+		return fio_get_crc32_impl(file_path, compress_alg);
+}
+
+/* Remove file */
+int
+fio_unlink(char const* path, fio_location location)
+{
+	if (fio_is_remote(location))
+	{
+		fio_header hdr;
+		size_t path_len = strlen(path) + 1;
+		hdr.cop = FIO_UNLINK;
+		hdr.handle = -1;
+		hdr.size = path_len;
+
+		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+		IO_CHECK(fio_write_all(fio_stdout, path, path_len), path_len);
+
+		// TODO: error is swallowed ?
+		return 0;
+	}
+	else
+	{
+		return remove_file_or_dir(path);
+	}
+}
+
+/* Create directory
+ * TODO: add strict flag
+ */
+int
+fio_mkdir(char const* path, int mode, fio_location location)
+{
+	if (fio_is_remote(location))
+	{
+		fio_header hdr;
+		size_t path_len = strlen(path) + 1;
+
+		hdr.cop = FIO_MKDIR;
+		hdr.handle = -1;
+		hdr.size = path_len;
+		hdr.arg = mode;
+
+		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+		IO_CHECK(fio_write_all(fio_stdout, path, path_len), path_len);
+
+		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
+		Assert(hdr.cop == FIO_MKDIR);
+
+		if (hdr.arg != 0)
+		{
+			errno = hdr.arg;
+			return -1;
+		}
+		return 0;
+	}
+	else
+	{
+		return dir_create_dir(path, mode, false);
+	}
+}
+
+/* Change file mode */
+int
+fio_chmod(char const* path, int mode, fio_location location)
+{
+	if (fio_is_remote(location))
+	{
+		fio_header hdr;
+		size_t path_len = strlen(path) + 1;
+
+		hdr.cop = FIO_CHMOD;
+		hdr.handle = -1;
+		hdr.size = path_len;
+		hdr.arg = mode;
+
+		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+		IO_CHECK(fio_write_all(fio_stdout, path, path_len), path_len);
+
+		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
+		Assert(hdr.cop == FIO_CHMOD);
+
+		if (hdr.arg != 0)
+		{
+			errno = hdr.arg;
+			return -1;
+		}
+		return 0;
+	}
+	else
+	{
+		return chmod(path, mode);
+	}
+}
+
+/* Execute single item of a batch, return errno or 0 */
+static int
+fio_batch_exec_item(uint32 cop, uint32 arg, char const* path, struct stat* st)
+{
+	int		fd;
+	int		rc = 0;
+
+	switch (cop)
+	{
+		case FIO_MKDIR:
+			rc = dir_create_dir(path, arg, false);
+			break;
+		case FIO_CHMOD:
+			rc = chmod(path, arg);
+			break;
+		case FIO_STAT:
+			rc = arg ? stat(path, st) : lstat(path, st);
+			break;
+		case FIO_SYNC:
+			fd = open(path, O_WRONLY | PG_BINARY, FILE_PERMISSIONS);
+			if (fd < 0)
+				return errno;
+			rc = fsync(fd);
+			if (rc < 0)
+			{
+				int		save_errno = errno;
+
+				close(fd);
+				return save_errno;
+			}
+			close(fd);
+			break;
+		default:
+			return EINVAL;
+	}
+
+	return rc < 0 ? errno : 0;
+}
+
+/* Send single batch message and read per-item results */
+static void
+fio_batch_send(fio_batch_item* items, int n_items)
+{
+	fio_header	hdr;
+	size_t		size = 0;
+	char	   *msg;
+	char	   *ptr;
+	int32	   *errnums;
+	int			n_stat = 0;
+	int			i;
+
+	for (i = 0; i < n_items; i++)
+		size += sizeof(fio_batch_request) + strlen(items[i].path) + 1;
+
+	msg = pgut_malloc(size);
+	ptr = msg;
+	for (i = 0; i < n_items; i++)
+	{
+		fio_batch_request req;
+
+		req.cop = items[i].cop;
+		req.arg = items[i].arg;
+		req.path_len = strlen(items[i].path) + 1;
+		memcpy(ptr, &req, sizeof(req));
+		memcpy(ptr + sizeof(req), items[i].path, req.path_len);
+		ptr += sizeof(req) + req.path_len;
+
+		if (items[i].cop == FIO_STAT)
+			n_stat++;
+	}
+
+	hdr.cop = FIO_BATCH;
+	hdr.handle = -1;
+	hdr.size = size;
+	hdr.arg = n_items;
+
+	IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+	IO_CHECK(fio_write_all(fio_stdout, msg, size), size);
+	pg_free(msg);
+
+	IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
+	Assert(hdr.cop == FIO_BATCH);
+
+	if (hdr.size != n_items * sizeof(int32) + n_stat * sizeof(struct stat))
+		elog(ERROR, "Unexpected size of batch reply from remote agent: %u", hdr.size);
+
+	errnums = pgut_malloc(n_items * sizeof(int32));
+	IO_CHECK(fio_read_all(fio_stdin, errnums, n_items * sizeof(int32)),
+			 n_items * sizeof(int32));
+
+	for (i = 0; i < n_items; i++)
+	{
+		items[i].errnum = errnums[i];
+
+		if (items[i].cop == FIO_STAT)
+			IO_CHECK(fio_read_all(fio_stdin, &items[i].st, sizeof(struct stat)),
+					 sizeof(struct stat));
+	}
+	pg_free(errnums);
+}
+
+/*
+ * Execute array of metadata operations (FIO_MKDIR, FIO_CHMOD, FIO_STAT,
+ * FIO_SYNC) at once. Remote items are sent in as few messages as possible.
+ * Result of every item is stored into its errnum (and st for FIO_STAT).
+ * Returns number of failed items.
+ */
+int
+fio_batch(fio_batch_item* items, int n_items, fio_location location)
+{
+	int		n_failed = 0;
+	int		i;
+
+	if (fio_is_remote(location))
+	{
+		for (i = 0; i < n_items; i += FIO_BATCH_MAX_ITEMS)
+			fio_batch_send(items + i, Min(n_items - i, FIO_BATCH_MAX_ITEMS));
+	}
+	else
+	{
+		for (i = 0; i < n_items; i++)
+			items[i].errnum = fio_batch_exec_item(items[i].cop, items[i].arg,
+												  items[i].path, &items[i].st);
+	}
+
+	for (i = 0; i < n_items; i++)
+		if (items[i].errnum != 0)
+			n_failed++;
+
+	return n_failed;
+}
+
+/* Execute batch of metadata operations on the agent side */
+static void
+fio_batch_impl(int out, char* buf, int n_items)
+{
+	fio_header	hdr;
+	int32	   *errnums = pgut_malloc(n_items * sizeof(int32));
+	struct stat *stats = NULL;
+	int			n_stat = 0;
+	char	   *ptr = buf;
+	int			i;
+
+	for (i = 0; i < n_items; i++)
+	{
+		fio_batch_request req;
+		struct stat st;
+
+		memcpy(&req, ptr, sizeof(req));
+		ptr += sizeof(req);
+
+		errnums[i] = fio_batch_exec_item(req.cop, req.arg, ptr, &st);
+		ptr += req.path_len;
+
+		if (req.cop == FIO_STAT)
+		{
+			if (stats == NULL)
+				stats = pgut_malloc(n_items * sizeof(struct stat));
+			stats[n_stat++] = st;
+		}
+	}
+
+	hdr.cop = FIO_BATCH;
+	hdr.handle = -1;
+	hdr.arg = n_items;
+	hdr.size = n_items * sizeof(int32) + n_stat * sizeof(struct stat);
+
+	IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+	IO_CHECK(fio_write_all(out, errnums, n_items * sizeof(int32)),
+			 n_items * sizeof(int32));
+	if (n_stat > 0)
+		IO_CHECK(fio_write_all(out, stats, n_stat * sizeof(struct stat)),
+				 n_stat * sizeof(struct stat));
+
+	pg_free(errnums);
+	pg_free(stats);
+}
+
+#ifdef HAVE_LIBZ
 
 #define ZLIB_BUFFER_SIZE     (64*1024)
 #define MAX_WBITS            15 /* 32K LZ77 window */
@@ -1785,7 +2674,6 @@ fio_load_file(int out, char const* path)
 {
 	int fd = open(path, O_RDONLY);
 	fio_header hdr;
-	void* buf = NULL;
 
 	hdr.cop = FIO_SEND;
 	hdr.size = 0;
@@ -1793,17 +2681,14 @@ fio_load_file(int out, char const* path)
 	if (fd >= 0)
 	{
 		off_t size = lseek(fd, 0, SEEK_END);
-		buf = pgut_malloc(size);
 		lseek(fd, 0, SEEK_SET);
-		IO_CHECK(fio_read_all(fd, buf, size), size);
 		hdr.size = size;
-		SYS_CHECK(close(fd));
 	}
 	IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
-	if (buf)
+	if (fd >= 0)
 	{
-		IO_CHECK(fio_write_all(out, buf, hdr.size), hdr.size);
-		free(buf);
+		IO_CHECK(fio_copy_to_channel(out, fd, hdr.size), hdr.size);
+		SYS_CHECK(close(fd));
 	}
 }
 
@@ -1852,16 +2737,13 @@ fio_send_pages(const char *to_fullpath, const char *from_fullpath, pgFile *file,
 	{
 		req.hdr.size = sizeof(fio_send_request) + (*file).pagemap.bitmapsize + strlen(from_fullpath) + 1;
 		req.arg.bitmapsize = (*file).pagemap.bitmapsize;
-
-		/* TODO: add optimization for the case of pagemap
-		 * containing small number of blocks with big serial numbers:
-		 * https://github.com/postgrespro/pg_probackup/blob/remote_page_backup/src/utils/file.c#L1211
-		 */
+		req.arg.bitmap_sparse = (*file).pagemap.sparse;
 	}
 	else
 	{
 		req.hdr.size = sizeof(fio_send_request) + strlen(from_fullpath) + 1;
 		req.arg.bitmapsize = 0;
+		req.arg.bitmap_sparse = false;
 	}
 
 	req.arg.nblocks = file->size/BLCKSZ;
@@ -1871,6 +2753,7 @@ fio_send_pages(const char *to_fullpath, const char *from_fullpath, pgFile *file,
 	req.arg.calg = calg;
 	req.arg.clevel = clevel;
 	req.arg.path_len = strlen(from_fullpath) + 1;
+	req.arg.agent_threads = agent_threads;
 
 	file->compress_alg = calg; /* TODO: wtf? why here? */
 
@@ -2019,16 +2902,13 @@ fio_copy_pages(const char *to_fullpath, const char *from_fullpath, pgFile *file,
 	{
 		req.hdr.size = sizeof(fio_send_request) + (*file).pagemap.bitmapsize + strlen(from_fullpath) + 1;
 		req.arg.bitmapsize = (*file).pagemap.bitmapsize;
-
-		/* TODO: add optimization for the case of pagemap
-		 * containing small number of blocks with big serial numbers:
-		 * https://github.com/postgrespro/pg_probackup/blob/remote_page_backup/src/utils/file.c#L1211
-		 */
+		req.arg.bitmap_sparse = (*file).pagemap.sparse;
 	}
 	else
 	{
 		req.hdr.size = sizeof(fio_send_request) + strlen(from_fullpath) + 1;
 		req.arg.bitmapsize = 0;
+		req.arg.bitmap_sparse = false;
 	}
 
 	req.arg.nblocks = file->size/BLCKSZ;
@@ -2038,6 +2918,7 @@ fio_copy_pages(const char *to_fullpath, const char *from_fullpath, pgFile *file,
 	req.arg.calg = calg;
 	req.arg.clevel = clevel;
 	req.arg.path_len = strlen(from_fullpath) + 1;
+	req.arg.agent_threads = agent_threads;
 
 	file->compress_alg = calg; /* TODO: wtf? why here? */
 
@@ -2158,11 +3039,211 @@ fio_copy_pages(const char *to_fullpath, const char *from_fullpath, pgFile *file,
 			elog(ERROR, "Remote agent returned message of unexpected type: %i", hdr.cop);
 	}
 
-	if (out)
-		fclose(out);
-	pg_free(out_buf);
+	if (out)
+		fclose(out);
+	pg_free(out_buf);
+
+	return n_blocks_read;
+}
+
+/*
+ * Pages read by fio_send_pages_impl() are collected into a batch, which is
+ * compressed by a pool of agent threads, and then sent in the order of blocks.
+ * Threads of the pool are started once per agent, when the first batch needs
+ * them, and then wait for the next batch on a condition variable.
+ */
+#define FIO_PAGE_BATCH_SIZE		32	/* pages per compression thread */
+#define FIO_MAX_AGENT_THREADS	32
+
+typedef struct
+{
+	BlockNumber blknum;
+	PageState	page_st;
+	char		page[BLCKSZ];
+	char		write_buffer[BLCKSZ*2];	/* BackupPageHeader and compressed page */
+} fio_page_slot;
+
+typedef struct
+{
+	fio_page_slot *slots;
+	int			n_slots;
+	int			max_slots;
+	int			n_workers;
+	int			calg;
+	int			clevel;
+	/* page headers */
+	BackupPageHeader2 *headers;
+	int32		hdr_num;
+	int64		cur_pos_out;
+} fio_page_batch;
+
+/* Share 0 of every batch is compressed by the agent main thread */
+static pthread_t fio_page_workers[FIO_MAX_AGENT_THREADS - 1];
+static uint32 fio_page_worker_start[FIO_MAX_AGENT_THREADS - 1];
+static int fio_n_page_workers = 0;
+
+static pthread_mutex_t fio_page_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signaled when the next batch is handed over to the pool */
+static pthread_cond_t fio_page_work_cond = PTHREAD_COND_INITIALIZER;
+/* Signaled when the last worker is done with its share */
+static pthread_cond_t fio_page_done_cond = PTHREAD_COND_INITIALIZER;
+static fio_page_batch *fio_page_work = NULL;
+static uint32 fio_page_generation = 0;
+static int fio_page_n_active = 0;	/* shares of the batch */
+static int fio_page_n_busy = 0;		/* workers not done with their shares */
+
+/* Compress page of the slot into its write buffer */
+static void
+fio_compress_page_slot(fio_page_slot *slot, int calg, int clevel)
+{
+	BackupPageHeader *bph = (BackupPageHeader *) slot->write_buffer;
+	int			compressed_size;
+
+	compressed_size = do_compress(slot->write_buffer + sizeof(BackupPageHeader),
+								  sizeof(slot->write_buffer) - sizeof(BackupPageHeader),
+								  slot->page, BLCKSZ, calg, clevel, NULL);
+
+	if (compressed_size <= 0 || compressed_size >= BLCKSZ)
+	{
+		/* Do not compress page */
+		memcpy(slot->write_buffer + sizeof(BackupPageHeader), slot->page, BLCKSZ);
+		compressed_size = BLCKSZ;
+	}
+	bph->block = slot->blknum;
+	bph->compressed_size = compressed_size;
+}
+
+/* Compress every n_shares-th page of the batch, starting with share */
+static void
+fio_compress_pages_share(fio_page_batch *batch, int share, int n_shares)
+{
+	int			i;
+
+	for (i = share; i < batch->n_slots; i += n_shares)
+		fio_compress_page_slot(&batch->slots[i], batch->calg, batch->clevel);
+}
+
+/* Compression thread of the pool, compresses share of every batch */
+static void *
+fio_compress_pages_worker(void *arg)
+{
+	int			worker = (int) (intptr_t) arg;
+	uint32		seen = fio_page_worker_start[worker];
+
+	pthread_lock(&fio_page_mutex);
+	for (;;)
+	{
+		fio_page_batch *batch;
+		int			share = worker + 1;
+		int			n_shares;
+
+		while (fio_page_generation == seen)
+			pthread_cond_wait(&fio_page_work_cond, &fio_page_mutex);
+		seen = fio_page_generation;
+
+		/* small batch does not need all of the workers */
+		if (share >= fio_page_n_active)
+			continue;
+
+		batch = fio_page_work;
+		n_shares = fio_page_n_active;
+		pthread_mutex_unlock(&fio_page_mutex);
+
+		fio_compress_pages_share(batch, share, n_shares);
+
+		pthread_lock(&fio_page_mutex);
+		if (--fio_page_n_busy == 0)
+			pthread_cond_signal(&fio_page_done_cond);
+	}
+
+	return NULL;
+}
+
+/*
+ * Make sure the pool has n_workers threads.
+ * Returns the number of threads available, which may be less on failure.
+ */
+static int
+fio_start_page_workers(int n_workers)
+{
+	while (fio_n_page_workers < n_workers)
+	{
+		int			worker = fio_n_page_workers;
+
+		/* batches handed over before the start are not for this thread */
+		fio_page_worker_start[worker] = fio_page_generation;
+		if (pthread_create(&fio_page_workers[worker], NULL,
+						   fio_compress_pages_worker, (void *) (intptr_t) worker) != 0)
+			break;
+		fio_n_page_workers++;
+	}
+
+	return Min(n_workers, fio_n_page_workers);
+}
+
+/* Compress pages of the batch and send them in order */
+static void
+fio_send_page_batch(int out, fio_page_batch *batch)
+{
+	fio_header	hdr;
+	int			n_shares = Min(batch->n_workers, batch->n_slots);
+	int			i;
+
+	if (batch->n_slots == 0)
+		return;
+
+	if (n_shares > 1)
+		n_shares = fio_start_page_workers(n_shares - 1) + 1;
+
+	if (n_shares > 1)
+	{
+		pthread_lock(&fio_page_mutex);
+		fio_page_work = batch;
+		fio_page_n_active = n_shares;
+		fio_page_n_busy = n_shares - 1;
+		fio_page_generation++;
+		pthread_cond_broadcast(&fio_page_work_cond);
+		pthread_mutex_unlock(&fio_page_mutex);
+
+		fio_compress_pages_share(batch, 0, n_shares);
+
+		pthread_lock(&fio_page_mutex);
+		while (fio_page_n_busy > 0)
+			pthread_cond_wait(&fio_page_done_cond, &fio_page_mutex);
+		pthread_mutex_unlock(&fio_page_mutex);
+	}
+	else
+		fio_compress_pages_share(batch, 0, 1);
+
+	for (i = 0; i < batch->n_slots; i++)
+	{
+		fio_page_slot *slot = &batch->slots[i];
+		BackupPageHeader *bph = (BackupPageHeader *) slot->write_buffer;
 
-	return n_blocks_read;
+		hdr.cop = FIO_PAGE;
+		hdr.arg = slot->blknum;
+		hdr.size = bph->compressed_size + sizeof(BackupPageHeader);
+
+		IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+		IO_CHECK(fio_write_all(out, slot->write_buffer, hdr.size), hdr.size);
+
+		/* set page header for this file */
+		batch->hdr_num++;
+		if (!batch->headers)
+			batch->headers = (BackupPageHeader2 *) pgut_malloc(sizeof(BackupPageHeader2));
+		else
+			batch->headers = (BackupPageHeader2 *) pgut_realloc(batch->headers,
+								(batch->hdr_num+1) * sizeof(BackupPageHeader2));
+
+		batch->headers[batch->hdr_num].block = slot->blknum;
+		batch->headers[batch->hdr_num].lsn = slot->page_st.lsn;
+		batch->headers[batch->hdr_num].checksum = slot->page_st.checksum;
+		batch->headers[batch->hdr_num].pos = batch->cur_pos_out;
+
+		batch->cur_pos_out += hdr.size;
+	}
+
+	batch->n_slots = 0;
 }
 
 /* TODO: read file using large buffer
@@ -2194,10 +3275,21 @@ fio_send_pages_impl(int out, char* buf)
 	/* parse buffer */
 	datapagemap_t *map = NULL;
 	datapagemap_iterator_t *iter = NULL;
-	/* page headers */
-	int32       hdr_num = -1;
-	int64       cur_pos_out = 0;
-	BackupPageHeader2 *headers = NULL;
+	/* pages to be compressed and sent */
+	fio_page_batch batch;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.hdr_num = -1;
+	batch.calg = req->calg;
+	batch.clevel = req->clevel;
+	batch.n_workers = 1;
+
+	/* pglz is not thread-safe */
+	if (req->calg == ZLIB_COMPRESS || req->calg == ZSTD_COMPRESS)
+		batch.n_workers = Max(1, Min(req->agent_threads, FIO_MAX_AGENT_THREADS));
+
+	batch.max_slots = batch.n_workers > 1 ? batch.n_workers * FIO_PAGE_BATCH_SIZE : 1;
+	batch.slots = pgut_malloc(batch.max_slots * sizeof(fio_page_slot));
 
 	/* open source file */
 	in = fopen(from_fullpath, PG_BINARY_R);
@@ -2236,7 +3328,11 @@ fio_send_pages_impl(int out, char* buf)
 	{
 		map = pgut_malloc(sizeof(datapagemap_t));
 		map->bitmapsize = req->bitmapsize;
-		map->bitmap = (char*) buf + sizeof(fio_send_request) + req->path_len;
+		map->sparse = req->bitmap_sparse;
+		/* array of block numbers must be aligned */
+		map->bitmap = pgut_malloc(req->bitmapsize);
+		memcpy(map->bitmap, (char*) buf + sizeof(fio_send_request) + req->path_len,
+			   req->bitmapsize);
 
 		/* get first block */
 		iter = datapagemap_iterate(map);
@@ -2282,13 +3378,18 @@ fio_send_pages_impl(int out, char* buf)
 			/* report error */
 			if (ferror(in))
 			{
+				int		errnum = errno;
+
+				/* pages read before the failed one go first */
+				fio_send_page_batch(out, &batch);
+
 				hdr.cop = FIO_ERROR;
 				hdr.arg = READ_FAILED;
 
 				errormsg = pgut_malloc(ERRMSG_MAX_LEN);
 				/* Construct the error message */
 				snprintf(errormsg, ERRMSG_MAX_LEN, "Cannot read block %u of '%s': %s",
-						blknum, from_fullpath, strerror(errno));
+						blknum, from_fullpath, strerror(errnum));
 				hdr.size = strlen(errormsg) + 1;
 
 				/* send header and message */
@@ -2319,6 +3420,8 @@ fio_send_pages_impl(int out, char* buf)
 			 */
 			if (--retry_attempts == 0)
 			{
+				fio_send_page_batch(out, &batch);
+
 				hdr.cop = FIO_SEND_FILE_CORRUPTION;
 				hdr.arg = blknum;
 
@@ -2354,46 +3457,15 @@ fio_send_pages_impl(int out, char* buf)
 			(page_st.lsn == InvalidXLogRecPtr) ||                     /* zeroed page */
 			(req->horizonLsn > 0 && page_st.lsn > req->horizonLsn))   /* delta, ptrack */
 		{
-			int  compressed_size = 0;
-			char write_buffer[BLCKSZ*2];
-			BackupPageHeader* bph = (BackupPageHeader*)write_buffer;
-
-			/* compress page */
-			hdr.cop = FIO_PAGE;
-			hdr.arg = blknum;
-
-			compressed_size = do_compress(write_buffer + sizeof(BackupPageHeader),
-										  sizeof(write_buffer) - sizeof(BackupPageHeader),
-										  read_buffer, BLCKSZ, req->calg, req->clevel,
-										  NULL);
+			fio_page_slot *slot = &batch.slots[batch.n_slots++];
 
-			if (compressed_size <= 0 || compressed_size >= BLCKSZ)
-			{
-				/* Do not compress page */
-				memcpy(write_buffer + sizeof(BackupPageHeader), read_buffer, BLCKSZ);
-				compressed_size = BLCKSZ;
-			}
-			bph->block = blknum;
-			bph->compressed_size = compressed_size;
-
-			hdr.size = compressed_size + sizeof(BackupPageHeader);
-
-			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
-			IO_CHECK(fio_write_all(out, write_buffer, hdr.size), hdr.size);
-
-			/* set page header for this file */
-			hdr_num++;
-			if (!headers)
-				headers = (BackupPageHeader2 *) pgut_malloc(sizeof(BackupPageHeader2));
-			else
-				headers = (BackupPageHeader2 *) pgut_realloc(headers, (hdr_num+1) * sizeof(BackupPageHeader2));
-
-			headers[hdr_num].block = blknum;
-			headers[hdr_num].lsn = page_st.lsn;
-			headers[hdr_num].checksum = page_st.checksum;
-			headers[hdr_num].pos = cur_pos_out;
+			slot->blknum = blknum;
+			slot->page_st = page_st;
+			memcpy(slot->page, read_buffer, BLCKSZ);
 
-			cur_pos_out += hdr.size;
+			/* compress and send collected pages */
+			if (batch.n_slots == batch.max_slots)
+				fio_send_page_batch(out, &batch);
 		}
 
 		/* next block */
@@ -2408,29 +3480,35 @@ fio_send_pages_impl(int out, char* buf)
 	}
 
 eof:
+	fio_send_page_batch(out, &batch);
+
 	/* We are done, send eof */
 	hdr.cop = FIO_SEND_FILE_EOF;
 	hdr.arg = n_blocks_read;
 	hdr.size = 0;
 
-	if (headers)
+	if (batch.headers)
 	{
-		hdr.size = (hdr_num+2) * sizeof(BackupPageHeader2);
+		hdr.size = (batch.hdr_num+2) * sizeof(BackupPageHeader2);
 
 		/* add dummy header */
-		headers = (BackupPageHeader2 *) pgut_realloc(headers, (hdr_num+2) * sizeof(BackupPageHeader2));
-		headers[hdr_num+1].pos = cur_pos_out;
+		batch.headers = (BackupPageHeader2 *) pgut_realloc(batch.headers,
+									(batch.hdr_num+2) * sizeof(BackupPageHeader2));
+		batch.headers[batch.hdr_num+1].pos = batch.cur_pos_out;
 	}
 	IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
 
-	if (headers)
-		IO_CHECK(fio_write_all(out, headers, hdr.size), hdr.size);
+	if (batch.headers)
+		IO_CHECK(fio_write_all(out, batch.headers, hdr.size), hdr.size);
 
 cleanup:
+	if (map)
+		pg_free(map->bitmap);
 	pg_free(map);
 	pg_free(iter);
 	pg_free(errormsg);
-	pg_free(headers);
+	pg_free(batch.headers);
+	pg_free(batch.slots);
 	if (in)
 		fclose(in);
 	return;
@@ -2459,6 +3537,8 @@ fio_send_file_gz(const char *from_fullpath, const char *to_fullpath, FILE* out,
 
 	hdr.cop = FIO_SEND_FILE;
 	hdr.size = path_len;
+	/* compressed data is decoded on the fly, no FIO_SEND_FILE_TRUNCATE */
+	hdr.arg = 0;
 
 //	elog(VERBOSE, "Thread [%d]: Attempting to open remote compressed WAL file '%s'",
 //			thread_num, from_fullpath);
@@ -2596,6 +3676,172 @@ cleanup:
 	return exit_code;
 }
 
+#ifdef HAVE_LIBZSTD
+/* Receive chunks of zstd-compressed data, decompress them and write to
+ * destination file.
+ * Return codes:
+ *   FILE_MISSING (-1)
+ *   OPEN_FAILED  (-2)
+ *   READ_FAILED  (-3)
+ *   WRITE_FAILED (-4)
+ *   REMOTE_ERROR (-6)
+ *   ZSTD_ERROR   (-7)
+ */
+int
+fio_send_file_zstd(const char *from_fullpath, const char *to_fullpath, FILE* out, char **errormsg)
+{
+	fio_header hdr;
+	int exit_code = SEND_OK;
+	size_t out_size = ZSTD_DStreamOutSize();
+	char *in_buf = pgut_malloc(CHUNK_SIZE);    /* buffer for compressed data */
+	char *out_buf = pgut_malloc(out_size);     /* buffer for decompressed data */
+	size_t path_len = strlen(from_fullpath) + 1;
+	/* decompressor */
+	ZSTD_DCtx *dctx = NULL;
+	size_t rc = 0;
+
+	hdr.cop = FIO_SEND_FILE;
+	hdr.size = path_len;
+	/* compressed data is decoded on the fly, no FIO_SEND_FILE_TRUNCATE */
+	hdr.arg = 0;
+
+	IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+	IO_CHECK(fio_write_all(fio_stdout, from_fullpath, path_len), path_len);
+
+	for (;;)
+	{
+		fio_header hdr;
+		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
+
+		if (hdr.cop == FIO_SEND_FILE_EOF)
+		{
+			/* decoder returns 0 only when the last frame is complete */
+			if (rc != 0)
+			{
+				*errormsg = pgut_malloc(ERRMSG_MAX_LEN);
+				snprintf(*errormsg, ERRMSG_MAX_LEN,
+						"Decompression failed for file '%s': unexpected end of file",
+						from_fullpath);
+				exit_code = ZSTD_ERROR;
+			}
+			break;
+		}
+		else if (hdr.cop == FIO_ERROR)
+		{
+			/* handle error, reported by the agent */
+			if (hdr.size > 0)
+			{
+				IO_CHECK(fio_read_all(fio_stdin, in_buf, hdr.size), hdr.size);
+				*errormsg = pgut_malloc(hdr.size);
+				snprintf(*errormsg, hdr.size, "%s", in_buf);
+			}
+			exit_code = hdr.arg;
+			goto cleanup;
+		}
+		else if (hdr.cop == FIO_PAGE)
+		{
+			ZSTD_inBuffer input;
+
+			Assert(hdr.size <= CHUNK_SIZE);
+			IO_CHECK(fio_read_all(fio_stdin, in_buf, hdr.size), hdr.size);
+
+			/* We have received a chunk of compressed data, lets decompress it */
+			if (dctx == NULL)
+			{
+				dctx = ZSTD_createDCtx();
+				if (dctx == NULL)
+				{
+					*errormsg = pgut_malloc(ERRMSG_MAX_LEN);
+					snprintf(*errormsg, ERRMSG_MAX_LEN,
+							"Failed to initialize decompression stream for file '%s'",
+							from_fullpath);
+					exit_code = ZSTD_ERROR;
+					goto cleanup;
+				}
+			}
+
+			input.src = in_buf;
+			input.size = hdr.size;
+			input.pos = 0;
+
+			/* full output buffer means that decoder may have more data to flush */
+			for (;;)
+			{
+				ZSTD_outBuffer output = { out_buf, out_size, 0 };
+
+				rc = ZSTD_decompressStream(dctx, &output, &input);
+
+				if (ZSTD_isError(rc))
+				{
+					*errormsg = pgut_malloc(ERRMSG_MAX_LEN);
+					snprintf(*errormsg, ERRMSG_MAX_LEN,
+							"Decompression failed for file '%s': %s",
+							from_fullpath, ZSTD_getErrorName(rc));
+					exit_code = ZSTD_ERROR;
+					goto cleanup;
+				}
+
+				if (output.pos > 0 &&
+					fwrite(out_buf, 1, output.pos, out) != output.pos)
+				{
+					exit_code = WRITE_FAILED;
+					goto cleanup;
+				}
+
+				if (input.pos == input.size && output.pos < output.size)
+					break;
+			}
+		}
+		else
+			elog(ERROR, "Remote agent returned message of unexpected type: %i", hdr.cop);
+	}
+
+cleanup:
+	if (exit_code < OPEN_FAILED)
+		fio_disconnect(); /* discard possible pending data in pipe */
+
+	if (dctx)
+		ZSTD_freeDCtx(dctx);
+
+	pg_free(in_buf);
+	pg_free(out_buf);
+	return exit_code;
+}
+#endif
+
+#ifdef __linux__
+/*
+ * Move len bytes received from the agent directly to file fd.
+ * Returns number of bytes moved, which is less than len on error
+ * (errno is set) or end of channel (errno is 0).
+ */
+static size_t
+fio_splice_from_channel(int fd, size_t len)
+{
+	size_t		offs = 0;
+
+	while (offs < len)
+	{
+		ssize_t		rc = splice(fio_stdin, NULL, fd, NULL, len - offs, SPLICE_F_MOVE);
+
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		else if (rc == 0)
+		{
+			errno = 0;
+			break;
+		}
+		offs += rc;
+	}
+
+	return offs;
+}
+#endif
+
 /* Receive chunks of data and write them to destination file.
  * Return codes:
  *   SEND_OK       (0)
@@ -2615,9 +3861,12 @@ fio_send_file(const char *from_fullpath, const char *to_fullpath, FILE* out,
 	int exit_code = SEND_OK;
 	size_t path_len = strlen(from_fullpath) + 1;
 	char *buf = pgut_malloc(CHUNK_SIZE);    /* buffer */
+	size_t pending = 0;	/* size of the last chunk in buf not counted in file yet */
 
 	hdr.cop = FIO_SEND_FILE;
 	hdr.size = path_len;
+	/* we can handle FIO_SEND_FILE_TRUNCATE, so let agent use sendfile() */
+	hdr.arg = 1;
 
 //	elog(VERBOSE, "Thread [%d]: Attempting to open remote WAL file '%s'",
 //			thread_num, from_fullpath);
@@ -2630,7 +3879,45 @@ fio_send_file(const char *from_fullpath, const char *to_fullpath, FILE* out,
 		/* receive data */
 		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
 
-		if (hdr.cop == FIO_SEND_FILE_EOF)
+		/*
+		 * Source file was truncated while the agent was sending the previous
+		 * chunk, and the chunk was padded with zeroes to the announced size.
+		 * Cut the padding off the destination file.
+		 */
+		if (hdr.cop == FIO_SEND_FILE_TRUNCATE)
+		{
+			off_t	end;
+
+			/*
+			 * Data spliced into the descriptor bypasses the stream, so
+			 * ftello() is stale, ask the descriptor for its position.
+			 */
+			if (fflush(out) != 0 ||
+				(end = lseek(fileno(out), 0, SEEK_CUR)) < (off_t) hdr.arg ||
+				ftruncate(fileno(out), end - hdr.arg) != 0 ||
+				fseeko(out, end - hdr.arg, SEEK_SET) != 0)
+			{
+				exit_code = WRITE_FAILED;
+				break;
+			}
+
+			Assert(pending >= hdr.arg);
+			pending -= hdr.arg;
+		}
+
+		/* account the last chunk, now when we know its real size */
+		if (file && pending > 0)
+		{
+			file->read_size += pending;
+			COMP_FILE_CRC32(true, file->crc, buf, pending);
+		}
+		pending = 0;
+
+		if (hdr.cop == FIO_SEND_FILE_TRUNCATE)
+		{
+			continue;
+		}
+		else if (hdr.cop == FIO_SEND_FILE_EOF)
 		{
 			break;
 		}
@@ -2649,6 +3936,38 @@ fio_send_file(const char *from_fullpath, const char *to_fullpath, FILE* out,
 		else if (hdr.cop == FIO_PAGE)
 		{
 			Assert(hdr.size <= CHUNK_SIZE);
+
+#ifdef __linux__
+			/* move data from the channel to the file without copying it */
+			if (file == NULL && !fio_splice_disabled &&
+				!fio_channel_compressed(fio_stdin))
+			{
+				size_t		moved;
+
+				if (fflush(out) != 0)
+				{
+					exit_code = WRITE_FAILED;
+					break;
+				}
+
+				moved = fio_splice_from_channel(fileno(out), hdr.size);
+				if (moved == hdr.size)
+				{
+					pending = hdr.size;
+					continue;
+				}
+
+				if (moved == 0 && errno == EINVAL)
+					fio_splice_disabled = true;
+				else if (errno == 0)
+					fio_error(moved, hdr.size, __FILE__, __LINE__);
+				else
+				{
+					exit_code = WRITE_FAILED;
+					break;
+				}
+			}
+#endif
 			IO_CHECK(fio_read_all(fio_stdin, buf, hdr.size), hdr.size);
 
 			/* We have received a chunk of data data, lets write it out */
@@ -2658,11 +3977,7 @@ fio_send_file(const char *from_fullpath, const char *to_fullpath, FILE* out,
 				break;
 			}
 
-			if (file)
-			{
-				file->read_size += hdr.size;
-				COMP_FILE_CRC32(true, file->crc, buf, hdr.size);
-			}
+			pending = hdr.size;
 		}
 		else
 		{
@@ -2686,22 +4001,27 @@ fio_send_file(const char *from_fullpath, const char *to_fullpath, FILE* out,
  *      READ_FAILED  (-3)
  *
  *  FIO_PAGE
+ *  FIO_SEND_FILE_TRUNCATE
  *  FIO_SEND_FILE_EOF
  *
+ * If zero_copy is true, the receiver understands FIO_SEND_FILE_TRUNCATE,
+ * so the data may be sent with sendfile().
  */
 static void
-fio_send_file_impl(int out, char const* path)
+fio_send_file_impl(int out, char const* path, bool zero_copy)
 {
-	FILE      *fp;
+	int        fd;
 	fio_header hdr;
 	char      *buf = pgut_malloc(CHUNK_SIZE);
-	size_t	   read_len = 0;
+	ssize_t	   read_len = 0;
 	char      *errormsg = NULL;
+	struct stat st;
+	off_t      remaining;
 
 	/* open source file for read */
 	/* TODO: check that file is regular file */
-	fp = fopen(path, PG_BINARY_R);
-	if (!fp)
+	fd = open(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
 	{
 		hdr.cop = FIO_ERROR;
 
@@ -2731,17 +4051,73 @@ fio_send_file_impl(int out, char const* path)
 		goto cleanup;
 	}
 
-	/* disable stdio buffering */
-	setvbuf(fp, NULL, _IONBF, BUFSIZ);
+	/*
+	 * Size known at start is sent without copying the data through our
+	 * buffer, the rest (if file grows) is read as usual.
+	 */
+	remaining = zero_copy && fstat(fd, &st) == 0 ? st.st_size : 0;
 
 	/* copy content */
 	for (;;)
 	{
-		read_len = fread(buf, 1, CHUNK_SIZE, fp);
+		if (remaining > 0)
+		{
+			size_t		chunk = Min(remaining, CHUNK_SIZE);
+			size_t		sent;
+
+			hdr.cop = FIO_PAGE;
+			hdr.size = chunk;
+			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+
+			sent = fio_copy_to_channel(out, fd, chunk);
+			if (sent < chunk)
+			{
+				int		errnum = errno;
+
+				/* chunk size is already promised, so complete it with zeroes */
+				memset(buf, 0, chunk - sent);
+				IO_CHECK(fio_write_all(out, buf, chunk - sent), chunk - sent);
+
+				if (errnum == 0)
+				{
+					/*
+					 * File was truncated during copy. It is not an error,
+					 * tell the receiver to drop the padding and continue
+					 * reading from the current position as usual.
+					 */
+					hdr.cop = FIO_SEND_FILE_TRUNCATE;
+					hdr.arg = chunk - sent;
+					hdr.size = 0;
+					IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+
+					remaining = 0;
+					continue;
+				}
+
+				hdr.cop = FIO_ERROR;
+				hdr.arg = READ_FAILED;
+				errormsg = pgut_malloc(ERRMSG_MAX_LEN);
+				snprintf(errormsg, ERRMSG_MAX_LEN, "Cannot read from file '%s': %s", path,
+						 strerror(errnum));
+				hdr.size = strlen(errormsg) + 1;
+				IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+				IO_CHECK(fio_write_all(out, errormsg, hdr.size), hdr.size);
+
+				goto cleanup;
+			}
+
+			remaining -= chunk;
+			continue;
+		}
+
+		read_len = read(fd, buf, CHUNK_SIZE);
 
 		/* report error */
-		if (ferror(fp))
+		if (read_len < 0)
 		{
+			if (errno == EINTR)
+				continue;
+
 			hdr.cop = FIO_ERROR;
 			errormsg = pgut_malloc(ERRMSG_MAX_LEN);
 			hdr.arg = READ_FAILED;
@@ -2755,17 +4131,14 @@ fio_send_file_impl(int out, char const* path)
 			goto cleanup;
 		}
 
-		if (read_len > 0)
-		{
-			/* send chunk */
-			hdr.cop = FIO_PAGE;
-			hdr.size = read_len;
-			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
-			IO_CHECK(fio_write_all(out, buf, read_len), read_len);
-		}
-
-		if (feof(fp))
+		if (read_len == 0)
 			break;
+
+		/* send chunk */
+		hdr.cop = FIO_PAGE;
+		hdr.size = read_len;
+		IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+		IO_CHECK(fio_write_all(out, buf, read_len), read_len);
 	}
 
 	/* we are done, send eof */
@@ -2773,8 +4146,8 @@ fio_send_file_impl(int out, char const* path)
 	IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
 
 cleanup:
-	if (fp)
-		fclose(fp);
+	if (fd >= 0)
+		close(fd);
 	pg_free(buf);
 	pg_free(errormsg);
 	return;
@@ -3051,6 +4424,7 @@ fio_get_lsn_map(const char *fullpath, uint32 checksum_version,
 
 			lsn_map->bitmap = pgut_malloc(hdr.size);
 			lsn_map->bitmapsize = hdr.size;
+			lsn_map->sparse = hdr.arg != 0;
 
 			IO_CHECK(fio_read_all(fio_stdin, lsn_map->bitmap, hdr.size), hdr.size);
 		}
@@ -3075,9 +4449,15 @@ fio_get_lsn_map_impl(int out, char *buf)
 	lsn_map = get_lsn_map(fullpath, req->checksumVersion, req->n_blocks,
 						  req->shift_lsn, req->segmentno);
 	if (lsn_map)
+	{
 		hdr.size = lsn_map->bitmapsize;
+		hdr.arg = lsn_map->sparse;
+	}
 	else
+	{
 		hdr.size = 0;
+		hdr.arg = 0;
+	}
 
 	/* send bitmap to main process */
 	IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
@@ -3340,11 +4720,13 @@ fio_communicate(int in, int out)
 			break;
 		  case FIO_MKDIR:  /* Create directory */
 			hdr.size = 0;
-			hdr.arg = dir_create_dir(buf, hdr.arg, false);
+			hdr.arg = dir_create_dir(buf, hdr.arg, false) == 0 ? 0 : errno;
 			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
 			break;
 		  case FIO_CHMOD:  /* Change file mode */
-			SYS_CHECK(chmod(buf, hdr.arg));
+			hdr.size = 0;
+			hdr.arg = chmod(buf, hdr.arg) == 0 ? 0 : errno;
+			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
 			break;
 		  case FIO_SEEK:   /* Set current position in file */
 			fio_seek_impl(fd[hdr.handle], hdr.arg);
@@ -3360,7 +4742,31 @@ fio_communicate(int in, int out)
 			fio_send_pages_impl(out, buf);
 			break;
 		  case FIO_SEND_FILE:
-			fio_send_file_impl(out, buf);
+			fio_send_file_impl(out, buf, hdr.arg != 0);
+			break;
+		  case FIO_BATCH:
+			fio_batch_impl(out, buf, hdr.arg);
+			break;
+		  case FIO_CHANNEL_COMPRESS:
+			/* reply is sent uncompressed, everything after it is compressed */
+#ifdef HAVE_LIBZSTD
+			rc = hdr.arg;
+			hdr.arg = 0;
+			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+			fio_channel_start(in, out, rc);
+#else
+			hdr.arg = ENOTSUP;
+			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+#endif
+			break;
+		  case FIO_SYNCFS:
+			hdr.arg = fio_syncfs_impl(buf) == 0 ? 0 : errno;
+			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+			break;
+		  case FIO_WAL_PACK:
+			hdr.arg = fio_wal_pack_impl(buf + sizeof(fio_wal_pack_request),
+										(fio_wal_pack_request *) buf) == 0 ? 0 : errno;
+			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
 			break;
 		  case FIO_SYNC:
 			/* open file and fsync it */
@@ -3380,10 +4786,7 @@ fio_communicate(int in, int out)
 			break;
 		  case FIO_GET_CRC32:
 			/* calculate crc32 for a file */
-			if (hdr.arg == 1)
-				crc = pgFileGetCRCgz(buf, true, true);
-			else
-				crc = pgFileGetCRC(buf, true, true);
+			crc = fio_get_crc32_impl(buf, hdr.arg);
 			IO_CHECK(fio_write_all(out, &crc, sizeof(crc)), sizeof(crc));
 			break;
 		  case FIO_GET_CHECKSUM_MAP:
@@ -3405,6 +4808,11 @@ fio_communicate(int in, int out)
 		  case FIO_DISCONNECT:
 			hdr.cop = FIO_DISCONNECTED;
 			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+#ifdef HAVE_LIBZSTD
+			/* it is the last reply, nobody is going to read after it */
+			if (fio_chan)
+				fio_channel_flush();
+#endif
 			free(buf);
 			return;
 		  case FIO_GET_ASYNC_ERROR:
@@ -10,6 +10,10 @@
 #include <zlib.h>
 #endif
 
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
 typedef enum
 {
 	/* message for compatibility check */
@@ -56,7 +60,13 @@ typedef enum
 	FIO_CHECK_POSTMASTER,
 	FIO_GET_ASYNC_ERROR,
 	FIO_WRITE_ASYNC,
-	FIO_READLINK
+	FIO_READLINK,
+	FIO_SYNCFS,
+	FIO_WAL_PACK,
+	FIO_BATCH,
+	FIO_CHANNEL_COMPRESS,
+	/* last FIO_PAGE of FIO_SEND_FILE was padded, arg is the padding length */
+	FIO_SEND_FILE_TRUNCATE
 } fio_operations;
 
 typedef enum
@@ -67,6 +77,19 @@ typedef enum
 	FIO_REMOTE_HOST  /* date is located at remote host */
 } fio_location;
 
+/* Max number of items sent to remote agent in one fio_batch() message */
+#define FIO_BATCH_MAX_ITEMS 4096
+
+/* Single metadata operation of fio_batch() */
+typedef struct
+{
+	fio_operations cop;		/* FIO_MKDIR, FIO_CHMOD, FIO_STAT or FIO_SYNC */
+	uint32		arg;		/* mode for FIO_MKDIR and FIO_CHMOD, follow_symlink for FIO_STAT */
+	const char *path;
+	int			errnum;		/* result: 0 or errno */
+	struct stat st;			/* result of FIO_STAT */
+} fio_batch_item;
+
 #define FIO_FDMAX 64
 #define FIO_PIPE_MARKER 0x40000000
 
@@ -119,14 +142,20 @@ extern int     fio_fstat(int fd, struct stat* st);
 extern int     fio_truncate(int fd, off_t size);
 extern int     fio_close(int fd);
 extern void    fio_disconnect(void);
+extern void    fio_set_channel_compression(int level);
 extern int     fio_sync(char const* path, fio_location location);
-extern pg_crc32 fio_get_crc32(const char *file_path, fio_location location, bool decompress);
+extern int     fio_syncfs(char const* path, fio_location location);
+extern int     fio_wal_pack(char const* archive_dir, char const* first_wal_file_name,
+							int n_segments, uint32 wal_seg_size, bool no_sync,
+							fio_location location);
+extern pg_crc32 fio_get_crc32(const char *file_path, fio_location location, int compress_alg);
 
 extern int     fio_rename(char const* old_path, char const* new_path, fio_location location);
 extern int     fio_symlink(char const* target, char const* link_path, bool overwrite, fio_location location);
 extern int     fio_unlink(char const* path, fio_location location);
 extern int     fio_mkdir(char const* path, int mode, fio_location location);
 extern int     fio_chmod(char const* path, int mode, fio_location location);
+extern int     fio_batch(fio_batch_item* items, int n_items, fio_location location);
 extern int     fio_access(char const* path, int mode, fio_location location);
 extern int     fio_stat(char const* path, struct stat* st, bool follow_symlinks, fio_location location);
 extern bool    fio_is_same_file(char const* filename1, char const* filename2, bool follow_symlink, fio_location location);
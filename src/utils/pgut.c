@@ -591,6 +591,19 @@ pgut_execute_extended(PGconn* conn, const char *query, int nParams,
 
 bool
 pgut_send(PGconn* conn, const char *query, int nParams, const char **params, int elevel)
+{
+	return pgut_send_extended(conn, query, nParams, params, true, false, elevel);
+}
+
+/*
+ * Send query without waiting for the result. In single row mode rows are
+ * returned by PQgetResult() one by one as they arrive, so the whole result
+ * is never kept in memory.
+ */
+bool
+pgut_send_extended(PGconn* conn, const char *query, int nParams,
+				   const char **params, bool text_result, bool single_row,
+				   int elevel)
 {
 	int			res;
 
@@ -617,10 +630,11 @@ pgut_send(PGconn* conn, const char *query, int nParams, const char **params, int
 		return false;
 	}
 
-	if (nParams == 0)
+	if (nParams == 0 && text_result)
 		res = PQsendQuery(conn, query);
 	else
-		res = PQsendQueryParams(conn, query, nParams, NULL, params, NULL, NULL, 0);
+		res = PQsendQueryParams(conn, query, nParams, NULL, params, NULL, NULL,
+								(text_result) ? 0 : 1);
 
 	if (res != 1)
 	{
@@ -629,6 +643,13 @@ pgut_send(PGconn* conn, const char *query, int nParams, const char **params, int
 		return false;
 	}
 
+	if (single_row && !PQsetSingleRowMode(conn))
+	{
+		elog(elevel, "cannot switch to single row mode: %s",
+			 PQerrorMessage(conn));
+		return false;
+	}
+
 	return true;
 }
 
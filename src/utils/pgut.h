@@ -52,6 +52,9 @@ extern PGresult *pgut_execute_parallel(PGconn* conn, PGcancel* thread_cancel_con
 							  const char *query, int nParams,
 							  const char **params, bool text_result, bool ok_error, bool async);
 extern bool pgut_send(PGconn* conn, const char *query, int nParams, const char **params, int elevel);
+extern bool pgut_send_extended(PGconn* conn, const char *query, int nParams,
+							   const char **params, bool text_result,
+							   bool single_row, int elevel);
 extern void pgut_cancel(PGconn* conn);
 extern int pgut_wait(int num, PGconn *connections[], struct timeval *timeout);
 
@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <fcntl.h>
 
 #ifdef WIN32
 #define __thread __declspec(thread)
@@ -60,6 +61,193 @@ static int split_options(int argc, char* argv[], int max_options, char* options)
 
 static __thread int child_pid;
 
+#ifndef WIN32
+/*
+ * SSH connection multiplexing.
+ *
+ * Every thread starts its own agent, but all of them share a single SSH
+ * connection: the first ssh process becomes the control master and the
+ * following ones open sessions through its control socket, which is much
+ * cheaper than a new handshake. sshd limits the number of sessions per
+ * connection (MaxSessions, 10 by default), so agents beyond
+ * SSH_MUX_MAX_SESSIONS use a separate connection as before.
+ * Settings from --ssh-options take precedence, so ControlMaster=no there
+ * disables multiplexing.
+ */
+#define SSH_MUX_MAX_SESSIONS 8
+/* how long control master outlives its last session, if owner is gone */
+#define SSH_MUX_PERSIST "ControlPersist=5"
+/* control socket directory is named after pid of its owner */
+#define SSH_MUX_DIR_PREFIX "pg_probackup_ssh_"
+
+static pthread_mutex_t ssh_mux_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char ssh_mux_dir[MAXPGPATH] = "";
+static char ssh_mux_path[MAXPGPATH] = "";
+static bool ssh_mux_disabled = false;
+static int ssh_mux_sessions = 0;
+static pid_t ssh_mux_owner = 0;	/* process which created ssh_mux_dir */
+static __thread bool child_uses_mux = false;
+
+static void ssh_mux_cleanup_atexit(bool fatal, void *userdata);
+
+/*
+ * Remove directories of control sockets left behind by pg_probackup
+ * processes, which were killed before they could clean up.
+ */
+static void
+ssh_mux_remove_stale(const char *tmpdir)
+{
+	DIR		   *dir;
+	struct dirent *dent;
+
+	dir = opendir(tmpdir);
+	if (dir == NULL)
+		return;
+
+	while ((dent = readdir(dir)) != NULL)
+	{
+		char		dir_path[MAXPGPATH];
+		char		socket_path[MAXPGPATH];
+		struct stat st;
+		int			pid;
+
+		if (strncmp(dent->d_name, SSH_MUX_DIR_PREFIX, strlen(SSH_MUX_DIR_PREFIX)) != 0 ||
+			sscanf(dent->d_name + strlen(SSH_MUX_DIR_PREFIX), "%d_", &pid) != 1 ||
+			pid <= 0)
+			continue;
+
+		join_path_components(dir_path, tmpdir, dent->d_name);
+		if (lstat(dir_path, &st) != 0 || !S_ISDIR(st.st_mode) ||
+			st.st_uid != geteuid())
+			continue;
+
+		/* owner is alive, it removes the directory itself */
+		if (kill(pid, 0) == 0 || errno != ESRCH)
+			continue;
+
+		elog(LOG, "Remove stale SSH control directory \"%s\"", dir_path);
+		join_path_components(socket_path, dir_path, "mux");
+		unlink(socket_path);
+		rmdir(dir_path);
+	}
+
+	closedir(dir);
+}
+
+/* Reserve a session of multiplexed connection, return false if it's not possible */
+static bool
+ssh_mux_acquire(void)
+{
+	bool		result = false;
+
+	pthread_lock(&ssh_mux_mutex);
+
+	if (!ssh_mux_disabled && ssh_mux_dir[0] == '\0')
+	{
+		const char *tmpdir = getenv("TMPDIR");
+
+		if (tmpdir == NULL || tmpdir[0] == '\0')
+			tmpdir = "/tmp";
+
+		ssh_mux_remove_stale(tmpdir);
+
+		snprintf(ssh_mux_dir, MAXPGPATH, "%s/" SSH_MUX_DIR_PREFIX "%d_XXXXXX",
+				 tmpdir, (int) getpid());
+		if (mkdtemp(ssh_mux_dir) == NULL)
+		{
+			elog(WARNING, "Cannot create temporary directory \"%s\", "
+				 "SSH connection multiplexing is disabled: %s",
+				 ssh_mux_dir, strerror(errno));
+			ssh_mux_dir[0] = '\0';
+			ssh_mux_disabled = true;
+		}
+		else
+		{
+			snprintf(ssh_mux_path, MAXPGPATH, "ControlPath=%s/mux", ssh_mux_dir);
+			ssh_mux_owner = getpid();
+			pgut_atexit_push(ssh_mux_cleanup_atexit, NULL);
+		}
+	}
+
+	if (!ssh_mux_disabled && ssh_mux_sessions < SSH_MUX_MAX_SESSIONS)
+	{
+		ssh_mux_sessions++;
+		result = true;
+	}
+
+	pthread_mutex_unlock(&ssh_mux_mutex);
+
+	return result;
+}
+
+static void
+ssh_mux_release(void)
+{
+	pthread_lock(&ssh_mux_mutex);
+	ssh_mux_sessions--;
+	pthread_mutex_unlock(&ssh_mux_mutex);
+}
+
+/* Stop control master and remove its socket */
+static void
+ssh_mux_cleanup_atexit(bool fatal, void *userdata)
+{
+	char		socket_path[MAXPGPATH];
+	pid_t		pid;
+
+	/* forked child must not stop control master of its parent */
+	if (getpid() != ssh_mux_owner)
+		return;
+
+	pid = fork();
+	if (pid == 0)
+	{
+		char	   *argv[] = { instance_config.remote.proto, "-o", ssh_mux_path,
+							   "-o", "LogLevel=quiet", "-O", "exit",
+							   instance_config.remote.host, NULL };
+		int			devnull = open("/dev/null", O_RDWR);
+
+		if (devnull >= 0)
+		{
+			dup2(devnull, STDIN_FILENO);
+			dup2(devnull, STDOUT_FILENO);
+			dup2(devnull, STDERR_FILENO);
+		}
+		execvp(argv[0], argv);
+		_exit(1);
+	}
+	else if (pid > 0)
+		waitpid(pid, NULL, 0);
+
+	join_path_components(socket_path, ssh_mux_dir, "mux");
+	unlink(socket_path);
+	rmdir(ssh_mux_dir);
+}
+#endif
+
+/*
+ * Forget multiplexed connection inherited from the parent process.
+ * Must be called in the child right after fork(), when no agents are
+ * running. The parent stops its control master on exit, so the child
+ * starts its own one when it needs it.
+ */
+void
+ssh_mux_reset_after_fork(void)
+{
+#ifndef WIN32
+	if (ssh_mux_dir[0] != '\0' && ssh_mux_owner != getpid())
+		pgut_atexit_pop(ssh_mux_cleanup_atexit, NULL);
+
+	pthread_mutex_init(&ssh_mux_mutex, NULL);
+	ssh_mux_dir[0] = '\0';
+	ssh_mux_path[0] = '\0';
+	ssh_mux_disabled = false;
+	ssh_mux_sessions = 0;
+	ssh_mux_owner = 0;
+	child_uses_mux = false;
+#endif
+}
+
 #if 0
 static void kill_child(void)
 {
@@ -79,6 +267,12 @@ void wait_ssh(void)
 	int status;
 	waitpid(child_pid, &status, 0);
 	elog(LOG, "SSH process %d is terminated with status %d",  child_pid, status);
+
+	if (child_uses_mux)
+	{
+		ssh_mux_release();
+		child_uses_mux = false;
+	}
 #endif
 }
 
@@ -147,8 +341,26 @@ bool launch_agent(void)
 	ssh_argv[ssh_argc++] = "-o";
 	ssh_argv[ssh_argc++] = "Compression=no";
 
-	ssh_argv[ssh_argc++] = "-o";
-	ssh_argv[ssh_argc++] = "ControlMaster=no";
+#ifndef WIN32
+	child_uses_mux = ssh_mux_acquire();
+	if (child_uses_mux)
+	{
+		ssh_argv[ssh_argc++] = "-o";
+		ssh_argv[ssh_argc++] = "ControlMaster=auto";
+
+		ssh_argv[ssh_argc++] = "-o";
+		ssh_argv[ssh_argc++] = ssh_mux_path;
+
+		/* keep master after the first agent exits, it quits soon when idle */
+		ssh_argv[ssh_argc++] = "-o";
+		ssh_argv[ssh_argc++] = SSH_MUX_PERSIST;
+	}
+	else
+#endif
+	{
+		ssh_argv[ssh_argc++] = "-o";
+		ssh_argv[ssh_argc++] = "ControlMaster=no";
+	}
 
 	ssh_argv[ssh_argc++] = "-o";
 	ssh_argv[ssh_argc++] = "LogLevel=error";
@@ -255,5 +467,8 @@ bool launch_agent(void)
 			agent_version_str, AGENT_PROTOCOL_VERSION_STR);
 	}
 
+	if (instance_config.remote.compress_level > 0)
+		fio_set_channel_compression(instance_config.remote.compress_level);
+
 	return true;
 }
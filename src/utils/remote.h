@@ -19,6 +19,7 @@ typedef struct RemoteConfig
 	char* user;
 	char *ssh_config;
 	char *ssh_options;
+	uint32 compress_level;	/* zstd level of channel compression, 0 disables */
 } RemoteConfig;
 
 #endif
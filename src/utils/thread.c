@@ -91,6 +91,32 @@ pthread_join(pthread_t th, void **thread_return)
 	return 0;
 }
 
+/* Mutex must be locked by pthread_lock() */
+int
+pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mp)
+{
+	if (!SleepConditionVariableCS(cond, *mp, INFINITE))
+	{
+		_dosmaperr(GetLastError());
+		return errno;
+	}
+	return 0;
+}
+
+int
+pthread_cond_signal(pthread_cond_t *cond)
+{
+	WakeConditionVariable(cond);
+	return 0;
+}
+
+int
+pthread_cond_broadcast(pthread_cond_t *cond)
+{
+	WakeAllConditionVariable(cond);
+	return 0;
+}
+
 #endif   /* WIN32 */
 
 int
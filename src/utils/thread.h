@@ -21,8 +21,14 @@ typedef int pthread_attr_t;
 #define PTHREAD_MUTEX_INITIALIZER NULL //{ NULL, 0 }
 #define PTHREAD_ONCE_INIT false
 
+typedef CONDITION_VARIABLE pthread_cond_t;
+#define PTHREAD_COND_INITIALIZER CONDITION_VARIABLE_INIT
+
 extern int pthread_create(pthread_t *thread, pthread_attr_t *attr, void *(*start_routine) (void *), void *arg);
 extern int pthread_join(pthread_t th, void **thread_return);
+extern int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mp);
+extern int pthread_cond_signal(pthread_cond_t *cond);
+extern int pthread_cond_broadcast(pthread_cond_t *cond);
 #else
 /* Use platform-dependent pthread capability */
 #include <pthread.h>
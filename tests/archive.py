@@ -526,6 +526,311 @@ class ArchiveTest(ProbackupTest, unittest.TestCase):
         # Clean after yourself
         self.del_test_dir(module_name, fname)
 
+    # @unittest.skip("skip")
+    def test_archive_push_daemon(self):
+        """
+        Run archive-push in daemon mode, archive_command only
+        waits for '.pushed' marker created by daemon
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+
+        if self.get_version(node) < 100000:
+            xlog_dir = 'pg_xlog'
+        else:
+            xlog_dir = 'pg_wal'
+
+        self.set_archiving(
+            backup_dir, 'node', node,
+            custom_archive_command=(
+                'for i in $(seq 600); do '
+                'test -f {0}/archive_status/%f.pushed && exit 0; '
+                'sleep 0.1; done; exit 1'.format(xlog_dir)))
+
+        node.slow_start()
+
+        daemon = self.run_pb(
+            ['archive-push', '-B', backup_dir, '--instance', 'node',
+             '--daemon', '-j', '2'],
+            asynchronous=True)
+
+        node.pgbench_init(scale=5)
+        self.switch_wal_segment(node)
+
+        self.backup_node(
+            backup_dir, 'node', node,
+            options=['--archive-timeout=60s'])
+
+        daemon.terminate()
+        daemon.wait()
+
+        show = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertEqual(show['status'], 'OK')
+
+        self.assertIn(
+            'archive-push daemon stopped',
+            daemon.stderr.read().decode('utf-8'))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_archive_push_zstd(self):
+        """
+        Archive WAL with zstd compression, take PAGE backup
+        and restore FULL backup, replaying compressed WAL
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_config(
+            backup_dir, 'node', options=['--compress-algorithm=zstd'])
+        self.set_archiving(backup_dir, 'node', node, compress=False)
+        node.slow_start()
+
+        try:
+            full_id = self.backup_node(backup_dir, 'node', node)
+        except ProbackupException as e:
+            if 'does not support zstd' in e.message:
+                self.skipTest('pg_probackup is built without zstd support')
+            raise
+
+        node.pgbench_init(scale=5)
+        result = node.safe_psql(
+            "postgres", "SELECT * FROM pgbench_accounts ORDER BY aid")
+
+        self.backup_node(backup_dir, 'node', node, backup_type='page')
+
+        wals_dir = os.path.join(backup_dir, 'wal', 'node')
+        zst_files = [f for f in os.listdir(wals_dir) if f.endswith('.zst')]
+        self.assertTrue(zst_files)
+
+        show = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertEqual(show['status'], 'OK')
+
+        node.cleanup()
+        self.restore_node(backup_dir, 'node', node, backup_id=full_id)
+        node.slow_start()
+
+        self.assertEqual(
+            result,
+            node.safe_psql(
+                "postgres", "SELECT * FROM pgbench_accounts ORDER BY aid"))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_archive_push_batch_group_commit(self):
+        """
+        Push batch of WAL segments, check that all of them are
+        renamed into place and marked as done after group commit
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+
+        if self.get_version(node) < 100000:
+            xlog_dir = 'pg_xlog'
+        else:
+            xlog_dir = 'pg_wal'
+
+        # accumulate '.ready' files
+        self.set_archiving(
+            backup_dir, 'node', node, custom_archive_command='exit 1')
+        node.slow_start()
+
+        for i in range(5):
+            node.safe_psql(
+                'postgres', 'create table t{0} as select 1'.format(i))
+            self.switch_wal_segment(node)
+
+        status_dir = os.path.join(node.data_dir, xlog_dir, 'archive_status')
+        ready_files = sorted(
+            f[:-len('.ready')] for f in os.listdir(status_dir)
+            if f.endswith('.ready'))
+        self.assertTrue(len(ready_files) > 1)
+
+        self.run_pb(
+            ['archive-push', '-B', backup_dir, '--instance', 'node',
+             '-D', node.data_dir,
+             '--wal-file-name={0}'.format(ready_files[0]),
+             '--wal-file-path={0}'.format(
+                 os.path.join(node.data_dir, xlog_dir, ready_files[0])),
+             '-j', '2', '--batch-size=10', '--log-level-file=LOG'])
+
+        wals_dir = os.path.join(backup_dir, 'wal', 'node')
+        wals = os.listdir(wals_dir)
+        self.assertFalse([f for f in wals if f.endswith('.part')])
+
+        for wal in ready_files:
+            self.assertTrue(
+                wal in wals or wal + '.gz' in wals or wal + '.zst' in wals)
+
+        # first file is marked as done by postgres itself
+        for wal in ready_files[1:]:
+            self.assertTrue(
+                os.path.exists(os.path.join(status_dir, wal + '.done')))
+
+        self.assertIn(
+            'Committed {0} WAL files of the batch'.format(len(ready_files)),
+            open(os.path.join(backup_dir, 'log', 'pg_probackup.log')).read())
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_archive_push_wal_pack(self):
+        """
+        Archive WAL with --wal-pack-size, check that segments
+        are packed, and that packed WAL can be used for
+        validation and restore
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_config(backup_dir, 'node', options=['--wal-pack-size=2'])
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        self.backup_node(backup_dir, 'node', node)
+
+        for i in range(5):
+            node.safe_psql(
+                'postgres', 'create table t{0} as select 1'.format(i))
+            self.switch_wal_segment(node)
+
+        # segments are packed in background, wait for it
+        wals_dir = os.path.join(backup_dir, 'wal', 'node')
+        for _ in range(60):
+            wals = os.listdir(wals_dir)
+            if ([f for f in wals if f.endswith('.pack')] and
+                    not [f for f in wals if f.endswith('.pack.part')]):
+                break
+            sleep(1)
+
+        self.assertTrue([f for f in wals if f.endswith('.pack')])
+        self.assertFalse([f for f in wals if f.endswith('.pack.part')])
+
+        self.validate_pb(backup_dir, 'node')
+
+        timeline = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertEqual(timeline['status'], 'OK')
+
+        node.cleanup()
+        self.restore_node(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.safe_psql('postgres', 'select * from t3')
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_archive_wal_pack_size_changed(self):
+        """
+        Pack WAL, then change and reset --wal-pack-size and check,
+        that existing packs are still used for validation, PAGE backup
+        and restore
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_config(backup_dir, 'node', options=['--wal-pack-size=2'])
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        self.backup_node(backup_dir, 'node', node)
+
+        wals_dir = os.path.join(backup_dir, 'wal', 'node')
+
+        def wait_for_packs(count):
+            for _ in range(60):
+                wals = os.listdir(wals_dir)
+                if (len([f for f in wals if f.endswith('.pack')]) >= count and
+                        not [f for f in wals if f.endswith('.pack.part')]):
+                    break
+                sleep(1)
+            return [f for f in os.listdir(wals_dir) if f.endswith('.pack')]
+
+        for i in range(5):
+            node.safe_psql(
+                'postgres', 'create table t{0} as select 1'.format(i))
+            self.switch_wal_segment(node)
+
+        packs = wait_for_packs(1)
+        self.assertTrue(packs)
+
+        # packs of size 2 must be found with another size configured
+        self.set_config(backup_dir, 'node', options=['--wal-pack-size=4'])
+
+        for i in range(5, 14):
+            node.safe_psql(
+                'postgres', 'create table t{0} as select 1'.format(i))
+            self.switch_wal_segment(node)
+
+        self.assertGreater(len(wait_for_packs(len(packs) + 1)), len(packs))
+
+        with open(os.path.join(wals_dir, '.pack_sizes')) as f:
+            self.assertEqual(sorted(f.read().split()), ['2', '4'])
+
+        # and with packing disabled
+        self.set_config(backup_dir, 'node', options=['--wal-pack-size=0'])
+
+        self.validate_pb(backup_dir, 'node')
+
+        timeline = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertEqual(timeline['status'], 'OK')
+
+        self.backup_node(backup_dir, 'node', node, backup_type='page')
+
+        pgdata = self.pgdata_content(node.data_dir)
+
+        self.validate_pb(backup_dir, 'node')
+
+        node.cleanup()
+        self.restore_node(backup_dir, 'node', node)
+        pgdata_restored = self.pgdata_content(node.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+        node.slow_start()
+
+        node.safe_psql('postgres', 'select * from t1')
+        node.safe_psql('postgres', 'select * from t12')
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     # @unittest.skip("skip")
     def test_archive_push_partial_file_exists(self):
         """Archive-push if stale '.part' file exists"""
@@ -2251,6 +2556,71 @@ class ArchiveTest(ProbackupTest, unittest.TestCase):
         # Clean after yourself
         self.del_test_dir(module_name, fname)
 
+    # @unittest.skip("skip")
+    def test_archive_get_remote_truncated_source(self):
+        """
+        Remote archive-get of a .partial file, which is truncated while
+        the agent sends it with sendfile() and we splice it into the
+        destination file. Result must be the truncated file padded up to
+        the segment size.
+        """
+        if not self.remote:
+            self.skipTest("You must enable PGPROBACKUP_SSH_REMOTE"
+                          " for run this test")
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+
+        seg_size = 16 * 1024 * 1024
+        truncated_size = 8 * 1024 * 1024 + 1000
+        wal_name = '0000000100000000000000AA'
+
+        partial_path = os.path.join(
+            backup_dir, 'wal', 'node', wal_name + '.partial')
+        with open(partial_path, 'wb') as f:
+            f.write(os.urandom(seg_size))
+        with open(partial_path, 'rb') as f:
+            expected = f.read(truncated_size)
+        expected += b'\0' * (seg_size - truncated_size)
+
+        if node.major_version >= 10:
+            wal_dir = 'pg_wal'
+        else:
+            wal_dir = 'pg_xlog'
+
+        # archive-get resolves --wal-file-path against the current directory
+        cwd = os.getcwd()
+        os.chdir(node.data_dir)
+        try:
+            gdb = self.run_pb(
+                ['archive-get', '-B', backup_dir, '--instance', 'node',
+                 '--wal-file-name', wal_name,
+                 '--wal-file-path', os.path.join(wal_dir, 'RECOVERYXLOG'),
+                 '--batch-size=1', '--no-validate-wal',
+                 '--remote-proto=ssh', '--remote-host=localhost'],
+                gdb=True)
+
+            gdb.set_breakpoint('fio_splice_from_channel')
+            gdb.run_until_break()
+
+            os.truncate(partial_path, truncated_size)
+
+            gdb.remove_all_breakpoints()
+            gdb.continue_execution_until_exit()
+        finally:
+            os.chdir(cwd)
+
+        with open(os.path.join(node.data_dir, wal_dir, 'RECOVERYXLOG'), 'rb') as f:
+            self.assertEqual(f.read(), expected)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     @unittest.skip("skip")
     def test_multi_timeline_recovery_prefetching(self):
         """"""
@@ -2572,6 +2942,144 @@ class ArchiveTest(ProbackupTest, unittest.TestCase):
         # Clean after yourself
         self.del_test_dir(module_name, fname)
 
+    # @unittest.skip("skip")
+    def test_archive_get_prefetch_refill(self):
+        """
+        Recovery consumes prefetched segments, check that archive-get
+        tops up prefetch directory in background and keeps serving
+        segments from it
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        self.backup_node(backup_dir, 'node', node, options=['--stream'])
+
+        node.pgbench_init(scale=30)
+        self.switch_wal_segment(node)
+
+        replica = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'replica'))
+        replica.cleanup()
+
+        self.restore_node(backup_dir, 'node', replica, replica.data_dir)
+        self.set_replica(node, replica, log_shipping=True)
+
+        restore_command = self.get_restore_command(backup_dir, 'node', replica)
+        restore_command += ' -j2 --batch-size=10 --log-level-console=LOG'
+
+        if node.major_version >= 12:
+            self.set_auto_conf(replica, {'restore_command': restore_command})
+        else:
+            replica.append_conf(
+                'recovery.conf', "restore_command = '{0}'".format(restore_command))
+
+        replica.slow_start(replica=True)
+
+        for _ in range(120):
+            with open(os.path.join(replica.logs_dir, 'postgresql.log'), 'r') as f:
+                postgres_log_content = f.read()
+            if 'Background prefetch is done' in postgres_log_content:
+                break
+            sleep(1)
+
+        self.assertIn('Prefetch plan: depth', postgres_log_content)
+        self.assertIn('Started background prefetch of', postgres_log_content)
+        self.assertIn('Background prefetch is done', postgres_log_content)
+        self.assertIn('used prefetched WAL segment', postgres_log_content)
+
+        self.wait_until_replica_catch_with_master(node, replica)
+
+        self.assertEqual(
+            node.safe_psql("postgres", "select count(*) from pgbench_accounts"),
+            replica.safe_psql("postgres", "select count(*) from pgbench_accounts"))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_archive_get_prefetch_stale_pid(self):
+        """
+        Lock file of background refill is left by a dead process,
+        check that archive-get removes it and starts a new refill
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        self.backup_node(backup_dir, 'node', node, options=['--stream'])
+
+        node.pgbench_init(scale=30)
+        self.switch_wal_segment(node)
+
+        replica = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'replica'))
+        replica.cleanup()
+
+        self.restore_node(backup_dir, 'node', replica, replica.data_dir)
+        self.set_replica(node, replica, log_shipping=True)
+
+        if node.major_version >= 10:
+            wal_dir = 'pg_wal'
+        else:
+            wal_dir = 'pg_xlog'
+
+        # pid of a process which is surely gone
+        proc = subprocess.Popen(['true'])
+        proc.wait()
+
+        prefetch_dir = os.path.join(replica.data_dir, wal_dir, 'pbk_prefetch')
+        os.mkdir(prefetch_dir)
+        with open(os.path.join(prefetch_dir, 'pbk_prefetch.pid'), 'w') as f:
+            f.write('{0}\n'.format(proc.pid))
+
+        restore_command = self.get_restore_command(backup_dir, 'node', replica)
+        restore_command += ' -j2 --batch-size=10 --log-level-console=LOG'
+
+        if node.major_version >= 12:
+            self.set_auto_conf(replica, {'restore_command': restore_command})
+        else:
+            replica.append_conf(
+                'recovery.conf', "restore_command = '{0}'".format(restore_command))
+
+        replica.slow_start(replica=True)
+
+        for _ in range(120):
+            with open(os.path.join(replica.logs_dir, 'postgresql.log'), 'r') as f:
+                postgres_log_content = f.read()
+            if 'Background prefetch is done' in postgres_log_content:
+                break
+            sleep(1)
+
+        self.assertIn('Remove stale prefetch lock file', postgres_log_content)
+        self.assertIn('Started background prefetch of', postgres_log_content)
+        self.assertIn('Background prefetch is done', postgres_log_content)
+
+        self.wait_until_replica_catch_with_master(node, replica)
+
+        self.assertEqual(
+            node.safe_psql("postgres", "select count(*) from pgbench_accounts"),
+            replica.safe_psql("postgres", "select count(*) from pgbench_accounts"))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     # @unittest.skip("skip")
     def test_archive_show_partial_files_handling(self):
         """
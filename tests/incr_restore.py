@@ -1389,6 +1389,89 @@ class IncrRestoreTest(ProbackupTest, unittest.TestCase):
         # Clean after yourself
         self.del_test_dir(module_name, fname)
 
+    # @unittest.skip("skip")
+    def test_incr_lsn_restore_sparse_and_dense_pagemap(self):
+        """
+        PAGE backups of relations with few and with many changed blocks,
+        so page maps are kept both as block arrays and as bitmaps.
+        Check full and incremental restore in LSN mode.
+        """
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'wal_log_hints': 'on', 'autovacuum': 'off'})
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        for table in ['t_sparse', 't_dense']:
+            node.safe_psql(
+                'postgres',
+                'create table {0} as select i, repeat(md5(i::text), 10) as s '
+                'from generate_series(1, 100000) i'.format(table))
+
+        self.backup_node(
+            backup_dir, 'node', node, options=["-j", "4"])
+
+        # a few blocks far apart and almost every block
+        node.safe_psql(
+            'postgres',
+            "update t_sparse set s = 'sparse' where i in (1, 50000, 99999); "
+            "update t_dense set s = 'dense' where i % 20 = 0")
+
+        self.backup_node(
+            backup_dir, 'node', node,
+            backup_type='page', options=["-j", "4"])
+
+        node.safe_psql(
+            'postgres',
+            "update t_sparse set s = 'sparse_1' where i in (2, 70000); "
+            "update t_dense set s = 'dense_1' where i % 20 = 1")
+
+        page_id = self.backup_node(
+            backup_dir, 'node', node,
+            backup_type='page', options=["-j", "4"])
+
+        pgdata = self.pgdata_content(node.data_dir)
+
+        self.validate_pb(backup_dir, 'node')
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        self.restore_node(
+            backup_dir, 'node', node_restored, options=["-j", "4"])
+
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # diverge node in few and in many blocks and restore it back
+        node.safe_psql(
+            'postgres',
+            "update t_sparse set s = 'sparse_2' where i in (3, 90000); "
+            "update t_dense set s = 'dense_2' where i % 20 = 2")
+        node.stop()
+
+        self.restore_node(
+            backup_dir, 'node', node, backup_id=page_id,
+            options=[
+                "-j", "4",
+                '--incremental-mode=lsn',
+                '--recovery-target=immediate',
+                '--recovery-target-action=pause'])
+
+        pgdata_restored = self.pgdata_content(node.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     # @unittest.skip("skip")
     # @unittest.expectedFailure
     def test_incr_checksum_restore_backward(self):
@@ -165,6 +165,104 @@ class MergeTest(ProbackupTest, unittest.TestCase):
         node.cleanup()
         self.del_test_dir(module_name, fname)
 
+    def test_merge_splice_compressed_blocks(self):
+        """
+        Check that data file changed in incremental backup is merged
+        by copying compressed page records and restored correctly
+        """
+        fname = self.id().split(".")[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, "backup")
+
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            initdb_params=["--data-checksums"])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, "node", node)
+        self.set_archiving(backup_dir, "node", node)
+        node.slow_start()
+
+        node.pgbench_init(scale=2)
+
+        self.backup_node(
+            backup_dir, "node", node, options=['--compress-algorithm=zlib'])
+
+        pgbench = node.pgbench(options=['-T', '5', '-c', '2'])
+        pgbench.wait()
+
+        page_id = self.backup_node(
+            backup_dir, "node", node, backup_type="page",
+            options=['--compress-algorithm=zlib'])
+
+        pgdata = self.pgdata_content(node.data_dir)
+
+        output = self.merge_backup(
+            backup_dir, "node", page_id,
+            options=['-j2', '--log-level-console=verbose'])
+
+        self.assertIn("by copying", output)
+
+        self.validate_pb(backup_dir)
+
+        node.cleanup()
+        self.restore_node(backup_dir, 'node', node)
+
+        pgdata_restored = self.pgdata_content(node.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    def test_merge_copy_as_is(self):
+        """
+        Check that data file, created after FULL backup and not changed
+        since, is merged by hardlinking it from incremental backup
+        """
+        fname = self.id().split(".")[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, "backup")
+
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            initdb_params=["--data-checksums"])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, "node", node)
+        self.set_archiving(backup_dir, "node", node)
+        node.slow_start()
+
+        self.backup_node(backup_dir, "node", node)
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select i as id, md5(i::text) as text "
+            "from generate_series(0,10000) i")
+
+        self.backup_node(backup_dir, "node", node, backup_type="page")
+
+        node.safe_psql("postgres", "checkpoint")
+
+        page_id = self.backup_node(
+            backup_dir, "node", node, backup_type="page")
+
+        pgdata = self.pgdata_content(node.data_dir)
+
+        output = self.merge_backup(
+            backup_dir, "node", page_id,
+            options=['--log-level-console=verbose'])
+
+        self.assertIn("copy it as is", output)
+
+        self.validate_pb(backup_dir)
+
+        node.cleanup()
+        self.restore_node(backup_dir, 'node', node)
+
+        pgdata_restored = self.pgdata_content(node.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     def test_merge_compressed_backups_1(self):
         """
         Test MERGE command with compressed backups
@@ -1048,6 +1146,71 @@ class MergeTest(ProbackupTest, unittest.TestCase):
         # Clean after yourself
         self.del_test_dir(module_name, fname)
 
+    # @unittest.skip("skip")
+    def test_continue_failed_merge_from_journal(self):
+        """
+        Check that failed MERGE is continued from the merge journal
+        and files merged before the failure are not merged again
+        """
+        self._check_gdb_flag_or_skip_test()
+
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        # FULL backup
+        self.backup_node(backup_dir, 'node', node)
+
+        node.pgbench_init(scale=1)
+
+        # DELTA BACKUP
+        backup_id = self.backup_node(
+            backup_dir, 'node', node, backup_type='delta')
+
+        pgdata = self.pgdata_content(node.data_dir)
+
+        gdb = self.merge_backup(backup_dir, "node", backup_id, gdb=True)
+
+        # stop after the first batch of files is journaled
+        gdb.set_breakpoint('merge_journal_flush')
+        gdb.run_until_break()
+        gdb.continue_execution_until_break()
+
+        gdb._execute('signal SIGKILL')
+        gdb._execute('detach')
+        time.sleep(1)
+
+        # Continue failed MERGE
+        output = self.merge_backup(
+            backup_dir, "node", backup_id,
+            options=['--log-level-console=verbose'])
+
+        self.assertIn("were merged by previous attempt", output)
+        self.assertIn("The file was merged by previous attempt", output)
+
+        journal = os.path.join(
+            backup_dir, 'backups', 'node', backup_id, 'merge_journal')
+        self.assertFalse(os.path.exists(journal))
+
+        self.validate_pb(backup_dir)
+
+        node.cleanup()
+        self.restore_node(backup_dir, 'node', node)
+
+        pgdata_restored = self.pgdata_content(node.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     # @unittest.skip("skip")
     def test_continue_failed_merge_with_corrupted_delta_backup(self):
         """
@@ -1370,6 +1533,67 @@ class MergeTest(ProbackupTest, unittest.TestCase):
 
         self.del_test_dir(module_name, fname)
 
+    def test_synthesize_full_backup(self):
+        """
+        Build synthetic FULL backup from FULL and two PAGE backups,
+        check that it replaces the chain and restores correctly
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.pgbench_init(scale=1)
+
+        self.backup_node(
+            backup_dir, 'node', node, options=['--compress'])
+
+        pgbench = node.pgbench(options=['-T', '5', '-c', '2'])
+        pgbench.wait()
+
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='page')
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select i as id from generate_series(0,10000) i")
+
+        page_id = self.backup_node(
+            backup_dir, 'node', node, backup_type='page',
+            options=['--compress'])
+
+        pgdata = self.pgdata_content(node.data_dir)
+
+        self.run_pb([
+            'synthesize', '-B', backup_dir, '--instance=node',
+            '-i', page_id, '-j', '2'])
+
+        show_backups = self.show_pb(backup_dir, 'node')
+        self.assertEqual(len(show_backups), 1)
+        self.assertEqual(show_backups[0]['id'], page_id)
+        self.assertEqual(show_backups[0]['status'], 'OK')
+        self.assertEqual(show_backups[0]['backup-mode'], 'FULL')
+
+        # no hidden leftovers in the catalog
+        self.assertEqual(
+            os.listdir(os.path.join(backup_dir, 'backups', 'node')),
+            [page_id])
+
+        node.cleanup()
+        self.restore_node(backup_dir, 'node', node)
+
+        pgdata_restored = self.pgdata_content(node.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     def test_merge_different_wal_modes(self):
         """
         Check that backups with different wal modes can be merged
@@ -6,6 +6,7 @@ from datetime import datetime, timedelta
 import subprocess
 import gzip
 import shutil
+import time
 
 module_name = 'page'
 
@@ -355,6 +356,65 @@ class PageTest(ProbackupTest, unittest.TestCase):
         # Clean after yourself
         self.del_test_dir(module_name, fname)
 
+    # @unittest.skip("skip")
+    def test_page_wal_summary(self):
+        """
+        archive WAL with --wal-summary, check that PAGE backup
+        uses WAL summaries instead of reading WAL segments
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(
+            backup_dir, 'node', node,
+            custom_archive_command='"{0}" archive-push -B {1} --instance=node '
+            '--wal-summary --wal-file-path=%p --wal-file-name=%f'.format(
+                self.probackup_path, backup_dir))
+        node.slow_start()
+
+        node.pgbench_init(scale=2)
+
+        self.backup_node(backup_dir, 'node', node)
+
+        for i in range(3):
+            pgbench = node.pgbench(options=['-T', '3', '-c', '2'])
+            pgbench.wait()
+            self.switch_wal_segment(node)
+
+        wals_dir = os.path.join(backup_dir, 'wal', 'node')
+        self.assertTrue(
+            [f for f in os.listdir(wals_dir) if f.endswith('.summary')])
+
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='page',
+            options=['--log-level-file=VERBOSE'])
+
+        self.assertIn(
+            'Use summary of WAL segment',
+            open(os.path.join(backup_dir, 'log', 'pg_probackup.log')).read())
+
+        if self.paranoia:
+            pgdata = self.pgdata_content(node.data_dir)
+
+        node.cleanup()
+        self.restore_node(backup_dir, 'node', node)
+
+        if self.paranoia:
+            pgdata_restored = self.pgdata_content(node.data_dir)
+            self.compare_pgdata(pgdata, pgdata_restored)
+
+        node.slow_start()
+        node.safe_psql('postgres', 'select count(*) from pgbench_accounts')
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     # @unittest.skip("skip")
     def test_page_multiple_segments(self):
         """
@@ -706,6 +766,156 @@ class PageTest(ProbackupTest, unittest.TestCase):
         node.cleanup()
         self.del_test_dir(module_name, fname)
 
+    # @unittest.skip("skip")
+    def test_page_wal_block_refs(self):
+        """
+        PAGE backup must collect block references of WAL reader threads
+        starting from an empty list and growing it past its initial size
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select i as id, md5(i::text) as text "
+            "from generate_series(0,100000) i")
+
+        self.backup_node(backup_dir, 'node', node)
+
+        # touch every block of the table in several WAL segments
+        for i in range(3):
+            node.safe_psql(
+                "postgres",
+                "update t_heap set text = md5(text) where id % 3 = {0}".format(i))
+            self.switch_wal_segment(node)
+
+        self.backup_node(backup_dir, 'node', node, backup_type='page')
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='page', options=['-j', '4'])
+
+        if self.paranoia:
+            pgdata = self.pgdata_content(node.data_dir)
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        self.restore_node(backup_dir, 'node', node_restored)
+
+        if self.paranoia:
+            pgdata_restored = self.pgdata_content(node_restored.data_dir)
+            self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    def page_backup_with_wal_read_ahead(self, fname, suffix, options):
+        """
+        Archive WAL with given instance options, take PAGE backup
+        with several WAL reader threads, check that segments were
+        loaded by read-ahead and that restored data is the same
+        """
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_config(backup_dir, 'node', options=options)
+        self.set_archiving(backup_dir, 'node', node, compress=False)
+        node.slow_start()
+
+        try:
+            self.backup_node(backup_dir, 'node', node)
+        except ProbackupException as e:
+            if 'does not support zstd' in e.message:
+                self.skipTest('pg_probackup is built without zstd support')
+            raise
+
+        node.pgbench_init(scale=5)
+        for i in range(4):
+            node.safe_psql(
+                "postgres",
+                "update pgbench_accounts set abalance = abalance + 1 "
+                "where aid % 4 = {0}".format(i))
+            self.switch_wal_segment(node)
+
+        # plain segments have no suffix
+        def archived(f):
+            return f.endswith(suffix) if suffix else len(f) == 24
+
+        # segments are packed in background, wait for it
+        wals_dir = os.path.join(backup_dir, 'wal', 'node')
+        for _ in range(60):
+            wals = os.listdir(wals_dir)
+            if ([f for f in wals if archived(f)] and
+                    not [f for f in wals if f.endswith('.part')]):
+                break
+            time.sleep(1)
+        self.assertTrue([f for f in wals if archived(f)])
+
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='page',
+            options=['-j', '4', '--log-level-file=VERBOSE'])
+
+        with open(os.path.join(backup_dir, 'log', 'pg_probackup.log')) as f:
+            self.assertIn('is loaded by read-ahead', f.read())
+
+        if self.paranoia:
+            pgdata = self.pgdata_content(node.data_dir)
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        self.restore_node(backup_dir, 'node', node_restored)
+
+        if self.paranoia:
+            pgdata_restored = self.pgdata_content(node_restored.data_dir)
+            self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_page_wal_read_ahead_plain(self):
+        """PAGE backup with read-ahead of uncompressed WAL segments"""
+        fname = self.id().split('.')[3]
+        self.page_backup_with_wal_read_ahead(
+            fname, None, ['--compress-algorithm=none'])
+
+    # @unittest.skip("skip")
+    def test_page_wal_read_ahead_gz(self):
+        """PAGE backup with read-ahead of gz-compressed WAL segments"""
+        fname = self.id().split('.')[3]
+        self.page_backup_with_wal_read_ahead(
+            fname, '.gz', ['--compress-algorithm=zlib'])
+
+    # @unittest.skip("skip")
+    def test_page_wal_read_ahead_zstd(self):
+        """PAGE backup with read-ahead of zstd-compressed WAL segments"""
+        fname = self.id().split('.')[3]
+        self.page_backup_with_wal_read_ahead(
+            fname, '.zst', ['--compress-algorithm=zstd'])
+
+    # @unittest.skip("skip")
+    def test_page_wal_read_ahead_pack(self):
+        """PAGE backup with read-ahead of WAL segments stored in packs"""
+        fname = self.id().split('.')[3]
+        self.page_backup_with_wal_read_ahead(
+            fname, '.pack', ['--wal-pack-size=2'])
+
     # @unittest.skip("skip")
     def test_page_backup_with_lost_wal_segment(self):
         """
@@ -492,6 +492,116 @@ class PtrackTest(ProbackupTest, unittest.TestCase):
         # Clean after yourself
         self.del_test_dir(module_name, self.fname)
 
+    # @unittest.skip("skip")
+    def test_ptrack_pagemapset_many_relations(self):
+        """
+        make node with relations in several databases and in tablespace,
+        change some of them, create and drop others, take ptrack backup,
+        check that pagemaps of changed relations are used
+        and restored data is correct
+        """
+        backup_dir = os.path.join(self.tmp_path, module_name, self.fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, self.fname, 'node'),
+            set_replication=True,
+            ptrack_enable=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.safe_psql(
+            "postgres",
+            "CREATE EXTENSION ptrack")
+
+        self.create_tblspace_in_node(node, 'somedata')
+        node.safe_psql("postgres", "create database db1")
+
+        for i in range(20):
+            node.safe_psql(
+                "postgres",
+                "create table t_heap_{0} as select i as id,"
+                " md5(i::text) as text from generate_series(0,10000) i".format(i))
+            node.safe_psql(
+                "db1",
+                "create table t_heap_{0} as select i as id,"
+                " md5(i::text) as text from generate_series(0,10000) i".format(i))
+
+        node.safe_psql(
+            "postgres",
+            "create table t_tblspc tablespace somedata as select i as id,"
+            " md5(i::text) as text from generate_series(0,10000) i")
+
+        self.backup_node(backup_dir, 'node', node, options=['--stream'])
+
+        changed = []
+        for dbname, table in [
+                ('postgres', 't_heap_3'), ('postgres', 't_tblspc'),
+                ('db1', 't_heap_17')]:
+            node.safe_psql(
+                dbname,
+                "update {0} set text = 'changed' where id % 100 = 0".format(table))
+            changed.append(node.safe_psql(
+                dbname,
+                "select pg_relation_filepath('{0}')".format(table)).decode('utf-8').rstrip())
+
+        # relations, which are not in FULL backup or not in ptrack backup
+        node.safe_psql(
+            "postgres",
+            "drop table t_heap_5; "
+            "create table t_new as select i as id from generate_series(0,1000) i")
+
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='ptrack',
+            options=['--stream', '--log-level-file=verbose'])
+
+        with open(os.path.join(backup_dir, 'log', 'pg_probackup.log')) as f:
+            log_content = f.read()
+
+        for rel_path in changed:
+            self.assertIn(
+                'Using ptrack pagemap for file "{0}"'.format(rel_path),
+                log_content)
+
+        if self.paranoia:
+            pgdata = self.pgdata_content(node.data_dir)
+
+        result = node.safe_psql(
+            "postgres", "SELECT * FROM t_heap_3 order by id")
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, self.fname, 'node_restored'))
+        node_restored.cleanup()
+
+        self.restore_node(
+            backup_dir, 'node', node_restored,
+            options=[
+                "-j", "4",
+                "-T", "{0}={1}".format(
+                    self.get_tblspace_path(node, 'somedata'),
+                    self.get_tblspace_path(node_restored, 'somedata'))])
+
+        # Physical comparison
+        if self.paranoia:
+            pgdata_restored = self.pgdata_content(
+                node_restored.data_dir, ignore_ptrack=False)
+            self.compare_pgdata(pgdata, pgdata_restored)
+
+        self.set_auto_conf(
+            node_restored, {'port': node_restored.port})
+
+        node_restored.slow_start()
+
+        # Logical comparison
+        self.assertEqual(
+            result,
+            node_restored.safe_psql(
+                "postgres", "SELECT * FROM t_heap_3 order by id"))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, self.fname)
+
     # @unittest.skip("skip")
     def test_ptrack_unprivileged(self):
         """"""
@@ -1,5 +1,7 @@
 import unittest
 import os
+import subprocess
+import tempfile
 from time import sleep
 from .helpers.ptrack_helpers import ProbackupTest, ProbackupException
 from .helpers.cfs_helpers import find_by_name
@@ -48,3 +50,181 @@ class RemoteTest(ProbackupTest, unittest.TestCase):
 
         # Clean after yourself
         self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_remote_backup_agent_threads(self):
+        """
+        Remote FULL and DELTA backups with pages compressed by several
+        agent threads, check that backups are valid and restore is correct
+        """
+        if not self.remote:
+            self.skipTest("You must enable PGPROBACKUP_SSH_REMOTE"
+                          " for run this test")
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.pgbench_init(scale=10)
+
+        self.backup_node(
+            backup_dir, 'node', node,
+            options=[
+                '--stream', '-j2', '--agent-threads=4',
+                '--compress-algorithm=zlib'])
+
+        pgbench = node.pgbench(options=['-T', '10', '-c', '2', '--no-vacuum'])
+        pgbench.wait()
+
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='delta',
+            options=[
+                '--stream', '-j2', '--agent-threads=4',
+                '--compress-algorithm=zlib'])
+
+        pgdata = self.pgdata_content(node.data_dir)
+
+        self.validate_pb(backup_dir, 'node')
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        self.restore_node(backup_dir, 'node', node_restored, options=['-j2'])
+
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_remote_backup_more_threads_than_ssh_sessions(self):
+        """
+        Remote backup and restore with more threads than sessions
+        of multiplexed SSH connection, check that restore is correct
+        and control socket directories are removed
+        """
+        if not self.remote:
+            self.skipTest("You must enable PGPROBACKUP_SSH_REMOTE"
+                          " for run this test")
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.pgbench_init(scale=5)
+
+        # directory left by killed pg_probackup must be removed
+        tmpdir = tempfile.gettempdir()
+        dead = subprocess.Popen(['true'])
+        dead.wait()
+        stale_dir = os.path.join(
+            tmpdir, 'pg_probackup_ssh_{0}_stale0'.format(dead.pid))
+        os.mkdir(stale_dir)
+        mux_dirs = set(
+            f for f in os.listdir(tmpdir) if f.startswith('pg_probackup_ssh_'))
+
+        # 8 sessions are multiplexed, the rest use their own connections
+        self.backup_node(
+            backup_dir, 'node', node, options=['--stream', '-j10'])
+
+        pgdata = self.pgdata_content(node.data_dir)
+
+        self.validate_pb(backup_dir, 'node', options=['-j10'])
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        self.restore_node(backup_dir, 'node', node_restored, options=['-j10'])
+
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        self.assertFalse(
+            os.path.exists(stale_dir),
+            'Stale SSH control socket directory is not removed')
+
+        # stale directories of others may be removed, but ours must be gone
+        self.assertFalse(
+            set(f for f in os.listdir(tmpdir)
+                if f.startswith('pg_probackup_ssh_')) - mux_dirs,
+            'SSH control socket directory is left behind')
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_remote_compress_level(self):
+        """
+        Remote backup and restore over compressed channel,
+        check that restored data is the same
+        """
+        if not self.remote:
+            self.skipTest("You must enable PGPROBACKUP_SSH_REMOTE"
+                          " for run this test")
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.pgbench_init(scale=5)
+
+        try:
+            self.backup_node(
+                backup_dir, 'node', node,
+                options=[
+                    '--stream', '-j2', '--remote-compress-level=3',
+                    '--log-level-file=LOG'])
+        except ProbackupException as e:
+            if 'does not support zstd' in e.message:
+                self.skipTest('pg_probackup is built without zstd support')
+            raise
+
+        with open(os.path.join(backup_dir, 'log', 'pg_probackup.log')) as f:
+            self.assertIn(
+                'Remote channel compression is enabled, level 3', f.read())
+
+        pgbench = node.pgbench(options=['-T', '5', '-c', '2', '--no-vacuum'])
+        pgbench.wait()
+
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='delta',
+            options=['--stream', '-j2', '--remote-compress-level=3'])
+
+        pgdata = self.pgdata_content(node.data_dir)
+
+        self.validate_pb(backup_dir, 'node')
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        self.restore_node(
+            backup_dir, 'node', node_restored,
+            options=['-j2', '--remote-compress-level=3'])
+
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
@@ -8,6 +8,7 @@ from datetime import datetime, timedelta, timezone
 import hashlib
 import shutil
 import json
+import re
 from shutil import copyfile
 from testgres import QueryException, StartNodeException
 from stat import S_ISDIR
@@ -3920,3 +3921,534 @@ class RestoreTest(ProbackupTest, unittest.TestCase):
 
         # Clean after yourself
         self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_restore_to_stdout(self):
+        """
+        Restore FULL + DELTA chain to stdout, extract tar stream
+        and compare with the regular restore
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.pgbench_init(scale=5)
+
+        self.backup_node(
+            backup_dir, 'node', node, options=['--stream', '--compress'])
+
+        pgbench = node.pgbench(options=['-T', '10', '-c', '2', '--no-vacuum'])
+        pgbench.wait()
+
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='delta', options=['--stream'])
+
+        result = node.safe_psql("postgres", "SELECT * FROM pgbench_accounts")
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+        self.restore_node(backup_dir, 'node', node_restored)
+        pgdata = self.pgdata_content(node_restored.data_dir)
+
+        node_tar = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_tar'))
+        node_tar.cleanup()
+        os.makedirs(node_tar.data_dir, mode=0o700)
+
+        restore = subprocess.Popen(
+            [self.probackup_path, 'restore', '-B', backup_dir,
+             '--instance', 'node', '--to-stdout'],
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+            env=self.test_env)
+        tar = subprocess.Popen(
+            ['tar', 'xf', '-', '-C', node_tar.data_dir],
+            stdin=restore.stdout)
+        restore.stdout.close()
+        tar.wait()
+        restore.wait()
+
+        self.assertEqual(
+            restore.returncode, 0,
+            restore.stderr.read().decode('utf-8'))
+        self.assertEqual(tar.returncode, 0)
+
+        pgdata_tar = self.pgdata_content(node_tar.data_dir)
+        self.compare_pgdata(pgdata, pgdata_tar)
+
+        self.set_auto_conf(node_tar, {'port': node_tar.port})
+        node_tar.slow_start()
+
+        self.assertEqual(
+            result,
+            node_tar.safe_psql("postgres", "SELECT * FROM pgbench_accounts"))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_restore_device_threads(self):
+        """
+        backup and restore a node with tablespace using
+        per-device thread limit
+        """
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        self.create_tblspace_in_node(node, 'tblspace')
+        node.pgbench_init(scale=2)
+        node.safe_psql(
+            "postgres",
+            "CREATE TABLE t_tblspace TABLESPACE tblspace AS "
+            "SELECT * FROM pgbench_accounts")
+
+        self.backup_node(
+            backup_dir, 'node', node,
+            options=['--stream', '-j', '4', '--device-threads=1'])
+
+        pgdata = self.pgdata_content(node.data_dir)
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        olddir = self.get_tblspace_path(node, 'tblspace')
+        newdir = self.get_tblspace_path(node_restored, 'tblspace')
+
+        self.restore_node(
+            backup_dir, 'node', node_restored,
+            options=[
+                '-j', '4', '--device-threads=1',
+                '-T', '{0}={1}'.format(olddir, newdir)])
+
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_partial_restore_filelist_index(self):
+        """
+        partial restore of FULL + DELTA chain must read only the
+        needed part of file lists and survive a broken file list index
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        for i in range(1, 4, 1):
+            node.safe_psql(
+                'postgres',
+                'CREATE database db{0}'.format(i))
+            node.safe_psql(
+                'db{0}'.format(i),
+                'CREATE TABLE t AS SELECT i FROM generate_series(0,10000) i')
+
+        full_id = self.backup_node(
+            backup_dir, 'node', node, options=['--stream'])
+
+        index_path = os.path.join(
+            backup_dir, 'backups', 'node', full_id, 'backup_content.index')
+        self.assertTrue(os.path.isfile(index_path))
+
+        for i in range(1, 4, 1):
+            node.safe_psql(
+                'db{0}'.format(i),
+                'INSERT INTO t SELECT i FROM generate_series(0,10000) i')
+
+        self.backup_node(
+            backup_dir, 'node', node,
+            backup_type='delta', options=['--stream'])
+
+        result = node.safe_psql('db1', 'SELECT count(*) FROM t')
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        self.restore_node(
+            backup_dir, 'node', node_restored,
+            options=['--db-include=db1'])
+
+        self.set_auto_conf(node_restored, {'port': node_restored.port})
+        node_restored.slow_start()
+
+        self.assertEqual(
+            result, node_restored.safe_psql('db1', 'SELECT count(*) FROM t'))
+
+        node_restored.stop()
+        node_restored.cleanup()
+
+        # damage the index, the whole file list must be read instead
+        with open(index_path, 'r') as f:
+            lines = f.readlines()
+
+        with open(index_path, 'w') as f:
+            f.write(lines[0])
+            for line in lines[1:]:
+                f.write(re.sub('"crc":"[0-9]+"', '"crc":"0"', line))
+
+        self.restore_node(
+            backup_dir, 'node', node_restored,
+            options=['--db-include=db1'])
+
+        self.set_auto_conf(node_restored, {'port': node_restored.port})
+        node_restored.slow_start()
+
+        self.assertEqual(
+            result, node_restored.safe_psql('db1', 'SELECT count(*) FROM t'))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_restore_prewarm_blocks(self):
+        """restore with creation of autoprewarm.blocks"""
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.pgbench_init(scale=2)
+
+        self.backup_node(
+            backup_dir, 'node', node, options=['--stream'])
+
+        pgbench = node.pgbench(options=['-T', '5', '-c', '1', '--no-vacuum'])
+        pgbench.wait()
+
+        self.backup_node(
+            backup_dir, 'node', node,
+            backup_type='delta', options=['--stream'])
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        self.restore_node(
+            backup_dir, 'node', node_restored,
+            options=['--prewarm-blocks=100'])
+
+        with open(os.path.join(
+                node_restored.data_dir, 'autoprewarm.blocks'), 'r') as f:
+            lines = f.read().splitlines()
+
+        n_blocks = int(re.match(r'<<(\d+)>>', lines[0]).group(1))
+        self.assertEqual(n_blocks, 100)
+        self.assertEqual(len(lines) - 1, n_blocks)
+
+        for line in lines[1:]:
+            self.assertEqual(len(line.split(',')), 5)
+
+        self.set_auto_conf(node_restored, {'port': node_restored.port})
+        node_restored.slow_start()
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    def restore_with_sync_cmd(self, backup_dir, data_dir):
+        """restore_node() always passes --no-sync, build command by hand"""
+        cmd = [
+            'restore', '-B', backup_dir, '-D', data_dir,
+            '--instance=node', '--log-level-file=LOG']
+
+        if self.remote:
+            cmd += ['--remote-proto=ssh', '--remote-host=localhost']
+
+        return cmd
+
+    # @unittest.skip("skip")
+    def test_restore_sync_batch_chunks(self):
+        """
+        Restore and sync more files than fit into a single batch
+        message, check that all of them are restored
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.safe_psql(
+            "postgres",
+            "do $$ begin for i in 1..4500 loop "
+            "execute format('create table t_%s (id int)', i); "
+            "end loop; end $$;")
+
+        self.backup_node(
+            backup_dir, 'node', node, options=['--stream'])
+
+        if self.paranoia:
+            pgdata = self.pgdata_content(node.data_dir)
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        self.run_pb(
+            self.restore_with_sync_cmd(backup_dir, node_restored.data_dir))
+
+        if self.paranoia:
+            pgdata_restored = self.pgdata_content(node_restored.data_dir)
+            self.compare_pgdata(pgdata, pgdata_restored)
+
+        self.set_auto_conf(node_restored, {'port': node_restored.port})
+        node_restored.slow_start()
+
+        self.assertEqual(
+            node_restored.safe_psql(
+                "postgres",
+                "select count(*) from pg_class "
+                "where relname like 't\\_%' and relkind = 'r'").decode('utf-8').rstrip(),
+            '4500')
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_restore_mkdir_failure(self):
+        """
+        Directory cannot be created during restore,
+        check that the error of the batch item is reported
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        self.backup_node(
+            backup_dir, 'node', node, options=['--stream'])
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        gdb = self.restore_node(
+            backup_dir, 'node', node_restored,
+            options=['--log-level-file=LOG'], gdb=True)
+
+        # the first batch creates directories
+        gdb.set_breakpoint('fio_batch')
+        gdb.run_until_break()
+
+        # replace data directory with a regular file
+        shutil.rmtree(node_restored.data_dir)
+        open(node_restored.data_dir, 'w').close()
+
+        gdb.continue_execution_until_error()
+        gdb._execute('detach')
+        sleep(1)
+
+        with open(os.path.join(backup_dir, 'log', 'pg_probackup.log')) as f:
+            log_content = f.read()
+
+        self.assertIn('Cannot create directory', log_content)
+        self.assertIn('Not a directory', log_content)
+
+        os.remove(node_restored.data_dir)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_restore_sync_failure(self):
+        """
+        Restored file is gone before it is synced,
+        check that the error of the batch item is reported
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        self.backup_node(
+            backup_dir, 'node', node, options=['--stream'])
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        gdb = self.run_pb(
+            self.restore_with_sync_cmd(backup_dir, node_restored.data_dir),
+            gdb=True)
+
+        # the first batch creates directories, the second one changes
+        # mode of restored files, the third one syncs them
+        gdb.set_breakpoint('fio_batch')
+        gdb.run_until_break()
+        gdb.continue_execution_until_break(ignore_count=2)
+
+        os.remove(os.path.join(node_restored.data_dir, 'PG_VERSION'))
+
+        gdb.continue_execution_until_error()
+        gdb._execute('detach')
+        sleep(1)
+
+        with open(os.path.join(backup_dir, 'log', 'pg_probackup.log')) as f:
+            log_content = f.read()
+
+        self.assertIn('Failed to sync file', log_content)
+        self.assertIn('PG_VERSION', log_content)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_restore_remote_external_dirs(self):
+        """
+        Remote restore of backup with external directories, check that
+        directories are created and modes of restored files are set
+        """
+        if not self.remote:
+            self.skipTest("You must enable PGPROBACKUP_SSH_REMOTE"
+                          " for run this test")
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        external_dir = self.get_tblspace_path(node, 'external_dir')
+        for i in range(100):
+            subdir = os.path.join(external_dir, 'dir_{0}'.format(i))
+            os.makedirs(subdir)
+            file_path = os.path.join(subdir, 'file')
+            with open(file_path, 'w') as f:
+                f.write(str(i))
+            os.chmod(file_path, 0o640 if i % 2 else 0o600)
+
+        self.backup_node(
+            backup_dir, 'node', node,
+            options=['--stream', '-E', external_dir])
+
+        pgdata = self.pgdata_content(
+            node.base_dir, exclude_dirs=['logs'])
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        external_dir_new = self.get_tblspace_path(node_restored, 'external_dir')
+
+        self.restore_node(
+            backup_dir, 'node', node_restored,
+            options=[
+                '-j', '4',
+                '--external-mapping={0}={1}'.format(
+                    external_dir, external_dir_new)])
+
+        pgdata_restored = self.pgdata_content(
+            node_restored.base_dir, exclude_dirs=['logs'])
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        for i in range(100):
+            mode = os.stat(os.path.join(
+                external_dir_new, 'dir_{0}'.format(i), 'file')).st_mode
+            self.assertEqual(mode & 0o777, 0o640 if i % 2 else 0o600)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_restore_remote_chmod_failure(self):
+        """
+        Restored file is gone before its mode is changed by remote agent,
+        check that the error of the batch item is reported
+        """
+        if not self.remote:
+            self.skipTest("You must enable PGPROBACKUP_SSH_REMOTE"
+                          " for run this test")
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        self.backup_node(
+            backup_dir, 'node', node, options=['--stream'])
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        gdb = self.restore_node(
+            backup_dir, 'node', node_restored,
+            options=['--log-level-file=LOG'], gdb=True)
+
+        # the first batch creates directories, the second one changes
+        # mode of restored files
+        gdb.set_breakpoint('fio_batch')
+        gdb.run_until_break()
+        gdb.continue_execution_until_break()
+
+        os.remove(os.path.join(node_restored.data_dir, 'PG_VERSION'))
+
+        gdb.continue_execution_until_error()
+        gdb._execute('detach')
+        sleep(1)
+
+        with open(os.path.join(backup_dir, 'log', 'pg_probackup.log')) as f:
+            log_content = f.read()
+
+        self.assertIn('Cannot change mode of', log_content)
+        self.assertIn('PG_VERSION', log_content)
+        self.assertIn('No such file or directory', log_content)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
@@ -1725,6 +1725,64 @@ class ValidateTest(ProbackupTest, unittest.TestCase):
         # Clean after yourself
         self.del_test_dir(module_name, fname)
 
+    # @unittest.skip("skip")
+    def test_validate_recovery_target_wal_summary(self):
+        """
+        archive WAL with --wal-summary, make full backup,
+        validate to xid located several segments after the backup,
+        check that segments before the target are skipped
+        by their summaries
+        """
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(
+            backup_dir, 'node', node,
+            custom_archive_command='"{0}" archive-push -B {1} --instance=node '
+            '--wal-summary --wal-file-path=%p --wal-file-name=%f'.format(
+                self.probackup_path, backup_dir))
+        node.slow_start()
+
+        node.pgbench_init(scale=2)
+
+        self.backup_node(backup_dir, 'node', node)
+
+        for i in range(3):
+            pgbench = node.pgbench(options=['-T', '2', '-c', '2'])
+            pgbench.wait()
+            self.switch_wal_segment(node)
+
+        target_xid = node.safe_psql(
+            'postgres',
+            'insert into pgbench_history(tid) values (1) '
+            'returning txid_current()').decode('utf-8').rstrip()
+
+        self.switch_wal_segment(node)
+        node.safe_psql('postgres', 'select txid_current()')
+        self.switch_wal_segment(node)
+
+        self.assertIn(
+            "INFO: Backup validation completed successfully",
+            self.validate_pb(
+                backup_dir, 'node',
+                options=[
+                    "--xid={0}".format(target_xid), "-j", "4",
+                    "--log-level-file=LOG"]),
+            '\n Unexpected Error Message: {0}\n CMD: {1}'.format(
+                repr(self.output), self.cmd))
+
+        self.assertIn(
+            'WAL segments by their summaries',
+            open(os.path.join(backup_dir, 'log', 'pg_probackup.log')).read())
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     # @unittest.skip("skip")
     def test_validate_corrupt_wal_between_backups(self):
         """